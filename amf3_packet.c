@@ -0,0 +1,1041 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtmp.h"
+#include "amf_packet.h"
+#include "amf3_packet.h"
+#include "rtmp_trace.h"
+#include "rtmp_allocator.h"
+#include "data_rw.h"
+
+
+#define AMF3_U29_MAX 0x1FFFFFFF
+#define AMF3_TABLE_INITIAL_CAPACITY 8
+
+
+static int amf3_context_add_string(
+    amf3_context_t *context, const unsigned char *data, size_t length);
+static int amf3_context_add_object(
+    amf3_context_t *context, amf_packet_t *amf);
+static amf3_trait_t *amf3_context_add_trait(amf3_context_t *context);
+
+static int amf3_read_u29(data_reader_t *reader, unsigned int *value);
+static int amf3_read_string(
+    amf3_context_t *context, data_reader_t *reader,
+    amf3_string_reference_t *string);
+static amf_packet_t *amf3_read_value(
+    amf3_context_t *context, data_reader_t *reader);
+static amf_packet_t *amf3_read_reference(
+    amf3_context_t *context, unsigned int index);
+static amf_packet_t *amf3_read_date(
+    amf3_context_t *context, data_reader_t *reader);
+static amf_packet_t *amf3_read_xml(
+    amf3_context_t *context, data_reader_t *reader);
+static amf_packet_t *amf3_read_array(
+    amf3_context_t *context, data_reader_t *reader);
+static amf_packet_t *amf3_read_dense_array(
+    amf3_context_t *context, data_reader_t *reader, unsigned int dense_num);
+static amf_packet_t *amf3_read_object(
+    amf3_context_t *context, data_reader_t *reader);
+static amf_packet_t *amf3_read_byte_array(
+    amf3_context_t *context, data_reader_t *reader);
+static int amf3_append_property(
+    amf_packet_object_property_t **last,
+    const unsigned char *key, size_t key_length, amf_packet_t *value);
+
+static int amf3_write_u29(data_writer_t *writer, unsigned int value);
+static int amf3_write_string(
+    amf3_context_t *context, data_writer_t *writer,
+    const char *string);
+static int amf3_write_number(data_writer_t *writer, double value);
+static int amf3_write_properties(
+    amf3_context_t *context, data_writer_t *writer,
+    amf_packet_object_property_t *property);
+static int amf3_write_value(
+    amf3_context_t *context, data_writer_t *writer, amf_packet_t *amf);
+
+
+void amf3_context_initialize(amf3_context_t *context)
+{
+    memset(context, 0x00, sizeof(amf3_context_t));
+}
+
+
+void amf3_context_cleanup(amf3_context_t *context)
+{
+    size_t i;
+
+    for (i = 0; i < context->traits_num; ++i) {
+        rtmp_release(context->traits[i].sealed_names);
+    }
+    rtmp_release(context->traits);
+    rtmp_release(context->objects);
+    rtmp_release(context->strings);
+    amf3_context_initialize(context);
+}
+
+
+static int amf3_context_add_string(
+    amf3_context_t *context, const unsigned char *data, size_t length)
+{
+    amf3_string_reference_t *strings;
+    size_t capacity;
+
+    if (context->strings_num == context->strings_capacity) {
+        capacity = context->strings_capacity * 2;
+        if (capacity == 0) {
+            capacity = AMF3_TABLE_INITIAL_CAPACITY;
+        }
+        strings = (amf3_string_reference_t*)rtmp_reallocate(
+            RTMP_ALLOCATION_AMF,
+            context->strings, capacity * sizeof(amf3_string_reference_t));
+        if (strings == NULL) {
+            return 0;
+        }
+        context->strings = strings;
+        context->strings_capacity = capacity;
+    }
+    context->strings[context->strings_num].data = data;
+    context->strings[context->strings_num].length = length;
+    context->strings_num++;
+    return 1;
+}
+
+
+static int amf3_context_add_object(amf3_context_t *context, amf_packet_t *amf)
+{
+    amf_packet_t **objects;
+    size_t capacity;
+
+    if (context->objects_num == context->objects_capacity) {
+        capacity = context->objects_capacity * 2;
+        if (capacity == 0) {
+            capacity = AMF3_TABLE_INITIAL_CAPACITY;
+        }
+        objects = (amf_packet_t**)rtmp_reallocate(
+            RTMP_ALLOCATION_AMF,
+            context->objects, capacity * sizeof(amf_packet_t*));
+        if (objects == NULL) {
+            return 0;
+        }
+        context->objects = objects;
+        context->objects_capacity = capacity;
+    }
+    context->objects[context->objects_num] = amf;
+    context->objects_num++;
+    return 1;
+}
+
+
+static amf3_trait_t *amf3_context_add_trait(amf3_context_t *context)
+{
+    amf3_trait_t *traits;
+    amf3_trait_t *trait;
+    size_t capacity;
+
+    if (context->traits_num == context->traits_capacity) {
+        capacity = context->traits_capacity * 2;
+        if (capacity == 0) {
+            capacity = AMF3_TABLE_INITIAL_CAPACITY;
+        }
+        traits = (amf3_trait_t*)rtmp_reallocate(
+            RTMP_ALLOCATION_AMF,
+            context->traits, capacity * sizeof(amf3_trait_t));
+        if (traits == NULL) {
+            return NULL;
+        }
+        context->traits = traits;
+        context->traits_capacity = capacity;
+    }
+    trait = &context->traits[context->traits_num];
+    memset(trait, 0x00, sizeof(amf3_trait_t));
+    context->traits_num++;
+    return trait;
+}
+
+
+amf_packet_t *amf3_packet_analyze_data(
+    amf3_context_t *context,
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
+{
+    data_reader_t reader;
+    amf_packet_t *amf;
+
+    data_reader_initialize(&reader, raw_data, raw_data_size);
+
+    amf = amf3_read_value(context, &reader);
+    if (packet_size) {
+        *packet_size = reader.position;
+    }
+    return amf;
+}
+
+
+/* variable length 29 bit unsigned integer */
+static int amf3_read_u29(data_reader_t *reader, unsigned int *value)
+{
+    unsigned int result;
+    unsigned char byte;
+    int i;
+
+    result = 0;
+    for (i = 0; i < 4; ++i) {
+        if (reader->position >= reader->size) {
+            return 0;
+        }
+        byte = reader->data[reader->position++];
+        if (i == 3) {
+            result = (result << 8) | byte;
+            break;
+        }
+        result = (result << 7) | (byte & 0x7F);
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    *value = result;
+    return 1;
+}
+
+
+static int amf3_read_string(
+    amf3_context_t *context, data_reader_t *reader,
+    amf3_string_reference_t *string)
+{
+    unsigned int header;
+    size_t length;
+
+    if (!amf3_read_u29(reader, &header)) {
+        return 0;
+    }
+    if ((header & 0x01) == 0) {
+        if ((header >> 1) >= context->strings_num) {
+            return 0;
+        }
+        *string = context->strings[header >> 1];
+        return 1;
+    }
+
+    length = header >> 1;
+    if (reader->size - reader->position < length) {
+        return 0;
+    }
+    string->data = reader->data + reader->position;
+    string->length = length;
+    reader->position += length;
+    /* the empty string is never sent by reference */
+    if (length > 0) {
+        return amf3_context_add_string(context, string->data, length);
+    }
+    return 1;
+}
+
+
+static amf_packet_t *amf3_read_value(
+    amf3_context_t *context, data_reader_t *reader)
+{
+    amf_packet_t *amf;
+    amf3_string_reference_t string;
+    unsigned int integer;
+    int value;
+
+    if (reader->position >= reader->size) {
+        return NULL;
+    }
+    /* see amf_packet_analyze_value */
+    if (context->depth > AMF_DEPTH_MAX) {
+        RTMP_TRACE(RTMP_TRACE_AMF_TOO_DEEP, context->depth);
+        return NULL;
+    }
+
+    switch (reader->data[reader->position++]) {
+    case AMF3_DATATYPE_UNDEFINED:
+        return amf_packet_create_undefined();
+    case AMF3_DATATYPE_NULL:
+        return amf_packet_create_null();
+    case AMF3_DATATYPE_FALSE:
+        return amf_packet_create_boolean(0);
+    case AMF3_DATATYPE_TRUE:
+        return amf_packet_create_boolean(1);
+    case AMF3_DATATYPE_INTEGER:
+        if (!amf3_read_u29(reader, &integer)) {
+            return NULL;
+        }
+        value = (int)integer;
+        if (integer & 0x10000000) {
+            value -= 0x20000000;
+        }
+        RTMP_TRACE(RTMP_TRACE_AMF3_INTEGER, value);
+        return amf_packet_create_number((double)value);
+    case AMF3_DATATYPE_DOUBLE:
+        if (reader->size - reader->position < 8) {
+            return NULL;
+        }
+        amf = amf_packet_create_number(
+            read_be64double(reader->data + reader->position));
+        reader->position += 8;
+        return amf;
+    case AMF3_DATATYPE_STRING:
+        if (!amf3_read_string(context, reader, &string)) {
+            return NULL;
+        }
+        amf = (amf_packet_t*)rtmp_allocate(
+            RTMP_ALLOCATION_AMF, sizeof(amf_packet_string_t));
+        if (amf == NULL) {
+            return NULL;
+        }
+        amf->datatype = AMF_DATATYPE_STRING;
+        amf->string.value = amf_packet_duplicate_string(
+            string.data, string.length);
+        if (amf->string.value == NULL) {
+            rtmp_release(amf);
+            return NULL;
+        }
+        RTMP_TRACE_TEXT(
+            RTMP_TRACE_AMF3_STRING, string.length, amf->string.value);
+        return amf;
+    case AMF3_DATATYPE_DATE:
+        return amf3_read_date(context, reader);
+    case AMF3_DATATYPE_XML_DOC:
+    case AMF3_DATATYPE_XML:
+        return amf3_read_xml(context, reader);
+    case AMF3_DATATYPE_ARRAY:
+    case AMF3_DATATYPE_OBJECT:
+        context->depth++;
+        if (reader->data[reader->position - 1] == AMF3_DATATYPE_ARRAY) {
+            amf = amf3_read_array(context, reader);
+        } else {
+            amf = amf3_read_object(context, reader);
+        }
+        context->depth--;
+        return amf;
+    case AMF3_DATATYPE_BYTE_ARRAY:
+        return amf3_read_byte_array(context, reader);
+    default:
+        break;
+    }
+
+    return NULL;
+}
+
+
+static amf_packet_t *amf3_read_reference(
+    amf3_context_t *context, unsigned int index)
+{
+    amf_packet_t *amf;
+
+    if (index >= context->objects_num) {
+        return NULL;
+    }
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_reference_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_REFERENCE;
+    amf->reference.index = index;
+    amf->reference.value = context->objects[index];
+    RTMP_TRACE(RTMP_TRACE_AMF3_REFERENCE, index);
+    return amf;
+}
+
+
+static amf_packet_t *amf3_read_date(
+    amf3_context_t *context, data_reader_t *reader)
+{
+    unsigned int header;
+    amf_packet_t *amf;
+
+    if (!amf3_read_u29(reader, &header)) {
+        return NULL;
+    }
+    if ((header & 0x01) == 0) {
+        return amf3_read_reference(context, header >> 1);
+    }
+    if (reader->size - reader->position < 8) {
+        return NULL;
+    }
+    amf = amf_packet_create_date(
+        read_be64double(reader->data + reader->position));
+    reader->position += 8;
+    if (amf && !amf3_context_add_object(context, amf)) {
+        amf_packet_free(amf);
+        return NULL;
+    }
+    return amf;
+}
+
+
+/* both XML types are held as an XML document */
+static amf_packet_t *amf3_read_xml(
+    amf3_context_t *context, data_reader_t *reader)
+{
+    unsigned int header;
+    size_t length;
+    amf_packet_t *amf;
+
+    if (!amf3_read_u29(reader, &header)) {
+        return NULL;
+    }
+    if ((header & 0x01) == 0) {
+        return amf3_read_reference(context, header >> 1);
+    }
+    length = header >> 1;
+    if (reader->size - reader->position < length) {
+        return NULL;
+    }
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_string_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_XML_DOCUMENT;
+    amf->string.value = amf_packet_duplicate_string(
+        reader->data + reader->position, length);
+    if (amf->string.value == NULL) {
+        rtmp_release(amf);
+        return NULL;
+    }
+    reader->position += length;
+    if (!amf3_context_add_object(context, amf)) {
+        amf_packet_free(amf);
+        return NULL;
+    }
+    return amf;
+}
+
+
+static int amf3_append_property(
+    amf_packet_object_property_t **last,
+    const unsigned char *key, size_t key_length, amf_packet_t *value)
+{
+    amf_packet_object_property_t *property;
+
+    property = (amf_packet_object_property_t*)
+        rtmp_allocate(
+            RTMP_ALLOCATION_AMF, sizeof(amf_packet_object_property_t));
+    if (property == NULL) {
+        return 0;
+    }
+    property->key = amf_packet_duplicate_string(key, key_length);
+    if (property->key == NULL) {
+        rtmp_release(property);
+        return 0;
+    }
+    property->value = value;
+    property->next = NULL;
+    *last = property;
+    return 1;
+}
+
+
+/*
+ * Dense arrays become strict arrays.  Arrays with an associative part
+ * become ECMA arrays: the associative part first, then the dense part
+ * keyed by index.
+ */
+static amf_packet_t *amf3_read_array(
+    amf3_context_t *context, data_reader_t *reader)
+{
+    unsigned int header;
+    unsigned int dense_num;
+    unsigned int i;
+    amf_packet_t *amf;
+    amf_packet_t *value;
+    amf_packet_object_property_t **last;
+    amf3_string_reference_t key;
+    char index_key[16];
+
+    if (!amf3_read_u29(reader, &header)) {
+        return NULL;
+    }
+    if ((header & 0x01) == 0) {
+        return amf3_read_reference(context, header >> 1);
+    }
+    dense_num = header >> 1;
+
+    /* strings have their own table, so the key can be read first */
+    if (!amf3_read_string(context, reader, &key)) {
+        return NULL;
+    }
+    if (key.length == 0) {
+        return amf3_read_dense_array(context, reader, dense_num);
+    }
+
+    amf = amf_packet_create_ecma_array();
+    if (amf == NULL) {
+        return NULL;
+    }
+    if (!amf3_context_add_object(context, amf)) {
+        rtmp_release(amf);
+        return NULL;
+    }
+    last = &amf->ecma_array.properties;
+
+    RTMP_TRACE(RTMP_TRACE_AMF3_ARRAY_START, dense_num);
+    while (key.length > 0) {
+        value = amf3_read_value(context, reader);
+        if (value == NULL) {
+            amf_packet_free(amf);
+            return NULL;
+        }
+        if (!amf3_append_property(last, key.data, key.length, value)) {
+            amf_packet_free(value);
+            amf_packet_free(amf);
+            return NULL;
+        }
+        last = &(*last)->next;
+        amf->ecma_array.num++;
+        if (!amf3_read_string(context, reader, &key)) {
+            amf_packet_free(amf);
+            return NULL;
+        }
+    }
+    for (i = 0; i < dense_num; ++i) {
+        value = amf3_read_value(context, reader);
+        if (value == NULL) {
+            amf_packet_free(amf);
+            return NULL;
+        }
+        sprintf(index_key, "%u", i);
+        if (!amf3_append_property(
+                last,
+                (const unsigned char*)index_key, strlen(index_key),
+                value)) {
+            amf_packet_free(value);
+            amf_packet_free(amf);
+            return NULL;
+        }
+        last = &(*last)->next;
+        amf->ecma_array.num++;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF3_ARRAY_END, 0);
+
+    return amf;
+}
+
+
+static amf_packet_t *amf3_read_dense_array(
+    amf3_context_t *context, data_reader_t *reader, unsigned int dense_num)
+{
+    unsigned int i;
+    amf_packet_t *amf;
+    amf_packet_t *value;
+
+    amf = amf_packet_create_strict_array();
+    if (amf == NULL) {
+        return NULL;
+    }
+    if (!amf3_context_add_object(context, amf)) {
+        rtmp_release(amf);
+        return NULL;
+    }
+
+    RTMP_TRACE(RTMP_TRACE_AMF3_DENSE_ARRAY_START, dense_num);
+    for (i = 0; i < dense_num; ++i) {
+        value = amf3_read_value(context, reader);
+        if (value == NULL) {
+            amf_packet_free(amf);
+            return NULL;
+        }
+        if (amf_packet_add_value_to_strict_array(amf, value) !=
+            RTMP_SUCCESS) {
+            amf_packet_free(value);
+            amf_packet_free(amf);
+            return NULL;
+        }
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF3_DENSE_ARRAY_END, 0);
+
+    return amf;
+}
+
+
+/* objects of a named class become typed objects */
+static amf_packet_t *amf3_read_object(
+    amf3_context_t *context, data_reader_t *reader)
+{
+    unsigned int header;
+    amf3_trait_t *trait;
+    size_t trait_index;
+    size_t i;
+    amf_packet_t *amf;
+    amf_packet_t *value;
+    amf_packet_object_property_t **last;
+    amf3_string_reference_t key;
+
+    if (!amf3_read_u29(reader, &header)) {
+        return NULL;
+    }
+    if ((header & 0x01) == 0) {
+        return amf3_read_reference(context, header >> 1);
+    }
+
+    if ((header & 0x02) == 0) {
+        trait_index = header >> 2;
+        if (trait_index >= context->traits_num) {
+            return NULL;
+        }
+    } else {
+        if (header & 0x04) {
+            /*
+             * The body is written by the class's own writeExternal, so
+             * nothing tells where it ends: the whole value is rejected.
+             */
+            RTMP_TRACE(RTMP_TRACE_AMF3_EXTERNALIZABLE, reader->position);
+            return NULL;
+        }
+        trait = amf3_context_add_trait(context);
+        if (trait == NULL) {
+            return NULL;
+        }
+        trait_index = context->traits_num - 1;
+        trait->dynamic = (header & 0x08) != 0;
+        trait->sealed_num = header >> 4;
+        if (!amf3_read_string(context, reader, &trait->class_name)) {
+            return NULL;
+        }
+        if (trait->sealed_num > 0) {
+            if (trait->sealed_num > reader->size - reader->position) {
+                /* each name takes at least one byte */
+                return NULL;
+            }
+            trait->sealed_names = (amf3_string_reference_t*)rtmp_allocate(
+                RTMP_ALLOCATION_AMF,
+                trait->sealed_num * sizeof(amf3_string_reference_t));
+            if (trait->sealed_names == NULL) {
+                return NULL;
+            }
+            for (i = 0; i < trait->sealed_num; ++i) {
+                if (!amf3_read_string(
+                        context, reader, &trait->sealed_names[i])) {
+                    return NULL;
+                }
+            }
+        }
+    }
+
+    trait = &context->traits[trait_index];
+    if (trait->class_name.length == 0) {
+        amf = amf_packet_create_object();
+        if (amf == NULL) {
+            return NULL;
+        }
+        last = &amf->object.properties;
+    } else {
+        amf = (amf_packet_t*)rtmp_allocate(
+            RTMP_ALLOCATION_AMF, sizeof(amf_packet_typed_object_t));
+        if (amf == NULL) {
+            return NULL;
+        }
+        amf->datatype = AMF_DATATYPE_TYPED_OBJECT;
+        amf->typed_object.properties = NULL;
+        amf->typed_object.class_name = amf_packet_duplicate_string(
+            trait->class_name.data, trait->class_name.length);
+        if (amf->typed_object.class_name == NULL) {
+            rtmp_release(amf);
+            return NULL;
+        }
+        last = &amf->typed_object.properties;
+    }
+    if (!amf3_context_add_object(context, amf)) {
+        amf_packet_free(amf);
+        return NULL;
+    }
+
+    RTMP_TRACE(RTMP_TRACE_AMF3_OBJECT_START, 0);
+    for (i = 0; i < context->traits[trait_index].sealed_num; ++i) {
+        value = amf3_read_value(context, reader);
+        if (value == NULL) {
+            amf_packet_free(amf);
+            return NULL;
+        }
+        /* the trait table may have grown while reading the value */
+        trait = &context->traits[trait_index];
+        if (!amf3_append_property(
+                last,
+                trait->sealed_names[i].data, trait->sealed_names[i].length,
+                value)) {
+            amf_packet_free(value);
+            amf_packet_free(amf);
+            return NULL;
+        }
+        last = &(*last)->next;
+    }
+    if (context->traits[trait_index].dynamic) {
+        while (1) {
+            if (!amf3_read_string(context, reader, &key)) {
+                amf_packet_free(amf);
+                return NULL;
+            }
+            if (key.length == 0) {
+                break;
+            }
+            value = amf3_read_value(context, reader);
+            if (value == NULL) {
+                amf_packet_free(amf);
+                return NULL;
+            }
+            if (!amf3_append_property(last, key.data, key.length, value)) {
+                amf_packet_free(value);
+                amf_packet_free(amf);
+                return NULL;
+            }
+            last = &(*last)->next;
+        }
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF3_OBJECT_END, 0);
+
+    return amf;
+}
+
+
+static amf_packet_t *amf3_read_byte_array(
+    amf3_context_t *context, data_reader_t *reader)
+{
+    unsigned int header;
+    size_t length;
+    amf_packet_t *amf;
+
+    if (!amf3_read_u29(reader, &header)) {
+        return NULL;
+    }
+    if ((header & 0x01) == 0) {
+        return amf3_read_reference(context, header >> 1);
+    }
+    length = header >> 1;
+    if (reader->size - reader->position < length) {
+        return NULL;
+    }
+    amf = amf_packet_create_byte_array(
+        reader->data + reader->position, length);
+    if (amf == NULL) {
+        return NULL;
+    }
+    reader->position += length;
+    if (!amf3_context_add_object(context, amf)) {
+        amf_packet_free(amf);
+        return NULL;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF3_BYTE_ARRAY, length);
+    return amf;
+}
+
+
+size_t amf3_packet_get_size(amf3_context_t *context, amf_packet_t *amf)
+{
+    return amf3_packet_serialize(context, amf, NULL, 0);
+}
+
+
+/*
+ * The reference tables make the size depend on what was written before,
+ * so get_size and serialize must be given contexts in the same state.
+ */
+size_t amf3_packet_serialize(
+    amf3_context_t *context,
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    data_writer_t writer;
+
+    data_writer_initialize(&writer, output_buffer, output_buffer_size);
+
+    if (!amf3_write_value(context, &writer, amf)) {
+        return 0;
+    }
+    if (data_writer_overflowed(&writer)) {
+        return 0;
+    }
+    return writer.position;
+}
+
+
+static int amf3_write_u29(data_writer_t *writer, unsigned int value)
+{
+    if (value > AMF3_U29_MAX) {
+        return 0;
+    }
+    if (value < 0x80) {
+        data_write_u8(writer, (unsigned char)value);
+    } else if (value < 0x4000) {
+        data_write_u8(writer, (unsigned char)((value >> 7) | 0x80));
+        data_write_u8(writer, (unsigned char)(value & 0x7F));
+    } else if (value < 0x200000) {
+        data_write_u8(writer, (unsigned char)((value >> 14) | 0x80));
+        data_write_u8(writer, (unsigned char)(((value >> 7) & 0x7F) | 0x80));
+        data_write_u8(writer, (unsigned char)(value & 0x7F));
+    } else {
+        data_write_u8(writer, (unsigned char)((value >> 22) | 0x80));
+        data_write_u8(writer, (unsigned char)(((value >> 15) & 0x7F) | 0x80));
+        data_write_u8(writer, (unsigned char)(((value >> 8) & 0x7F) | 0x80));
+        data_write_u8(writer, (unsigned char)(value & 0xFF));
+    }
+    return 1;
+}
+
+
+static int amf3_write_string(
+    amf3_context_t *context, data_writer_t *writer,
+    const char *string)
+{
+    size_t length;
+    size_t i;
+
+    length = strlen(string);
+    if (length == 0) {
+        return amf3_write_u29(writer, 0x01);
+    }
+
+    for (i = 0; i < context->strings_num; ++i) {
+        if (context->strings[i].length == length &&
+            ((const char*)context->strings[i].data == string ||
+             memcmp(context->strings[i].data, string, length) == 0)) {
+            return amf3_write_u29(writer, (unsigned int)(i << 1));
+        }
+    }
+    if (length > (AMF3_U29_MAX >> 1)) {
+        return 0;
+    }
+    if (!amf3_context_add_string(
+            context, (const unsigned char*)string, length)) {
+        return 0;
+    }
+    if (!amf3_write_u29(writer, (unsigned int)((length << 1) | 0x01))) {
+        return 0;
+    }
+    data_write_bytes(writer, (const unsigned char*)string, length);
+    return 1;
+}
+
+
+/* integral numbers which fit in 29 bits are sent as integers */
+static int amf3_write_number(data_writer_t *writer, double value)
+{
+    long integer;
+    unsigned char number_data[8];
+
+    if (value >= AMF3_INTEGER_MIN && value <= AMF3_INTEGER_MAX) {
+        integer = (long)value;
+        if (!(value < (double)integer) && !(value > (double)integer)) {
+            data_write_u8(writer, AMF3_DATATYPE_INTEGER);
+            return amf3_write_u29(
+                writer, (unsigned int)integer & AMF3_U29_MAX);
+        }
+    }
+
+    data_write_u8(writer, AMF3_DATATYPE_DOUBLE);
+    write_be64double(number_data, value);
+    data_write_bytes(writer, number_data, 8);
+    return 1;
+}
+
+
+static int amf3_write_properties(
+    amf3_context_t *context, data_writer_t *writer,
+    amf_packet_object_property_t *property)
+{
+    while (property) {
+        if (property->key[0] != '\0') {
+            if (!amf3_write_string(context, writer, property->key) ||
+                !amf3_write_value(context, writer, property->value)) {
+                return 0;
+            }
+        }
+        property = property->next;
+    }
+    /* end of dynamic members */
+    return amf3_write_u29(writer, 0x01);
+}
+
+
+static int amf3_write_value(
+    amf3_context_t *context, data_writer_t *writer, amf_packet_t *amf)
+{
+    size_t i;
+    size_t length;
+    const char *class_name;
+    amf3_trait_t *trait;
+    amf_packet_object_property_t *properties;
+    unsigned char number_data[8];
+    amf3_datatype_t datatype;
+
+    switch (amf->datatype) {
+    case AMF_DATATYPE_NUMBER:
+        return amf3_write_number(writer, amf->number.value);
+    case AMF_DATATYPE_BOOLEAN:
+        data_write_u8(
+            writer,
+            amf->boolean.value ? AMF3_DATATYPE_TRUE : AMF3_DATATYPE_FALSE);
+        return 1;
+    case AMF_DATATYPE_STRING:
+    case AMF_DATATYPE_LONG_STRING:
+        data_write_u8(writer, AMF3_DATATYPE_STRING);
+        return amf3_write_string(context, writer, amf->string.value);
+    case AMF_DATATYPE_NULL:
+        data_write_u8(writer, AMF3_DATATYPE_NULL);
+        return 1;
+    case AMF_DATATYPE_UNDEFINED:
+    case AMF_DATATYPE_UNSUPPORTED:
+        data_write_u8(writer, AMF3_DATATYPE_UNDEFINED);
+        return 1;
+    case AMF_DATATYPE_REFERENCE:
+        if (amf->reference.value == NULL) {
+            /* unresolved AMF0 reference */
+            return 0;
+        }
+        return amf3_write_value(context, writer, amf->reference.value);
+    case AMF_DATATYPE_AVMPLUS_OBJECT:
+        return amf3_write_value(context, writer, amf->avmplus.value);
+    case AMF_DATATYPE_DATE:
+        datatype = AMF3_DATATYPE_DATE;
+        break;
+    case AMF_DATATYPE_XML_DOCUMENT:
+        datatype = AMF3_DATATYPE_XML_DOC;
+        break;
+    case AMF_DATATYPE_BYTE_ARRAY:
+        datatype = AMF3_DATATYPE_BYTE_ARRAY;
+        break;
+    case AMF_DATATYPE_STRICT_ARRAY:
+    case AMF_DATATYPE_ECMA_ARRAY:
+        datatype = AMF3_DATATYPE_ARRAY;
+        break;
+    case AMF_DATATYPE_OBJECT:
+    case AMF_DATATYPE_TYPED_OBJECT:
+        datatype = AMF3_DATATYPE_OBJECT;
+        break;
+    default:
+        return 0;
+    }
+
+    /* the rest go to the object table: by reference if already written */
+    data_write_u8(writer, (unsigned char)datatype);
+    for (i = 0; i < context->objects_num; ++i) {
+        if (context->objects[i] == amf) {
+            return amf3_write_u29(writer, (unsigned int)(i << 1));
+        }
+    }
+    if (!amf3_context_add_object(context, amf)) {
+        return 0;
+    }
+
+    switch (amf->datatype) {
+    case AMF_DATATYPE_DATE:
+        if (!amf3_write_u29(writer, 0x01)) {
+            return 0;
+        }
+        write_be64double(number_data, amf->date.value);
+        data_write_bytes(writer, number_data, 8);
+        return 1;
+    case AMF_DATATYPE_XML_DOCUMENT:
+        length = strlen(amf->string.value);
+        if (length > (AMF3_U29_MAX >> 1) ||
+            !amf3_write_u29(writer, (unsigned int)((length << 1) | 0x01))) {
+            return 0;
+        }
+        data_write_bytes(
+            writer, (const unsigned char*)amf->string.value, length);
+        return 1;
+    case AMF_DATATYPE_BYTE_ARRAY:
+        length = amf->byte_array.length;
+        if (length > (AMF3_U29_MAX >> 1) ||
+            !amf3_write_u29(writer, (unsigned int)((length << 1) | 0x01))) {
+            return 0;
+        }
+        if (length > 0) {
+            /* data is NULL then */
+            data_write_bytes(writer, amf->byte_array.data, length);
+        }
+        return 1;
+    case AMF_DATATYPE_STRICT_ARRAY:
+        /* everything goes to the dense part */
+        if (amf->strict_array.num > (AMF3_U29_MAX >> 1) ||
+            !amf3_write_u29(
+                writer,
+                (unsigned int)((amf->strict_array.num << 1) | 0x01)) ||
+            !amf3_write_u29(writer, 0x01)) {
+            return 0;
+        }
+        for (i = 0; i < amf->strict_array.num; ++i) {
+            if (amf->strict_array.values == NULL) {
+                if (!amf3_write_number(
+                        writer, amf->strict_array.numbers[i])) {
+                    return 0;
+                }
+            } else if (!amf3_write_value(
+                           context, writer, amf->strict_array.values[i])) {
+                return 0;
+            }
+        }
+        return 1;
+    case AMF_DATATYPE_ECMA_ARRAY:
+        /* everything goes to the associative part */
+        if (!amf3_write_u29(writer, 0x01)) {
+            return 0;
+        }
+        return amf3_write_properties(
+            context, writer, amf->ecma_array.properties);
+    default:
+        break;
+    }
+
+    /* dynamic object, the trait is sent once per class */
+    class_name = "";
+    properties = amf->object.properties;
+    if (amf->datatype == AMF_DATATYPE_TYPED_OBJECT) {
+        class_name = amf->typed_object.class_name;
+        properties = amf->typed_object.properties;
+    }
+    length = strlen(class_name);
+    for (i = 0; i < context->traits_num; ++i) {
+        trait = &context->traits[i];
+        if (trait->dynamic && trait->sealed_num == 0 &&
+            trait->class_name.length == length &&
+            memcmp(trait->class_name.data, class_name, length) == 0) {
+            break;
+        }
+    }
+    if (i < context->traits_num) {
+        if (!amf3_write_u29(writer, (unsigned int)((i << 2) | 0x01))) {
+            return 0;
+        }
+    } else {
+        trait = amf3_context_add_trait(context);
+        if (trait == NULL) {
+            return 0;
+        }
+        trait->dynamic = 1;
+        trait->class_name.data = (const unsigned char*)class_name;
+        trait->class_name.length = length;
+        /* inline traits, dynamic, no sealed members */
+        if (!amf3_write_u29(writer, 0x0B) ||
+            !amf3_write_string(context, writer, class_name)) {
+            return 0;
+        }
+    }
+    return amf3_write_properties(context, writer, properties);
+}
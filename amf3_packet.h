@@ -0,0 +1,118 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#ifndef _amf3_packet_H_
+#define _amf3_packet_H_
+
+#include "amf_packet.h"
+
+
+/* Set up for C function definitions, even when using C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+typedef enum amf3_datatype amf3_datatype_t;
+
+enum amf3_datatype
+{
+    AMF3_DATATYPE_UNDEFINED  = 0x00,
+    AMF3_DATATYPE_NULL       = 0x01,
+    AMF3_DATATYPE_FALSE      = 0x02,
+    AMF3_DATATYPE_TRUE       = 0x03,
+    AMF3_DATATYPE_INTEGER    = 0x04,
+    AMF3_DATATYPE_DOUBLE     = 0x05,
+    AMF3_DATATYPE_STRING     = 0x06,
+    AMF3_DATATYPE_XML_DOC    = 0x07,
+    AMF3_DATATYPE_DATE       = 0x08,
+    AMF3_DATATYPE_ARRAY      = 0x09,
+    AMF3_DATATYPE_OBJECT     = 0x0A,
+    AMF3_DATATYPE_XML        = 0x0B,
+    AMF3_DATATYPE_BYTE_ARRAY = 0x0C,
+};
+
+#define AMF3_INTEGER_MAX 0x0FFFFFFF
+#define AMF3_INTEGER_MIN (-0x10000000)
+
+typedef struct amf3_string_reference_t amf3_string_reference_t;
+
+struct amf3_string_reference_t
+{
+    const unsigned char *data;
+    size_t length;
+};
+
+typedef struct amf3_trait_t amf3_trait_t;
+
+struct amf3_trait_t
+{
+    amf3_string_reference_t class_name;
+    int dynamic;
+    size_t sealed_num;
+    amf3_string_reference_t *sealed_names;
+};
+
+/*
+ * Reference tables.  One context covers one AMF3 value tree, i.e.
+ * everything after a single AMF_DATATYPE_AVMPLUS_OBJECT marker.
+ */
+typedef struct amf3_context_t amf3_context_t;
+
+struct amf3_context_t
+{
+    amf3_string_reference_t *strings;
+    size_t strings_num;
+    size_t strings_capacity;
+    amf_packet_t **objects;
+    size_t objects_num;
+    size_t objects_capacity;
+    amf3_trait_t *traits;
+    size_t traits_num;
+    size_t traits_capacity;
+    int depth; /* containers the value decoded next is in */
+};
+
+
+extern void amf3_context_initialize(amf3_context_t *context);
+extern void amf3_context_cleanup(amf3_context_t *context);
+
+extern amf_packet_t *amf3_packet_analyze_data(
+    amf3_context_t *context,
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size);
+
+extern size_t amf3_packet_get_size(
+    amf3_context_t *context, amf_packet_t *amf);
+
+extern size_t amf3_packet_serialize(
+    amf3_context_t *context,
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+
+
+/* Ends C function definitions when using C++ */
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,198 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+
+#include <string.h>
+#if !defined(__WIN32__) && !defined(WIN32)
+#include <pthread.h>
+#define AMF_INTERN_ONCE
+#endif
+
+#include "amf_intern.h"
+
+
+#define AMF_INTERN_HASH_SIZE 256 /* must be power of 2 */
+
+
+/*
+ * All interned strings live in this one object, so that
+ * amf_intern_is_interned() is a range check.  It is never modified.
+ */
+typedef struct amf_intern_pool_t amf_intern_pool_t;
+
+struct amf_intern_pool_t
+{
+#define AMF_INTERN_ENTRY(id, string) char amf_intern_##id[sizeof(string)];
+    AMF_INTERN_LIST
+#undef AMF_INTERN_ENTRY
+};
+
+static amf_intern_pool_t amf_intern_pool = {
+#define AMF_INTERN_ENTRY(id, string) string,
+    AMF_INTERN_LIST
+#undef AMF_INTERN_ENTRY
+};
+
+const char *const amf_intern_strings[AMF_INTERN_NUM] = {
+#define AMF_INTERN_ENTRY(id, string) amf_intern_pool.amf_intern_##id,
+    AMF_INTERN_LIST
+#undef AMF_INTERN_ENTRY
+};
+
+static const size_t amf_intern_lengths[AMF_INTERN_NUM] = {
+#define AMF_INTERN_ENTRY(id, string) sizeof(string) - 1,
+    AMF_INTERN_LIST
+#undef AMF_INTERN_ENTRY
+};
+
+/* id + 1 of the string in the slot, 0 is empty */
+static unsigned char amf_intern_hash_table[AMF_INTERN_HASH_SIZE];
+static unsigned int amf_intern_hashes[AMF_INTERN_NUM];
+/* id + 1 of the string starting at each offset of the pool, or 0 */
+static unsigned char amf_intern_offset_ids[sizeof(amf_intern_pool_t)];
+static size_t amf_intern_max_length;
+#ifdef AMF_INTERN_ONCE
+static pthread_once_t amf_intern_once = PTHREAD_ONCE_INIT;
+#else
+static int amf_intern_initialized = 0;
+#endif
+
+
+static void amf_intern_build(void);
+
+
+unsigned int amf_intern_hash(const unsigned char *data, size_t length)
+{
+    unsigned int hash;
+    size_t i;
+
+    /* FNV-1a */
+    hash = 2166136261U;
+    for (i = 0; i < length; ++i) {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+
+/*
+ * Builds the lookup table, once.  The table is read only afterwards, so
+ * one table serves every server, client and thread.  The lookups call
+ * this themselves, so calling it first only moves the work.  It is thread
+ * safe except on Win32, where the first call has to come before starting
+ * threads.
+ */
+void amf_intern_initialize(void)
+{
+#ifdef AMF_INTERN_ONCE
+    pthread_once(&amf_intern_once, amf_intern_build);
+#else
+    if (!amf_intern_initialized) {
+        amf_intern_build();
+        amf_intern_initialized = 1;
+    }
+#endif
+}
+
+
+static void amf_intern_build(void)
+{
+    int id;
+    unsigned int slot;
+
+    memset(amf_intern_hash_table, 0x00, sizeof(amf_intern_hash_table));
+    memset(amf_intern_offset_ids, 0x00, sizeof(amf_intern_offset_ids));
+    amf_intern_max_length = 0;
+    for (id = 0; id < AMF_INTERN_NUM; ++id) {
+        amf_intern_hashes[id] = amf_intern_hash(
+            (const unsigned char*)amf_intern_strings[id],
+            amf_intern_lengths[id]);
+        amf_intern_offset_ids[
+            amf_intern_strings[id] - (const char*)&amf_intern_pool] =
+            (unsigned char)(id + 1);
+        slot = amf_intern_hashes[id] & (AMF_INTERN_HASH_SIZE - 1);
+        while (amf_intern_hash_table[slot] != 0) {
+            slot = (slot + 1) & (AMF_INTERN_HASH_SIZE - 1);
+        }
+        amf_intern_hash_table[slot] = (unsigned char)(id + 1);
+        if (amf_intern_lengths[id] > amf_intern_max_length) {
+            amf_intern_max_length = amf_intern_lengths[id];
+        }
+    }
+}
+
+
+/* returns the canonical string for data, or NULL if it is not interned */
+const char *amf_intern_lookup(const unsigned char *data, size_t length)
+{
+    unsigned int slot;
+    int id;
+
+    amf_intern_initialize();
+    if (length > amf_intern_max_length) {
+        return NULL;
+    }
+
+    slot = amf_intern_hash(data, length) & (AMF_INTERN_HASH_SIZE - 1);
+    while (amf_intern_hash_table[slot] != 0) {
+        id = amf_intern_hash_table[slot] - 1;
+        if (amf_intern_lengths[id] == length &&
+            memcmp(amf_intern_strings[id], data, length) == 0) {
+            return amf_intern_strings[id];
+        }
+        slot = (slot + 1) & (AMF_INTERN_HASH_SIZE - 1);
+    }
+    return NULL;
+}
+
+
+/*
+ * amf_intern_hash of a nul terminated string, setting *length to its
+ * length.  Both come from the table for an interned string, without
+ * reading it.
+ */
+unsigned int amf_intern_hash_string(const char *string, size_t *length)
+{
+    int id;
+
+    if (amf_intern_is_interned(string)) {
+        amf_intern_initialize();
+        id = amf_intern_offset_ids[
+            string - (const char*)&amf_intern_pool] - 1;
+        if (id >= 0) {
+            *length = amf_intern_lengths[id];
+            return amf_intern_hashes[id];
+        }
+    }
+    *length = strlen(string);
+    return amf_intern_hash((const unsigned char*)string, *length);
+}
+
+
+int amf_intern_is_interned(const char *string)
+{
+    const char *pool;
+
+    pool = (const char*)&amf_intern_pool;
+    return string >= pool && string < pool + sizeof(amf_intern_pool);
+}
@@ -0,0 +1,136 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#ifndef _amf_intern_H_
+#define _amf_intern_H_
+
+#include <stddef.h>
+
+
+/* Set up for C function definitions, even when using C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * Strings which appear in almost every command message.  The decoder
+ * returns the canonical pointer for these instead of a malloc()ed copy,
+ * so that they can be compared by pointer.
+ */
+#define AMF_INTERN_LIST \
+    AMF_INTERN_ENTRY(EMPTY, "") \
+    AMF_INTERN_ENTRY(CODE, "code") \
+    AMF_INTERN_ENTRY(LEVEL, "level") \
+    AMF_INTERN_ENTRY(DESCRIPTION, "description") \
+    AMF_INTERN_ENTRY(DETAILS, "details") \
+    AMF_INTERN_ENTRY(CLIENTID, "clientid") \
+    AMF_INTERN_ENTRY(OBJECT_ENCODING, "objectEncoding") \
+    AMF_INTERN_ENTRY(RESULT, "_result") \
+    AMF_INTERN_ENTRY(ERROR, "_error") \
+    AMF_INTERN_ENTRY(ON_STATUS, "onStatus") \
+    AMF_INTERN_ENTRY(ON_META_DATA, "onMetaData") \
+    AMF_INTERN_ENTRY(SET_DATA_FRAME, "@setDataFrame") \
+    AMF_INTERN_ENTRY(CONNECT, "connect") \
+    AMF_INTERN_ENTRY(CREATE_STREAM, "createStream") \
+    AMF_INTERN_ENTRY(DELETE_STREAM, "deleteStream") \
+    AMF_INTERN_ENTRY(CLOSE_STREAM, "closeStream") \
+    AMF_INTERN_ENTRY(RELEASE_STREAM, "releaseStream") \
+    AMF_INTERN_ENTRY(PLAY, "play") \
+    AMF_INTERN_ENTRY(PAUSE, "pause") \
+    AMF_INTERN_ENTRY(SEEK, "seek") \
+    AMF_INTERN_ENTRY(PUBLISH, "publish") \
+    AMF_INTERN_ENTRY(FC_PUBLISH, "FCPublish") \
+    AMF_INTERN_ENTRY(FC_UNPUBLISH, "FCUnpublish") \
+    AMF_INTERN_ENTRY(APP, "app") \
+    AMF_INTERN_ENTRY(FLASH_VER, "flashVer") \
+    AMF_INTERN_ENTRY(SWF_URL, "swfUrl") \
+    AMF_INTERN_ENTRY(TC_URL, "tcUrl") \
+    AMF_INTERN_ENTRY(FPAD, "fpad") \
+    AMF_INTERN_ENTRY(CAPABILITIES, "capabilities") \
+    AMF_INTERN_ENTRY(AUDIO_CODECS, "audioCodecs") \
+    AMF_INTERN_ENTRY(VIDEO_CODECS, "videoCodecs") \
+    AMF_INTERN_ENTRY(VIDEO_FUNCTION, "videoFunction") \
+    AMF_INTERN_ENTRY(PAGE_URL, "pageUrl") \
+    AMF_INTERN_ENTRY(FMSVER, "fmsver") \
+    AMF_INTERN_ENTRY(MODE, "mode") \
+    AMF_INTERN_ENTRY(STATUS, "status") \
+    AMF_INTERN_ENTRY(LEVEL_ERROR, "error") \
+    AMF_INTERN_ENTRY(WARNING, "warning") \
+    AMF_INTERN_ENTRY(CONNECT_SUCCESS, "NetConnection.Connect.Success") \
+    AMF_INTERN_ENTRY(CONNECT_REJECTED, "NetConnection.Connect.Rejected") \
+    AMF_INTERN_ENTRY(CONNECT_CLOSED, "NetConnection.Connect.Closed") \
+    AMF_INTERN_ENTRY(CONNECT_FAILED, "NetConnection.Connect.Failed") \
+    AMF_INTERN_ENTRY(CONNECT_INVALID_APP, "NetConnection.Connect.InvalidApp") \
+    AMF_INTERN_ENTRY(PLAY_START, "NetStream.Play.Start") \
+    AMF_INTERN_ENTRY(PLAY_STOP, "NetStream.Play.Stop") \
+    AMF_INTERN_ENTRY(PLAY_RESET, "NetStream.Play.Reset") \
+    AMF_INTERN_ENTRY(PLAY_STREAM_NOT_FOUND, "NetStream.Play.StreamNotFound") \
+    AMF_INTERN_ENTRY(PLAY_FAILED, "NetStream.Play.Failed") \
+    AMF_INTERN_ENTRY(PLAY_PUBLISH_NOTIFY, "NetStream.Play.PublishNotify") \
+    AMF_INTERN_ENTRY(PLAY_UNPUBLISH_NOTIFY, "NetStream.Play.UnpublishNotify") \
+    AMF_INTERN_ENTRY(PAUSE_NOTIFY, "NetStream.Pause.Notify") \
+    AMF_INTERN_ENTRY(UNPAUSE_NOTIFY, "NetStream.Unpause.Notify") \
+    AMF_INTERN_ENTRY(SEEK_NOTIFY, "NetStream.Seek.Notify") \
+    AMF_INTERN_ENTRY(PUBLISH_START, "NetStream.Publish.Start") \
+    AMF_INTERN_ENTRY(PUBLISH_BAD_NAME, "NetStream.Publish.BadName") \
+    AMF_INTERN_ENTRY(DURATION, "duration") \
+    AMF_INTERN_ENTRY(WIDTH, "width") \
+    AMF_INTERN_ENTRY(HEIGHT, "height") \
+    AMF_INTERN_ENTRY(FRAMERATE, "framerate") \
+    AMF_INTERN_ENTRY(VIDEOCODECID, "videocodecid") \
+    AMF_INTERN_ENTRY(AUDIOCODECID, "audiocodecid") \
+    AMF_INTERN_ENTRY(KEYFRAMES, "keyframes") \
+    AMF_INTERN_ENTRY(TIMES, "times") \
+    AMF_INTERN_ENTRY(FILEPOSITIONS, "filepositions")
+
+typedef enum amf_intern_id amf_intern_id_t;
+
+enum amf_intern_id
+{
+#define AMF_INTERN_ENTRY(id, string) AMF_INTERN_##id,
+    AMF_INTERN_LIST
+#undef AMF_INTERN_ENTRY
+    AMF_INTERN_NUM
+};
+
+extern const char *const amf_intern_strings[AMF_INTERN_NUM];
+
+/* canonical pointer of a well known string, e.g. AMF_INTERNED(RESULT) */
+#define AMF_INTERNED(id) (amf_intern_strings[AMF_INTERN_##id])
+
+
+extern void amf_intern_initialize(void);
+extern const char *amf_intern_lookup(
+    const unsigned char *data, size_t length);
+extern int amf_intern_is_interned(const char *string);
+extern unsigned int amf_intern_hash(const unsigned char *data, size_t length);
+extern unsigned int amf_intern_hash_string(const char *string, size_t *length);
+
+
+/* Ends C function definitions when using C++ */
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
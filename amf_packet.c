@@ -1,888 +1,1709 @@
-/*
-    librtmp
-    Copyright (C) 2009 ITOYANAGI Kazunori
-
-    This library is free software; you can redistribute it and/or
-    modify it under the terms of the GNU Library General Public
-    License as published by the Free Software Foundation; either
-    version 2 of the License, or (at your option) any later version.
-
-    This library is distributed in the hope that it will be useful,
-    but WITHOUT ANY WARRANTY; without even the implied warranty of
-    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-    Library General Public License for more details.
-
-    You should have received a copy of the GNU Library General Public
-    License along with this library; if not, write to the Free
-    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
-
-    ITOYANAGI Kazunori
-    kazunori@itoyanagi.name
-*/
-
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-#include "rtmp.h"
-#include "amf_packet.h"
-#include "data_rw.h"
-
-
-static amf_packet_t *amf_packet_analyze_number(
-    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size);
-static amf_packet_t *amf_packet_analyze_boolean(
-    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size);
-static amf_packet_t *amf_packet_analyze_string(
-    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size);
-static amf_packet_t *amf_packet_analyze_object(
-    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size);
-static amf_packet_t *amf_packet_analyze_null(void);
-static amf_packet_t *amf_packet_analyze_undefined(void);
-static amf_packet_t *amf_packet_analyze_ecma_array(
-    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size);
-
-static size_t amf_packet_serialize_number(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size);
-static size_t amf_packet_serialize_boolean(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size);
-static size_t amf_packet_serialize_string(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size);
-static size_t amf_packet_serialize_object(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size);
-static size_t amf_packet_serialize_null(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size);
-static size_t amf_packet_serialize_undefined(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size);
-static size_t amf_packet_serialize_ecma_array(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size);
-
-
-amf_packet_t *amf_packet_analyze_data(
-    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
-{
-    amf_packet_t *amf;
-
-    if (raw_data_size < 1) {
-        return NULL;
-    }
-
-    if (raw_data[0] == 0x00 && raw_data[1] == 0x00 && raw_data[2] == 0x09) {
-        /* FIXME: end of object without object start, why? */
-        amf = amf_packet_analyze_undefined();
-        *packet_size = 3;
-        return amf;
-    }
-
-    switch (raw_data[0]) {
-    case AMF_DATATYPE_NUMBER:
-        amf = amf_packet_analyze_number(
-            raw_data, raw_data_size, packet_size);
-        return amf;
-    case AMF_DATATYPE_BOOLEAN:
-        amf = amf_packet_analyze_boolean(
-            raw_data, raw_data_size, packet_size);
-        return amf;
-    case AMF_DATATYPE_STRING:
-        amf = amf_packet_analyze_string(
-            raw_data, raw_data_size, packet_size);
-        return amf;
-    case AMF_DATATYPE_OBJECT:
-        amf = amf_packet_analyze_object(
-            raw_data, raw_data_size, packet_size);
-        return amf;
-    case AMF_DATATYPE_NULL:
-        amf = amf_packet_analyze_null();
-        *packet_size = 1;
-        return amf;
-    case AMF_DATATYPE_UNDEFINED:
-        amf = amf_packet_analyze_undefined();
-        *packet_size = 1;
-        return amf;
-    case AMF_DATATYPE_ECMA_ARRAY:
-        amf = amf_packet_analyze_ecma_array(
-            raw_data, raw_data_size, packet_size);
-        return amf;
-    case AMF_DATATYPE_OBJECT_END:
-        
-        break;
-    default:
-        break;
-    }
-
-    *packet_size = 0;
-    return NULL;
-}
-
-amf_packet_t *amf_packet_analyze_number(
-    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
-{
-    amf_packet_t *amf;
-
-    if (raw_data_size < 9) {
-        if (packet_size) {
-            *packet_size = 1;
-        }
-        return NULL;
-    }
-
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_number_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_NUMBER;
-    amf->number.value = read_be64double(raw_data + 1);
-#ifdef DEBUG
-    printf("AMF number: %f\n", amf->number.value);
-#endif
-    if (packet_size) {
-        *packet_size = 9;
-    }
-    return amf;
-}
-
-
-amf_packet_t *amf_packet_analyze_boolean(
-    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
-{
-    amf_packet_t *amf;
-
-    if (raw_data_size < 2) {
-        if (packet_size) {
-            *packet_size = 0;
-        }
-        return NULL;
-    }
-
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_boolean_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_BOOLEAN;
-
-    amf->boolean.value = raw_data[1];
-#ifdef DEBUG
-    printf("AMF boolean: %d\n", amf->boolean.value);
-#endif
-
-    if (packet_size) {
-        *packet_size = 2;
-    }
-
-    return amf;
-}
-
-amf_packet_t *amf_packet_analyze_string(
-    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
-{
-    amf_packet_t *amf;
-    size_t string_data_length;
-    char *string_data;
-
-    if (raw_data_size < 3) {
-        if (packet_size) {
-            *packet_size = 0;
-        }
-        return NULL;
-    }
-
-    string_data_length = read_be16int(raw_data + 1);
-    if (raw_data_size < 3 + string_data_length) {
-        if (packet_size) {
-            *packet_size = 0;
-        }
-        return NULL;
-    }
-
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_string_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_STRING;
-
-    string_data = (char*)malloc(string_data_length + 1);
-    if (string_data == NULL) {
-        free(amf);
-        return NULL;
-    }
-    memset(string_data, 0x00, string_data_length + 1);
-
-    memmove(string_data, raw_data + 3, string_data_length);
-    string_data[string_data_length] = '\0';
-
-    amf->string.value = string_data;
-#ifdef DEBUG
-    printf("AMF string: %d \"%s\"\n", string_data_length, string_data);
-#endif
-
-    if (packet_size) {
-        /* datatype(1) + length(2) + string */
-        *packet_size = 1 + 2 + string_data_length;
-    }
-
-    return amf;
-}
-
-amf_packet_t *amf_packet_analyze_object(
-    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
-{
-    amf_packet_t *amf;
-    int raw_data_position;
-    size_t string_length;
-    size_t property_packet_size;
-    amf_packet_object_property_t *property;
-    amf_packet_object_property_t *previous_property;
-
-    if (raw_data_size < 1) {
-        return NULL;
-    }
-
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_object_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_OBJECT;
-
-    raw_data_position = 1;
-    amf->object.properties = NULL;
-#ifdef DEBUG
-    printf("AMF object start\n");
-#endif
-    while (1) {
-        string_length = read_be16int(raw_data + raw_data_position);
-        if (string_length == 0 && raw_data[raw_data_position + 2] == 0x09) {
-            raw_data_position += 3;
-            break;
-        }
-        raw_data_position += 2;
-
-        property = (amf_packet_object_property_t*)
-            malloc(sizeof(amf_packet_object_property_t));
-        if (property == NULL) {
-            *packet_size = raw_data_position;
-            return NULL;
-        }
-        property->next = NULL;
-
-        property->key = malloc(string_length + 1);
-        if (property->key == NULL) {
-            free(property);
-            *packet_size = raw_data_position;
-            return NULL;
-        }
-        memmove(property->key, raw_data + raw_data_position, string_length);
-printf("out\n");
-        property->key[string_length] = '\0';
-        raw_data_position += string_length;
-
-#ifdef DEBUG
-    printf("AMF object key: %d \"%s\"\n", string_length, property->key);
-#endif
-
-        property->value = amf_packet_analyze_data(
-            raw_data + raw_data_position,
-            raw_data_size - raw_data_position,
-            &property_packet_size);
-        raw_data_position += property_packet_size;
-
-        if (amf->object.properties == NULL) {
-            amf->object.properties = property;
-        } else {
-            previous_property->next = property;
-        }
-        previous_property = property;
-    }
-#ifdef DEBUG
-    printf("AMF object end\n");
-#endif
-
-    *packet_size = raw_data_position;
-
-    return amf;
-}
-
-amf_packet_t *amf_packet_analyze_null(void)
-{
-    amf_packet_t *amf;
-    
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_null_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_NULL;
-#ifdef DEBUG
-    printf("AMF null\n");
-#endif
-    
-    return amf;
-}
-
-amf_packet_t *amf_packet_analyze_undefined(void)
-{
-    amf_packet_t *amf;
-    
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_undefined_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_UNDEFINED;
-#ifdef DEBUG
-    printf("AMF undefined\n");
-#endif
-    
-    return amf;
-}
-
-
-amf_packet_t *amf_packet_analyze_ecma_array(
-    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
-{
-    amf_packet_t *amf;
-    int raw_data_position;
-    size_t string_length;
-    int array_num;
-    int i;
-    size_t property_packet_size;
-    amf_packet_object_property_t *property;
-    amf_packet_object_property_t *previous_property;
-
-    if (raw_data_size < 1) {
-        return NULL;
-    }
-
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_ecma_array_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_ECMA_ARRAY;
-
-    array_num = read_le32int(raw_data + 1);
-
-    raw_data_position = 5;
-    amf->object.properties = NULL;
-#ifdef DEBUG
-    printf("AMF ecma array start: %d\n", array_num);
-#endif
-    for (i = 0; i < array_num; ++i) {
-        string_length = read_be16int(raw_data + raw_data_position);
-        if (string_length == 0 && raw_data[raw_data_position + 2] == 0x09) {
-            raw_data_position += 3;
-            break;
-        }
-        raw_data_position += 2;
-
-        property = (amf_packet_object_property_t*)
-            malloc(sizeof(amf_packet_object_property_t));
-        if (property == NULL) {
-            *packet_size = raw_data_position;
-            return NULL;
-        }
-        property->next = NULL;
-
-        property->key = malloc(string_length + 1);
-        if (property->key == NULL) {
-            free(property);
-            *packet_size = raw_data_position;
-            return NULL;
-        }
-        memmove(property->key, raw_data + raw_data_position, string_length);
-        property->key[string_length] = '\0';
-        raw_data_position += string_length;
-
-#ifdef DEBUG
-    printf("AMF ecma array key: %d \"%s\"\n", string_length, property->key);
-#endif
-
-        property->value = amf_packet_analyze_data(
-            raw_data + raw_data_position,
-            raw_data_size - raw_data_position,
-            &property_packet_size);
-        raw_data_position += property_packet_size;
-
-        if (amf->ecma_array.properties == NULL) {
-            amf->ecma_array.properties = property;
-        } else {
-            previous_property->next = property;
-        }
-        previous_property = property;
-    }
-#ifdef DEBUG
-    printf("AMF ecma array end\n");
-#endif
-
-    *packet_size = raw_data_position;
-
-    return amf;
-}
-
-
-void amf_packet_free(amf_packet_t *amf)
-{
-    amf_packet_object_property_t *property;
-    amf_packet_object_property_t *next;
-
-    switch (amf->datatype) {
-    case AMF_DATATYPE_NUMBER:
-        break;
-    case AMF_DATATYPE_BOOLEAN:
-        break;
-    case AMF_DATATYPE_STRING:
-        free(amf->string.value);
-        break;
-    case AMF_DATATYPE_OBJECT:
-        property = amf->object.properties;
-        while (property) {
-            next = property->next;
-            free(property->key);
-            amf_packet_free(property->value);
-            free(property);
-            property = next;
-        }
-        break;
-    case AMF_DATATYPE_NULL:
-        break;
-    case AMF_DATATYPE_UNDEFINED:
-        break;
-    case AMF_DATATYPE_OBJECT_END:
-        break;
-    default:
-        break;
-    }
-
-    free(amf);
-}
-
-
-amf_packet_t *amf_packet_create_number(double number)
-{
-    amf_packet_t *amf;
-
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_number_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_NUMBER;
-    amf->number.value = number;
-    return amf;
-}
-
-
-amf_packet_t *amf_packet_create_boolean(int boolean)
-{
-    amf_packet_t *amf;
-
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_boolean_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_BOOLEAN;
-    amf->boolean.value = boolean;
-    return amf;
-}
-
-
-amf_packet_t *amf_packet_create_string(const char *string)
-{
-    amf_packet_t *amf;
-
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_string_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_STRING;
-    amf->string.value = (char*)malloc(strlen(string) + 1);
-    if (amf->string.value == NULL) {
-        free(amf);
-    }
-    strcpy(amf->string.value, string);
-    return amf;
-}
-
-
-amf_packet_t *amf_packet_create_object(void)
-{
-    amf_packet_t *amf;
-
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_object_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_OBJECT;
-    amf->object.properties = NULL;
-    return amf;
-}
-
-
-rtmp_result_t amf_packet_add_property_to_object(
-    amf_packet_t *amf, const char *key, amf_packet_t *value)
-{
-    amf_packet_object_property_t *property;
-    amf_packet_object_property_t *last_property;
-
-    property = (amf_packet_object_property_t*)
-        malloc(sizeof(amf_packet_object_property_t));
-    if (property == NULL) {
-        return RTMP_ERROR_MEMORY_ALLOCATION;
-    }
-    property->key = (char*)malloc(strlen(key) + 1);
-    if (property->key == NULL) {
-        free(property);
-        return RTMP_ERROR_MEMORY_ALLOCATION;
-    }
-    strcpy(property->key, key);
-    property->value = value;
-
-    property->next = NULL;
-    if (amf->object.properties == NULL) {
-        amf->object.properties = property;
-    } else {
-        last_property = amf->object.properties;
-        while (last_property->next) {
-            last_property = last_property->next;
-        }
-        last_property->next = property;
-    }
-
-    return RTMP_SUCCESS;
-}
-
-
-amf_packet_t *amf_packet_create_null(void)
-{
-    amf_packet_t *amf;
-
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_null_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_NULL;
-    return amf;
-}
-
-
-amf_packet_t *amf_packet_create_undefined(void)
-{
-    amf_packet_t *amf;
-
-    amf = (amf_packet_t*)malloc(sizeof(amf_packet_undefined_t));
-    if (amf == NULL) {
-        return NULL;
-    }
-    amf->datatype = AMF_DATATYPE_UNDEFINED;
-    return amf;
-}
-
-
-size_t amf_packet_get_size(amf_packet_t *amf)
-{
-    size_t size;
-    amf_packet_object_property_t *property;
-
-    switch (amf->datatype) {
-    case AMF_DATATYPE_NUMBER:
-        /* datatype(1) + number(8) */
-        return 9;
-    case AMF_DATATYPE_BOOLEAN:
-        /* datatype(1) + boolean(1) */
-        return 2;
-    case AMF_DATATYPE_STRING:
-        /* datatype(1) + length(2) + string */
-        return 1 + 2 + strlen(amf->string.value);
-    case AMF_DATATYPE_OBJECT:
-        property = amf->object.properties;
-        size = 1;
-        while (property) {
-            size += 2 + strlen(property->key); /* length + key */
-            size += amf_packet_get_size(property->value);
-            property = property->next;
-        }
-        size += 3; /* length + object end (0x09) */
-        return size;
-    case AMF_DATATYPE_NULL:
-        /* datatype(1) */
-        return 1;
-    case AMF_DATATYPE_UNDEFINED:
-        /* datatype(1) */
-        return 1;
-    case AMF_DATATYPE_OBJECT_END:
-        /* datatype(1) */
-        return 1;
-    default:
-        break;
-    }
-    return 0;
-}
-
-
-size_t amf_packet_serialize(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size)
-{
-    switch (amf->datatype) {
-    case AMF_DATATYPE_NUMBER:
-        return amf_packet_serialize_number(
-            amf, output_buffer, output_buffer_size);
-    case AMF_DATATYPE_BOOLEAN:
-        return amf_packet_serialize_boolean(
-            amf, output_buffer, output_buffer_size);
-    case AMF_DATATYPE_STRING:
-        return amf_packet_serialize_string(
-            amf, output_buffer, output_buffer_size);
-    case AMF_DATATYPE_OBJECT:
-        return amf_packet_serialize_object(
-            amf, output_buffer, output_buffer_size);
-    case AMF_DATATYPE_NULL:
-        return amf_packet_serialize_null(
-            amf, output_buffer, output_buffer_size);
-    case AMF_DATATYPE_UNDEFINED:
-        return amf_packet_serialize_undefined(
-            amf, output_buffer, output_buffer_size);
-    case AMF_DATATYPE_ECMA_ARRAY:
-        return amf_packet_serialize_ecma_array(
-            amf, output_buffer, output_buffer_size);
-    case AMF_DATATYPE_OBJECT_END:
-        break;
-    default:
-        break;
-    }
-    return 0;
-}
-
-
-size_t amf_packet_serialize_number(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size)
-{
-    if (output_buffer_size < 9) {
-        return 0;
-    }
-
-    output_buffer[0] = AMF_DATATYPE_NUMBER;
-    write_be64double(output_buffer + 1, amf->number.value);
-#ifdef DEBUG
-    printf("AMF serialize number: %f: ", amf->number.value);
-    {
-        int i;
-        for (i = 0; i < 9; ++i) {
-            printf("%02x, ", output_buffer[i]);
-        }
-    }
-    printf("\n");
-#endif
-
-    return 9;
-}
-
-size_t amf_packet_serialize_boolean(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size)
-{
-    if (output_buffer_size < 2) {
-        return 0;
-    }
-
-    output_buffer[0] = AMF_DATATYPE_BOOLEAN;
-    memmove(output_buffer + 1, &amf->boolean.value, 1);
-#ifdef DEBUG
-    printf("AMF serialize boolean: %d\n", amf->boolean.value);
-#endif
-
-    return 2;
-}
-
-size_t amf_packet_serialize_string(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size)
-{
-    size_t length;
-
-    if (output_buffer_size < (3 + strlen(amf->string.value)) ) {
-        return 0;
-    }
-
-    output_buffer[0] = AMF_DATATYPE_STRING;
-    length = strlen(amf->string.value);
-    write_be16int(output_buffer + 1, (int)length);
-    memmove(output_buffer + 3 , amf->string.value, length);
-#ifdef DEBUG
-    printf("AMF serialize string: %d: '%s': ", length, amf->string.value);
-    {
-        int i;
-        for (i = 0; i < 3 + (int)length; ++i) {
-            printf("%02x, ", output_buffer[i]);
-        }
-    }
-    printf("\n");
-#endif
-
-    return 3 + length;
-}
-
-size_t amf_packet_serialize_object(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size)
-{
-    amf_packet_object_property_t *property;
-    size_t key_length;
-    size_t outputed_size;
-    size_t serialized_value_size;
-
-    if (output_buffer_size < 1) {
-        return 0;
-    }
-
-#ifdef DEBUG
-    printf("AMF serialize object start\n");
-#endif
-    output_buffer[0] = AMF_DATATYPE_OBJECT;
-    outputed_size = 1;
-    property = amf->object.properties;
-    while (property) {
-        key_length = strlen(property->key);
-        if ((outputed_size + 2 + key_length) > output_buffer_size) {
-            return 0;
-        }
-        write_be16int(output_buffer + outputed_size, (int)key_length);
-        memmove(
-            output_buffer + outputed_size + 2,
-            property->key, key_length);
-#ifdef DEBUG
-    printf("key serialize: %d: '%s': ", key_length, property->key);
-    {
-        int i;
-        for (i = 0; i < 2 + (int)key_length; ++i) {
-            printf("%02x, ", output_buffer[outputed_size + i]);
-        }
-    }
-    printf("\n");
-#endif
-        outputed_size += 2 + key_length;
-        serialized_value_size = amf_packet_serialize(
-            property->value,
-            output_buffer + outputed_size,
-            output_buffer_size - outputed_size);
-        if (serialized_value_size == 0) {
-            return 0;
-        }
-        outputed_size += serialized_value_size;
-        property = property->next;
-    }
-    if ((outputed_size + 3) > output_buffer_size) {
-        return 0;
-    }
-    write_be16int(output_buffer + outputed_size, 0);
-    outputed_size += 2;
-    output_buffer[outputed_size] = 0x09;
-    outputed_size += 1;
-#ifdef DEBUG
-    printf("AMF serialize object end\n");
-#endif
-
-    return outputed_size;
-}
-
-size_t amf_packet_serialize_null(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size)
-{
-    if (output_buffer_size < 1 ) {
-        return 0;
-    }
-
-    if (amf->datatype == AMF_DATATYPE_NULL) {
-        output_buffer[0] = AMF_DATATYPE_NULL;
-    }
-
-    return 1;
-}
-
-size_t amf_packet_serialize_undefined(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size)
-{
-    if (output_buffer_size < 1 ) {
-        return 0;
-    }
-
-
-    if (amf->datatype == AMF_DATATYPE_UNDEFINED) {
-        output_buffer[0] = AMF_DATATYPE_UNDEFINED;
-    }
-#ifdef DEBUG
-    printf("AMF serialize undefined\n");
-#endif
-
-    return 1;
-}
-
-
-size_t amf_packet_serialize_ecma_array(
-    amf_packet_t *amf,
-    unsigned char *output_buffer, size_t output_buffer_size)
-{
-    amf_packet_object_property_t *property;
-    size_t key_length;
-    size_t outputed_size;
-    size_t serialized_value_size;
-
-    if (output_buffer_size < 1) {
-        return 0;
-    }
-
-#ifdef DEBUG
-    printf("AMF serialize ecma array start\n");
-#endif
-    output_buffer[0] = AMF_DATATYPE_OBJECT;
-    outputed_size = 1;
-    property = amf->ecma_array.properties;
-    while (property) {
-        key_length = strlen(property->key);
-        if ((outputed_size + 2 + key_length) > output_buffer_size) {
-            return 0;
-        }
-        write_be16int(output_buffer + outputed_size, (int)key_length);
-        memmove(
-            output_buffer + outputed_size + 2,
-            property->key, key_length);
-#ifdef DEBUG
-    printf("key serialize: %d: '%s': ", key_length, property->key);
-    {
-        int i;
-        for (i = 0; i < 2 + (int)key_length; ++i) {
-            printf("%02x, ", output_buffer[outputed_size + i]);
-        }
-    }
-    printf("\n");
-#endif
-        outputed_size += 2 + key_length;
-        serialized_value_size = amf_packet_serialize(
-            property->value,
-            output_buffer + outputed_size,
-            output_buffer_size - outputed_size);
-        if (serialized_value_size == 0) {
-            return 0;
-        }
-        outputed_size += serialized_value_size;
-        property = property->next;
-    }
-    if ((outputed_size + 3) > output_buffer_size) {
-        return 0;
-    }
-    write_be16int(output_buffer + outputed_size, 0);
-    outputed_size += 2;
-    output_buffer[outputed_size] = 0x09;
-    outputed_size += 1;
-#ifdef DEBUG
-    printf("AMF serialize ecma array end\n");
-#endif
-
-    return outputed_size;
-}
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtmp.h"
+#include "amf_packet.h"
+#include "amf3_packet.h"
+#include "amf_intern.h"
+#include "rtmp_trace.h"
+#include "rtmp_allocator.h"
+#include "data_rw.h"
+
+
+static amf_packet_t *amf_packet_analyze_value(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth);
+static amf_packet_t *amf_packet_analyze_number(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size);
+static amf_packet_t *amf_packet_analyze_boolean(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size);
+static amf_packet_t *amf_packet_analyze_string(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size);
+static amf_packet_t *amf_packet_analyze_object(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth);
+static amf_packet_t *amf_packet_analyze_null(void);
+static amf_packet_t *amf_packet_analyze_undefined(void);
+static amf_packet_t *amf_packet_analyze_ecma_array(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth);
+static amf_packet_t *amf_packet_analyze_strict_array(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth);
+static amf_packet_t *amf_packet_analyze_date(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size);
+static amf_packet_t *amf_packet_analyze_typed_object(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth);
+static amf_packet_t *amf_packet_analyze_reference(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size);
+static amf_packet_t *amf_packet_analyze_avmplus(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth);
+static size_t amf_packet_analyze_properties(
+    unsigned char *raw_data, size_t raw_data_size,
+    amf_packet_object_property_t **properties, int *num, int depth);
+
+static amf_packet_object_property_t **amf_packet_get_properties(
+    amf_packet_t *amf);
+static void amf_packet_free_properties(
+    amf_packet_object_property_t *property);
+static rtmp_result_t amf_packet_box_strict_array(amf_packet_t *amf);
+static size_t amf_packet_get_properties_size(
+    amf_packet_object_property_t *property);
+
+static size_t amf_packet_serialize_number(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_boolean(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_string(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_object(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_null(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_undefined(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_ecma_array(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_strict_array(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_date(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_typed_object(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_properties(
+    amf_packet_object_property_t *property,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_reference(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+static size_t amf_packet_serialize_avmplus(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size);
+
+
+/*
+ * Well known strings are shared with the intern table instead of being
+ * copied; amf_packet_free_string() knows not to free them.
+ */
+const char *amf_packet_duplicate_string(
+    const unsigned char *data, size_t length)
+{
+    const char *interned;
+    char *string;
+
+    interned = amf_intern_lookup(data, length);
+    if (interned) {
+        return interned;
+    }
+
+    string = (char*)rtmp_allocate(RTMP_ALLOCATION_AMF, length + 1);
+    if (string == NULL) {
+        return NULL;
+    }
+    memmove(string, data, length);
+    string[length] = '\0';
+    return string;
+}
+
+
+/* strings are const as they may be interned, only the copies are freed */
+void amf_packet_free_string(const char *string)
+{
+    union {
+        const char *string;
+        void *copy;
+    } owned;
+
+    if (!amf_intern_is_interned(string)) {
+        owned.string = string;
+        rtmp_release(owned.copy);
+    }
+}
+
+
+amf_packet_t *amf_packet_analyze_data(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
+{
+    return amf_packet_analyze_value(raw_data, raw_data_size, packet_size, 0);
+}
+
+
+/*
+ * depth is the number of containers the value is in.  The peer chooses it,
+ * so past AMF_DEPTH_MAX the value is rejected rather than recursing on.
+ */
+amf_packet_t *amf_packet_analyze_value(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth)
+{
+    amf_packet_t *amf;
+
+    if (raw_data_size < 1) {
+        return NULL;
+    }
+    if (depth > AMF_DEPTH_MAX) {
+        RTMP_TRACE(RTMP_TRACE_AMF_TOO_DEEP, depth);
+        *packet_size = 0;
+        return NULL;
+    }
+
+    if (raw_data_size >= 3 &&
+        raw_data[0] == 0x00 && raw_data[1] == 0x00 && raw_data[2] == 0x09) {
+        /* FIXME: end of object without object start, why? */
+        amf = amf_packet_analyze_undefined();
+        *packet_size = 3;
+        return amf;
+    }
+
+    switch (raw_data[0]) {
+    case AMF_DATATYPE_NUMBER:
+        amf = amf_packet_analyze_number(
+            raw_data, raw_data_size, packet_size);
+        return amf;
+    case AMF_DATATYPE_BOOLEAN:
+        amf = amf_packet_analyze_boolean(
+            raw_data, raw_data_size, packet_size);
+        return amf;
+    case AMF_DATATYPE_STRING:
+    case AMF_DATATYPE_LONG_STRING:
+    case AMF_DATATYPE_XML_DOCUMENT:
+        amf = amf_packet_analyze_string(
+            raw_data, raw_data_size, packet_size);
+        return amf;
+    case AMF_DATATYPE_OBJECT:
+        amf = amf_packet_analyze_object(
+            raw_data, raw_data_size, packet_size, depth);
+        return amf;
+    case AMF_DATATYPE_NULL:
+        amf = amf_packet_analyze_null();
+        *packet_size = 1;
+        return amf;
+    case AMF_DATATYPE_UNDEFINED:
+        amf = amf_packet_analyze_undefined();
+        *packet_size = 1;
+        return amf;
+    case AMF_DATATYPE_UNSUPPORTED:
+        amf = amf_packet_analyze_undefined();
+        if (amf) {
+            amf->datatype = AMF_DATATYPE_UNSUPPORTED;
+        }
+        *packet_size = 1;
+        return amf;
+    case AMF_DATATYPE_REFERENCE:
+        amf = amf_packet_analyze_reference(
+            raw_data, raw_data_size, packet_size);
+        return amf;
+    case AMF_DATATYPE_ECMA_ARRAY:
+        amf = amf_packet_analyze_ecma_array(
+            raw_data, raw_data_size, packet_size, depth);
+        return amf;
+    case AMF_DATATYPE_OBJECT_END:
+        
+        break;
+    case AMF_DATATYPE_STRICT_ARRAY:
+        amf = amf_packet_analyze_strict_array(
+            raw_data, raw_data_size, packet_size, depth);
+        return amf;
+    case AMF_DATATYPE_DATE:
+        amf = amf_packet_analyze_date(
+            raw_data, raw_data_size, packet_size);
+        return amf;
+    case AMF_DATATYPE_TYPED_OBJECT:
+        amf = amf_packet_analyze_typed_object(
+            raw_data, raw_data_size, packet_size, depth);
+        return amf;
+    case AMF_DATATYPE_AVMPLUS_OBJECT:
+        amf = amf_packet_analyze_avmplus(
+            raw_data, raw_data_size, packet_size, depth);
+        return amf;
+    default:
+        break;
+    }
+
+    *packet_size = 0;
+    return NULL;
+}
+
+amf_packet_t *amf_packet_analyze_number(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
+{
+    amf_packet_t *amf;
+
+    if (raw_data_size < 9) {
+        if (packet_size) {
+            *packet_size = 1;
+        }
+        return NULL;
+    }
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_number_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_NUMBER;
+    amf->number.value = read_be64double(raw_data + 1);
+    RTMP_TRACE(RTMP_TRACE_AMF_NUMBER, amf->number.value);
+    if (packet_size) {
+        *packet_size = 9;
+    }
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_analyze_boolean(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
+{
+    amf_packet_t *amf;
+
+    if (raw_data_size < 2) {
+        if (packet_size) {
+            *packet_size = 0;
+        }
+        return NULL;
+    }
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_boolean_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_BOOLEAN;
+
+    amf->boolean.value = raw_data[1];
+    RTMP_TRACE(RTMP_TRACE_AMF_BOOLEAN, amf->boolean.value);
+
+    if (packet_size) {
+        *packet_size = 2;
+    }
+
+    return amf;
+}
+
+/* LONG_STRING and XML_DOCUMENT have 32 bits length */
+amf_packet_t *amf_packet_analyze_string(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
+{
+    amf_packet_t *amf;
+    size_t length_size;
+    size_t string_data_length;
+    const char *string_data;
+
+    length_size = raw_data[0] == AMF_DATATYPE_STRING ? 2 : 4;
+    if (raw_data_size < 1 + length_size) {
+        if (packet_size) {
+            *packet_size = 0;
+        }
+        return NULL;
+    }
+
+    if (length_size == 2) {
+        string_data_length = read_be16int(raw_data + 1);
+    } else {
+        string_data_length = (unsigned int)read_be32int(raw_data + 1);
+    }
+    if (raw_data_size - 1 - length_size < string_data_length) {
+        if (packet_size) {
+            *packet_size = 0;
+        }
+        return NULL;
+    }
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_string_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = (amf_datatype_t)raw_data[0];
+
+    string_data = amf_packet_duplicate_string(
+        raw_data + 1 + length_size, string_data_length);
+    if (string_data == NULL) {
+        rtmp_release(amf);
+        return NULL;
+    }
+
+    amf->string.value = string_data;
+    RTMP_TRACE_TEXT(RTMP_TRACE_AMF_STRING, string_data_length, string_data);
+
+    if (packet_size) {
+        /* datatype(1) + length(2 or 4) + string */
+        *packet_size = 1 + length_size + string_data_length;
+    }
+
+    return amf;
+}
+
+amf_packet_t *amf_packet_analyze_object(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth)
+{
+    amf_packet_t *amf;
+    size_t properties_size;
+    int num;
+
+    *packet_size = 0;
+    if (raw_data_size < 1) {
+        return NULL;
+    }
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_object_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_OBJECT;
+
+    RTMP_TRACE(RTMP_TRACE_AMF_OBJECT_START, 0);
+    properties_size = amf_packet_analyze_properties(
+        raw_data + 1, raw_data_size - 1,
+        &amf->object.properties, &num, depth);
+    if (properties_size == 0) {
+        rtmp_release(amf);
+        return NULL;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF_OBJECT_END, 0);
+
+    *packet_size = 1 + properties_size;
+
+    return amf;
+}
+
+amf_packet_t *amf_packet_analyze_null(void)
+{
+    amf_packet_t *amf;
+    
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_null_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_NULL;
+    RTMP_TRACE(RTMP_TRACE_AMF_NULL, 0);
+    
+    return amf;
+}
+
+amf_packet_t *amf_packet_analyze_undefined(void)
+{
+    amf_packet_t *amf;
+    
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_undefined_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_UNDEFINED;
+    RTMP_TRACE(RTMP_TRACE_AMF_UNDEFINED, 0);
+    
+    return amf;
+}
+
+
+/* the count is only a hint, the properties run to the object end */
+amf_packet_t *amf_packet_analyze_ecma_array(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth)
+{
+    amf_packet_t *amf;
+    size_t properties_size;
+
+    *packet_size = 0;
+    if (raw_data_size < 5) {
+        return NULL;
+    }
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_ecma_array_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_ECMA_ARRAY;
+
+    RTMP_TRACE(
+        RTMP_TRACE_AMF_ECMA_ARRAY_START, read_be32int(raw_data + 1));
+    properties_size = amf_packet_analyze_properties(
+        raw_data + 5, raw_data_size - 5,
+        &amf->ecma_array.properties, &amf->ecma_array.num, depth);
+    if (properties_size == 0) {
+        rtmp_release(amf);
+        return NULL;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF_ECMA_ARRAY_END, 0);
+
+    *packet_size = 5 + properties_size;
+
+    return amf;
+}
+
+
+/*
+ * Reads properties up to the object end marker.  Returns the size read,
+ * or 0 after freeing the properties read so far if the data is broken.
+ */
+size_t amf_packet_analyze_properties(
+    unsigned char *raw_data, size_t raw_data_size,
+    amf_packet_object_property_t **properties, int *num, int depth)
+{
+    size_t raw_data_position;
+    size_t string_length;
+    size_t property_packet_size;
+    amf_packet_object_property_t *property;
+    amf_packet_object_property_t **last;
+
+    *properties = NULL;
+    *num = 0;
+    last = properties;
+    raw_data_position = 0;
+    while (1) {
+        if (raw_data_size - raw_data_position < 3) {
+            break;
+        }
+        string_length = read_be16int(raw_data + raw_data_position);
+        if (string_length == 0 &&
+            raw_data[raw_data_position + 2] == AMF_DATATYPE_OBJECT_END) {
+            return raw_data_position + 3;
+        }
+        raw_data_position += 2;
+        if (raw_data_size - raw_data_position < string_length) {
+            break;
+        }
+
+        property = (amf_packet_object_property_t*)
+            rtmp_allocate(
+                RTMP_ALLOCATION_AMF, sizeof(amf_packet_object_property_t));
+        if (property == NULL) {
+            break;
+        }
+        property->value = NULL;
+        property->next = NULL;
+
+        property->key = amf_packet_duplicate_string(
+            raw_data + raw_data_position, string_length);
+        if (property->key == NULL) {
+            rtmp_release(property);
+            break;
+        }
+        *last = property;
+        last = &property->next;
+        raw_data_position += string_length;
+        RTMP_TRACE_TEXT(
+            RTMP_TRACE_AMF_PROPERTY_KEY, string_length, property->key);
+
+        property->value = amf_packet_analyze_value(
+            raw_data + raw_data_position,
+            raw_data_size - raw_data_position,
+            &property_packet_size, depth + 1);
+        if (property->value == NULL) {
+            break;
+        }
+        raw_data_position += property_packet_size;
+        ++*num;
+    }
+
+    amf_packet_free_properties(*properties);
+    *properties = NULL;
+    return 0;
+}
+
+
+/*
+ * Arrays made of numbers only are read in one pass into a plain array of
+ * doubles, without a packet per element.
+ */
+amf_packet_t *amf_packet_analyze_strict_array(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth)
+{
+    amf_packet_t *amf;
+    amf_packet_t *value;
+    size_t array_num;
+    size_t i;
+    size_t raw_data_position;
+    size_t value_packet_size;
+
+    *packet_size = 0;
+    if (raw_data_size < 5) {
+        return NULL;
+    }
+    array_num = (unsigned int)read_be32int(raw_data + 1);
+
+    amf = amf_packet_create_strict_array();
+    if (amf == NULL) {
+        return NULL;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF_STRICT_ARRAY_START, array_num);
+
+    if (array_num <= (raw_data_size - 5) / 9) {
+        for (i = 0; i < array_num; ++i) {
+            if (raw_data[5 + i * 9] != AMF_DATATYPE_NUMBER) {
+                break;
+            }
+        }
+        if (i == array_num && array_num > 0) {
+            amf->strict_array.numbers = (double*)rtmp_allocate(
+                RTMP_ALLOCATION_AMF, array_num * sizeof(double));
+            if (amf->strict_array.numbers == NULL) {
+                amf_packet_free(amf);
+                return NULL;
+            }
+            for (i = 0; i < array_num; ++i) {
+                amf->strict_array.numbers[i] =
+                    read_be64double(raw_data + 5 + i * 9 + 1);
+            }
+            amf->strict_array.num = array_num;
+            amf->strict_array.capacity = array_num;
+            RTMP_TRACE(RTMP_TRACE_AMF_STRICT_ARRAY_END, 0);
+            *packet_size = 5 + array_num * 9;
+            return amf;
+        }
+    }
+
+    raw_data_position = 5;
+    for (i = 0; i < array_num; ++i) {
+        value = amf_packet_analyze_value(
+            raw_data + raw_data_position,
+            raw_data_size - raw_data_position,
+            &value_packet_size, depth + 1);
+        if (value == NULL) {
+            amf_packet_free(amf);
+            return NULL;
+        }
+        if (amf_packet_add_value_to_strict_array(amf, value) !=
+            RTMP_SUCCESS) {
+            amf_packet_free(value);
+            amf_packet_free(amf);
+            return NULL;
+        }
+        raw_data_position += value_packet_size;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF_STRICT_ARRAY_END, 0);
+
+    *packet_size = raw_data_position;
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_analyze_date(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
+{
+    amf_packet_t *amf;
+
+    *packet_size = 0;
+    /* datatype(1) + date(8) + timezone(2) */
+    if (raw_data_size < 11) {
+        return NULL;
+    }
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_date_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_DATE;
+    amf->date.value = read_be64double(raw_data + 1);
+    amf->date.timezone = (short)read_be16int(raw_data + 9);
+    RTMP_TRACE(RTMP_TRACE_AMF_DATE, amf->date.value);
+
+    *packet_size = 11;
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_analyze_typed_object(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth)
+{
+    amf_packet_t *amf;
+    size_t class_name_length;
+    size_t properties_size;
+    int num;
+
+    *packet_size = 0;
+    if (raw_data_size < 3) {
+        return NULL;
+    }
+    class_name_length = read_be16int(raw_data + 1);
+    if (raw_data_size - 3 < class_name_length) {
+        return NULL;
+    }
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_typed_object_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_TYPED_OBJECT;
+    amf->typed_object.class_name = amf_packet_duplicate_string(
+        raw_data + 3, class_name_length);
+    if (amf->typed_object.class_name == NULL) {
+        rtmp_release(amf);
+        return NULL;
+    }
+
+    RTMP_TRACE_TEXT(
+        RTMP_TRACE_AMF_TYPED_OBJECT_START, 0, amf->typed_object.class_name);
+    properties_size = amf_packet_analyze_properties(
+        raw_data + 3 + class_name_length,
+        raw_data_size - 3 - class_name_length,
+        &amf->typed_object.properties, &num, depth);
+    if (properties_size == 0) {
+        amf_packet_free_string(amf->typed_object.class_name);
+        rtmp_release(amf);
+        return NULL;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF_TYPED_OBJECT_END, 0);
+
+    *packet_size = 3 + class_name_length + properties_size;
+    return amf;
+}
+
+
+/* AMF0 references are kept as an index, value is left NULL */
+amf_packet_t *amf_packet_analyze_reference(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size)
+{
+    amf_packet_t *amf;
+
+    *packet_size = 0;
+    if (raw_data_size < 3) {
+        return NULL;
+    }
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_reference_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_REFERENCE;
+    amf->reference.index = read_be16int(raw_data + 1);
+    amf->reference.value = NULL;
+
+    *packet_size = 3;
+    return amf;
+}
+
+
+/* AMF3 value; each switch marker starts new reference tables */
+amf_packet_t *amf_packet_analyze_avmplus(
+    unsigned char *raw_data, size_t raw_data_size, size_t *packet_size,
+    int depth)
+{
+    amf_packet_t *amf;
+    amf3_context_t context;
+    size_t value_packet_size;
+
+    *packet_size = 0;
+    if (raw_data_size < 2) {
+        return NULL;
+    }
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_avmplus_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_AVMPLUS_OBJECT;
+
+    amf3_context_initialize(&context);
+    context.depth = depth;
+    amf->avmplus.value = amf3_packet_analyze_data(
+        &context, raw_data + 1, raw_data_size - 1, &value_packet_size);
+    amf3_context_cleanup(&context);
+    if (amf->avmplus.value == NULL) {
+        rtmp_release(amf);
+        return NULL;
+    }
+
+    *packet_size = 1 + value_packet_size;
+    return amf;
+}
+
+
+void amf_packet_free(amf_packet_t *amf)
+{
+    size_t i;
+
+    switch (amf->datatype) {
+    case AMF_DATATYPE_NUMBER:
+        break;
+    case AMF_DATATYPE_BOOLEAN:
+        break;
+    case AMF_DATATYPE_STRING:
+    case AMF_DATATYPE_LONG_STRING:
+    case AMF_DATATYPE_XML_DOCUMENT:
+        amf_packet_free_string(amf->string.value);
+        break;
+    case AMF_DATATYPE_OBJECT:
+        amf_packet_free_properties(amf->object.properties);
+        break;
+    case AMF_DATATYPE_NULL:
+        break;
+    case AMF_DATATYPE_UNDEFINED:
+        break;
+    case AMF_DATATYPE_REFERENCE:
+        /* the value belongs to the object referred to */
+        break;
+    case AMF_DATATYPE_ECMA_ARRAY:
+        amf_packet_free_properties(amf->ecma_array.properties);
+        break;
+    case AMF_DATATYPE_OBJECT_END:
+        break;
+    case AMF_DATATYPE_STRICT_ARRAY:
+        if (amf->strict_array.values) {
+            for (i = 0; i < amf->strict_array.num; ++i) {
+                amf_packet_free(amf->strict_array.values[i]);
+            }
+            rtmp_release(amf->strict_array.values);
+        }
+        rtmp_release(amf->strict_array.numbers);
+        break;
+    case AMF_DATATYPE_TYPED_OBJECT:
+        amf_packet_free_string(amf->typed_object.class_name);
+        amf_packet_free_properties(amf->typed_object.properties);
+        break;
+    case AMF_DATATYPE_AVMPLUS_OBJECT:
+        amf_packet_free(amf->avmplus.value);
+        break;
+    case AMF_DATATYPE_BYTE_ARRAY:
+        rtmp_release(amf->byte_array.data);
+        break;
+    default:
+        break;
+    }
+
+    rtmp_release(amf);
+}
+
+
+void amf_packet_free_properties(amf_packet_object_property_t *property)
+{
+    amf_packet_object_property_t *next;
+
+    while (property) {
+        next = property->next;
+        amf_packet_free_string(property->key);
+        if (property->value) {
+            amf_packet_free(property->value);
+        }
+        rtmp_release(property);
+        property = next;
+    }
+}
+
+
+amf_packet_t *amf_packet_create_number(double number)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_number_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_NUMBER;
+    amf->number.value = number;
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_create_boolean(int boolean)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_boolean_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_BOOLEAN;
+    amf->boolean.value = boolean;
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_create_string(const char *string)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_string_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_STRING;
+    amf->string.value = amf_packet_duplicate_string(
+        (const unsigned char*)string, strlen(string));
+    if (amf->string.value == NULL) {
+        rtmp_release(amf);
+        return NULL;
+    }
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_create_object(void)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_object_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_OBJECT;
+    amf->object.properties = NULL;
+    return amf;
+}
+
+
+/* value is sent AMF3 encoded after the switch marker */
+amf_packet_t *amf_packet_create_avmplus(amf_packet_t *value)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_avmplus_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_AVMPLUS_OBJECT;
+    amf->avmplus.value = value;
+    return amf;
+}
+
+
+/* data is copied */
+amf_packet_t *amf_packet_create_byte_array(
+    const unsigned char *data, size_t length)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_byte_array_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_BYTE_ARRAY;
+    amf->byte_array.length = length;
+    amf->byte_array.data = NULL;
+    if (length > 0) {
+        amf->byte_array.data = (unsigned char*)rtmp_allocate(
+            RTMP_ALLOCATION_AMF, length);
+        if (amf->byte_array.data == NULL) {
+            rtmp_release(amf);
+            return NULL;
+        }
+        memcpy(amf->byte_array.data, data, length);
+    }
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_create_typed_object(const char *class_name)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_typed_object_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_TYPED_OBJECT;
+    amf->typed_object.properties = NULL;
+    amf->typed_object.class_name = amf_packet_duplicate_string(
+        (const unsigned char*)class_name, strlen(class_name));
+    if (amf->typed_object.class_name == NULL) {
+        rtmp_release(amf);
+        return NULL;
+    }
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_create_ecma_array(void)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_ecma_array_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_ECMA_ARRAY;
+    amf->ecma_array.num = 0;
+    amf->ecma_array.properties = NULL;
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_create_strict_array(void)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_strict_array_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_STRICT_ARRAY;
+    amf->strict_array.num = 0;
+    amf->strict_array.capacity = 0;
+    amf->strict_array.values = NULL;
+    amf->strict_array.numbers = NULL;
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_create_number_array(
+    const double *numbers, size_t num)
+{
+    amf_packet_t *amf;
+
+    amf = amf_packet_create_strict_array();
+    if (amf == NULL || num == 0) {
+        return amf;
+    }
+    amf->strict_array.numbers = (double*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, num * sizeof(double));
+    if (amf->strict_array.numbers == NULL) {
+        rtmp_release(amf);
+        return NULL;
+    }
+    memmove(amf->strict_array.numbers, numbers, num * sizeof(double));
+    amf->strict_array.num = num;
+    amf->strict_array.capacity = num;
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_create_date(double value)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_date_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_DATE;
+    amf->date.value = value;
+    amf->date.timezone = 0;
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_create_xml_document(const char *xml)
+{
+    amf_packet_t *amf;
+
+    amf = amf_packet_create_string(xml);
+    if (amf) {
+        amf->datatype = AMF_DATATYPE_XML_DOCUMENT;
+    }
+    return amf;
+}
+
+
+/* property list of an object, a typed object or an ECMA array */
+amf_packet_object_property_t **amf_packet_get_properties(amf_packet_t *amf)
+{
+    switch (amf->datatype) {
+    case AMF_DATATYPE_OBJECT:
+        return &amf->object.properties;
+    case AMF_DATATYPE_ECMA_ARRAY:
+        return &amf->ecma_array.properties;
+    case AMF_DATATYPE_TYPED_OBJECT:
+        return &amf->typed_object.properties;
+    default:
+        break;
+    }
+    return NULL;
+}
+
+
+rtmp_result_t amf_packet_add_property_to_object(
+    amf_packet_t *amf, const char *key, amf_packet_t *value)
+{
+    amf_packet_object_property_t *property;
+    amf_packet_object_property_t **last;
+
+    last = amf_packet_get_properties(amf);
+    if (last == NULL) {
+        return RTMP_ERROR_UNKNOWN;
+    }
+
+    /* keys have a 16 bit length when serialized */
+    if (strlen(key) > 0xFFFF) {
+        return RTMP_ERROR_BUFFER_OVERFLOW;
+    }
+
+    property = (amf_packet_object_property_t*)
+        rtmp_allocate(
+            RTMP_ALLOCATION_AMF, sizeof(amf_packet_object_property_t));
+    if (property == NULL) {
+        return RTMP_ERROR_MEMORY_ALLOCATION;
+    }
+    property->key = amf_packet_duplicate_string(
+        (const unsigned char*)key, strlen(key));
+    if (property->key == NULL) {
+        rtmp_release(property);
+        return RTMP_ERROR_MEMORY_ALLOCATION;
+    }
+    property->value = value;
+
+    property->next = NULL;
+    while (*last) {
+        last = &(*last)->next;
+    }
+    *last = property;
+    if (amf->datatype == AMF_DATATYPE_ECMA_ARRAY) {
+        amf->ecma_array.num++;
+    }
+
+    return RTMP_SUCCESS;
+}
+
+
+/* returns the value of key in an object or an ECMA array, or NULL */
+amf_packet_t *amf_packet_get_property(amf_packet_t *amf, const char *key)
+{
+    amf_packet_object_property_t **properties;
+    amf_packet_object_property_t *property;
+
+    properties = amf_packet_get_properties(amf);
+    if (properties == NULL) {
+        return NULL;
+    }
+
+    property = *properties;
+    while (property) {
+        if (property->key == key || strcmp(property->key, key) == 0) {
+            return property->value;
+        }
+        property = property->next;
+    }
+    return NULL;
+}
+
+
+/*
+ * Takes value.  Numbers are stored unboxed while the array holds nothing
+ * else, so value may already be freed when this returns.
+ */
+rtmp_result_t amf_packet_add_value_to_strict_array(
+    amf_packet_t *amf, amf_packet_t *value)
+{
+    amf_packet_strict_array_t *array;
+    size_t capacity;
+    void *grown;
+    rtmp_result_t result;
+
+    array = &amf->strict_array;
+    if (array->values == NULL && value->datatype == AMF_DATATYPE_NUMBER) {
+        if (array->num == array->capacity) {
+            capacity = array->capacity ? array->capacity * 2 : 8;
+            grown = rtmp_reallocate(
+                RTMP_ALLOCATION_AMF,
+                array->numbers, capacity * sizeof(double));
+            if (grown == NULL) {
+                return RTMP_ERROR_MEMORY_ALLOCATION;
+            }
+            array->numbers = (double*)grown;
+            array->capacity = capacity;
+        }
+        array->numbers[array->num++] = value->number.value;
+        rtmp_release(value);
+        return RTMP_SUCCESS;
+    }
+
+    if (array->values == NULL) {
+        result = amf_packet_box_strict_array(amf);
+        if (result != RTMP_SUCCESS) {
+            return result;
+        }
+    }
+    if (array->num == array->capacity) {
+        capacity = array->capacity * 2;
+        grown = rtmp_reallocate(
+            RTMP_ALLOCATION_AMF,
+            array->values, capacity * sizeof(amf_packet_t*));
+        if (grown == NULL) {
+            return RTMP_ERROR_MEMORY_ALLOCATION;
+        }
+        array->values = (amf_packet_t**)grown;
+        array->capacity = capacity;
+    }
+    array->values[array->num++] = value;
+
+    return RTMP_SUCCESS;
+}
+
+
+/* turns the unboxed numbers into number packets */
+rtmp_result_t amf_packet_box_strict_array(amf_packet_t *amf)
+{
+    amf_packet_strict_array_t *array;
+    amf_packet_t **values;
+    size_t capacity;
+    size_t i;
+
+    array = &amf->strict_array;
+    capacity = array->capacity > 8 ? array->capacity : 8;
+    values = (amf_packet_t**)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, capacity * sizeof(amf_packet_t*));
+    if (values == NULL) {
+        return RTMP_ERROR_MEMORY_ALLOCATION;
+    }
+    for (i = 0; i < array->num; ++i) {
+        values[i] = amf_packet_create_number(array->numbers[i]);
+        if (values[i] == NULL) {
+            while (i > 0) {
+                rtmp_release(values[--i]);
+            }
+            rtmp_release(values);
+            return RTMP_ERROR_MEMORY_ALLOCATION;
+        }
+    }
+    rtmp_release(array->numbers);
+    array->numbers = NULL;
+    array->values = values;
+    array->capacity = capacity;
+
+    return RTMP_SUCCESS;
+}
+
+
+amf_packet_t *amf_packet_create_null(void)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_null_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_NULL;
+    return amf;
+}
+
+
+amf_packet_t *amf_packet_create_undefined(void)
+{
+    amf_packet_t *amf;
+
+    amf = (amf_packet_t*)rtmp_allocate(
+        RTMP_ALLOCATION_AMF, sizeof(amf_packet_undefined_t));
+    if (amf == NULL) {
+        return NULL;
+    }
+    amf->datatype = AMF_DATATYPE_UNDEFINED;
+    return amf;
+}
+
+
+size_t amf_packet_get_size(amf_packet_t *amf)
+{
+    size_t size;
+    size_t i;
+    amf3_context_t context;
+
+    switch (amf->datatype) {
+    case AMF_DATATYPE_NUMBER:
+        /* datatype(1) + number(8) */
+        return 9;
+    case AMF_DATATYPE_BOOLEAN:
+        /* datatype(1) + boolean(1) */
+        return 2;
+    case AMF_DATATYPE_STRING:
+        size = strlen(amf->string.value);
+        if (size > 0xFFFF) {
+            /* sent as a long string */
+            return 1 + 4 + size;
+        }
+        /* datatype(1) + length(2) + string */
+        return 1 + 2 + size;
+    case AMF_DATATYPE_LONG_STRING:
+    case AMF_DATATYPE_XML_DOCUMENT:
+        /* datatype(1) + length(4) + string */
+        return 1 + 4 + strlen(amf->string.value);
+    case AMF_DATATYPE_OBJECT:
+        return 1 + amf_packet_get_properties_size(amf->object.properties);
+    case AMF_DATATYPE_NULL:
+    case AMF_DATATYPE_UNDEFINED:
+    case AMF_DATATYPE_UNSUPPORTED:
+        /* datatype(1) */
+        return 1;
+    case AMF_DATATYPE_REFERENCE:
+        /* datatype(1) + index(2) */
+        return 3;
+    case AMF_DATATYPE_ECMA_ARRAY:
+        /* datatype(1) + count(4) + properties */
+        return 1 + 4 +
+            amf_packet_get_properties_size(amf->ecma_array.properties);
+    case AMF_DATATYPE_OBJECT_END:
+        /* datatype(1) */
+        return 1;
+    case AMF_DATATYPE_STRICT_ARRAY:
+        /* datatype(1) + count(4) + values */
+        if (amf->strict_array.values == NULL) {
+            return 1 + 4 + amf->strict_array.num * 9;
+        }
+        size = 1 + 4;
+        for (i = 0; i < amf->strict_array.num; ++i) {
+            size += amf_packet_get_size(amf->strict_array.values[i]);
+        }
+        return size;
+    case AMF_DATATYPE_DATE:
+        /* datatype(1) + date(8) + timezone(2) */
+        return 11;
+    case AMF_DATATYPE_TYPED_OBJECT:
+        /* datatype(1) + length(2) + class name + properties */
+        return 1 + 2 + strlen(amf->typed_object.class_name) +
+            amf_packet_get_properties_size(amf->typed_object.properties);
+    case AMF_DATATYPE_AVMPLUS_OBJECT:
+        amf3_context_initialize(&context);
+        size = amf3_packet_get_size(&context, amf->avmplus.value);
+        amf3_context_cleanup(&context);
+        if (size == 0) {
+            return 0;
+        }
+        /* datatype(1) + AMF3 value */
+        return 1 + size;
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+/* properties and the object end */
+size_t amf_packet_get_properties_size(amf_packet_object_property_t *property)
+{
+    size_t size;
+
+    size = 0;
+    while (property) {
+        size += 2 + strlen(property->key); /* length + key */
+        size += amf_packet_get_size(property->value);
+        property = property->next;
+    }
+    size += 3; /* length + object end (0x09) */
+    return size;
+}
+
+
+size_t amf_packet_serialize(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    switch (amf->datatype) {
+    case AMF_DATATYPE_NUMBER:
+        return amf_packet_serialize_number(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_BOOLEAN:
+        return amf_packet_serialize_boolean(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_STRING:
+    case AMF_DATATYPE_LONG_STRING:
+    case AMF_DATATYPE_XML_DOCUMENT:
+        return amf_packet_serialize_string(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_OBJECT:
+        return amf_packet_serialize_object(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_NULL:
+    case AMF_DATATYPE_UNSUPPORTED:
+        return amf_packet_serialize_null(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_UNDEFINED:
+        return amf_packet_serialize_undefined(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_ECMA_ARRAY:
+        return amf_packet_serialize_ecma_array(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_STRICT_ARRAY:
+        return amf_packet_serialize_strict_array(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_DATE:
+        return amf_packet_serialize_date(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_TYPED_OBJECT:
+        return amf_packet_serialize_typed_object(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_REFERENCE:
+        return amf_packet_serialize_reference(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_AVMPLUS_OBJECT:
+        return amf_packet_serialize_avmplus(
+            amf, output_buffer, output_buffer_size);
+    case AMF_DATATYPE_OBJECT_END:
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+
+size_t amf_packet_serialize_number(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    if (output_buffer_size < 9) {
+        return 0;
+    }
+
+    output_buffer[0] = AMF_DATATYPE_NUMBER;
+    write_be64double(output_buffer + 1, amf->number.value);
+    RTMP_TRACE(RTMP_TRACE_AMF_SERIALIZE_NUMBER, amf->number.value);
+
+    return 9;
+}
+
+size_t amf_packet_serialize_boolean(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    if (output_buffer_size < 2) {
+        return 0;
+    }
+
+    output_buffer[0] = AMF_DATATYPE_BOOLEAN;
+    memmove(output_buffer + 1, &amf->boolean.value, 1);
+    RTMP_TRACE(RTMP_TRACE_AMF_SERIALIZE_BOOLEAN, amf->boolean.value);
+
+    return 2;
+}
+
+/* strings longer than 0xFFFF go out as long strings */
+size_t amf_packet_serialize_string(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    size_t length;
+    size_t length_size;
+    amf_datatype_t datatype;
+
+    length = strlen(amf->string.value);
+    datatype = amf->datatype;
+    if (datatype == AMF_DATATYPE_STRING && length > 0xFFFF) {
+        datatype = AMF_DATATYPE_LONG_STRING;
+    }
+    length_size = datatype == AMF_DATATYPE_STRING ? 2 : 4;
+    if (output_buffer_size < (1 + length_size + length)) {
+        return 0;
+    }
+
+    output_buffer[0] = datatype;
+    if (length_size == 2) {
+        write_be16int(output_buffer + 1, (int)length);
+    } else {
+        write_be32int(output_buffer + 1, (int)length);
+    }
+    memmove(output_buffer + 1 + length_size, amf->string.value, length);
+    RTMP_TRACE_TEXT(
+        RTMP_TRACE_AMF_SERIALIZE_STRING, length, amf->string.value);
+
+    return 1 + length_size + length;
+}
+
+size_t amf_packet_serialize_object(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    size_t serialized_properties_size;
+
+    if (output_buffer_size < 1) {
+        return 0;
+    }
+
+    RTMP_TRACE(RTMP_TRACE_AMF_SERIALIZE_OBJECT_START, 0);
+    output_buffer[0] = AMF_DATATYPE_OBJECT;
+    serialized_properties_size = amf_packet_serialize_properties(
+        amf->object.properties, output_buffer + 1, output_buffer_size - 1);
+    if (serialized_properties_size == 0) {
+        return 0;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF_SERIALIZE_OBJECT_END, 0);
+
+    return 1 + serialized_properties_size;
+}
+
+/* also writes the marker of AMF_DATATYPE_UNSUPPORTED */
+size_t amf_packet_serialize_null(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    if (output_buffer_size < 1 ) {
+        return 0;
+    }
+
+    output_buffer[0] = amf->datatype;
+
+    return 1;
+}
+
+size_t amf_packet_serialize_undefined(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    if (output_buffer_size < 1 ) {
+        return 0;
+    }
+
+
+    if (amf->datatype == AMF_DATATYPE_UNDEFINED) {
+        output_buffer[0] = AMF_DATATYPE_UNDEFINED;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF_SERIALIZE_UNDEFINED, 0);
+
+    return 1;
+}
+
+
+size_t amf_packet_serialize_ecma_array(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    amf_packet_object_property_t *property;
+    int num;
+    size_t serialized_properties_size;
+
+    if (output_buffer_size < 5) {
+        return 0;
+    }
+
+    num = 0;
+    for (property = amf->ecma_array.properties;
+         property; property = property->next) {
+        ++num;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF_SERIALIZE_ECMA_ARRAY_START, num);
+    output_buffer[0] = AMF_DATATYPE_ECMA_ARRAY;
+    write_be32int(output_buffer + 1, num);
+    serialized_properties_size = amf_packet_serialize_properties(
+        amf->ecma_array.properties,
+        output_buffer + 5, output_buffer_size - 5);
+    if (serialized_properties_size == 0) {
+        return 0;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF_SERIALIZE_ECMA_ARRAY_END, 0);
+
+    return 5 + serialized_properties_size;
+}
+
+
+/* unboxed numbers are written in one pass */
+size_t amf_packet_serialize_strict_array(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    size_t outputed_size;
+    size_t serialized_value_size;
+    size_t i;
+
+    if (output_buffer_size < 5) {
+        return 0;
+    }
+
+    output_buffer[0] = AMF_DATATYPE_STRICT_ARRAY;
+    write_be32int(output_buffer + 1, (int)amf->strict_array.num);
+    outputed_size = 5;
+
+    if (amf->strict_array.values == NULL) {
+        if ((output_buffer_size - outputed_size) / 9 <
+            amf->strict_array.num) {
+            return 0;
+        }
+        for (i = 0; i < amf->strict_array.num; ++i) {
+            output_buffer[outputed_size] = AMF_DATATYPE_NUMBER;
+            write_be64double(
+                output_buffer + outputed_size + 1,
+                amf->strict_array.numbers[i]);
+            outputed_size += 9;
+        }
+        return outputed_size;
+    }
+
+    for (i = 0; i < amf->strict_array.num; ++i) {
+        serialized_value_size = amf_packet_serialize(
+            amf->strict_array.values[i],
+            output_buffer + outputed_size,
+            output_buffer_size - outputed_size);
+        if (serialized_value_size == 0) {
+            return 0;
+        }
+        outputed_size += serialized_value_size;
+    }
+
+    return outputed_size;
+}
+
+
+size_t amf_packet_serialize_date(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    if (output_buffer_size < 11) {
+        return 0;
+    }
+
+    output_buffer[0] = AMF_DATATYPE_DATE;
+    write_be64double(output_buffer + 1, amf->date.value);
+    write_be16int(output_buffer + 9, amf->date.timezone);
+
+    return 11;
+}
+
+
+size_t amf_packet_serialize_typed_object(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    size_t class_name_length;
+    size_t serialized_properties_size;
+
+    class_name_length = strlen(amf->typed_object.class_name);
+    if (class_name_length > 0xFFFF ||
+        output_buffer_size < 3 + class_name_length) {
+        return 0;
+    }
+
+    output_buffer[0] = AMF_DATATYPE_TYPED_OBJECT;
+    write_be16int(output_buffer + 1, (int)class_name_length);
+    memmove(output_buffer + 3, amf->typed_object.class_name,
+        class_name_length);
+    serialized_properties_size = amf_packet_serialize_properties(
+        amf->typed_object.properties,
+        output_buffer + 3 + class_name_length,
+        output_buffer_size - 3 - class_name_length);
+    if (serialized_properties_size == 0) {
+        return 0;
+    }
+
+    return 3 + class_name_length + serialized_properties_size;
+}
+
+
+/* properties and the object end */
+size_t amf_packet_serialize_properties(
+    amf_packet_object_property_t *property,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    size_t key_length;
+    size_t outputed_size;
+    size_t serialized_value_size;
+
+    outputed_size = 0;
+    while (property) {
+        key_length = strlen(property->key);
+        /* keys have a 16 bit length, a longer one can not be written */
+        if (key_length > 0xFFFF ||
+            (outputed_size + 2 + key_length) > output_buffer_size) {
+            return 0;
+        }
+        write_be16int(output_buffer + outputed_size, (int)key_length);
+        memmove(
+            output_buffer + outputed_size + 2,
+            property->key, key_length);
+        RTMP_TRACE_TEXT(
+            RTMP_TRACE_AMF_SERIALIZE_PROPERTY_KEY, key_length, property->key);
+        outputed_size += 2 + key_length;
+        serialized_value_size = amf_packet_serialize(
+            property->value,
+            output_buffer + outputed_size,
+            output_buffer_size - outputed_size);
+        if (serialized_value_size == 0) {
+            return 0;
+        }
+        outputed_size += serialized_value_size;
+        property = property->next;
+    }
+    if ((outputed_size + 3) > output_buffer_size) {
+        return 0;
+    }
+    write_be16int(output_buffer + outputed_size, 0);
+    outputed_size += 2;
+    output_buffer[outputed_size] = AMF_DATATYPE_OBJECT_END;
+    outputed_size += 1;
+
+    return outputed_size;
+}
+
+
+size_t amf_packet_serialize_reference(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    if (output_buffer_size < 3) {
+        return 0;
+    }
+
+    output_buffer[0] = AMF_DATATYPE_REFERENCE;
+    write_be16int(output_buffer + 1, (int)amf->reference.index);
+
+    return 3;
+}
+
+
+size_t amf_packet_serialize_avmplus(
+    amf_packet_t *amf,
+    unsigned char *output_buffer, size_t output_buffer_size)
+{
+    amf3_context_t context;
+    size_t serialized_value_size;
+
+    if (output_buffer_size < 1) {
+        return 0;
+    }
+
+    output_buffer[0] = AMF_DATATYPE_AVMPLUS_OBJECT;
+    amf3_context_initialize(&context);
+    serialized_value_size = amf3_packet_serialize(
+        &context, amf->avmplus.value,
+        output_buffer + 1, output_buffer_size - 1);
+    amf3_context_cleanup(&context);
+    if (serialized_value_size == 0) {
+        return 0;
+    }
+    RTMP_TRACE(RTMP_TRACE_AMF_SERIALIZE_AVMPLUS, serialized_value_size);
+
+    return 1 + serialized_value_size;
+}
@@ -0,0 +1,551 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rtmp.h"
+#include "rtmp_packet.h"
+#include "amf_packet.h"
+#include "amf_intern.h"
+
+
+/*
+ * Connection rate and handshake benchmark.
+ *
+ * An rtmp_server_t runs rtmp_server_wait_message on its own thread.
+ * The main thread opens every connection at once, like viewers
+ * reconnecting after a restart, and drives each through the handshake
+ * and a connect invoke until the connect _result arrives.  The clients
+ * are plain non-blocking sockets replaying prebuilt bytes, so the client
+ * side costs little next to the server.
+ *
+ * usage: bench_accept [connections ...]  (default: 100 1000)
+ *
+ * Prints CSV, one line per run:
+ *   connections,completed,elapsed_s,connects_per_s,server_cpu_s,connects_per_server_cpu_s
+ * then for each run the latency from connect() per phase:
+ *   connections,metric,count,min,p50,p90,p99,max
+ * connects_per_server_cpu_s is what one core spent on the server would
+ * sustain.
+ */
+
+#define BENCH_CHUNK_SIZE DEFAULT_AMF_CHUNK_SIZE
+#define BENCH_TIMEOUT_NS 30000000000.0 /* give up on a run after 30s */
+#define BENCH_MAX_EVENTS 256
+#define BENCH_RECEIVE_SIZE (RTMP_HANDSHAKE_SIZE * 2 + 1 + RTMP_BUFFER_SIZE)
+#define BENCH_SERVER_WAIT 0.1 /* seconds, how soon the server sees stop */
+
+
+typedef enum bench_state bench_state_t;
+
+enum bench_state
+{
+    BENCH_STATE_CONNECTING,
+    BENCH_STATE_HANDSHAKE,
+    BENCH_STATE_WAITING_RESULT,
+    BENCH_STATE_DONE,
+    BENCH_STATE_FAILED,
+};
+
+typedef struct bench_connection_t bench_connection_t;
+
+/* times are in ns from started */
+struct bench_connection_t
+{
+    int sock;
+    bench_state_t state;
+    double started;
+    double handshaken;
+    double connected;
+    const unsigned char *will_send;
+    size_t will_send_size;
+    unsigned char received_buffer[BENCH_RECEIVE_SIZE];
+    size_t received_size;
+};
+
+typedef struct bench_server_t bench_server_t;
+
+struct bench_server_t
+{
+    rtmp_server_t *rs;
+    pthread_t thread;
+    volatile int stop;
+    double cpu_ns;
+};
+
+
+/* C0 and C1, then C2 and the connect invoke */
+static unsigned char bench_hello[1 + RTMP_HANDSHAKE_SIZE];
+static unsigned char bench_connect[RTMP_HANDSHAKE_SIZE + RTMP_BUFFER_SIZE];
+static size_t bench_connect_size;
+
+
+static double bench_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000.0 + now.tv_nsec;
+}
+
+
+static double bench_thread_cpu_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000.0 + now.tv_nsec;
+}
+
+
+static void *bench_server_main(void *argument)
+{
+    bench_server_t *server;
+    double start;
+
+    server = (bench_server_t*)argument;
+    start = bench_thread_cpu_ns();
+    while (!server->stop) {
+        rtmp_server_wait_message(server->rs, BENCH_SERVER_WAIT);
+    }
+    server->cpu_ns = bench_thread_cpu_ns() - start;
+    return NULL;
+}
+
+
+static int bench_build_requests(void)
+{
+    rtmp_packet_t *packet;
+    amf_packet_t *object;
+    size_t packet_size;
+    rtmp_result_t result;
+    int i;
+
+    bench_hello[0] = 0x03;
+    for (i = 1; i < (int)sizeof(bench_hello); ++i) {
+        bench_hello[i] = (unsigned char)rand();
+    }
+    /* the server does not check C2 */
+    memset(bench_connect, 0x00, RTMP_HANDSHAKE_SIZE);
+
+    packet = rtmp_packet_create();
+    if (packet == NULL) {
+        return 0;
+    }
+    packet->object_id = 3;
+    packet->data_type = RTMP_DATATYPE_INVOKE;
+    rtmp_packet_add_amf(packet, amf_packet_create_string("connect"));
+    rtmp_packet_add_amf(packet, amf_packet_create_number(1.0));
+    object = amf_packet_create_object();
+    amf_packet_add_property_to_object(
+        object, "app", amf_packet_create_string("live"));
+    amf_packet_add_property_to_object(
+        object, "flashVer", amf_packet_create_string("WIN 10,0,12,36"));
+    amf_packet_add_property_to_object(
+        object, "tcUrl",
+        amf_packet_create_string("rtmp://127.0.0.1/live"));
+    amf_packet_add_property_to_object(
+        object, "capabilities", amf_packet_create_number(15.0));
+    amf_packet_add_property_to_object(
+        object, "objectEncoding", amf_packet_create_number(0.0));
+    rtmp_packet_add_amf(packet, object);
+    result = rtmp_packet_serialize(
+        packet,
+        bench_connect + RTMP_HANDSHAKE_SIZE,
+        sizeof(bench_connect) - RTMP_HANDSHAKE_SIZE,
+        BENCH_CHUNK_SIZE,
+        &packet_size);
+    rtmp_packet_free(packet);
+    if (result != RTMP_SUCCESS) {
+        return 0;
+    }
+    bench_connect_size = RTMP_HANDSHAKE_SIZE + packet_size;
+    return 1;
+}
+
+
+static int bench_open(
+    int epoll_fd, bench_connection_t *connection,
+    const struct sockaddr_in *address)
+{
+    struct epoll_event event;
+
+    connection->started = bench_now_ns();
+    connection->state = BENCH_STATE_FAILED;
+    connection->received_size = 0;
+    connection->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connection->sock == -1) {
+        return 0;
+    }
+    fcntl(connection->sock, F_SETFL,
+        fcntl(connection->sock, F_GETFL) | O_NONBLOCK);
+    if (connect(connection->sock,
+            (const struct sockaddr*)address, sizeof(*address)) == -1 &&
+        errno != EINPROGRESS) {
+        return 0;
+    }
+
+    connection->state = BENCH_STATE_CONNECTING;
+    connection->will_send = bench_hello;
+    connection->will_send_size = sizeof(bench_hello);
+    memset(&event, 0x00, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = connection;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->sock, &event) == -1) {
+        connection->state = BENCH_STATE_FAILED;
+        return 0;
+    }
+    return 1;
+}
+
+
+static void bench_close(bench_connection_t *connection)
+{
+    if (connection->sock != -1) {
+        close(connection->sock);
+        connection->sock = -1;
+    }
+}
+
+
+/* looks for the _result of connect after the handshake */
+static int bench_find_connect_result(
+    bench_connection_t *connection, rtmp_packet_t *packet)
+{
+    size_t position;
+    size_t packet_size;
+    amf_packet_t *amf;
+
+    position = 1 + RTMP_HANDSHAKE_SIZE * 2;
+    while (position < connection->received_size) {
+        if (rtmp_packet_analyze_data(
+                packet,
+                connection->received_buffer + position,
+                connection->received_size - position,
+                BENCH_CHUNK_SIZE,
+                &packet_size) != RTMP_SUCCESS || packet_size == 0) {
+            return 0;
+        }
+        position += packet_size;
+        if (packet->data_type == RTMP_DATATYPE_INVOKE &&
+            packet->inner_amf_packets) {
+            amf = packet->inner_amf_packets->amf;
+            if (amf->datatype == AMF_DATATYPE_STRING &&
+                strcmp(amf->string.value, "_result") == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+static void bench_service(
+    int epoll_fd, bench_connection_t *connection, int events,
+    rtmp_packet_t *packet)
+{
+    struct epoll_event event;
+    ssize_t size;
+
+    if (connection->state == BENCH_STATE_CONNECTING) {
+        connection->state = BENCH_STATE_HANDSHAKE;
+    }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        connection->state = BENCH_STATE_FAILED;
+        bench_close(connection);
+        return;
+    }
+
+    if ((events & EPOLLOUT) && connection->will_send_size > 0) {
+        size = send(connection->sock,
+            connection->will_send, connection->will_send_size, 0);
+        if (size == -1 && errno != EAGAIN && errno != EINTR) {
+            connection->state = BENCH_STATE_FAILED;
+            bench_close(connection);
+            return;
+        }
+        if (size > 0) {
+            connection->will_send += size;
+            connection->will_send_size -= size;
+        }
+    }
+
+    if (events & EPOLLIN) {
+        size = recv(connection->sock,
+            connection->received_buffer + connection->received_size,
+            sizeof(connection->received_buffer) - connection->received_size,
+            0);
+        if (size == 0 ||
+            (size == -1 && errno != EAGAIN && errno != EINTR)) {
+            connection->state = BENCH_STATE_FAILED;
+            bench_close(connection);
+            return;
+        }
+        if (size > 0) {
+            connection->received_size += size;
+        }
+    }
+
+    if (connection->state == BENCH_STATE_HANDSHAKE &&
+        connection->received_size >= 1 + RTMP_HANDSHAKE_SIZE * 2) {
+        connection->handshaken = bench_now_ns() - connection->started;
+        connection->state = BENCH_STATE_WAITING_RESULT;
+        connection->will_send = bench_connect;
+        connection->will_send_size = bench_connect_size;
+    }
+    if (connection->state == BENCH_STATE_WAITING_RESULT &&
+        bench_find_connect_result(connection, packet)) {
+        connection->connected = bench_now_ns() - connection->started;
+        connection->state = BENCH_STATE_DONE;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->sock, NULL);
+        return;
+    }
+
+    memset(&event, 0x00, sizeof(event));
+    event.events = EPOLLIN;
+    if (connection->will_send_size > 0) {
+        event.events |= EPOLLOUT;
+    }
+    event.data.ptr = connection;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->sock, &event);
+}
+
+
+static int bench_compare_double(const void *a, const void *b)
+{
+    double x;
+    double y;
+
+    x = *(const double*)a;
+    y = *(const double*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+/* values are sorted in place */
+static void bench_print_latency(
+    int connections_num, const char *name, double *values, int values_num)
+{
+    if (values_num == 0) {
+        printf("%d,%s,0,,,,,\n", connections_num, name);
+        return;
+    }
+    qsort(values, values_num, sizeof(double), bench_compare_double);
+    printf("%d,%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+        connections_num, name, values_num,
+        values[0],
+        values[(values_num - 1) * 50 / 100],
+        values[(values_num - 1) * 90 / 100],
+        values[(values_num - 1) * 99 / 100],
+        values[values_num - 1]);
+}
+
+
+/* every connection needs two descriptors, the client and the server side */
+static void bench_raise_file_limit(int descriptors)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1 ||
+        limit.rlim_cur >= (rlim_t)descriptors) {
+        return;
+    }
+    limit.rlim_cur = (rlim_t)descriptors;
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_cur > limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+    }
+    setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+
+static int bench_run(
+    int connections_num, unsigned short port,
+    double *handshake_ms, int *handshake_num,
+    double *connect_ms, int *connect_num)
+{
+    bench_server_t server;
+    bench_connection_t *connections;
+    struct sockaddr_in address;
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    rtmp_packet_t *packet;
+    int epoll_fd;
+    int events_num;
+    int completed;
+    int failed;
+    int i;
+    double start;
+    double elapsed;
+
+    server.rs = rtmp_server_create(port);
+    if (server.rs == NULL) {
+        fprintf(stderr, "could not listen on port %d\n", port);
+        return 0;
+    }
+    server.stop = 0;
+    server.cpu_ns = 0;
+    if (pthread_create(&server.thread, NULL, bench_server_main, &server)) {
+        rtmp_server_free(server.rs);
+        return 0;
+    }
+
+    connections = (bench_connection_t*)calloc(
+        connections_num, sizeof(bench_connection_t));
+    packet = rtmp_packet_create();
+    epoll_fd = epoll_create(connections_num);
+    if (connections == NULL || packet == NULL || epoll_fd == -1) {
+        server.stop = 1;
+        pthread_join(server.thread, NULL);
+        rtmp_server_free(server.rs);
+        return 0;
+    }
+    memset(&address, 0x00, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    address.sin_port = htons(port);
+
+    start = bench_now_ns();
+    completed = 0;
+    failed = 0;
+    for (i = 0; i < connections_num; ++i) {
+        connections[i].sock = -1;
+        if (!bench_open(epoll_fd, &connections[i], &address)) {
+            bench_close(&connections[i]);
+            failed++;
+        }
+    }
+    while (completed + failed < connections_num &&
+           bench_now_ns() - start < BENCH_TIMEOUT_NS) {
+        events_num = epoll_wait(epoll_fd, events, BENCH_MAX_EVENTS, 10);
+        for (i = 0; i < events_num; ++i) {
+            bench_service(
+                epoll_fd, (bench_connection_t*)events[i].data.ptr,
+                events[i].events, packet);
+            if (((bench_connection_t*)events[i].data.ptr)->state ==
+                BENCH_STATE_DONE) {
+                completed++;
+            } else if (((bench_connection_t*)events[i].data.ptr)->state ==
+                       BENCH_STATE_FAILED) {
+                failed++;
+            }
+        }
+    }
+    elapsed = bench_now_ns() - start;
+
+    server.stop = 1;
+    pthread_join(server.thread, NULL);
+
+    *handshake_num = 0;
+    *connect_num = 0;
+    for (i = 0; i < connections_num; ++i) {
+        if (connections[i].handshaken > 0) {
+            handshake_ms[(*handshake_num)++] =
+                connections[i].handshaken / 1000000.0;
+        }
+        if (connections[i].state == BENCH_STATE_DONE) {
+            connect_ms[(*connect_num)++] =
+                connections[i].connected / 1000000.0;
+        }
+        bench_close(&connections[i]);
+    }
+    printf("%d,%d,%.3f,%.1f,%.3f,%.1f\n",
+        connections_num, completed, elapsed / 1000000000.0,
+        completed * 1000000000.0 / elapsed,
+        server.cpu_ns / 1000000000.0,
+        server.cpu_ns > 0 ? completed * 1000000000.0 / server.cpu_ns : 0);
+
+    close(epoll_fd);
+    rtmp_packet_free(packet);
+    free(connections);
+    rtmp_server_free(server.rs);
+    return 1;
+}
+
+
+int main(int argc, char **argv)
+{
+    static const int default_runs[] = {100, 1000};
+    int runs_num;
+    int *runs;
+    int max_connections;
+    double **handshake_ms;
+    double **connect_ms;
+    int *handshake_num;
+    int *connect_num;
+    unsigned short port;
+    int result;
+    int i;
+
+    runs_num = argc > 1 ? argc - 1 : 2;
+    runs = (int*)malloc(sizeof(int) * runs_num);
+    handshake_ms = (double**)calloc(runs_num, sizeof(double*));
+    connect_ms = (double**)calloc(runs_num, sizeof(double*));
+    handshake_num = (int*)calloc(runs_num, sizeof(int));
+    connect_num = (int*)calloc(runs_num, sizeof(int));
+    if (runs == NULL || handshake_ms == NULL || connect_ms == NULL ||
+        handshake_num == NULL || connect_num == NULL) {
+        return 1;
+    }
+    max_connections = 0;
+    for (i = 0; i < runs_num; ++i) {
+        runs[i] = argc > 1 ? atoi(argv[i + 1]) : default_runs[i];
+        if (runs[i] < 1) {
+            fprintf(stderr, "usage: bench_accept [connections ...]\n");
+            return 1;
+        }
+        if (runs[i] > max_connections) {
+            max_connections = runs[i];
+        }
+    }
+    bench_raise_file_limit(max_connections * 2 + 64);
+
+    /* the requests are built before any server initializes it */
+    amf_intern_initialize();
+    if (!bench_build_requests()) {
+        return 1;
+    }
+
+    /* a fresh port per run, the last one may be in TIME_WAIT */
+    port = (unsigned short)(20000 + getpid() % 20000);
+    result = 0;
+    printf("connections,completed,elapsed_s,connects_per_s,server_cpu_s,"
+        "connects_per_server_cpu_s\n");
+    for (i = 0; i < runs_num; ++i) {
+        handshake_ms[i] = (double*)malloc(sizeof(double) * runs[i]);
+        connect_ms[i] = (double*)malloc(sizeof(double) * runs[i]);
+        if (handshake_ms[i] == NULL || connect_ms[i] == NULL ||
+            !bench_run(runs[i], (unsigned short)(port + i),
+                handshake_ms[i], &handshake_num[i],
+                connect_ms[i], &connect_num[i])) {
+            result = 1;
+            break;
+        }
+    }
+
+    printf("connections,metric,count,min,p50,p90,p99,max\n");
+    for (i = 0; i < runs_num && handshake_ms[i]; ++i) {
+        bench_print_latency(
+            runs[i], "handshake_ms", handshake_ms[i], handshake_num[i]);
+        bench_print_latency(
+            runs[i], "connect_ms", connect_ms[i], connect_num[i]);
+    }
+
+    for (i = 0; i < runs_num; ++i) {
+        free(handshake_ms[i]);
+        free(connect_ms[i]);
+    }
+    free(handshake_ms);
+    free(connect_ms);
+    free(handshake_num);
+    free(connect_num);
+    free(runs);
+    return result;
+}
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtmp.h"
+#include "amf_packet.h"
+#include "amf_intern.h"
+
+
+/*
+ * AMF codec microbenchmark.
+ *
+ * Prints one CSV line per corpus entry and operation:
+ *   corpus,operation,bytes,iterations,ns_per_op,allocs_per_op
+ * Decoding includes freeing the decoded values.  Allocations are counted
+ * by wrapping malloc, calloc and realloc at link time (see Makefile.gcc).
+ */
+
+#define BENCH_MIN_NS 200000000.0 /* run each case for at least 0.2s */
+#define BENCH_BUFFER_SIZE (1024 * 1024)
+#define BENCH_KEYFRAMES 1000
+#define BENCH_DEPTH 32
+#define BENCH_CORPUS_VALUES 8
+
+
+typedef struct bench_corpus_t bench_corpus_t;
+
+struct bench_corpus_t
+{
+    const char *name;
+    amf_packet_t *values[BENCH_CORPUS_VALUES];
+    int values_num;
+    unsigned char *data;
+    size_t data_size;
+};
+
+typedef enum bench_operation bench_operation_t;
+
+enum bench_operation
+{
+    BENCH_ANALYZE,
+    BENCH_GET_SIZE,
+    BENCH_SERIALIZE,
+};
+
+
+static unsigned long bench_allocations;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t num, size_t size);
+extern void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    bench_allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size)
+{
+    bench_allocations++;
+    return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+    bench_allocations++;
+    return __real_realloc(pointer, size);
+}
+
+
+static double bench_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000.0 + now.tv_nsec;
+}
+
+
+static void bench_add(bench_corpus_t *corpus, amf_packet_t *value)
+{
+    corpus->values[corpus->values_num++] = value;
+}
+
+
+static void bench_add_property(
+    amf_packet_t *object, const char *key, amf_packet_t *value)
+{
+    amf_packet_add_property_to_object(object, key, value);
+}
+
+
+static void bench_build_connect(bench_corpus_t *corpus)
+{
+    amf_packet_t *object;
+
+    corpus->name = "connect";
+    bench_add(corpus, amf_packet_create_string("connect"));
+    bench_add(corpus, amf_packet_create_number(1));
+    object = amf_packet_create_object();
+    bench_add_property(object, "app", amf_packet_create_string("live"));
+    bench_add_property(object, "flashVer",
+        amf_packet_create_string("LNX 10,0,32,18"));
+    bench_add_property(object, "swfUrl",
+        amf_packet_create_string("http://example.com/player.swf"));
+    bench_add_property(object, "tcUrl",
+        amf_packet_create_string("rtmp://example.com:1935/live"));
+    bench_add_property(object, "fpad", amf_packet_create_boolean(0));
+    bench_add_property(object, "capabilities", amf_packet_create_number(15));
+    bench_add_property(object, "audioCodecs", amf_packet_create_number(3191));
+    bench_add_property(object, "videoCodecs", amf_packet_create_number(252));
+    bench_add_property(object, "videoFunction", amf_packet_create_number(1));
+    bench_add_property(object, "pageUrl",
+        amf_packet_create_string("http://example.com/watch.html"));
+    bench_add_property(object, "objectEncoding", amf_packet_create_number(0));
+    bench_add(corpus, object);
+}
+
+
+static void bench_build_on_status(bench_corpus_t *corpus)
+{
+    amf_packet_t *object;
+
+    corpus->name = "onStatus";
+    bench_add(corpus, amf_packet_create_string("onStatus"));
+    bench_add(corpus, amf_packet_create_number(0));
+    bench_add(corpus, amf_packet_create_null());
+    object = amf_packet_create_object();
+    bench_add_property(object, "level", amf_packet_create_string("status"));
+    bench_add_property(object, "code",
+        amf_packet_create_string("NetStream.Play.Start"));
+    bench_add_property(object, "description",
+        amf_packet_create_string("Started playing test.flv."));
+    bench_add_property(object, "details", amf_packet_create_string("test.flv"));
+    bench_add_property(object, "clientid", amf_packet_create_number(12345));
+    bench_add(corpus, object);
+}
+
+
+static void bench_build_on_meta_data(bench_corpus_t *corpus)
+{
+    amf_packet_t *meta_data;
+    amf_packet_t *keyframes;
+    double times[BENCH_KEYFRAMES];
+    double file_positions[BENCH_KEYFRAMES];
+    int i;
+
+    for (i = 0; i < BENCH_KEYFRAMES; ++i) {
+        times[i] = i * 2.002;
+        file_positions[i] = 13 + i * 250000.0;
+    }
+
+    corpus->name = "onMetaData";
+    bench_add(corpus, amf_packet_create_string("onMetaData"));
+    meta_data = amf_packet_create_ecma_array();
+    bench_add_property(meta_data, "duration",
+        amf_packet_create_number(BENCH_KEYFRAMES * 2.002));
+    bench_add_property(meta_data, "width", amf_packet_create_number(1280));
+    bench_add_property(meta_data, "height", amf_packet_create_number(720));
+    bench_add_property(meta_data, "framerate", amf_packet_create_number(29.97));
+    bench_add_property(meta_data, "videocodecid", amf_packet_create_number(7));
+    bench_add_property(meta_data, "audiocodecid", amf_packet_create_number(10));
+    keyframes = amf_packet_create_object();
+    bench_add_property(keyframes, "times",
+        amf_packet_create_number_array(times, BENCH_KEYFRAMES));
+    bench_add_property(keyframes, "filepositions",
+        amf_packet_create_number_array(file_positions, BENCH_KEYFRAMES));
+    bench_add_property(meta_data, "keyframes", keyframes);
+    bench_add(corpus, meta_data);
+}
+
+
+static void bench_build_nested(bench_corpus_t *corpus)
+{
+    amf_packet_t *object;
+    amf_packet_t *child;
+    int i;
+
+    corpus->name = "nested";
+    object = amf_packet_create_object();
+    bench_add_property(object, "leaf", amf_packet_create_string("bottom"));
+    for (i = 0; i < BENCH_DEPTH; ++i) {
+        child = object;
+        object = amf_packet_create_object();
+        bench_add_property(object, "depth", amf_packet_create_number(i));
+        bench_add_property(object, "name", amf_packet_create_string("node"));
+        bench_add_property(object, "child", child);
+    }
+    bench_add(corpus, object);
+}
+
+
+static void bench_serialize_corpus(bench_corpus_t *corpus)
+{
+    int i;
+
+    corpus->data = (unsigned char*)malloc(BENCH_BUFFER_SIZE);
+    corpus->data_size = 0;
+    for (i = 0; i < corpus->values_num; ++i) {
+        corpus->data_size += amf_packet_serialize(
+            corpus->values[i],
+            corpus->data + corpus->data_size,
+            BENCH_BUFFER_SIZE - corpus->data_size);
+    }
+}
+
+
+static void bench_free_corpus(bench_corpus_t *corpus)
+{
+    int i;
+
+    for (i = 0; i < corpus->values_num; ++i) {
+        amf_packet_free(corpus->values[i]);
+    }
+    free(corpus->data);
+}
+
+
+static size_t bench_run_once(
+    bench_corpus_t *corpus, bench_operation_t operation,
+    unsigned char *output_buffer)
+{
+    size_t position;
+    size_t packet_size;
+    size_t total;
+    amf_packet_t *amf;
+    int i;
+
+    total = 0;
+    switch (operation) {
+    case BENCH_ANALYZE:
+        position = 0;
+        while (position < corpus->data_size) {
+            amf = amf_packet_analyze_data(
+                corpus->data + position, corpus->data_size - position,
+                &packet_size);
+            if (amf == NULL) {
+                fprintf(stderr, "%s: analyze failed\n", corpus->name);
+                exit(1);
+            }
+            amf_packet_free(amf);
+            position += packet_size;
+        }
+        total = position;
+        break;
+    case BENCH_GET_SIZE:
+        for (i = 0; i < corpus->values_num; ++i) {
+            total += amf_packet_get_size(corpus->values[i]);
+        }
+        break;
+    case BENCH_SERIALIZE:
+        for (i = 0; i < corpus->values_num; ++i) {
+            total += amf_packet_serialize(
+                corpus->values[i],
+                output_buffer + total, BENCH_BUFFER_SIZE - total);
+        }
+        break;
+    }
+    return total;
+}
+
+
+static void bench_run(
+    bench_corpus_t *corpus, bench_operation_t operation,
+    const char *operation_name, unsigned char *output_buffer)
+{
+    unsigned long iterations;
+    unsigned long i;
+    unsigned long allocations;
+    double start;
+    double elapsed;
+    size_t total;
+
+    /* warm up and check */
+    total = bench_run_once(corpus, operation, output_buffer);
+    if (total != corpus->data_size) {
+        fprintf(stderr, "%s %s: %d bytes, expected %d\n",
+            corpus->name, operation_name, (int)total, (int)corpus->data_size);
+        exit(1);
+    }
+
+    iterations = 1;
+    while (1) {
+        allocations = bench_allocations;
+        start = bench_now_ns();
+        for (i = 0; i < iterations; ++i) {
+            bench_run_once(corpus, operation, output_buffer);
+        }
+        elapsed = bench_now_ns() - start;
+        allocations = bench_allocations - allocations;
+        if (elapsed >= BENCH_MIN_NS) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    printf("%s,%s,%d,%lu,%.1f,%.2f\n",
+        corpus->name, operation_name, (int)corpus->data_size, iterations,
+        elapsed / iterations, (double)allocations / iterations);
+}
+
+
+int main(void)
+{
+    bench_corpus_t corpora[4];
+    unsigned char *output_buffer;
+    int i;
+
+    amf_intern_initialize();
+    memset(corpora, 0x00, sizeof(corpora));
+    bench_build_connect(&corpora[0]);
+    bench_build_on_status(&corpora[1]);
+    bench_build_on_meta_data(&corpora[2]);
+    bench_build_nested(&corpora[3]);
+
+    output_buffer = (unsigned char*)malloc(BENCH_BUFFER_SIZE);
+    if (output_buffer == NULL) {
+        return 1;
+    }
+
+    printf("corpus,operation,bytes,iterations,ns_per_op,allocs_per_op\n");
+    for (i = 0; i < 4; ++i) {
+        bench_serialize_corpus(&corpora[i]);
+        bench_run(&corpora[i], BENCH_ANALYZE, "analyze", output_buffer);
+        bench_run(&corpora[i], BENCH_GET_SIZE, "get_size", output_buffer);
+        bench_run(&corpora[i], BENCH_SERIALIZE, "serialize", output_buffer);
+        bench_free_corpus(&corpora[i]);
+    }
+
+    free(output_buffer);
+    return 0;
+}
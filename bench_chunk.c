@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "rtmp.h"
+#include "rtmp_packet.h"
+#include "amf_intern.h"
+
+
+/*
+ * RTMP chunk demux/mux throughput benchmark.
+ *
+ * A synthetic stream of interleaved audio and video messages, with a
+ * keyframe every BENCH_GOP video frames, is chunked at each chunk size
+ * and then run through rtmp_packet_analyze_data (demux) and
+ * rtmp_packet_serialize (mux), on one thread and on several threads each
+ * working on its own copy.  Prints one CSV line per case:
+ *   operation,chunk_size,profile,threads,stream_bytes,messages,mb_per_s,msgs_per_s
+ * Byte counts are on-the-wire bytes, headers and chunk delimiters included.
+ *
+ * Messages alternate, but each one is sent whole: every chunk of a message
+ * follows the previous one, as rtmp_packet_serialize writes them.  A real
+ * publisher may interleave the chunks of an audio message between those
+ * of a keyframe, which rtmp_packet_analyze_data can not demux, as it keeps
+ * no state per chunk stream.  The figures are therefore an upper bound,
+ * for streams which never interleave chunks, and do not measure the
+ * capacity for arbitrary publishers.
+ *
+ * usage: bench_chunk [max_threads]  (default: number of online CPUs)
+ */
+
+#define BENCH_MIN_NS 200000000.0 /* run each case for at least 0.2s */
+#define BENCH_MESSAGES 256 /* per stream, half audio and half video */
+#define BENCH_GOP 30
+#define BENCH_AUDIO_OBJECT_ID 4
+#define BENCH_VIDEO_OBJECT_ID 6
+#define BENCH_STREAM_ID 1
+#define BENCH_AUDIO_INTERVAL 23 /* ms, AAC at 44.1kHz */
+#define BENCH_VIDEO_INTERVAL 33 /* ms, 30fps */
+
+
+typedef struct bench_profile_t bench_profile_t;
+
+/* message body sizes in bytes */
+struct bench_profile_t
+{
+    const char *name;
+    size_t audio_size;
+    size_t video_size;
+    size_t keyframe_size;
+};
+
+typedef struct bench_message_t bench_message_t;
+
+struct bench_message_t
+{
+    rtmp_datatype_t data_type;
+    char object_id;
+    long timer;
+    size_t size;
+};
+
+typedef enum bench_operation bench_operation_t;
+
+enum bench_operation
+{
+    BENCH_DEMUX,
+    BENCH_MUX,
+};
+
+typedef struct bench_stream_t bench_stream_t;
+
+struct bench_stream_t
+{
+    bench_message_t messages[BENCH_MESSAGES];
+    size_t chunk_size;
+    unsigned char *payload; /* shared by every message body */
+    size_t payload_size;
+    unsigned char *data; /* the chunked stream */
+    size_t data_size;
+};
+
+typedef struct bench_worker_t bench_worker_t;
+
+struct bench_worker_t
+{
+    pthread_t thread;
+    bench_stream_t *stream;
+    bench_operation_t operation;
+    unsigned long iterations;
+    double elapsed;
+    int failed;
+};
+
+
+static const bench_profile_t bench_profiles[] = {
+    /* 64kbps audio, 500kbps video */
+    {"sd", 184, 1536, 24576},
+    /* 128kbps audio, 4Mbps video */
+    {"hd", 368, 12288, 196608},
+};
+
+static const size_t bench_chunk_sizes[] = {128, 4096, 65536};
+
+
+static double bench_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000.0 + now.tv_nsec;
+}
+
+
+static void bench_build_messages(
+    bench_stream_t *stream, const bench_profile_t *profile)
+{
+    bench_message_t *message;
+    int audio_frames;
+    int video_frames;
+    int i;
+
+    audio_frames = 0;
+    video_frames = 0;
+    for (i = 0; i < BENCH_MESSAGES; ++i) {
+        message = &stream->messages[i];
+        if (i % 2 == 0) {
+            message->data_type = RTMP_DATATYPE_AUDIO_DATA;
+            message->object_id = BENCH_AUDIO_OBJECT_ID;
+            message->timer = audio_frames * BENCH_AUDIO_INTERVAL;
+            message->size = profile->audio_size;
+            audio_frames++;
+        } else {
+            message->data_type = RTMP_DATATYPE_VIDEO_DATA;
+            message->object_id = BENCH_VIDEO_OBJECT_ID;
+            message->timer = video_frames * BENCH_VIDEO_INTERVAL;
+            if (video_frames % BENCH_GOP == 0) {
+                message->size = profile->keyframe_size;
+            } else {
+                message->size = profile->video_size;
+            }
+            video_frames++;
+        }
+    }
+}
+
+
+/* 12 byte header, the body and one delimiter per extra chunk */
+static size_t bench_get_chunked_size(size_t body_size, size_t chunk_size)
+{
+    return 12 + body_size + (body_size - 1) / chunk_size;
+}
+
+
+static int bench_prepare_stream(
+    bench_stream_t *stream, const bench_profile_t *profile, size_t chunk_size)
+{
+    size_t i;
+
+    bench_build_messages(stream, profile);
+    stream->chunk_size = chunk_size;
+
+    stream->payload_size = profile->keyframe_size;
+    stream->payload = (unsigned char*)malloc(stream->payload_size);
+    if (stream->payload == NULL) {
+        return 0;
+    }
+    for (i = 0; i < stream->payload_size; ++i) {
+        stream->payload[i] = (unsigned char)(i * 7);
+    }
+
+    stream->data_size = 0;
+    for (i = 0; i < BENCH_MESSAGES; ++i) {
+        stream->data_size += bench_get_chunked_size(
+            stream->messages[i].size, chunk_size);
+    }
+    stream->data = (unsigned char*)malloc(stream->data_size);
+    if (stream->data == NULL) {
+        free(stream->payload);
+        return 0;
+    }
+    return 1;
+}
+
+
+static void bench_free_stream(bench_stream_t *stream)
+{
+    free(stream->payload);
+    free(stream->data);
+}
+
+
+static int bench_copy_stream(bench_stream_t *copy, bench_stream_t *stream)
+{
+    *copy = *stream;
+    copy->payload = (unsigned char*)malloc(stream->payload_size);
+    copy->data = (unsigned char*)malloc(stream->data_size);
+    if (copy->payload == NULL || copy->data == NULL) {
+        free(copy->payload);
+        free(copy->data);
+        return 0;
+    }
+    memcpy(copy->payload, stream->payload, stream->payload_size);
+    memcpy(copy->data, stream->data, stream->data_size);
+    return 1;
+}
+
+
+/* mux every message into stream->data */
+static int bench_mux(bench_stream_t *stream, rtmp_packet_t *packet)
+{
+    bench_message_t *message;
+    size_t position;
+    size_t packet_size;
+    rtmp_result_t result;
+    int i;
+
+    position = 0;
+    for (i = 0; i < BENCH_MESSAGES; ++i) {
+        message = &stream->messages[i];
+        packet->object_id = message->object_id;
+        packet->timer = message->timer;
+        packet->data_type = message->data_type;
+        packet->stream_id = BENCH_STREAM_ID;
+        packet->body_type = RTMP_BODY_TYPE_DATA;
+        packet->body_data = stream->payload;
+        packet->body_data_length = message->size;
+        result = rtmp_packet_serialize(
+            packet,
+            stream->data + position, stream->data_size - position,
+            stream->chunk_size,
+            &packet_size);
+        packet->body_data = NULL;
+        if (result != RTMP_SUCCESS) {
+            return 0;
+        }
+        position += packet_size;
+    }
+    return position == stream->data_size;
+}
+
+
+/* demux stream->data and check what comes out */
+static int bench_demux(bench_stream_t *stream, rtmp_packet_t *packet)
+{
+    bench_message_t *message;
+    size_t position;
+    size_t packet_size;
+    rtmp_result_t result;
+    int i;
+
+    position = 0;
+    for (i = 0; i < BENCH_MESSAGES; ++i) {
+        message = &stream->messages[i];
+        result = rtmp_packet_analyze_data(
+            packet,
+            stream->data + position, stream->data_size - position,
+            stream->chunk_size,
+            &packet_size);
+        if (result != RTMP_SUCCESS ||
+            packet->data_type != message->data_type ||
+            packet->body_data_length != message->size) {
+            return 0;
+        }
+        position += packet_size;
+    }
+    return position == stream->data_size;
+}
+
+
+static int bench_run_once(
+    bench_stream_t *stream, bench_operation_t operation,
+    rtmp_packet_t *packet)
+{
+    if (operation == BENCH_DEMUX) {
+        return bench_demux(stream, packet);
+    }
+    return bench_mux(stream, packet);
+}
+
+
+static void *bench_worker_main(void *argument)
+{
+    bench_worker_t *worker;
+    rtmp_packet_t *packet;
+    double start;
+
+    worker = (bench_worker_t*)argument;
+    packet = rtmp_packet_create();
+    if (packet == NULL) {
+        worker->failed = 1;
+        return NULL;
+    }
+    worker->iterations = 0;
+    start = bench_now_ns();
+    do {
+        if (!bench_run_once(worker->stream, worker->operation, packet)) {
+            worker->failed = 1;
+            break;
+        }
+        worker->iterations++;
+        worker->elapsed = bench_now_ns() - start;
+    } while (worker->elapsed < BENCH_MIN_NS);
+    rtmp_packet_free(packet);
+    return NULL;
+}
+
+
+static int bench_run(
+    bench_stream_t *stream, bench_operation_t operation,
+    const char *operation_name, const char *profile_name, int threads)
+{
+    bench_worker_t *workers;
+    bench_stream_t *copies;
+    double bytes_per_ns;
+    double messages_per_ns;
+    int copied;
+    int started;
+    int failed;
+    int i;
+
+    workers = (bench_worker_t*)calloc(threads, sizeof(bench_worker_t));
+    copies = (bench_stream_t*)calloc(threads, sizeof(bench_stream_t));
+    if (workers == NULL || copies == NULL) {
+        free(workers);
+        free(copies);
+        return 0;
+    }
+
+    failed = 0;
+    for (copied = 0; copied < threads; ++copied) {
+        if (!bench_copy_stream(&copies[copied], stream)) {
+            failed = 1;
+            break;
+        }
+        workers[copied].stream = &copies[copied];
+        workers[copied].operation = operation;
+    }
+    for (started = 0; started < threads && !failed; ++started) {
+        if (pthread_create(
+                &workers[started].thread, NULL,
+                bench_worker_main, &workers[started])) {
+            failed = 1;
+            break;
+        }
+    }
+
+    bytes_per_ns = 0;
+    messages_per_ns = 0;
+    for (i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        failed |= workers[i].failed;
+        if (workers[i].elapsed > 0) {
+            bytes_per_ns +=
+                workers[i].iterations * (double)stream->data_size /
+                workers[i].elapsed;
+            messages_per_ns +=
+                workers[i].iterations * (double)BENCH_MESSAGES /
+                workers[i].elapsed;
+        }
+    }
+    for (i = 0; i < copied; ++i) {
+        bench_free_stream(&copies[i]);
+    }
+    free(workers);
+    free(copies);
+
+    if (failed) {
+        fprintf(stderr, "%s %s chunk %d: failed\n",
+            operation_name, profile_name, (int)stream->chunk_size);
+        return 0;
+    }
+    printf("%s,%d,%s,%d,%d,%d,%.1f,%.0f\n",
+        operation_name, (int)stream->chunk_size, profile_name, threads,
+        (int)stream->data_size, BENCH_MESSAGES,
+        bytes_per_ns * 1000.0, messages_per_ns * 1000000000.0);
+    return 1;
+}
+
+
+int main(int argc, char **argv)
+{
+    bench_stream_t stream;
+    rtmp_packet_t *packet;
+    const bench_profile_t *profile;
+    size_t chunk_size;
+    long max_threads;
+    int threads;
+    int next_threads;
+    int profile_index;
+    int chunk_size_index;
+    int result;
+
+    if (argc > 1) {
+        max_threads = atol(argv[1]);
+    } else {
+        max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+
+    amf_intern_initialize();
+    packet = rtmp_packet_create();
+    if (packet == NULL) {
+        return 1;
+    }
+
+    result = 0;
+    printf("operation,chunk_size,profile,threads,stream_bytes,messages,"
+        "mb_per_s,msgs_per_s\n");
+    for (profile_index = 0;
+         profile_index < (int)(sizeof(bench_profiles) /
+                               sizeof(bench_profiles[0]));
+         ++profile_index) {
+        profile = &bench_profiles[profile_index];
+        for (chunk_size_index = 0;
+             chunk_size_index < (int)(sizeof(bench_chunk_sizes) /
+                                      sizeof(bench_chunk_sizes[0]));
+             ++chunk_size_index) {
+            chunk_size = bench_chunk_sizes[chunk_size_index];
+            if (!bench_prepare_stream(&stream, profile, chunk_size)) {
+                result = 1;
+                break;
+            }
+            /* the muxed stream is also the demux input */
+            if (!bench_mux(&stream, packet)) {
+                fprintf(stderr, "%s chunk %d: mux failed\n",
+                    profile->name, (int)chunk_size);
+                result = 1;
+            }
+            /* 1, 2, 4, ... and max_threads */
+            for (threads = 1; threads <= max_threads && result == 0;
+                 threads = next_threads) {
+                if (!bench_run(&stream, BENCH_DEMUX, "demux",
+                        profile->name, threads) ||
+                    !bench_run(&stream, BENCH_MUX, "mux",
+                        profile->name, threads)) {
+                    result = 1;
+                }
+                next_threads = threads * 2;
+                if (threads < max_threads && next_threads > max_threads) {
+                    next_threads = (int)max_threads;
+                }
+            }
+            bench_free_stream(&stream);
+        }
+    }
+
+    rtmp_packet_free(packet);
+    return result;
+}
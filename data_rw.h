@@ -1,55 +1,479 @@
-/*
-    librtmp
-    Copyright (C) 2009 ITOYANAGI Kazunori
-
-    This library is free software; you can redistribute it and/or
-    modify it under the terms of the GNU Library General Public
-    License as published by the Free Software Foundation; either
-    version 2 of the License, or (at your option) any later version.
-
-    This library is distributed in the hope that it will be useful,
-    but WITHOUT ANY WARRANTY; without even the implied warranty of
-    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-    Library General Public License for more details.
-
-    You should have received a copy of the GNU Library General Public
-    License along with this library; if not, write to the Free
-    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
-
-    ITOYANAGI Kazunori
-    kazunori@itoyanagi.name
-*/
-
-#ifndef _data_rw_H_
-#define _data_rw_H_
-
-
-/* Set up for C function definitions, even when using C++ */
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-
-extern int is_little_endian(void);
-extern int is_big_endian(void);
-
-extern int read_be16int(unsigned char *data);
-extern int read_le32int(unsigned char *data);
-extern int read_be32int(unsigned char *data);
-extern int read_be24int(unsigned char *data);
-extern double read_be64double(unsigned char *data);
-
-extern void write_be16int(unsigned char *data, int value);
-extern void write_be24int(unsigned char *data, int value);
-extern void write_le32int(unsigned char *data, int value);
-extern void write_be32int(unsigned char *data, int value);
-extern void write_be64double(unsigned char *data, double value);
-
-
-/* Ends C function definitions when using C++ */
-#ifdef __cplusplus
-}
-#endif
-
-
-#endif
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#ifndef _data_rw_H_
+#define _data_rw_H_
+
+#include <stddef.h>
+#include <string.h>
+
+
+/* Set up for C function definitions, even when using C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * Everything here is inline.  The byte order is decided at compile time;
+ * loads and stores go through memcpy so that unaligned access is fine and
+ * compiles to a single move plus a byte swap.
+ */
+
+#if defined(__cplusplus)
+#define DATA_RW_INLINE static inline
+#elif defined(__GNUC__)
+#define DATA_RW_INLINE static __inline__
+#elif defined(_MSC_VER)
+#define DATA_RW_INLINE static __inline
+#else
+#define DATA_RW_INLINE static
+#endif
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define DATA_RW_LITTLE_ENDIAN 1
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define DATA_RW_BIG_ENDIAN 1
+#endif
+#elif defined(__WIN32__) || defined(WIN32) || defined(__i386__) || \
+      defined(__x86_64__)
+#define DATA_RW_LITTLE_ENDIAN 1
+#endif
+
+#if defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+#define data_rw_bswap16(value) __builtin_bswap16(value)
+#define data_rw_bswap32(value) __builtin_bswap32(value)
+#define data_rw_bswap64(value) __builtin_bswap64(value)
+#else
+DATA_RW_INLINE unsigned short data_rw_bswap16(unsigned short value)
+{
+    return (unsigned short)((value >> 8) | (value << 8));
+}
+
+DATA_RW_INLINE unsigned int data_rw_bswap32(unsigned int value)
+{
+    return (value >> 24) | ((value >> 8) & 0xFF00) |
+        ((value << 8) & 0xFF0000) | (value << 24);
+}
+
+DATA_RW_INLINE unsigned long long data_rw_bswap64(unsigned long long value)
+{
+    return ((unsigned long long)data_rw_bswap32((unsigned int)value) << 32) |
+        data_rw_bswap32((unsigned int)(value >> 32));
+}
+#endif
+
+
+DATA_RW_INLINE int is_little_endian(void)
+{
+#ifdef DATA_RW_LITTLE_ENDIAN
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+DATA_RW_INLINE int is_big_endian(void)
+{
+    return !is_little_endian();
+}
+
+
+/* unchecked accessors; the caller has checked the size */
+
+DATA_RW_INLINE int read_be16int(const unsigned char *data)
+{
+#if defined(DATA_RW_LITTLE_ENDIAN) || defined(DATA_RW_BIG_ENDIAN)
+    unsigned short value;
+
+    memcpy(&value, data, 2);
+#ifdef DATA_RW_LITTLE_ENDIAN
+    value = data_rw_bswap16(value);
+#endif
+    return value;
+#else
+    return (data[0] << 8) | data[1];
+#endif
+}
+
+
+DATA_RW_INLINE int read_be24int(const unsigned char *data)
+{
+    return (data[0] << 16) | (data[1] << 8) | data[2];
+}
+
+
+DATA_RW_INLINE int read_be32int(const unsigned char *data)
+{
+#if defined(DATA_RW_LITTLE_ENDIAN) || defined(DATA_RW_BIG_ENDIAN)
+    unsigned int value;
+
+    memcpy(&value, data, 4);
+#ifdef DATA_RW_LITTLE_ENDIAN
+    value = data_rw_bswap32(value);
+#endif
+    return (int)value;
+#else
+    return (int)(((unsigned int)data[0] << 24) | (data[1] << 16) |
+        (data[2] << 8) | data[3]);
+#endif
+}
+
+
+DATA_RW_INLINE int read_le32int(const unsigned char *data)
+{
+#if defined(DATA_RW_LITTLE_ENDIAN) || defined(DATA_RW_BIG_ENDIAN)
+    unsigned int value;
+
+    memcpy(&value, data, 4);
+#ifdef DATA_RW_BIG_ENDIAN
+    value = data_rw_bswap32(value);
+#endif
+    return (int)value;
+#else
+    return (int)(((unsigned int)data[3] << 24) | (data[2] << 16) |
+        (data[1] << 8) | data[0]);
+#endif
+}
+
+
+DATA_RW_INLINE double read_be64double(const unsigned char *data)
+{
+    unsigned long long bits;
+    double value;
+
+#if defined(DATA_RW_LITTLE_ENDIAN) || defined(DATA_RW_BIG_ENDIAN)
+    memcpy(&bits, data, 8);
+#ifdef DATA_RW_LITTLE_ENDIAN
+    bits = data_rw_bswap64(bits);
+#endif
+#else
+    bits = ((unsigned long long)(unsigned int)read_be32int(data) << 32) |
+        (unsigned int)read_be32int(data + 4);
+#endif
+    memcpy(&value, &bits, 8);
+    return value;
+}
+
+
+DATA_RW_INLINE void write_be16int(unsigned char *data, int value)
+{
+    data[0] = (unsigned char)(value >> 8);
+    data[1] = (unsigned char)value;
+}
+
+
+DATA_RW_INLINE void write_be24int(unsigned char *data, int value)
+{
+    data[0] = (unsigned char)(value >> 16);
+    data[1] = (unsigned char)(value >> 8);
+    data[2] = (unsigned char)value;
+}
+
+
+DATA_RW_INLINE void write_be32int(unsigned char *data, int value)
+{
+#if defined(DATA_RW_LITTLE_ENDIAN) || defined(DATA_RW_BIG_ENDIAN)
+    unsigned int bits;
+
+    bits = (unsigned int)value;
+#ifdef DATA_RW_LITTLE_ENDIAN
+    bits = data_rw_bswap32(bits);
+#endif
+    memcpy(data, &bits, 4);
+#else
+    data[0] = (unsigned char)((unsigned int)value >> 24);
+    data[1] = (unsigned char)(value >> 16);
+    data[2] = (unsigned char)(value >> 8);
+    data[3] = (unsigned char)value;
+#endif
+}
+
+
+DATA_RW_INLINE void write_le32int(unsigned char *data, int value)
+{
+#if defined(DATA_RW_LITTLE_ENDIAN) || defined(DATA_RW_BIG_ENDIAN)
+    unsigned int bits;
+
+    bits = (unsigned int)value;
+#ifdef DATA_RW_BIG_ENDIAN
+    bits = data_rw_bswap32(bits);
+#endif
+    memcpy(data, &bits, 4);
+#else
+    data[0] = (unsigned char)value;
+    data[1] = (unsigned char)(value >> 8);
+    data[2] = (unsigned char)(value >> 16);
+    data[3] = (unsigned char)((unsigned int)value >> 24);
+#endif
+}
+
+
+DATA_RW_INLINE void write_be64double(unsigned char *data, double value)
+{
+    unsigned long long bits;
+
+    memcpy(&bits, &value, 8);
+#if defined(DATA_RW_LITTLE_ENDIAN) || defined(DATA_RW_BIG_ENDIAN)
+#ifdef DATA_RW_LITTLE_ENDIAN
+    bits = data_rw_bswap64(bits);
+#endif
+    memcpy(data, &bits, 8);
+#else
+    write_be32int(data, (int)(unsigned int)(bits >> 32));
+    write_be32int(data + 4, (int)(unsigned int)bits);
+#endif
+}
+
+
+/*
+ * Bounds checked cursors.  A read past the end returns 0 and marks the
+ * reader broken, so a run of reads needs only one check at the end.
+ * A writer with a NULL buffer only counts; one which runs out of room
+ * keeps counting without writing, see data_writer_overflowed().
+ */
+typedef struct data_reader_t data_reader_t;
+
+struct data_reader_t
+{
+    const unsigned char *data;
+    size_t size;
+    size_t position;
+    int broken;
+};
+
+typedef struct data_writer_t data_writer_t;
+
+struct data_writer_t
+{
+    unsigned char *buffer;
+    size_t size;
+    size_t position;
+};
+
+
+DATA_RW_INLINE void data_reader_initialize(
+    data_reader_t *reader, const unsigned char *data, size_t size)
+{
+    reader->data = data;
+    reader->size = size;
+    reader->position = 0;
+    reader->broken = 0;
+}
+
+
+DATA_RW_INLINE size_t data_reader_remaining(data_reader_t *reader)
+{
+    return reader->size - reader->position;
+}
+
+
+/* returns where length bytes start and skips them, or NULL */
+DATA_RW_INLINE const unsigned char *data_read_bytes(
+    data_reader_t *reader, size_t length)
+{
+    const unsigned char *data;
+
+    if (reader->size - reader->position < length) {
+        reader->broken = 1;
+        reader->position = reader->size;
+        return NULL;
+    }
+    data = reader->data + reader->position;
+    reader->position += length;
+    return data;
+}
+
+
+DATA_RW_INLINE int data_read_u8(data_reader_t *reader)
+{
+    const unsigned char *data;
+
+    data = data_read_bytes(reader, 1);
+    return data ? data[0] : 0;
+}
+
+
+DATA_RW_INLINE int data_read_be16(data_reader_t *reader)
+{
+    const unsigned char *data;
+
+    data = data_read_bytes(reader, 2);
+    return data ? read_be16int(data) : 0;
+}
+
+
+DATA_RW_INLINE int data_read_be24(data_reader_t *reader)
+{
+    const unsigned char *data;
+
+    data = data_read_bytes(reader, 3);
+    return data ? read_be24int(data) : 0;
+}
+
+
+DATA_RW_INLINE unsigned int data_read_be32(data_reader_t *reader)
+{
+    const unsigned char *data;
+
+    data = data_read_bytes(reader, 4);
+    return data ? (unsigned int)read_be32int(data) : 0;
+}
+
+
+DATA_RW_INLINE unsigned int data_read_le32(data_reader_t *reader)
+{
+    const unsigned char *data;
+
+    data = data_read_bytes(reader, 4);
+    return data ? (unsigned int)read_le32int(data) : 0;
+}
+
+
+DATA_RW_INLINE double data_read_be64double(data_reader_t *reader)
+{
+    const unsigned char *data;
+
+    data = data_read_bytes(reader, 8);
+    return data ? read_be64double(data) : 0.0;
+}
+
+
+DATA_RW_INLINE void data_writer_initialize(
+    data_writer_t *writer, unsigned char *buffer, size_t size)
+{
+    writer->buffer = buffer;
+    writer->size = size;
+    writer->position = 0;
+}
+
+
+DATA_RW_INLINE int data_writer_overflowed(data_writer_t *writer)
+{
+    return writer->buffer && writer->position > writer->size;
+}
+
+
+/* returns where length bytes go and skips them, or NULL if counting only */
+DATA_RW_INLINE unsigned char *data_write_reserve(
+    data_writer_t *writer, size_t length)
+{
+    unsigned char *data;
+
+    data = NULL;
+    if (writer->buffer && writer->position <= writer->size &&
+        writer->size - writer->position >= length) {
+        data = writer->buffer + writer->position;
+    }
+    writer->position += length;
+    return data;
+}
+
+
+DATA_RW_INLINE void data_write_bytes(
+    data_writer_t *writer, const unsigned char *bytes, size_t length)
+{
+    unsigned char *data;
+
+    data = data_write_reserve(writer, length);
+    if (data) {
+        memmove(data, bytes, length);
+    }
+}
+
+
+DATA_RW_INLINE void data_write_u8(data_writer_t *writer, int value)
+{
+    unsigned char *data;
+
+    data = data_write_reserve(writer, 1);
+    if (data) {
+        data[0] = (unsigned char)value;
+    }
+}
+
+
+DATA_RW_INLINE void data_write_be16(data_writer_t *writer, int value)
+{
+    unsigned char *data;
+
+    data = data_write_reserve(writer, 2);
+    if (data) {
+        write_be16int(data, value);
+    }
+}
+
+
+DATA_RW_INLINE void data_write_be24(data_writer_t *writer, int value)
+{
+    unsigned char *data;
+
+    data = data_write_reserve(writer, 3);
+    if (data) {
+        write_be24int(data, value);
+    }
+}
+
+
+DATA_RW_INLINE void data_write_be32(data_writer_t *writer, int value)
+{
+    unsigned char *data;
+
+    data = data_write_reserve(writer, 4);
+    if (data) {
+        write_be32int(data, value);
+    }
+}
+
+
+DATA_RW_INLINE void data_write_le32(data_writer_t *writer, int value)
+{
+    unsigned char *data;
+
+    data = data_write_reserve(writer, 4);
+    if (data) {
+        write_le32int(data, value);
+    }
+}
+
+
+DATA_RW_INLINE void data_write_be64double(data_writer_t *writer, double value)
+{
+    unsigned char *data;
+
+    data = data_write_reserve(writer, 8);
+    if (data) {
+        write_be64double(data, value);
+    }
+}
+
+
+/* Ends C function definitions when using C++ */
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
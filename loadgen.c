@@ -0,0 +1,669 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "rtmp.h"
+#include "rtmp_packet.h"
+
+
+/*
+ * RTMP load generator.
+ *
+ * Opens the given number of rtmp_client_t connections from one epoll
+ * loop, each running handshake, connect, createStream and play, then keeps
+ * them playing for the given duration.  With -s an rtmp_server_t is run on
+ * a thread of this process and the url defaults to it.  With -p the
+ * commands are pipelined by rtmp_client_play_url instead of waiting for
+ * the connect result.
+ *
+ * usage: loadgen [-n connections] [-r connects_per_tick] [-t seconds]
+ *                [-s port] [-c] [-p] [url [stream]]
+ *
+ * Prints CSV.  With -c one line per connection:
+ *   id,state,tcp_connect_ms,ttfb_ms,connect_ms,play_ms,messages,media_bytes,jitter_ms,kbps
+ * followed by the summary, one line per metric:
+ *   metric,count,min,p50,p90,p99,max
+ * Times are from the start of each connection.  ttfb is the first byte
+ * from the server, jitter is the RFC 3550 interarrival jitter of audio and
+ * video messages against their timestamps.  dispatch_ms and send_ms are
+ * the latency histograms of the clients (see rtmp_stats_t), without min.
+ */
+
+#define LOADGEN_DEFAULT_CONNECTIONS 100
+#define LOADGEN_DEFAULT_RATE 100 /* connections opened per tick */
+#define LOADGEN_DEFAULT_DURATION 10 /* seconds, after the last connection */
+#define LOADGEN_DEFAULT_STREAM "test"
+#define LOADGEN_TICK_MS 10
+#define LOADGEN_WINDOW_ACK_SIZE 2500000 /* bytes, with -p */
+#define LOADGEN_BUFFER_LENGTH 1000 /* ms, with -p */
+#define LOADGEN_MAX_EVENTS 256
+#define LOADGEN_SERVER_WAIT 0.1 /* seconds, how soon the server sees stop */
+
+
+typedef enum loadgen_state loadgen_state_t;
+
+enum loadgen_state
+{
+    LOADGEN_STATE_HANDSHAKE,
+    LOADGEN_STATE_CONNECTING,
+    LOADGEN_STATE_PLAYING,
+    LOADGEN_STATE_FAILED,
+    LOADGEN_STATE_CLOSED,
+};
+
+typedef struct loadgen_connection_t loadgen_connection_t;
+
+/* times are in ns from started, 0 if it has not happened */
+struct loadgen_connection_t
+{
+    int id;
+    rtmp_client_t *rc;
+    loadgen_state_t state;
+    int sock; /* registered with epoll, or -1 */
+    int events;
+    double started;
+    double tcp_connected;
+    double first_byte;
+    double connect_success;
+    double play_start;
+    double first_media;
+    double last_media;
+    long last_timer;
+    unsigned long messages;
+    double media_bytes;
+    double jitter;
+};
+
+typedef struct loadgen_server_t loadgen_server_t;
+
+struct loadgen_server_t
+{
+    rtmp_server_t *rs;
+    pthread_t thread;
+    volatile int stop;
+};
+
+
+static const char *loadgen_state_names[] = {
+    "handshake", "connecting", "playing", "failed", "closed"
+};
+
+static const char *loadgen_stream = LOADGEN_DEFAULT_STREAM;
+static int loadgen_pipelined = 0;
+
+/* latencies inside the clients, merged as they are closed */
+static rtmp_histogram_t loadgen_dispatch_latency;
+static rtmp_histogram_t loadgen_send_latency;
+
+
+static double loadgen_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000.0 + now.tv_nsec;
+}
+
+
+static void *loadgen_server_main(void *argument)
+{
+    loadgen_server_t *server;
+
+    server = (loadgen_server_t*)argument;
+    while (!server->stop) {
+        rtmp_server_wait_message(server->rs, LOADGEN_SERVER_WAIT);
+    }
+    return NULL;
+}
+
+
+static void loadgen_on_status(
+    rtmp_client_t *rc, double transaction_id,
+    struct rtmp_packet_inner_amf_t *arguments, void *data)
+{
+    loadgen_connection_t *connection;
+    const char *code;
+    const char *level;
+
+    (void)rc;
+    (void)transaction_id;
+    connection = (loadgen_connection_t*)data;
+
+    rtmp_packet_retrieve_status_info_of_amf(arguments, &code, &level);
+    if (code == NULL || level == NULL) {
+        return;
+    }
+    if (strcmp(code, "NetStream.Play.Start") == 0) {
+        connection->play_start = loadgen_now_ns() - connection->started;
+        connection->state = LOADGEN_STATE_PLAYING;
+    } else if (strcmp(level, "error") == 0) {
+        connection->state = LOADGEN_STATE_FAILED;
+    }
+}
+
+
+static void loadgen_on_media(
+    rtmp_client_t *rc, struct rtmp_packet_t *packet, void *data)
+{
+    loadgen_connection_t *connection;
+    double now;
+    double transit_difference;
+
+    (void)rc;
+    connection = (loadgen_connection_t*)data;
+    now = loadgen_now_ns() - connection->started;
+    if (connection->messages == 0) {
+        connection->first_media = now;
+    } else {
+        /* arrival gap against timestamp gap, in ns */
+        transit_difference =
+            (now - connection->last_media) -
+            (packet->timer - connection->last_timer) * 1000000.0;
+        if (transit_difference < 0) {
+            transit_difference = -transit_difference;
+        }
+        connection->jitter +=
+            (transit_difference - connection->jitter) / 16.0;
+    }
+    connection->last_media = now;
+    connection->last_timer = packet->timer;
+    connection->messages++;
+    connection->media_bytes += packet->body_data_length;
+}
+
+
+static void loadgen_on_event(
+    rtmp_client_t *rc, const rtmp_event_t *event, void *data)
+{
+    loadgen_connection_t *connection;
+
+    connection = (loadgen_connection_t*)data;
+    if (event->id == RTMP_EVENT_CONNECT_SUCCESS) {
+        connection->connect_success = loadgen_now_ns() - connection->started;
+        connection->state = LOADGEN_STATE_CONNECTING;
+        if (!loadgen_pipelined) {
+            rtmp_client_create_stream(rc);
+            rtmp_client_play(rc, loadgen_stream);
+        }
+    } else if (event->level_id == RTMP_EVENT_LEVEL_ERROR) {
+        connection->state = LOADGEN_STATE_FAILED;
+    } else if (event->id == RTMP_EVENT_CONNECT_CLOSED &&
+               connection->state != LOADGEN_STATE_FAILED) {
+        connection->state = LOADGEN_STATE_CLOSED;
+    }
+}
+
+
+static int loadgen_update_interest(
+    int epoll_fd, loadgen_connection_t *connection)
+{
+    struct epoll_event event;
+    int events;
+
+    /* a socket closed for the next address left the set with it */
+    if (connection->rc->conn_sock != connection->sock) {
+        connection->sock = connection->rc->conn_sock;
+        connection->events = 0;
+    }
+    if (connection->sock == -1) {
+        return 1;
+    }
+    events = EPOLLIN;
+    if (connection->rc->will_send_size > 0 ||
+        connection->rc->connect_state != RTMP_CLIENT_CONNECTED) {
+        events |= EPOLLOUT;
+    }
+    if (events == connection->events) {
+        return 1;
+    }
+    memset(&event, 0x00, sizeof(event));
+    event.events = events;
+    event.data.ptr = connection;
+    if (epoll_ctl(
+            epoll_fd,
+            connection->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+            connection->sock, &event) == -1) {
+        return 0;
+    }
+    connection->events = events;
+    return 1;
+}
+
+
+static void loadgen_close(int epoll_fd, loadgen_connection_t *connection)
+{
+    if (connection->rc == NULL) {
+        return;
+    }
+    if (connection->sock != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->sock, NULL);
+    }
+    rtmp_histogram_merge(
+        &loadgen_dispatch_latency, &connection->rc->stats.dispatch_latency);
+    rtmp_histogram_merge(
+        &loadgen_send_latency, &connection->rc->stats.send_latency);
+    rtmp_client_free(connection->rc);
+    connection->rc = NULL;
+}
+
+
+/*
+ * Runs the client until it stops consuming what it has received.  Returns
+ * RTMP_ERROR_DISCONNECTED once the connection is over.
+ */
+static rtmp_result_t loadgen_pump(loadgen_connection_t *connection)
+{
+    rtmp_client_t *rc;
+    size_t received_size;
+    rtmp_result_t result;
+
+    rc = connection->rc;
+    do {
+        received_size = rc->received_size;
+        result = rtmp_client_process_message(rc);
+        if (connection->tcp_connected == 0 &&
+            rc->connect_state == RTMP_CLIENT_CONNECTED) {
+            connection->tcp_connected =
+                loadgen_now_ns() - connection->started;
+        }
+    } while (result == RTMP_SUCCESS &&
+             rc->received_size > 0 && rc->received_size != received_size);
+    return result;
+}
+
+
+static int loadgen_open(
+    int epoll_fd, loadgen_connection_t *connection, const char *url)
+{
+    connection->started = loadgen_now_ns();
+    connection->sock = -1;
+    connection->events = 0;
+    if (loadgen_pipelined) {
+        connection->rc = rtmp_client_play_url(
+            url, loadgen_stream,
+            LOADGEN_WINDOW_ACK_SIZE, LOADGEN_BUFFER_LENGTH);
+    } else {
+        connection->rc = rtmp_client_create(url);
+    }
+    if (connection->rc == NULL) {
+        connection->state = LOADGEN_STATE_FAILED;
+        return 0;
+    }
+    connection->state = LOADGEN_STATE_HANDSHAKE;
+    rtmp_client_on_media(connection->rc, loadgen_on_media, connection);
+    rtmp_client_on_event(connection->rc, loadgen_on_event, connection);
+    if (rtmp_client_on_command(
+            connection->rc, "onStatus",
+            loadgen_on_status, connection) != RTMP_SUCCESS) {
+        connection->state = LOADGEN_STATE_FAILED;
+        loadgen_close(epoll_fd, connection);
+        return 0;
+    }
+
+    /* connects, or queues the first half of the handshake */
+    if (loadgen_pump(connection) != RTMP_SUCCESS ||
+        !loadgen_update_interest(epoll_fd, connection)) {
+        connection->state = LOADGEN_STATE_FAILED;
+        loadgen_close(epoll_fd, connection);
+        return 0;
+    }
+    return 1;
+}
+
+
+static void loadgen_service(
+    int epoll_fd, loadgen_connection_t *connection, int events)
+{
+    if (connection->rc == NULL) {
+        return;
+    }
+    if (events & EPOLLIN) {
+        if (connection->first_byte == 0) {
+            connection->first_byte = loadgen_now_ns() - connection->started;
+        }
+    } else if (events & (EPOLLERR | EPOLLHUP) &&
+               connection->rc->connect_state == RTMP_CLIENT_CONNECTED) {
+        /* a failed connect is for the client to handle */
+        connection->state = LOADGEN_STATE_FAILED;
+        loadgen_close(epoll_fd, connection);
+        return;
+    }
+
+    if (loadgen_pump(connection) != RTMP_SUCCESS) {
+        loadgen_close(epoll_fd, connection);
+        return;
+    }
+    if (connection->state == LOADGEN_STATE_FAILED ||
+        !loadgen_update_interest(epoll_fd, connection)) {
+        connection->state = LOADGEN_STATE_FAILED;
+        loadgen_close(epoll_fd, connection);
+    }
+}
+
+
+static double loadgen_get_kbps(loadgen_connection_t *connection)
+{
+    if (connection->messages < 2 ||
+        connection->last_media <= connection->first_media) {
+        return 0;
+    }
+    return connection->media_bytes * 8.0 * 1000000.0 /
+        (connection->last_media - connection->first_media);
+}
+
+
+static int loadgen_compare_double(const void *a, const void *b)
+{
+    double x;
+    double y;
+
+    x = *(const double*)a;
+    y = *(const double*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+/* values are sorted in place */
+static void loadgen_print_metric(
+    const char *name, double *values, int values_num)
+{
+    if (values_num == 0) {
+        printf("%s,0,,,,,\n", name);
+        return;
+    }
+    qsort(values, values_num, sizeof(double), loadgen_compare_double);
+    printf("%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+        name, values_num,
+        values[0],
+        values[(values_num - 1) * 50 / 100],
+        values[(values_num - 1) * 90 / 100],
+        values[(values_num - 1) * 99 / 100],
+        values[values_num - 1]);
+}
+
+
+static void loadgen_print_histogram(
+    const char *name, rtmp_histogram_t *histogram)
+{
+    if (histogram->count == 0) {
+        printf("%s,0,,,,,\n", name);
+        return;
+    }
+    printf("%s,%llu,,%.3f,%.3f,%.3f,%.3f\n",
+        name, histogram->count,
+        rtmp_histogram_get_percentile(histogram, 50) * 1000.0,
+        rtmp_histogram_get_percentile(histogram, 90) * 1000.0,
+        rtmp_histogram_get_percentile(histogram, 99) * 1000.0,
+        histogram->max * 1000.0);
+}
+
+
+static void loadgen_print_summary(
+    loadgen_connection_t *connections, int connections_num)
+{
+    double *values;
+    int values_num;
+    int states[LOADGEN_STATE_CLOSED + 1];
+    int metric;
+    int i;
+    static const char *metric_names[] = {
+        "tcp_connect_ms", "ttfb_ms", "connect_ms", "play_ms",
+        "jitter_ms", "kbps"
+    };
+
+    values = (double*)malloc(sizeof(double) * (connections_num + 1));
+    if (values == NULL) {
+        return;
+    }
+    memset(states, 0x00, sizeof(states));
+    for (i = 0; i < connections_num; ++i) {
+        states[connections[i].state]++;
+    }
+    printf("metric,count,min,p50,p90,p99,max\n");
+    for (i = 0; i <= LOADGEN_STATE_CLOSED; ++i) {
+        printf("%s,%d,,,,,\n", loadgen_state_names[i], states[i]);
+    }
+    for (metric = 0; metric < 6; ++metric) {
+        values_num = 0;
+        for (i = 0; i < connections_num; ++i) {
+            switch (metric) {
+            case 0:
+                if (connections[i].tcp_connected > 0) {
+                    values[values_num++] =
+                        connections[i].tcp_connected / 1000000.0;
+                }
+                break;
+            case 1:
+                if (connections[i].first_byte > 0) {
+                    values[values_num++] =
+                        connections[i].first_byte / 1000000.0;
+                }
+                break;
+            case 2:
+                if (connections[i].connect_success > 0) {
+                    values[values_num++] =
+                        connections[i].connect_success / 1000000.0;
+                }
+                break;
+            case 3:
+                if (connections[i].play_start > 0) {
+                    values[values_num++] =
+                        connections[i].play_start / 1000000.0;
+                }
+                break;
+            case 4:
+                if (connections[i].messages > 1) {
+                    values[values_num++] = connections[i].jitter / 1000000.0;
+                }
+                break;
+            case 5:
+                if (connections[i].messages > 1) {
+                    values[values_num++] = loadgen_get_kbps(&connections[i]);
+                }
+                break;
+            }
+        }
+        loadgen_print_metric(metric_names[metric], values, values_num);
+    }
+    loadgen_print_histogram("dispatch_ms", &loadgen_dispatch_latency);
+    loadgen_print_histogram("send_ms", &loadgen_send_latency);
+    free(values);
+}
+
+
+static void loadgen_print_connections(
+    loadgen_connection_t *connections, int connections_num)
+{
+    loadgen_connection_t *connection;
+    int i;
+
+    printf("id,state,tcp_connect_ms,ttfb_ms,connect_ms,play_ms,"
+        "messages,media_bytes,jitter_ms,kbps\n");
+    for (i = 0; i < connections_num; ++i) {
+        connection = &connections[i];
+        printf("%d,%s,%.3f,%.3f,%.3f,%.3f,%lu,%.0f,%.3f,%.1f\n",
+            connection->id, loadgen_state_names[connection->state],
+            connection->tcp_connected / 1000000.0,
+            connection->first_byte / 1000000.0,
+            connection->connect_success / 1000000.0,
+            connection->play_start / 1000000.0,
+            connection->messages, connection->media_bytes,
+            connection->jitter / 1000000.0,
+            loadgen_get_kbps(connection));
+    }
+}
+
+
+/* every connection needs a descriptor, two with the server in process */
+static void loadgen_raise_file_limit(int descriptors)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        return;
+    }
+    if (limit.rlim_cur >= (rlim_t)descriptors) {
+        return;
+    }
+    limit.rlim_cur = (rlim_t)descriptors;
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_cur > limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        fprintf(stderr, "open file limit is %lu\n",
+            (unsigned long)limit.rlim_max);
+    }
+    setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+
+static void loadgen_usage(void)
+{
+    fprintf(stderr,
+        "usage: loadgen [-n connections] [-r connects_per_tick] "
+        "[-t seconds] [-s port] [-c] [-p] [url [stream]]\n");
+}
+
+
+int main(int argc, char **argv)
+{
+    loadgen_connection_t *connections;
+    loadgen_server_t server;
+    struct epoll_event events[LOADGEN_MAX_EVENTS];
+    char default_url[64];
+    const char *url;
+    int connections_num;
+    int rate;
+    int duration;
+    int server_port;
+    int print_connections;
+    int epoll_fd;
+    int opened;
+    int events_num;
+    int option;
+    int i;
+    double all_opened;
+
+    connections_num = LOADGEN_DEFAULT_CONNECTIONS;
+    rate = LOADGEN_DEFAULT_RATE;
+    duration = LOADGEN_DEFAULT_DURATION;
+    server_port = 0;
+    print_connections = 0;
+    while ((option = getopt(argc, argv, "n:r:t:s:cp")) != -1) {
+        switch (option) {
+        case 'n':
+            connections_num = atoi(optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 't':
+            duration = atoi(optarg);
+            break;
+        case 's':
+            server_port = atoi(optarg);
+            break;
+        case 'c':
+            print_connections = 1;
+            break;
+        case 'p':
+            loadgen_pipelined = 1;
+            break;
+        default:
+            loadgen_usage();
+            return 1;
+        }
+    }
+    url = NULL;
+    if (optind < argc) {
+        url = argv[optind++];
+    }
+    if (optind < argc) {
+        loadgen_stream = argv[optind++];
+    }
+    if (server_port > 0 && url == NULL) {
+        sprintf(default_url, "rtmp://127.0.0.1:%d/live/", server_port);
+        url = default_url;
+    }
+    if (url == NULL || connections_num < 1 || rate < 1 || duration < 0) {
+        loadgen_usage();
+        return 1;
+    }
+
+    loadgen_raise_file_limit(
+        connections_num * (server_port > 0 ? 2 : 1) + 64);
+
+    server.rs = NULL;
+    server.stop = 0;
+    if (server_port > 0) {
+        server.rs = rtmp_server_create((unsigned short)server_port);
+        if (server.rs == NULL) {
+            fprintf(stderr, "could not listen on port %d\n", server_port);
+            return 1;
+        }
+        if (pthread_create(
+                &server.thread, NULL, loadgen_server_main, &server)) {
+            rtmp_server_free(server.rs);
+            return 1;
+        }
+    }
+
+    connections = (loadgen_connection_t*)calloc(
+        connections_num, sizeof(loadgen_connection_t));
+    epoll_fd = epoll_create(connections_num);
+    if (connections == NULL || epoll_fd == -1) {
+        return 1;
+    }
+
+    opened = 0;
+    all_opened = 0;
+    while (1) {
+        for (i = 0; i < rate && opened < connections_num; ++i) {
+            connections[opened].id = opened;
+            loadgen_open(epoll_fd, &connections[opened], url);
+            opened++;
+        }
+        if (opened == connections_num && all_opened == 0) {
+            all_opened = loadgen_now_ns();
+        }
+        if (all_opened > 0 &&
+            loadgen_now_ns() - all_opened >= duration * 1000000000.0) {
+            break;
+        }
+
+        events_num = epoll_wait(
+            epoll_fd, events, LOADGEN_MAX_EVENTS, LOADGEN_TICK_MS);
+        for (i = 0; i < events_num; ++i) {
+            loadgen_service(
+                epoll_fd,
+                (loadgen_connection_t*)events[i].data.ptr,
+                events[i].events);
+        }
+        /* a host name being looked up has no socket to wait on yet */
+        for (i = 0; i < opened; ++i) {
+            if (connections[i].rc != NULL && connections[i].sock == -1) {
+                loadgen_service(epoll_fd, &connections[i], 0);
+            }
+        }
+    }
+
+    if (print_connections) {
+        loadgen_print_connections(connections, connections_num);
+    }
+    for (i = 0; i < connections_num; ++i) {
+        loadgen_close(epoll_fd, &connections[i]);
+    }
+    loadgen_print_summary(connections, connections_num);
+    close(epoll_fd);
+    free(connections);
+    if (server.rs) {
+        server.stop = 1;
+        pthread_join(server.thread, NULL);
+        rtmp_server_free(server.rs);
+    }
+    return 0;
+}
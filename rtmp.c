@@ -21,12 +21,18 @@
 */
 
 
+#ifdef linux
+#define _GNU_SOURCE /* accept4 */
+#endif
+
 #ifdef MACOS_OPENTRANSPORT
 #include <OpenTransport.h>
 #include <OpenTptInternet.h>
 #else
 #if defined(__WIN32__) || defined(WIN32)
 #define __USE_W32_SOCKETS
+#include <winsock2.h>
+#include <ws2tcpip.h> /* getaddrinfo */
 #include <windows.h>
 #ifdef __CYGWIN__
 #include <netinet/in.h>
@@ -43,11 +49,10 @@
 #ifndef __BEOS__
 #include <arpa/inet.h>
 #endif
-#ifdef linux /* FIXME: what other platforms have this? */
 #include <netinet/tcp.h>
-#endif
 #include <netdb.h>
 #include <sys/socket.h>
+#include <poll.h>
 #endif /* WIN32 */
 #endif /* Open Transport */
 
@@ -61,21 +66,122 @@
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
 
 
 #include "rtmp.h"
 #include "rtmp_packet.h"
 #include "amf_packet.h"
+#include "amf_intern.h"
+#include "rtmp_command.h"
+#include "rtmp_trace.h"
+#include "rtmp_allocator.h"
+#include "rtmp_pool.h"
+#include "rtmp_resolver.h"
 #include "data_rw.h"
 
 
+#ifdef __USE_W32_SOCKETS
+typedef WSAPOLLFD rtmp_pollfd_t;
+#define rtmp_poll WSAPoll
+#else
+typedef struct pollfd rtmp_pollfd_t;
+#define rtmp_poll poll
+#endif
+
+/* a send to a closed peer fails with EPIPE rather than raising SIGPIPE */
+#ifdef MSG_NOSIGNAL
+#define RTMP_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define RTMP_SEND_FLAGS 0
+#endif
+
+/*
+ * For the index of an event ring the other thread moves: loading it with
+ * acquire orders the slot accesses after it, and storing one's own with
+ * release orders the slot accesses before it.  See rtmp_event_ring_t.
+ */
+#ifdef __GNUC__
+#define RTMP_LOAD_ACQUIRE(index) __atomic_load_n(&(index), __ATOMIC_ACQUIRE)
+#define RTMP_STORE_RELEASE(index, value) \
+    __atomic_store_n(&(index), (value), __ATOMIC_RELEASE)
+#elif defined(_MSC_VER)
+#define RTMP_LOAD_ACQUIRE(index) \
+    ((unsigned int)InterlockedOr((volatile LONG*)&(index), 0))
+#define RTMP_STORE_RELEASE(index, value) \
+    InterlockedExchange((volatile LONG*)&(index), (LONG)(value))
+#else
+#define RTMP_LOAD_ACQUIRE(index) (index)
+#define RTMP_STORE_RELEASE(index, value) ((index) = (value))
+#endif
+
+/* seconds, the longest rtmp_server_wait_message polls at once */
+#define RTMP_SERVER_WAIT_MAX 60.0
+
+/* interned strings of the known event codes, by rtmp_event_code_t */
+static const amf_intern_id_t rtmp_event_code_interns[RTMP_EVENT_CODE_NUM] = {
+    AMF_INTERN_EMPTY, /* RTMP_EVENT_UNKNOWN, never matched */
+#define RTMP_EVENT_CODE_ENTRY(id) AMF_INTERN_##id,
+    RTMP_EVENT_CODE_LIST
+#undef RTMP_EVENT_CODE_ENTRY
+};
+
+
+static int rtmp_initialized = 0;
+
+
+static void rtmp_initialize(void);
+static int rtmp_socket_is_ready(int sock, int for_writing);
+static int rtmp_socket_is_connecting(void);
+static int rtmp_socket_should_retry(void);
+static int rtmp_socket_out_of_descriptors(void);
+static int rtmp_socket_set_nonblocking(int sock);
+static rtmp_result_t rtmp_socket_set_buffer_sizes(
+    int sock, const rtmp_socket_options_t *options);
+static rtmp_result_t rtmp_socket_set_options(
+    int sock, const rtmp_socket_options_t *options);
+static void rtmp_socket_close(int sock);
+static void rtmp_socket_reset(int sock);
+static double rtmp_get_time(void);
+static void rtmp_stats_add(rtmp_stats_t *total, rtmp_stats_t *stats);
+static void rtmp_stats_count_message(
+    unsigned long long *messages, rtmp_datatype_t data_type);
+static void rtmp_send_marks_push(
+    rtmp_send_marks_t *marks, unsigned long long end);
+static void rtmp_send_marks_pop(
+    rtmp_send_marks_t *marks, unsigned long long bytes_out,
+    rtmp_histogram_t *histogram);
 static rtmp_server_client_t *get_new_server_client(rtmp_server_t *s);
+static rtmp_result_t rtmp_server_client_reserve_will_send_buffer(
+    rtmp_server_client_t *rsc, size_t size);
+static void rtmp_server_client_count_will_send_buffer(
+    rtmp_server_client_t *rsc, size_t size);
 static int rtmp_server_client_set_will_send_buffer(
     rtmp_server_client_t *rc, unsigned char *data, size_t size);
 static void rtmp_server_client_delete_received_buffer(
     rtmp_server_client_t *rsc, size_t size);
+static void rtmp_server_client_release_buffers(rtmp_server_client_t *rsc);
+static rtmp_pollfd_t *rtmp_server_poll(
+    rtmp_server_t *rs, int timeout, double now);
+static void rtmp_server_client_on_timeout(rtmp_timer_t *timer);
+static void rtmp_server_client_on_ping_timer(rtmp_timer_t *timer);
+static void rtmp_server_client_set_idle_timers(
+    rtmp_server_client_t *rsc, double now);
+static void rtmp_server_accept(rtmp_server_t *rs);
+static int rtmp_server_accept_socket(
+    rtmp_server_t *rs, struct sockaddr_in *client_sockaddr);
+static int rtmp_server_admit(
+    rtmp_server_t *rs, const struct sockaddr_in *client_sockaddr);
+static void rtmp_server_refill_accept_tokens(rtmp_server_t *rs, double now);
+static unsigned int rtmp_address_hash(unsigned long address);
+static rtmp_address_count_t *rtmp_address_counts_probe(
+    rtmp_address_count_t *entries, size_t capacity, unsigned long address);
+static rtmp_result_t rtmp_server_count_address(
+    rtmp_server_t *rs, unsigned long address);
+static void rtmp_server_uncount_address(
+    rtmp_server_t *rs, unsigned long address);
 static rtmp_result_t rtmp_server_client_send_and_recv(
-    rtmp_server_client_t *rsc);
+    rtmp_server_client_t *rsc, const rtmp_pollfd_t *poll_fd);
 static rtmp_result_t rtmp_server_client_send_packet(
     rtmp_server_client_t *rsc, rtmp_packet_t *packet);
 static void rtmp_server_client_process_packet(
@@ -89,6 +195,17 @@ static void rtmp_server_client_handshake_second(
     rtmp_server_client_t *server_client);
 static void rtmp_server_client_get_packet(
     rtmp_server_client_t *server_client);
+static void rtmp_server_client_process_received(rtmp_server_client_t *rsc);
+
+static void rtmp_server_client_on_connect(
+    rtmp_server_client_t *rsc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, void *data);
+static void rtmp_server_client_on_create_stream(
+    rtmp_server_client_t *rsc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, void *data);
+static void rtmp_server_client_on_play(
+    rtmp_server_client_t *rsc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, void *data);
 
 
 rtmp_server_t *rtmp_server_create(unsigned short port_number)
@@ -96,20 +213,77 @@ rtmp_server_t *rtmp_server_create(unsigned short port_number)
     rtmp_server_t *rtmp_server;
     int ret;
 
-    rtmp_server = (rtmp_server_t*)malloc(sizeof(rtmp_server_t));
+    rtmp_initialize();
+
+    /* aligned for its rtmp_stats_t */
+    rtmp_server = (rtmp_server_t*)rtmp_allocate_aligned(
+        RTMP_ALLOCATION_CONNECTION,
+        sizeof(rtmp_server_t), RTMP_CACHE_LINE_SIZE);
     if (rtmp_server == NULL) {
         return NULL;
     }
     rtmp_server->client_pool = NULL;
+    rtmp_server->client_pool_size = 0;
+    rtmp_server->client_pool_max = RTMP_CLIENT_POOL_SIZE;
     rtmp_server->client_working = NULL;
+    rtmp_server->poll_fds = NULL;
+    rtmp_server->poll_fds_capacity = 0;
+    rtmp_timer_wheel_initialize(&rtmp_server->timers, rtmp_get_time());
+    rtmp_server->handshake_timeout = RTMP_HANDSHAKE_TIMEOUT;
+    rtmp_server->idle_timeout = RTMP_IDLE_TIMEOUT;
+    rtmp_server->ping_interval = RTMP_PING_INTERVAL;
+    rtmp_server->send_queue_high_water = RTMP_SEND_QUEUE_HIGH_WATER;
+    rtmp_server->drop_audio = 0;
+    rtmp_socket_options_initialize(&rtmp_server->socket_options);
+    rtmp_admission_initialize(&rtmp_server->admission);
+    rtmp_server->client_working_num = 0;
+    rtmp_server->accept_tokens = 0;
+    rtmp_server->accept_time = 0;
+    rtmp_server->accept_resumed = 0;
+    rtmp_server->address_counts = NULL;
+    rtmp_server->address_counts_capacity = 0;
+    rtmp_server->address_counts_num = 0;
+    memset(&rtmp_server->closed_stats, 0x00, sizeof(rtmp_stats_t));
+    rtmp_server->conn_sock = -1;
     rtmp_server->stand_by_socket = -1;
 
+    rtmp_server->commands = rtmp_command_table_create();
+    if (rtmp_server->commands == NULL) {
+        rtmp_server_free(rtmp_server);
+        return NULL;
+    }
+    if (rtmp_server_on_command(
+            rtmp_server, "connect",
+            rtmp_server_client_on_connect, NULL) != RTMP_SUCCESS ||
+        rtmp_server_on_command(
+            rtmp_server, "createStream",
+            rtmp_server_client_on_create_stream, NULL) != RTMP_SUCCESS ||
+        rtmp_server_on_command(
+            rtmp_server, "play",
+            rtmp_server_client_on_play, NULL) != RTMP_SUCCESS) {
+        rtmp_server_free(rtmp_server);
+        return NULL;
+    }
+
+#ifdef SOCK_NONBLOCK
+    rtmp_server->conn_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (rtmp_server->conn_sock == -1) {
+        rtmp_server_free(rtmp_server);
+        return NULL;
+    }
+    rtmp_server->stand_by_socket = 1;
+#else
     rtmp_server->conn_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (rtmp_server->conn_sock == -1) {
         rtmp_server_free(rtmp_server);
         return NULL;
     }
     rtmp_server->stand_by_socket = 1;
+    if (!rtmp_socket_set_nonblocking(rtmp_server->conn_sock)) {
+        rtmp_server_free(rtmp_server);
+        return NULL;
+    }
+#endif
 
     rtmp_server->conn_sockaddr.sin_family = AF_INET;
     rtmp_server->conn_sockaddr.sin_addr.s_addr = INADDR_ANY;
@@ -123,7 +297,8 @@ rtmp_server_t *rtmp_server_create(unsigned short port_number)
         return NULL;
     }
 
-    ret = listen(rtmp_server->conn_sock, 10);
+    ret = listen(
+        rtmp_server->conn_sock, rtmp_server->socket_options.backlog);
     if (ret == -1) {
         rtmp_server_free(rtmp_server);
         return NULL;
@@ -133,57 +308,87 @@ rtmp_server_t *rtmp_server_create(unsigned short port_number)
 }
 
 
+/*
+ * Registers the handler called when a client invokes command.  The built in
+ * connect, createStream and play handlers can be replaced this way.
+ */
+rtmp_result_t rtmp_server_on_command(
+    rtmp_server_t *rs, const char *command,
+    rtmp_server_command_handler_t handler, void *data)
+{
+    rtmp_command_handler_t command_handler;
+
+    command_handler.server = handler;
+    return rtmp_command_table_register(
+        rs->commands, command, command_handler, data);
+}
+
+
+/*
+ * Every socket is nonblocking and the listening socket and the clients
+ * are polled together, once per call, so that a slow peer can not hold
+ * up the others.
+ */
 void rtmp_server_process_message(rtmp_server_t *rs)
+{
+    rtmp_server_wait_message(rs, 0);
+}
+
+
+/*
+ * rtmp_server_process_message, waiting for a socket to get ready up to
+ * timeout seconds, or with a negative timeout for as long as no timer is
+ * due.  The wait never goes past the next timer.
+ */
+void rtmp_server_wait_message(rtmp_server_t *rs, double timeout)
 {
     rtmp_server_client_t *rsc;
     rtmp_server_client_t *next;
-    int client_sock;
-#ifdef __MINGW32__
-    int addrlen;
-#else
-    socklen_t addrlen;
-#endif
-    fd_set fdset;
-    int ret;
-    struct timeval timeout;
+    rtmp_pollfd_t *poll_fds;
+    size_t i;
     rtmp_result_t result;
+    double now;
+    double expires;
+    int poll_timeout;
+
+    now = rtmp_get_time();
+    if (rtmp_timer_wheel_run(&rs->timers, now) > 0) {
+        /* the timers may have left clients to close, without waiting */
+        timeout = 0;
+    }
 
-    FD_ZERO(&fdset);
-    FD_SET((unsigned int)rs->conn_sock, &fdset);
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    ret = select(rs->conn_sock + 1, &fdset, NULL, NULL, &timeout);
-    if (ret == 1) {
-        rsc = get_new_server_client(rs);
-
-        addrlen = sizeof(rs->conn_sockaddr);
-        client_sock = accept(
-            rs->conn_sock,
-            (struct sockaddr*)&(rs->conn_sockaddr),
-            &addrlen);
-        if (client_sock == -1) {
-            return;
+    expires = rtmp_timer_wheel_next(&rs->timers);
+    if (rs->accept_resumed > now &&
+        (expires < 0 || rs->accept_resumed < expires)) {
+        expires = rs->accept_resumed;
+    }
+    if (expires >= 0 && (timeout < 0 || expires - now < timeout)) {
+        timeout = expires - now;
+        if (timeout < 0) {
+            timeout = 0;
         }
+    }
+    if (timeout < 0) {
+        poll_timeout = -1;
+    } else if (timeout > RTMP_SERVER_WAIT_MAX) {
+        poll_timeout = (int)(RTMP_SERVER_WAIT_MAX * 1000);
+    } else {
+        /* rounded up, so that the timer is due on waking */
+        poll_timeout = (int)(timeout * 1000 + 0.999);
+    }
 
-        rsc->conn_sock = client_sock;
-        rsc->prev = NULL;
-        rsc->next = rs->client_working;
-        if (rs->client_working == NULL) {
-            rs->client_working = rsc;
-        } else {
-            rs->client_working->prev = rsc;
-            rs->client_working = rsc;
-        }
+    poll_fds = rtmp_server_poll(rs, poll_timeout, now);
+    if (poll_fds == NULL) {
+        return;
     }
 
+    /* in the order rtmp_server_poll put them */
+    i = 1;
     rsc = rs->client_working;
     while (rsc) {
-        result = rtmp_server_client_send_and_recv(rsc);
-        rsc->process_message(rsc);
+        result = rtmp_server_client_send_and_recv(rsc, &poll_fds[i++]);
         if (result == RTMP_ERROR_DISCONNECTED) {
-#ifdef DEBUG
-        printf("client disconnected\n");
-#endif
+            RTMP_TRACE(RTMP_TRACE_DISCONNECTED, rsc->conn_sock);
             next = rsc->next;
             rtmp_server_client_free(rs, rsc);
             rsc = next;
@@ -191,213 +396,983 @@ void rtmp_server_process_message(rtmp_server_t *rs)
             rsc = rsc->next;
         }
     }
+
+    if (poll_fds[0].revents & POLLIN) {
+        rtmp_server_accept(rs);
+    }
 }
 
 
-static rtmp_result_t rtmp_server_client_send_and_recv(rtmp_server_client_t *rsc)
+/*
+ * Polls the listening socket, then the clients in list order.  A client is
+ * watched for writing only while it has data queued, and for reading only
+ * while it has room for it, so that a peer which is not reading costs
+ * nothing until its socket drains.
+ */
+static rtmp_pollfd_t *rtmp_server_poll(
+    rtmp_server_t *rs, int timeout, double now)
 {
-    fd_set fdset;
-    int ret;
-    struct timeval timeout;
-    int received_size;
-    int sent_size;
+    rtmp_server_client_t *rsc;
+    rtmp_pollfd_t *poll_fds;
+    size_t poll_fds_num;
+    size_t capacity;
 
-    FD_ZERO(&fdset);
-    FD_SET(rsc->conn_sock, &fdset);
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    ret = select(rsc->conn_sock + 1, &fdset, NULL, NULL, &timeout);
-    if (ret == 1) {
-        received_size = recv(
-            rsc->conn_sock,
-            (void*)(rsc->received_buffer + rsc->received_size),
-            RTMP_BUFFER_SIZE - rsc->received_size, 0);
-        if (received_size == -1) {
-            return RTMP_ERROR_DISCONNECTED;
+    poll_fds_num = 1;
+    for (rsc = rs->client_working; rsc; rsc = rsc->next) {
+        poll_fds_num++;
+    }
+    if (poll_fds_num > rs->poll_fds_capacity) {
+        capacity = rs->poll_fds_capacity > 0 ? rs->poll_fds_capacity : 64;
+        while (capacity < poll_fds_num) {
+            capacity *= 2;
         }
-#ifdef DEBUG
-        if (received_size > 0) {
-            printf("received: %d\n", received_size);
+        poll_fds = (rtmp_pollfd_t*)rtmp_reallocate(
+            RTMP_ALLOCATION_CONNECTION,
+            rs->poll_fds, capacity * sizeof(rtmp_pollfd_t));
+        if (poll_fds == NULL) {
+            return NULL;
         }
-#endif
-        rsc->received_size += received_size;
+        rs->poll_fds = poll_fds;
+        rs->poll_fds_capacity = capacity;
     }
 
-    rsc->process_message(rsc);
-
-    if (rsc->will_send_size > 0) {
-        FD_ZERO(&fdset);
-        FD_SET(rsc->conn_sock, &fdset);
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 0;
-        ret = select(rsc->conn_sock + 1, NULL, &fdset, NULL, &timeout);
-        if (ret == 1) {
-            sent_size = send(
-                rsc->conn_sock,
-                rsc->will_send_buffer,
-                rsc->will_send_size, 0);
-            if (sent_size == -1) {
-                return RTMP_ERROR_DISCONNECTED;
-            }
-#ifdef DEBUG
-            if (sent_size > 0) {
-                printf("sent: %d\n", sent_size);
-            }
-#endif
-            if (rsc->will_send_size - sent_size > 0) {
-                memmove(
-                    rsc->will_send_buffer,
-                    rsc->will_send_buffer + sent_size,
-                    rsc->will_send_size - sent_size);
-            }
-            rsc->will_send_size -= sent_size;
+    poll_fds = (rtmp_pollfd_t*)rs->poll_fds;
+    poll_fds[0].fd = rs->conn_sock;
+    poll_fds[0].events = rs->accept_resumed > now ? 0 : POLLIN;
+    poll_fds[0].revents = 0;
+    poll_fds_num = 1;
+    for (rsc = rs->client_working; rsc; rsc = rsc->next) {
+        poll_fds[poll_fds_num].fd = rsc->conn_sock;
+        poll_fds[poll_fds_num].events = 0;
+        if (!rsc->peer_closed && rsc->received_size < RTMP_BUFFER_SIZE) {
+            poll_fds[poll_fds_num].events |= POLLIN;
         }
+        if (rsc->will_send_size > 0) {
+            poll_fds[poll_fds_num].events |= POLLOUT;
+        }
+        poll_fds[poll_fds_num].revents = 0;
+        poll_fds_num++;
     }
 
-    return RTMP_SUCCESS;
+    if (rtmp_poll(poll_fds, poll_fds_num, timeout) < 0) {
+        return NULL;
+    }
+    return poll_fds;
 }
 
 
-static rtmp_server_client_t *get_new_server_client(rtmp_server_t *rs)
+/*
+ * Drains the backlog, up to accept_batch connections so that a storm of
+ * them can not starve the clients already served.  The connections over
+ * the admission limits are reset as soon as they are accepted.
+ */
+static void rtmp_server_accept(rtmp_server_t *rs)
 {
     rtmp_server_client_t *rsc;
+    struct sockaddr_in client_sockaddr;
+    int client_sock;
+    size_t accepted;
+    double now;
+
+    now = rtmp_get_time();
+    rtmp_server_refill_accept_tokens(rs, now);
+    for (accepted = 0;
+         rs->admission.accept_batch == 0 ||
+         accepted < rs->admission.accept_batch;
+         ++accepted) {
+        client_sock = rtmp_server_accept_socket(rs, &client_sockaddr);
+        if (client_sock == -1) {
+            /*
+             * The connection stays in the backlog and the listening
+             * socket ready, which would wake every poll until a
+             * descriptor is freed.
+             */
+            if (rtmp_socket_out_of_descriptors()) {
+                RTMP_TRACE(RTMP_TRACE_ACCEPT_PAUSED, rs->conn_sock);
+                rs->accept_resumed = now + RTMP_ACCEPT_PAUSE;
+            }
+            return;
+        }
+        if (!rtmp_server_admit(rs, &client_sockaddr)) {
+            RTMP_TRACE(RTMP_TRACE_SHED, client_sock);
+            rtmp_socket_reset(client_sock);
+            rs->closed_stats.connections_shed++;
+            continue;
+        }
 
-    if (rs->client_pool == NULL) {
-        rsc = (rtmp_server_client_t*)malloc(sizeof(rtmp_server_client_t));
+        rsc = get_new_server_client(rs);
         if (rsc == NULL) {
-            return NULL;
+            rtmp_server_uncount_address(
+                rs, client_sockaddr.sin_addr.s_addr);
+            rtmp_socket_close(client_sock);
+            return;
         }
-    } else {
-        rsc = rs->client_pool;
-        rs->client_pool = rsc->next;
-        if (rs->client_pool) {
-            rs->client_pool->prev = NULL;
+        rs->client_working_num++;
+        rsc->conn_sock = client_sock;
+        rsc->conn_sockaddr = client_sockaddr;
+        /* the client works with the system defaults if these fail */
+        rtmp_socket_set_options(client_sock, &rs->socket_options);
+        rsc->handshake_started = now;
+        if (rs->handshake_timeout > 0) {
+            rtmp_timer_set(
+                &rs->timers, &rsc->handshake_timer,
+                rsc->handshake_started + rs->handshake_timeout);
+        }
+        rsc->prev = NULL;
+        rsc->next = rs->client_working;
+        if (rs->client_working == NULL) {
+            rs->client_working = rsc;
+        } else {
+            rs->client_working->prev = rsc;
+            rs->client_working = rsc;
         }
     }
+}
 
 
-    rsc->received_size = 0;
-    rsc->will_send_size = 0;
-    rsc->amf_chunk_size = DEFAULT_AMF_CHUNK_SIZE;
-    rsc->process_message = rtmp_server_client_handshake_first;
+/* a nonblocking socket, or -1 once the backlog is empty */
+static int rtmp_server_accept_socket(
+    rtmp_server_t *rs, struct sockaddr_in *client_sockaddr)
+{
+    int client_sock;
+#ifdef __MINGW32__
+    int addrlen;
+#else
+    socklen_t addrlen;
+#endif
 
-    return rsc;
+    addrlen = sizeof(*client_sockaddr);
+#if defined(linux) && defined(SOCK_NONBLOCK)
+    client_sock = accept4(
+        rs->conn_sock,
+        (struct sockaddr*)client_sockaddr,
+        &addrlen, SOCK_NONBLOCK);
+#else
+    client_sock = accept(
+        rs->conn_sock,
+        (struct sockaddr*)client_sockaddr,
+        &addrlen);
+    if (client_sock != -1 && !rtmp_socket_set_nonblocking(client_sock)) {
+        rtmp_socket_close(client_sock);
+        return -1;
+    }
+#endif
+    return client_sock;
 }
 
 
-static int rtmp_server_client_set_will_send_buffer(
-    rtmp_server_client_t *rsc, unsigned char *data, size_t size)
+/*
+ * Checks a new connection against the admission limits, counting it
+ * against its address when it passes.  Only the connections which pass
+ * take from the rate.
+ */
+static int rtmp_server_admit(
+    rtmp_server_t *rs, const struct sockaddr_in *client_sockaddr)
 {
-    if (rsc->will_send_size + size > RTMP_BUFFER_SIZE) {
-        return RTMP_ERROR_BUFFER_OVERFLOW;
+    rtmp_address_count_t *entry;
+    unsigned long address;
+
+    if (rs->admission.max_connections > 0 &&
+        rs->client_working_num >= rs->admission.max_connections) {
+        return 0;
     }
-    memmove(
-        rsc->will_send_buffer + rsc->will_send_size,
-        data, size);
-    rsc->will_send_size += size;
-    return RTMP_SUCCESS;
+    address = client_sockaddr->sin_addr.s_addr;
+    if (rs->admission.max_connections_per_address > 0 &&
+        rs->address_counts != NULL) {
+        entry = rtmp_address_counts_probe(
+            rs->address_counts, rs->address_counts_capacity, address);
+        if (entry->count >= rs->admission.max_connections_per_address) {
+            return 0;
+        }
+    }
+    if (rs->admission.max_rate > 0) {
+        if (rs->accept_tokens < 1) {
+            return 0;
+        }
+        rs->accept_tokens -= 1;
+    }
+    return rtmp_server_count_address(rs, address) == RTMP_SUCCESS;
 }
 
 
-static void rtmp_server_client_delete_received_buffer(
-    rtmp_server_client_t *rsc, size_t size)
+static void rtmp_server_refill_accept_tokens(rtmp_server_t *rs, double now)
 {
-    if (size >= rsc->received_size) {
-        rsc->received_size = 0;
-    } else {
-        memmove(
-            rsc->received_buffer,
-            rsc->received_buffer + size,
-            rsc->received_size - size);
-        rsc->received_size -= size;
+    double burst;
+
+    if (rs->admission.max_rate > 0) {
+        burst = rs->admission.burst;
+        if (burst <= 0) {
+            burst = rs->admission.max_rate;
+        }
+        if (burst < 1) {
+            burst = 1;
+        }
+        rs->accept_tokens += (now - rs->accept_time) * rs->admission.max_rate;
+        if (rs->accept_tokens > burst) {
+            rs->accept_tokens = burst;
+        }
     }
+    rs->accept_time = now;
 }
 
 
-void rtmp_server_client_handshake_first(rtmp_server_client_t *rsc)
+static unsigned int rtmp_address_hash(unsigned long address)
 {
-    unsigned char magic[] = {0x03};
-    int i;
-#if defined(__WIN32__) || defined(WIN32)
-    DWORD now;
-#else
-    unsigned long now;
-#endif
+    unsigned int hash;
 
-    if (rsc->received_size >= (1 + RTMP_HANDSHAKE_SIZE)) {
-        rtmp_server_client_set_will_send_buffer(
-            rsc, magic, 1);
-#if defined(__WIN32__) || defined(WIN32)
-        now = timeGetTime();
-#else
-        now = time(NULL) * 1000;
-#endif
-        write_le32int(rsc->handshake, (int)now);
-        write_le32int(rsc->handshake + 4, 0);
-        for (i = 8; i < RTMP_HANDSHAKE_SIZE; ++i) {
-            rsc->handshake[i] = (unsigned char)(rand() % 256);
-        }
-        rtmp_server_client_set_will_send_buffer(
-            rsc,
-            rsc->handshake,
-            RTMP_HANDSHAKE_SIZE);
-        rtmp_server_client_set_will_send_buffer(
-            rsc,
-            rsc->received_buffer + 1,
-            RTMP_HANDSHAKE_SIZE);
-        rtmp_server_client_delete_received_buffer(
-            rsc,
-            1 + RTMP_HANDSHAKE_SIZE);
-#ifdef DEBUG
-        printf("handshake 1\n");
-#endif
-        rsc->process_message = rtmp_server_client_handshake_second;
-    }
+    hash = (unsigned int)address * 2654435761U;
+    return hash ^ (hash >> 16);
 }
 
 
-void rtmp_server_client_handshake_second(rtmp_server_client_t *rsc)
+/* returns the slot holding address, or the empty slot where it would go */
+static rtmp_address_count_t *rtmp_address_counts_probe(
+    rtmp_address_count_t *entries, size_t capacity, unsigned long address)
 {
-    unsigned char *client_signature;
-    unsigned char *response;
+    size_t slot;
 
-    if (rsc->received_size >= RTMP_HANDSHAKE_SIZE) {
-        client_signature = rsc->received_buffer;
-        response = rsc->received_buffer;
-#ifdef DEBUG
-        if (memcmp(rsc->handshake, response, RTMP_HANDSHAKE_SIZE) == 0) {
-            printf("handshake response OK!\n");
+    slot = rtmp_address_hash(address) & (capacity - 1);
+    while (entries[slot].count > 0 && entries[slot].address != address) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return &entries[slot];
+}
+
+
+static rtmp_result_t rtmp_server_count_address(
+    rtmp_server_t *rs, unsigned long address)
+{
+    rtmp_address_count_t *entries;
+    rtmp_address_count_t *entry;
+    size_t capacity;
+    size_t i;
+
+    if ((rs->address_counts_num + 1) * 2 > rs->address_counts_capacity) {
+        capacity = rs->address_counts_capacity ?
+            rs->address_counts_capacity * 2 : RTMP_CLIENT_POOL_SIZE;
+        entries = (rtmp_address_count_t*)rtmp_allocate_zeroed(
+            RTMP_ALLOCATION_CONNECTION,
+            capacity, sizeof(rtmp_address_count_t));
+        if (entries == NULL) {
+            return RTMP_ERROR_MEMORY_ALLOCATION;
         }
-#endif
-        rtmp_server_client_delete_received_buffer(
-            rsc, RTMP_HANDSHAKE_SIZE);
-#ifdef DEBUG
-        printf("handshake 2\n");
-#endif
-        rsc->data = rtmp_packet_create();
-        rsc->process_message = rtmp_server_client_get_packet;
-        rtmp_server_client_send_server_bandwidth(rsc);
-        rtmp_server_client_send_client_bandwidth(rsc);
-        rtmp_server_client_send_ping(rsc);
+        for (i = 0; i < rs->address_counts_capacity; ++i) {
+            if (rs->address_counts[i].count > 0) {
+                *rtmp_address_counts_probe(
+                    entries, capacity, rs->address_counts[i].address) =
+                    rs->address_counts[i];
+            }
+        }
+        rtmp_release(rs->address_counts);
+        rs->address_counts = entries;
+        rs->address_counts_capacity = capacity;
+    }
+
+    entry = rtmp_address_counts_probe(
+        rs->address_counts, rs->address_counts_capacity, address);
+    if (entry->count == 0) {
+        entry->address = address;
+        rs->address_counts_num++;
     }
+    entry->count++;
+    return RTMP_SUCCESS;
 }
 
 
-static void rtmp_server_client_process_packet(
-    rtmp_server_client_t *rsc, rtmp_packet_t *packet)
+/*
+ * The last connection of an address empties its slot, shifting back the
+ * entries of its probe sequence so that no tombstones pile up.
+ */
+static void rtmp_server_uncount_address(
+    rtmp_server_t *rs, unsigned long address)
 {
-    rtmp_packet_inner_amf_t *inner_amf;
-    amf_packet_t *amf;
-    char *command;
-    double number;
-    char *code;
-    char *level;
+    rtmp_address_count_t *entries;
+    size_t mask;
+    size_t hole;
+    size_t slot;
+    size_t home;
 
-    switch (packet->data_type) {
-    case RTMP_DATATYPE_CHUNK_SIZE:
-        break;
-    case RTMP_DATATYPE_BYTES_READ:
-        break;
+    if (rs->address_counts == NULL) {
+        return;
+    }
+    entries = rs->address_counts;
+    mask = rs->address_counts_capacity - 1;
+    hole = rtmp_address_counts_probe(
+        entries, rs->address_counts_capacity, address) - entries;
+    if (entries[hole].count == 0) {
+        return;
+    }
+    if (--entries[hole].count > 0) {
+        return;
+    }
+    rs->address_counts_num--;
+
+    slot = hole;
+    while (1) {
+        slot = (slot + 1) & mask;
+        if (entries[slot].count == 0) {
+            break;
+        }
+        home = rtmp_address_hash(entries[slot].address) & mask;
+        /* moves the entry unless its home lies in (hole, slot] */
+        if ((slot > hole && (home <= hole || home > slot)) ||
+            (slot < hole && home <= hole && home > slot)) {
+            entries[hole] = entries[slot];
+            hole = slot;
+        }
+    }
+    entries[hole].count = 0;
+}
+
+
+/*
+ * Zero timeout readiness check.  poll has no FD_SETSIZE limit, so it keeps
+ * working past 1024 open sockets.
+ */
+static int rtmp_socket_is_ready(int sock, int for_writing)
+{
+#ifdef __USE_W32_SOCKETS
+    fd_set fdset;
+    struct timeval timeout;
+
+    FD_ZERO(&fdset);
+    FD_SET((unsigned int)sock, &fdset);
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+    if (for_writing) {
+        return select(sock + 1, NULL, &fdset, NULL, &timeout) == 1;
+    }
+    return select(sock + 1, &fdset, NULL, NULL, &timeout) == 1;
+#else
+    struct pollfd pollfd;
+
+    pollfd.fd = sock;
+    pollfd.events = for_writing ? POLLOUT : POLLIN;
+    pollfd.revents = 0;
+    if (poll(&pollfd, 1, 0) != 1) {
+        return 0;
+    }
+    /* errors and hang ups are reported by the following recv or send */
+    return 1;
+#endif
+}
+
+
+/*
+ * Whether the recv or send that just failed may succeed later: nothing to
+ * read or no room to write yet, or interrupted by a signal.
+ */
+static int rtmp_socket_should_retry(void)
+{
+#ifdef __USE_W32_SOCKETS
+    int error;
+
+    error = WSAGetLastError();
+    return error == WSAEWOULDBLOCK || error == WSAEINTR;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+
+/* after accept failed as the process or the system has no socket left */
+static int rtmp_socket_out_of_descriptors(void)
+{
+#ifdef __USE_W32_SOCKETS
+    return WSAGetLastError() == WSAEMFILE;
+#else
+    return errno == EMFILE || errno == ENFILE;
+#endif
+}
+
+
+/* returns 0 on failure */
+static int rtmp_socket_set_nonblocking(int sock)
+{
+#ifdef __USE_W32_SOCKETS
+    u_long enabled;
+
+    enabled = 1;
+    return ioctlsocket(sock, FIONBIO, &enabled) == 0;
+#else
+    int flags;
+
+    flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1) {
+        return 0;
+    }
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK) != -1;
+#endif
+}
+
+
+/*
+ * Once per process: seeds the handshake bytes, which every client seeding
+ * from the same second would have made the same, and starts Winsock.
+ */
+static void rtmp_initialize(void)
+{
+#ifdef __USE_W32_SOCKETS
+    WSADATA data;
+#endif
+
+    if (rtmp_initialized) {
+        return;
+    }
+#ifdef __USE_W32_SOCKETS
+    WSAStartup(MAKEWORD(2, 2), &data);
+#endif
+    srand((unsigned)time(NULL));
+    amf_intern_initialize();
+    rtmp_initialized = 1;
+}
+
+
+/* a nonblocking connect which is under way */
+static int rtmp_socket_is_connecting(void)
+{
+#ifdef __USE_W32_SOCKETS
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+
+void rtmp_socket_options_initialize(rtmp_socket_options_t *options)
+{
+    options->no_delay = 1;
+    options->send_buffer_size = 0;
+    options->receive_buffer_size = 0;
+    options->not_sent_low_water = 0;
+    options->backlog = SOMAXCONN;
+}
+
+
+void rtmp_admission_initialize(rtmp_admission_t *admission)
+{
+    admission->accept_batch = RTMP_ACCEPT_BATCH;
+    admission->max_connections = 0;
+    admission->max_connections_per_address = 0;
+    admission->max_rate = 0;
+    admission->burst = 0;
+}
+
+
+/*
+ * Set before listening or connecting, as the window scale negotiated
+ * depends on them.  The accepted sockets inherit those of the listening
+ * socket.
+ */
+static rtmp_result_t rtmp_socket_set_buffer_sizes(
+    int sock, const rtmp_socket_options_t *options)
+{
+    if (options->send_buffer_size > 0 &&
+        setsockopt(
+            sock, SOL_SOCKET, SO_SNDBUF,
+            (const char*)&options->send_buffer_size,
+            sizeof(options->send_buffer_size)) == -1) {
+        return RTMP_ERROR_UNKNOWN;
+    }
+    if (options->receive_buffer_size > 0 &&
+        setsockopt(
+            sock, SOL_SOCKET, SO_RCVBUF,
+            (const char*)&options->receive_buffer_size,
+            sizeof(options->receive_buffer_size)) == -1) {
+        return RTMP_ERROR_UNKNOWN;
+    }
+    return RTMP_SUCCESS;
+}
+
+
+/* every option but the buffer sizes and the backlog */
+static rtmp_result_t rtmp_socket_set_options(
+    int sock, const rtmp_socket_options_t *options)
+{
+    int no_delay;
+
+    no_delay = options->no_delay ? 1 : 0;
+    if (setsockopt(
+            sock, IPPROTO_TCP, TCP_NODELAY,
+            (const char*)&no_delay, sizeof(no_delay)) == -1) {
+        return RTMP_ERROR_UNKNOWN;
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    if (options->not_sent_low_water > 0 &&
+        setsockopt(
+            sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+            (const char*)&options->not_sent_low_water,
+            sizeof(options->not_sent_low_water)) == -1) {
+        return RTMP_ERROR_UNKNOWN;
+    }
+#endif
+    return RTMP_SUCCESS;
+}
+
+
+static void rtmp_socket_close(int sock)
+{
+#ifdef __USE_W32_SOCKETS
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+}
+
+
+/*
+ * Closes with a reset rather than a FIN, so that a shed connection leaves
+ * no TIME_WAIT behind and its peer fails at once.
+ */
+static void rtmp_socket_reset(int sock)
+{
+    struct linger linger;
+
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    setsockopt(
+        sock, SOL_SOCKET, SO_LINGER, (const char*)&linger, sizeof(linger));
+    rtmp_socket_close(sock);
+}
+
+
+/* seconds from an arbitrary point, never going backwards */
+static double rtmp_get_time(void)
+{
+#if defined(__WIN32__) || defined(WIN32)
+    return timeGetTime() / 1000.0;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+#endif
+}
+
+
+static void rtmp_stats_add(rtmp_stats_t *total, rtmp_stats_t *stats)
+{
+    int i;
+
+    total->connections += stats->connections;
+    total->bytes_in += stats->bytes_in;
+    total->bytes_out += stats->bytes_out;
+    for (i = 0; i < RTMP_STATS_DATATYPE_NUM; ++i) {
+        total->messages_in[i] += stats->messages_in[i];
+        total->messages_out[i] += stats->messages_out[i];
+    }
+    for (i = 0; i < RTMP_STATS_RESULT_NUM; ++i) {
+        total->parse_errors[i] += stats->parse_errors[i];
+    }
+    total->partial_writes += stats->partial_writes;
+    total->video_dropped += stats->video_dropped;
+    total->audio_dropped += stats->audio_dropped;
+    total->connections_shed += stats->connections_shed;
+    if (stats->send_queue_high_water > total->send_queue_high_water) {
+        total->send_queue_high_water = stats->send_queue_high_water;
+    }
+    total->handshakes += stats->handshakes;
+    total->handshake_time += stats->handshake_time;
+    if (stats->handshake_time_max > total->handshake_time_max) {
+        total->handshake_time_max = stats->handshake_time_max;
+    }
+    rtmp_histogram_merge(&total->dispatch_latency, &stats->dispatch_latency);
+    rtmp_histogram_merge(&total->send_latency, &stats->send_latency);
+}
+
+
+static void rtmp_stats_count_message(
+    unsigned long long *messages, rtmp_datatype_t data_type)
+{
+    if ((unsigned int)data_type < RTMP_STATS_DATATYPE_NUM) {
+        messages[data_type]++;
+    } else {
+        messages[0]++;
+    }
+}
+
+
+/* end is the bytes_out value once the queued data is sent */
+static void rtmp_send_marks_push(
+    rtmp_send_marks_t *marks, unsigned long long end)
+{
+    int last;
+
+    if (marks->num == RTMP_SEND_MARK_NUM) {
+        return;
+    }
+    last = (marks->first + marks->num) % RTMP_SEND_MARK_NUM;
+    marks->ends[last] = end;
+    marks->times[last] = rtmp_get_time();
+    marks->num++;
+}
+
+
+static void rtmp_send_marks_pop(
+    rtmp_send_marks_t *marks, unsigned long long bytes_out,
+    rtmp_histogram_t *histogram)
+{
+    double now;
+
+    if (marks->num == 0 || marks->ends[marks->first] > bytes_out) {
+        return;
+    }
+    now = rtmp_get_time();
+    while (marks->num > 0 && marks->ends[marks->first] <= bytes_out) {
+        rtmp_histogram_record(histogram, now - marks->times[marks->first]);
+        marks->first = (marks->first + 1) % RTMP_SEND_MARK_NUM;
+        marks->num--;
+    }
+}
+
+
+/*
+ * Counters of every connection the server has had, open or closed.  Call
+ * it from the thread running rtmp_server_process_message.
+ */
+void rtmp_server_get_stats(rtmp_server_t *rs, rtmp_stats_t *stats)
+{
+    rtmp_server_client_t *rsc;
+
+    memcpy(stats, &rs->closed_stats, sizeof(rtmp_stats_t));
+    for (rsc = rs->client_working; rsc; rsc = rsc->next) {
+        rtmp_stats_add(stats, &rsc->stats);
+    }
+}
+
+
+void rtmp_server_client_get_stats(
+    rtmp_server_client_t *rsc, rtmp_stats_t *stats)
+{
+    memcpy(stats, &rsc->stats, sizeof(rtmp_stats_t));
+}
+
+
+/*
+ * Once the peer has closed, the data left to send is still flushed, as the
+ * peer may only have shut down its side, and the connection is reported
+ * disconnected when nothing is left.
+ */
+static rtmp_result_t rtmp_server_client_send_and_recv(
+    rtmp_server_client_t *rsc, const rtmp_pollfd_t *poll_fd)
+{
+    int received_size;
+    int sent_size;
+
+    if (rsc->timed_out || rsc->failed) {
+        return RTMP_ERROR_DISCONNECTED;
+    }
+
+    /* a full buffer would make recv return 0 as at the end of stream */
+    if (!rsc->peer_closed && rsc->received_size < RTMP_BUFFER_SIZE &&
+        (poll_fd->revents & (POLLIN | POLLERR | POLLHUP))) {
+        if (rsc->received_buffer == NULL) {
+            rsc->received_buffer = (unsigned char*)rtmp_pool_allocate(
+                RTMP_BUFFER_SIZE);
+            if (rsc->received_buffer == NULL) {
+                return RTMP_ERROR_MEMORY_ALLOCATION;
+            }
+        }
+        received_size = recv(
+            rsc->conn_sock,
+            (void*)(rsc->received_buffer + rsc->received_size),
+            RTMP_BUFFER_SIZE - rsc->received_size, 0);
+        if (received_size > 0) {
+            RTMP_TRACE(RTMP_TRACE_RECEIVED, received_size);
+            rsc->received_time = rtmp_get_time();
+            rsc->received_size += received_size;
+            rsc->stats.bytes_in += received_size;
+            if (rsc->stats.handshakes > 0) {
+                rtmp_server_client_set_idle_timers(rsc, rsc->received_time);
+            }
+        } else if (received_size == 0) {
+            RTMP_TRACE(RTMP_TRACE_PEER_CLOSED, rsc->conn_sock);
+            rsc->peer_closed = 1;
+        } else if (!rtmp_socket_should_retry()) {
+            return RTMP_ERROR_DISCONNECTED;
+        }
+        if (rsc->received_size == 0) {
+            rtmp_pool_release(rsc->received_buffer);
+            rsc->received_buffer = NULL;
+        }
+        if (received_size > 0) {
+            rtmp_server_client_process_received(rsc);
+            if (rsc->failed) {
+                return RTMP_ERROR_DISCONNECTED;
+            }
+        }
+    }
+
+    /*
+     * Data queued since the poll is sent right away, data that was already
+     * waiting once the socket has room.  The messages queued meanwhile go
+     * in one send, which the kernel cuts into full segments already.
+     */
+    if (rsc->will_send_size > 0) {
+        if (!(poll_fd->events & POLLOUT) ||
+            (poll_fd->revents & (POLLOUT | POLLERR | POLLHUP))) {
+            sent_size = send(
+                rsc->conn_sock,
+                rsc->will_send_buffer,
+                rsc->will_send_size, RTMP_SEND_FLAGS);
+            if (sent_size == -1) {
+                if (!rtmp_socket_should_retry()) {
+                    return RTMP_ERROR_DISCONNECTED;
+                }
+                return RTMP_SUCCESS;
+            }
+            RTMP_TRACE(RTMP_TRACE_SENT, sent_size);
+            rsc->stats.bytes_out += sent_size;
+            rtmp_send_marks_pop(
+                &rsc->send_marks, rsc->stats.bytes_out,
+                &rsc->stats.send_latency);
+            if (rsc->will_send_size - sent_size > 0) {
+                rsc->stats.partial_writes++;
+                memmove(
+                    rsc->will_send_buffer,
+                    rsc->will_send_buffer + sent_size,
+                    rsc->will_send_size - sent_size);
+            }
+            rsc->will_send_size -= sent_size;
+            if (rsc->will_send_size == 0) {
+                rtmp_pool_release(rsc->will_send_buffer);
+                rsc->will_send_buffer = NULL;
+                rsc->will_send_capacity = 0;
+            }
+        }
+    }
+
+    if (rsc->peer_closed && rsc->will_send_size == 0) {
+        return RTMP_ERROR_DISCONNECTED;
+    }
+    return RTMP_SUCCESS;
+}
+
+
+static rtmp_server_client_t *get_new_server_client(rtmp_server_t *rs)
+{
+    rtmp_server_client_t *rsc;
+
+    if (rs->client_pool == NULL) {
+        /* aligned for its rtmp_stats_t */
+        rsc = (rtmp_server_client_t*)rtmp_allocate_aligned(
+            RTMP_ALLOCATION_CONNECTION,
+            sizeof(rtmp_server_client_t), RTMP_CACHE_LINE_SIZE);
+        if (rsc == NULL) {
+            return NULL;
+        }
+    } else {
+        rsc = rs->client_pool;
+        rs->client_pool = rsc->next;
+        rs->client_pool_size--;
+    }
+
+    rsc->received_buffer = NULL;
+    rsc->received_size = 0;
+    rsc->will_send_buffer = NULL;
+    rsc->will_send_size = 0;
+    rsc->will_send_capacity = 0;
+    rsc->waiting_keyframe = 0;
+    rsc->peer_closed = 0;
+    rsc->handshake = NULL;
+    rtmp_timer_initialize(
+        &rsc->handshake_timer, rtmp_server_client_on_timeout, rsc);
+    rtmp_timer_initialize(
+        &rsc->idle_timer, rtmp_server_client_on_timeout, rsc);
+    rtmp_timer_initialize(
+        &rsc->ping_timer, rtmp_server_client_on_ping_timer, rsc);
+    rsc->timed_out = 0;
+    rsc->failed = 0;
+    rsc->amf_chunk_size = DEFAULT_AMF_CHUNK_SIZE;
+    rsc->data = NULL;
+    rsc->object_encoding = RTMP_OBJECT_ENCODING_AMF0;
+    memset(&rsc->stats, 0x00, sizeof(rtmp_stats_t));
+    rsc->stats.connections = 1;
+    rsc->received_time = 0;
+    memset(&rsc->send_marks, 0x00, sizeof(rtmp_send_marks_t));
+    rsc->process_message = rtmp_server_client_handshake_first;
+    rsc->server = rs;
+
+    return rsc;
+}
+
+
+/*
+ * Makes room for size more bytes in the send queue.  It starts at
+ * RTMP_BUFFER_SIZE and doubles up to RTMP_SEND_QUEUE_SIZE_MAX.
+ */
+static rtmp_result_t rtmp_server_client_reserve_will_send_buffer(
+    rtmp_server_client_t *rsc, size_t size)
+{
+    unsigned char *buffer;
+    size_t capacity;
+
+    if (size <= rsc->will_send_capacity - rsc->will_send_size) {
+        return RTMP_SUCCESS;
+    }
+    if (size > RTMP_SEND_QUEUE_SIZE_MAX - rsc->will_send_size) {
+        return RTMP_ERROR_BUFFER_OVERFLOW;
+    }
+    capacity = rsc->will_send_capacity > 0 ?
+        rsc->will_send_capacity : RTMP_BUFFER_SIZE;
+    while (capacity < rsc->will_send_size + size) {
+        capacity *= 2;
+    }
+    if (capacity > RTMP_SEND_QUEUE_SIZE_MAX) {
+        capacity = RTMP_SEND_QUEUE_SIZE_MAX;
+    }
+    buffer = (unsigned char*)rtmp_pool_allocate(capacity);
+    if (buffer == NULL) {
+        return RTMP_ERROR_MEMORY_ALLOCATION;
+    }
+    if (rsc->will_send_size > 0) {
+        memcpy(buffer, rsc->will_send_buffer, rsc->will_send_size);
+    }
+    rtmp_pool_release(rsc->will_send_buffer);
+    rsc->will_send_buffer = buffer;
+    rsc->will_send_capacity = capacity;
+    return RTMP_SUCCESS;
+}
+
+
+/* adds size bytes written past the end of the send queue to it */
+static void rtmp_server_client_count_will_send_buffer(
+    rtmp_server_client_t *rsc, size_t size)
+{
+    rsc->will_send_size += size;
+    if (rsc->will_send_size > rsc->stats.send_queue_high_water) {
+        rsc->stats.send_queue_high_water = rsc->will_send_size;
+    }
+    rtmp_send_marks_push(
+        &rsc->send_marks, rsc->stats.bytes_out + rsc->will_send_size);
+}
+
+
+static int rtmp_server_client_set_will_send_buffer(
+    rtmp_server_client_t *rsc, unsigned char *data, size_t size)
+{
+    rtmp_result_t result;
+
+    result = rtmp_server_client_reserve_will_send_buffer(rsc, size);
+    if (result != RTMP_SUCCESS) {
+        return result;
+    }
+    memmove(
+        rsc->will_send_buffer + rsc->will_send_size,
+        data, size);
+    rtmp_server_client_count_will_send_buffer(rsc, size);
+    return RTMP_SUCCESS;
+}
+
+
+static void rtmp_server_client_delete_received_buffer(
+    rtmp_server_client_t *rsc, size_t size)
+{
+    if (size >= rsc->received_size) {
+        rsc->received_size = 0;
+        rtmp_pool_release(rsc->received_buffer);
+        rsc->received_buffer = NULL;
+    } else {
+        memmove(
+            rsc->received_buffer,
+            rsc->received_buffer + size,
+            rsc->received_size - size);
+        rsc->received_size -= size;
+    }
+}
+
+
+void rtmp_server_client_handshake_first(rtmp_server_client_t *rsc)
+{
+    unsigned char magic[] = {0x03};
+    int i;
+#if defined(__WIN32__) || defined(WIN32)
+    DWORD now;
+#else
+    unsigned long now;
+#endif
+
+    if (rsc->received_size >= (1 + RTMP_HANDSHAKE_SIZE)) {
+        rsc->handshake = (unsigned char*)rtmp_pool_allocate(
+            RTMP_HANDSHAKE_SIZE);
+        if (rsc->handshake == NULL) {
+            return;
+        }
+        rtmp_server_client_set_will_send_buffer(
+            rsc, magic, 1);
+#if defined(__WIN32__) || defined(WIN32)
+        now = timeGetTime();
+#else
+        now = time(NULL) * 1000;
+#endif
+        write_le32int(rsc->handshake, (int)now);
+        write_le32int(rsc->handshake + 4, 0);
+        for (i = 8; i < RTMP_HANDSHAKE_SIZE; ++i) {
+            rsc->handshake[i] = (unsigned char)(rand() % 256);
+        }
+        rtmp_server_client_set_will_send_buffer(
+            rsc,
+            rsc->handshake,
+            RTMP_HANDSHAKE_SIZE);
+        rtmp_server_client_set_will_send_buffer(
+            rsc,
+            rsc->received_buffer + 1,
+            RTMP_HANDSHAKE_SIZE);
+        rtmp_server_client_delete_received_buffer(
+            rsc,
+            1 + RTMP_HANDSHAKE_SIZE);
+        RTMP_TRACE(RTMP_TRACE_HANDSHAKE_1, 0);
+        rsc->process_message = rtmp_server_client_handshake_second;
+    }
+}
+
+
+void rtmp_server_client_handshake_second(rtmp_server_client_t *rsc)
+{
+    double handshake_time;
+
+    if (rsc->received_size >= RTMP_HANDSHAKE_SIZE) {
+        /* 1 when the response echoes the handshake we sent */
+        RTMP_TRACE(
+            RTMP_TRACE_HANDSHAKE_2,
+            memcmp(
+                rsc->handshake, rsc->received_buffer,
+                RTMP_HANDSHAKE_SIZE) == 0);
+        rtmp_server_client_delete_received_buffer(
+            rsc, RTMP_HANDSHAKE_SIZE);
+        rtmp_pool_release(rsc->handshake);
+        rsc->handshake = NULL;
+        rtmp_timer_cancel(&rsc->server->timers, &rsc->handshake_timer);
+        rtmp_server_client_set_idle_timers(rsc, rtmp_get_time());
+        handshake_time = rtmp_get_time() - rsc->handshake_started;
+        rsc->stats.handshakes = 1;
+        rsc->stats.handshake_time = handshake_time;
+        rsc->stats.handshake_time_max = handshake_time;
+        rsc->data = rtmp_packet_create();
+        rsc->process_message = rtmp_server_client_get_packet;
+        rtmp_server_client_send_server_bandwidth(rsc);
+        rtmp_server_client_send_client_bandwidth(rsc);
+        rtmp_server_client_send_ping(rsc);
+    }
+}
+
+
+static void rtmp_server_client_process_packet(
+    rtmp_server_client_t *rsc, rtmp_packet_t *packet)
+{
+    rtmp_packet_inner_amf_t *inner_amf;
+    amf_packet_t *amf;
+    const char *code;
+    const char *level;
+    rtmp_command_entry_t *entry;
+    double transaction_id;
+    rtmp_packet_inner_amf_t *arguments;
+
+    switch (packet->data_type) {
+    case RTMP_DATATYPE_CHUNK_SIZE:
+        break;
+    case RTMP_DATATYPE_BYTES_READ:
+        break;
     case RTMP_DATATYPE_PING:
         break;
     case RTMP_DATATYPE_SERVER_BW:
@@ -408,64 +1383,37 @@ static void rtmp_server_client_process_packet(
         break;
     case RTMP_DATATYPE_VIDEO_DATA:
         break;
-    case RTMP_DATATYPE_MESSAGE:
-        break;
     case RTMP_DATATYPE_NOTIFY:
         inner_amf = packet->inner_amf_packets;
         amf = inner_amf->amf;
         if (amf->datatype != AMF_DATATYPE_STRING) {
             break;
         }
-        command = amf->string.value;
-#ifdef DEBUG
-        printf("notify command: %s\n", command);
-#endif
+        RTMP_TRACE_TEXT(RTMP_TRACE_NOTIFY_COMMAND, 0, amf->string.value);
         rtmp_packet_retrieve_status_info(packet, &code, &level);
         if (code == NULL || level == NULL) {
             break;
         }
-#ifdef DEBUG
-        printf("code: %s\n", code);
-        printf("level: %s\n", level);
-#endif
+        RTMP_TRACE_TEXT(RTMP_TRACE_STATUS_CODE, 0, code);
+        RTMP_TRACE_TEXT(RTMP_TRACE_STATUS_LEVEL, 0, level);
         /* FIXME: add event */
         break;
     case RTMP_DATATYPE_SHARED_OBJECT:
         break;
-    case RTMP_DATATYPE_INVOKE:
-        inner_amf = packet->inner_amf_packets;
-        amf = inner_amf->amf;
-        if (amf->datatype != AMF_DATATYPE_STRING) {
+    case RTMP_DATATYPE_MESSAGE:
+        if (packet->body_type != RTMP_BODY_TYPE_AMF) {
             break;
         }
-        command = amf->string.value;
-        amf = inner_amf->next->amf;
-        if (amf->datatype != AMF_DATATYPE_NUMBER) {
+        /* AMF3 command, handled as an invoke */
+        /* FALLTHROUGH */
+    case RTMP_DATATYPE_INVOKE:
+        entry = rtmp_command_table_find_invoke(
+            rsc->server->commands, packet, &transaction_id, &arguments);
+        if (entry == NULL) {
             break;
         }
-        number = amf->number.value;
-#ifdef DEBUG
-        printf("invoke command: %s\n", command);
-#endif
-        if (strcmp(command, "_result") == 0) {
-            rtmp_packet_retrieve_status_info(packet, &code, &level);
-            if (code == NULL || level == NULL) {
-                break;
-            }
-#ifdef DEBUG
-            printf("code: %s\n", code);
-            printf("level: %s\n", level);
-#endif
-            /* FIXME: add event */
-        } else if (strcmp(command, "connect") == 0) {
-//            rsc->amf_chunk_size = 4096;
-            rtmp_server_client_send_chunk_size(rsc);
-            rtmp_server_client_send_connect_result(rsc, number);
-        } else if (strcmp(command, "createStream") == 0) {
-            rtmp_server_client_send_create_stream_result(rsc, number);
-        } else if (strcmp(command, "play") == 0) {
-            rtmp_server_client_send_play_result_success(rsc, number);
-	}
+        RTMP_TRACE_TEXT(RTMP_TRACE_INVOKE_COMMAND, 0, entry->name);
+        entry->handler.server(rsc, transaction_id, arguments, entry->data);
         break;
     default:
         break;
@@ -473,13 +1421,87 @@ static void rtmp_server_client_process_packet(
 }
 
 
+static void rtmp_server_client_on_connect(
+    rtmp_server_client_t *rsc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, void *data)
+{
+    amf_packet_t *object_encoding;
+
+    (void)data;
+
+    rsc->object_encoding = RTMP_OBJECT_ENCODING_AMF0;
+    if (arguments) {
+        object_encoding = amf_packet_get_property(
+            arguments->amf, AMF_INTERNED(OBJECT_ENCODING));
+        if (object_encoding &&
+            object_encoding->datatype == AMF_DATATYPE_NUMBER) {
+            rsc->object_encoding = object_encoding->number.value;
+        }
+    }
+
+//    rsc->amf_chunk_size = 4096;
+    rtmp_server_client_send_chunk_size(rsc);
+    rtmp_server_client_send_connect_result(rsc, transaction_id);
+}
+
+
+static void rtmp_server_client_on_create_stream(
+    rtmp_server_client_t *rsc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, void *data)
+{
+    (void)arguments;
+    (void)data;
+
+    rtmp_server_client_send_create_stream_result(rsc, transaction_id);
+}
+
+
+static void rtmp_server_client_on_play(
+    rtmp_server_client_t *rsc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, void *data)
+{
+    (void)arguments;
+    (void)data;
+
+    rtmp_server_client_send_play_result_success(rsc, transaction_id);
+}
+
+
 static rtmp_result_t rtmp_server_client_send_packet(
     rtmp_server_client_t *rsc, rtmp_packet_t *packet)
 {
     rtmp_result_t result;
     size_t packet_size;
-
     unsigned char fuck[1024];
+
+    /*
+     * The size of a data body is known up front: one full header, the body
+     * and a chunk header between chunks.  It is serialized in place.
+     */
+    if (packet->body_type == RTMP_BODY_TYPE_DATA) {
+        packet_size = 12 + packet->body_data_length;
+        if (packet->body_data_length > 0) {
+            packet_size +=
+                (packet->body_data_length - 1) / rsc->amf_chunk_size;
+        }
+        result = rtmp_server_client_reserve_will_send_buffer(
+            rsc, packet_size);
+        if (result != RTMP_SUCCESS) {
+            return result;
+        }
+        result = rtmp_packet_serialize(
+            packet,
+            rsc->will_send_buffer + rsc->will_send_size, packet_size,
+            rsc->amf_chunk_size,
+            &packet_size);
+        if (result == RTMP_SUCCESS) {
+            rtmp_server_client_count_will_send_buffer(rsc, packet_size);
+            rtmp_stats_count_message(
+                rsc->stats.messages_out, packet->data_type);
+        }
+        return result;
+    }
+
     result = rtmp_packet_serialize(
         packet,
         fuck,
@@ -489,6 +1511,7 @@ static rtmp_result_t rtmp_server_client_send_packet(
     if (result == RTMP_SUCCESS) {
         rtmp_server_client_set_will_send_buffer(
             rsc, fuck, packet_size);
+        rtmp_stats_count_message(rsc->stats.messages_out, packet->data_type);
     }
 
     return RTMP_SUCCESS;
@@ -563,6 +1586,91 @@ void rtmp_server_client_send_ping(rtmp_server_client_t *rsc)
 }
 
 
+/*
+ * Queues an audio or video message, a RTMP_BODY_TYPE_DATA packet owned by
+ * the caller, unless the client is backed up.  Past the high water mark
+ * video is dropped up to the next keyframe, and audio as well if the
+ * server drops audio.  Keyframes are still queued up to twice the mark,
+ * so that a viewer catching up starts from a fresh one.
+ *
+ * Every message carries its full header with an absolute timestamp, so
+ * the ones delivered keep their timing.  No extended timestamp is written,
+ * so the timestamp wraps after 2^24 milliseconds, about 4.66 hours.  A
+ * dropped message returns RTMP_SUCCESS and is counted in the stats.
+ *
+ * A keyframe which does not fit in the send queue closes the connection,
+ * returning RTMP_ERROR_DISCONNECTED, as the viewer could only wait for
+ * the next one to fit.
+ */
+rtmp_result_t rtmp_server_client_send_media(
+    rtmp_server_client_t *rsc, rtmp_packet_t *packet)
+{
+    rtmp_result_t result;
+    int backed_up;
+    int keyframe;
+
+    backed_up = rsc->will_send_size >= rsc->server->send_queue_high_water;
+    keyframe = 0;
+    if (packet->data_type == RTMP_DATATYPE_VIDEO_DATA) {
+        /* the frame type in the high nibble of the FLV video tag */
+        keyframe = packet->body_data_length > 0 &&
+            (packet->body_data[0] >> 4) == RTMP_VIDEO_FRAME_KEY;
+        if (keyframe) {
+            rsc->waiting_keyframe = rsc->will_send_size >=
+                2 * rsc->server->send_queue_high_water;
+        } else if (backed_up) {
+            rsc->waiting_keyframe = 1;
+        }
+        if (rsc->waiting_keyframe) {
+            rsc->stats.video_dropped++;
+            return RTMP_SUCCESS;
+        }
+    } else if (packet->data_type == RTMP_DATATYPE_AUDIO_DATA) {
+        if (backed_up && rsc->server->drop_audio) {
+            rsc->stats.audio_dropped++;
+            return RTMP_SUCCESS;
+        }
+    }
+
+    result = rtmp_server_client_send_packet(rsc, packet);
+    if (result == RTMP_ERROR_BUFFER_OVERFLOW &&
+        packet->data_type == RTMP_DATATYPE_VIDEO_DATA) {
+        rsc->stats.video_dropped++;
+        if (keyframe) {
+            RTMP_TRACE(RTMP_TRACE_KEYFRAME_DROPPED, packet->body_data_length);
+            rsc->failed = 1;
+            return RTMP_ERROR_DISCONNECTED;
+        }
+        /* the frames depending on this one would not decode */
+        rsc->waiting_keyframe = 1;
+    }
+    return result;
+}
+
+
+/* user control ping request, answered with a ping response */
+void rtmp_server_client_send_ping_request(rtmp_server_client_t *rsc)
+{
+    rtmp_packet_t *rtmp_packet;
+
+    RTMP_TRACE(RTMP_TRACE_PING_REQUEST, rsc->conn_sock);
+    rtmp_packet = (rtmp_packet_t*)rsc->data;
+    rtmp_packet_cleanup(rtmp_packet);
+    rtmp_packet->object_id = 2;
+    rtmp_packet->timer = 0;
+    rtmp_packet->data_type = RTMP_DATATYPE_PING;
+    rtmp_packet->stream_id = 0;
+    rtmp_packet->body_type = RTMP_BODY_TYPE_DATA;
+    rtmp_packet_allocate_body_data(rtmp_packet, 6);
+    write_be16int(rtmp_packet->body_data, RTMP_PING_REQUEST);
+    write_be32int(
+        rtmp_packet->body_data + 2,
+        (int)((rtmp_get_time() - rsc->handshake_started) * 1000));
+
+    rtmp_server_client_send_packet(rsc, rtmp_packet);
+}
+
+
 void rtmp_server_client_send_chunk_size(
     rtmp_server_client_t *rsc)
 {
@@ -621,7 +1729,8 @@ void rtmp_server_client_send_connect_result(
         amf_object, "clientid", amf_packet_create_number(313639155));
     /* FIXME: increment client id */
     amf_packet_add_property_to_object(
-        amf_object, "objectEncoding", amf_packet_create_number(0));
+        amf_object, "objectEncoding",
+        amf_packet_create_number(rsc->object_encoding));
     rtmp_packet_add_amf(rtmp_packet, amf_object);
 
     rtmp_server_client_send_packet(rsc, rtmp_packet);
@@ -650,10 +1759,10 @@ void rtmp_server_client_send_create_stream_result(
     rtmp_packet_add_amf(
         rtmp_packet,
         amf_packet_create_null());
+    /* the stream id, play results go out on the first stream */
     rtmp_packet_add_amf(
         rtmp_packet,
-        amf_packet_create_number(15125));
-    /* FIXME: What's this number */
+        amf_packet_create_number(RTMP_CLIENT_FIRST_STREAM_ID));
 
     rtmp_server_client_send_packet(rsc, rtmp_packet);
 }
@@ -749,6 +1858,9 @@ static void rtmp_server_client_get_packet(rtmp_server_client_t *rsc)
     size_t packet_size;
     rtmp_packet_t *packet;
 
+    if (rsc->received_size == 0 || rsc->failed) {
+        return;
+    }
     packet = (rtmp_packet_t*)rsc->data;
     ret = rtmp_packet_analyze_data(
         packet,
@@ -757,11 +1869,44 @@ static void rtmp_server_client_get_packet(rtmp_server_client_t *rsc)
         &packet_size);
     if (ret == RTMP_SUCCESS) {
         rtmp_server_client_delete_received_buffer(rsc, packet_size);
+        rtmp_stats_count_message(rsc->stats.messages_in, packet->data_type);
         rtmp_server_client_process_packet(rsc, packet);
+        rtmp_histogram_record(
+            &rsc->stats.dispatch_latency,
+            rtmp_get_time() - rsc->received_time);
+    } else if (ret != RTMP_ERROR_DIVIDED_PACKET ||
+               rsc->received_size == RTMP_BUFFER_SIZE) {
+        /*
+         * An incomplete message only waits for the rest, unless it can
+         * not fit in the buffer.  Nothing after a message which can not
+         * be parsed can be, so the connection is closed.
+         */
+        if (ret == RTMP_ERROR_DIVIDED_PACKET) {
+            ret = RTMP_ERROR_BUFFER_OVERFLOW;
+        }
+        rsc->stats.parse_errors[ret]++;
+        rsc->failed = 1;
     }
 }
 
 
+/*
+ * Runs the current stage until it stops consuming received data, that is
+ * until what is left is an incomplete message.  Several messages may have
+ * arrived together, and those sent just before the peer closed are not
+ * followed by any more reads.
+ */
+static void rtmp_server_client_process_received(rtmp_server_client_t *rsc)
+{
+    size_t received_size;
+
+    do {
+        received_size = rsc->received_size;
+        rsc->process_message(rsc);
+    } while (rsc->received_size > 0 && rsc->received_size != received_size);
+}
+
+
 static void rtmp_server_client_free(rtmp_server_t *rs, rtmp_server_client_t *rsc)
 {
     if (rsc->prev) {
@@ -781,14 +1926,79 @@ static void rtmp_server_client_free(rtmp_server_t *rs, rtmp_server_client_t *rsc
     }
     if (rsc->data) {
         rtmp_packet_free((rtmp_packet_t*)rsc->data);
+        rsc->data = NULL;
     }
-#ifdef __USE_W32_SOCKETS
-        closesocket(rsc->conn_sock);
-        WSACleanup();
-#else
-        close(rsc->conn_sock);
-#endif
-    free(rsc);
+    rtmp_server_client_release_buffers(rsc);
+    rtmp_timer_cancel(&rs->timers, &rsc->handshake_timer);
+    rtmp_timer_cancel(&rs->timers, &rsc->idle_timer);
+    rtmp_timer_cancel(&rs->timers, &rsc->ping_timer);
+    rtmp_socket_close(rsc->conn_sock);
+    rtmp_server_uncount_address(rs, rsc->conn_sockaddr.sin_addr.s_addr);
+    rs->client_working_num--;
+    rtmp_stats_add(&rs->closed_stats, &rsc->stats);
+    if (rs->client_pool_size < rs->client_pool_max) {
+        rsc->prev = NULL;
+        rsc->next = rs->client_pool;
+        rs->client_pool = rsc;
+        rs->client_pool_size++;
+    } else {
+        rtmp_release_aligned(rsc);
+    }
+}
+
+
+/* the handshake or idle deadline passed */
+static void rtmp_server_client_on_timeout(rtmp_timer_t *timer)
+{
+    rtmp_server_client_t *rsc;
+
+    rsc = (rtmp_server_client_t*)timer->data;
+    RTMP_TRACE(RTMP_TRACE_TIMED_OUT, rsc->conn_sock);
+    rsc->timed_out = 1;
+}
+
+
+/* nothing received for a ping interval, asks the peer for a response */
+static void rtmp_server_client_on_ping_timer(rtmp_timer_t *timer)
+{
+    rtmp_server_client_t *rsc;
+
+    rsc = (rtmp_server_client_t*)timer->data;
+    rtmp_server_client_send_ping_request(rsc);
+    rtmp_timer_set(
+        &rsc->server->timers, &rsc->ping_timer,
+        rtmp_get_time() + rsc->server->ping_interval);
+}
+
+
+/* pushes the idle deadline and the next ping back from now */
+static void rtmp_server_client_set_idle_timers(
+    rtmp_server_client_t *rsc, double now)
+{
+    rtmp_server_t *rs;
+
+    rs = rsc->server;
+    if (rs->idle_timeout > 0) {
+        rtmp_timer_set(&rs->timers, &rsc->idle_timer, now + rs->idle_timeout);
+    }
+    if (rs->ping_interval > 0) {
+        rtmp_timer_set(
+            &rs->timers, &rsc->ping_timer, now + rs->ping_interval);
+    }
+}
+
+
+static void rtmp_server_client_release_buffers(rtmp_server_client_t *rsc)
+{
+    rtmp_pool_release(rsc->received_buffer);
+    rsc->received_buffer = NULL;
+    rsc->received_size = 0;
+    rtmp_pool_release(rsc->will_send_buffer);
+    rsc->will_send_buffer = NULL;
+    rsc->will_send_size = 0;
+    rsc->will_send_capacity = 0;
+    rtmp_pool_release(rsc->handshake);
+    rsc->handshake = NULL;
 }
 
 
@@ -803,19 +2013,117 @@ void rtmp_server_free(rtmp_server_t *rs)
         rtmp_server_client_free(rs, rsc);
         rsc = next;
     }
-    rsc = rs->client_pool;
-    while (rsc) {
-        free(rsc);
+    rtmp_server_set_client_pool_size(rs, 0);
+    rtmp_release(rs->poll_fds);
+    rtmp_release(rs->address_counts);
+    if (rs->commands) {
+        rtmp_command_table_free(rs->commands);
     }
     if (rs->stand_by_socket) {
-#ifdef __USE_W32_SOCKETS
-        closesocket(rs->conn_sock);
-        WSACleanup();
-#else
-        close(rs->conn_sock);
-#endif
+        rtmp_socket_close(rs->conn_sock);
+    }
+    rtmp_release_aligned(rs);
+}
+
+
+/*
+ * Seconds a client may take to complete the handshake, may stay silent
+ * before it is disconnected, and stays silent before it is sent a ping
+ * request, which a live peer answers.  0 disables each.  Applies to the
+ * deadlines set after the call.
+ */
+void rtmp_server_set_timeouts(
+    rtmp_server_t *rs,
+    double handshake_timeout, double idle_timeout, double ping_interval)
+{
+    rs->handshake_timeout = handshake_timeout;
+    rs->idle_timeout = idle_timeout;
+    rs->ping_interval = ping_interval;
+}
+
+
+/*
+ * Bytes queued to a client past which its media is dropped, see
+ * rtmp_server_client_send_media.  RTMP_SEND_QUEUE_HIGH_WATER and video
+ * only by default.
+ */
+void rtmp_server_set_backpressure(
+    rtmp_server_t *rs, size_t high_water, int drop_audio)
+{
+    rs->send_queue_high_water = high_water;
+    rs->drop_audio = drop_audio;
+}
+
+
+/*
+ * Options of the clients accepted from now on.  The buffer sizes and the
+ * backlog also apply to the listening socket.
+ */
+rtmp_result_t rtmp_server_set_socket_options(
+    rtmp_server_t *rs, const rtmp_socket_options_t *options)
+{
+    rs->socket_options = *options;
+    if (rtmp_socket_set_buffer_sizes(rs->conn_sock, options) !=
+        RTMP_SUCCESS) {
+        return RTMP_ERROR_UNKNOWN;
+    }
+    /* listening again only changes the backlog */
+    if (listen(rs->conn_sock, options->backlog) == -1) {
+        return RTMP_ERROR_UNKNOWN;
+    }
+    return RTMP_SUCCESS;
+}
+
+
+/*
+ * Limits of the connections accepted from now on, see rtmp_admission_t.
+ * The rate limit starts with a full burst.
+ */
+void rtmp_server_set_admission(
+    rtmp_server_t *rs, const rtmp_admission_t *admission)
+{
+    rs->admission = *admission;
+    rs->accept_tokens = admission->max_rate;
+    if (admission->burst > 0) {
+        rs->accept_tokens = admission->burst;
+    }
+    if (rs->accept_tokens < 1) {
+        rs->accept_tokens = 1;
+    }
+    rs->accept_time = rtmp_get_time();
+}
+
+
+/*
+ * The backlog is ignored.  The buffer sizes do not change the window scale
+ * negotiated already.
+ */
+rtmp_result_t rtmp_server_client_set_socket_options(
+    rtmp_server_client_t *rsc, const rtmp_socket_options_t *options)
+{
+    if (rtmp_socket_set_buffer_sizes(rsc->conn_sock, options) !=
+        RTMP_SUCCESS) {
+        return RTMP_ERROR_UNKNOWN;
+    }
+    return rtmp_socket_set_options(rsc->conn_sock, options);
+}
+
+
+/*
+ * Sets how many freed clients are kept for reuse, releasing the ones over
+ * the new size.  RTMP_CLIENT_POOL_SIZE by default.
+ */
+void rtmp_server_set_client_pool_size(rtmp_server_t *rs, size_t size)
+{
+    rtmp_server_client_t *rsc;
+
+    rs->client_pool_max = size;
+    while (rs->client_pool_size > size) {
+        rsc = rs->client_pool;
+        rs->client_pool = rsc->next;
+        rs->client_pool_size--;
+        rtmp_release_aligned(rsc);
     }
-    free(rs);
 }
 
 
@@ -834,10 +2142,16 @@ void rtmp_server_free(rtmp_server_t *rs)
 static void rtmp_client_parse_url(rtmp_client_t *rc, const char *url);
 static void rtmp_client_parse_host_and_port_number(
     rtmp_client_t *rc, const char *host_and_port_number);
+static rtmp_result_t rtmp_client_continue_connect(rtmp_client_t *rc);
+static rtmp_result_t rtmp_client_start_connect(rtmp_client_t *rc);
+static void rtmp_client_on_connected(rtmp_client_t *rc);
+static void rtmp_client_close_socket(rtmp_client_t *rc);
+static rtmp_result_t rtmp_client_fail_connect(rtmp_client_t *rc);
 
 static void rtmp_client_handshake_first(rtmp_client_t *rc);
 static void rtmp_client_handshake_second(rtmp_client_t *rc);
 static void rtmp_client_get_packet(rtmp_client_t *rc);
+static void rtmp_client_process_received(rtmp_client_t *rc);
 static void rtmp_client_process_packet(
     rtmp_client_t *rc, rtmp_packet_t *packet);
 
@@ -847,109 +2161,419 @@ static void rtmp_client_delete_received_buffer(
     rtmp_client_t *rc, size_t size);
 static rtmp_result_t rtmp_client_send_packet(
     rtmp_client_t *rc, rtmp_packet_t *packet);
+static rtmp_result_t rtmp_client_disconnect(rtmp_client_t *rc, const char *level);
+static void rtmp_client_send_ping_response(rtmp_client_t *rc, int timestamp);
 static rtmp_result_t rtmp_client_add_event(
-    rtmp_client_t *rc, char *code, char *level);
+    rtmp_client_t *rc, const char *code, const char *level);
+static const char *rtmp_event_intern(
+    const char *string, char *buffer, size_t buffer_size);
+static void rtmp_client_on_result(
+    rtmp_client_t *rc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, void *data);
+static void rtmp_client_on_error(
+    rtmp_client_t *rc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, void *data);
+static void rtmp_client_on_response(
+    rtmp_client_t *rc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, rtmp_transaction_status_t status);
+static void rtmp_client_on_connect_result(
+    rtmp_client_t *rc, rtmp_transaction_t *transaction, void *data);
+static void rtmp_client_on_create_stream_result(
+    rtmp_client_t *rc, rtmp_transaction_t *transaction, void *data);
+static void rtmp_client_send_pipelined_play(rtmp_client_t *rc);
+static long rtmp_client_start_invoke(
+    rtmp_client_t *rc, const char *command,
+    rtmp_client_result_handler_t handler, void *data);
+static long rtmp_client_send_invoke(rtmp_client_t *rc, long transaction_id);
+static rtmp_transaction_t *rtmp_transaction_probe(
+    rtmp_transaction_t *transactions, size_t capacity, long id);
+static rtmp_result_t rtmp_client_add_transaction(
+    rtmp_client_t *rc, long id,
+    rtmp_client_result_handler_t handler, void *data);
+static rtmp_transaction_t *rtmp_client_find_transaction(
+    rtmp_client_t *rc, long id);
+static void rtmp_client_remove_transaction(
+    rtmp_client_t *rc, rtmp_transaction_t *entry);
+static void rtmp_client_complete_transaction(
+    rtmp_client_t *rc, rtmp_transaction_t *entry,
+    rtmp_transaction_status_t status, rtmp_packet_inner_amf_t *arguments);
+static void rtmp_client_expire_transactions(rtmp_client_t *rc, double now);
 
 
+/*
+ * Starts connecting to url and returns at once, the connection is made by
+ * rtmp_client_process_message.  NULL if url is malformed or its host is an
+ * address no socket can be opened for.
+ */
 rtmp_client_t *rtmp_client_create(const char *url)
 {
     rtmp_client_t *rc;
-    int ret;
-#ifdef __USE_W32_SOCKETS
-    WSADATA data;
-#endif
-    struct sockaddr_in conn_sockaddr;
 
-#ifdef __USE_W32_SOCKETS
-    WSAStartup(MAKEWORD(2, 0), &data);
-#endif
-
-    srand((unsigned)time(NULL));
+    rtmp_initialize();
 
-    rc = (rtmp_client_t*)malloc(sizeof(rtmp_client_t));
+    rc = (rtmp_client_t*)rtmp_allocate_aligned(
+        RTMP_ALLOCATION_CONNECTION,
+        sizeof(rtmp_client_t), RTMP_CACHE_LINE_SIZE);
     if (rc == NULL) {
         return NULL;
     }
 
     rc->conn_sock = -1;
-
+    rc->connect_state = RTMP_CLIENT_RESOLVING;
+    rc->resolver = NULL;
+    rc->addresses = NULL;
+    rc->address = NULL;
+    rc->connect_started = rtmp_get_time();
+    rc->connect_timeout = RTMP_CONNECT_TIMEOUT;
+    rtmp_socket_options_initialize(&rc->socket_options);
+    rc->peer_closed = 0;
+    rc->failed = 0;
+    rc->disconnected = 0;
+    rc->commands = NULL;
+    rc->data = NULL;
+    rc->media_handler = NULL;
+    rc->media_handler_data = NULL;
+    rc->event_handler = NULL;
+    rc->event_handler_data = NULL;
+    rc->events.head = 0;
+    rc->events.tail = 0;
+    rc->events.dropped = 0;
+    memset(&rc->stats, 0x00, sizeof(rtmp_stats_t));
+    rc->stats.connections = 1;
+    rc->received_time = 0;
+    memset(&rc->send_marks, 0x00, sizeof(rtmp_send_marks_t));
+    rc->amf_chunk_size = DEFAULT_AMF_CHUNK_SIZE;
+    rc->received_size = 0;
+    rc->will_send_size = 0;
+    rc->process_message = rtmp_client_handshake_first;
+    rc->message_number = 0.0;
+    rc->object_encoding = RTMP_OBJECT_ENCODING_AMF0;
+    rc->stream_id = 0;
+    rc->transactions = NULL;
+    rc->transactions_capacity = 0;
+    rc->transactions_num = 0;
+    rc->transactions_deadline = 0;
+    rc->call_timeout = RTMP_CALL_TIMEOUT;
+    rc->play_stream_name = NULL;
+    rc->window_ack_size = 0;
+    rc->buffer_length = 0;
+
+    rc->url = (char*)rtmp_allocate(
+        RTMP_ALLOCATION_CONNECTION, strlen(url) + 1);
+    if (rc->url != NULL) {
+        strcpy(rc->url, url);
+    }
     rc->protocol = NULL;
     rc->host = NULL;
     rc->port_number = -1;
+    rc->path = NULL;
     rtmp_client_parse_url(rc, url);
     if (rc->url == NULL || rc->protocol == NULL || rc->host == NULL || rc->path == NULL) {
         rtmp_client_free(rc);
         return NULL;
     }
 
-    memset(&conn_sockaddr, 0, sizeof(conn_sockaddr));
-    conn_sockaddr.sin_family = AF_INET;
-    conn_sockaddr.sin_addr.s_addr = inet_addr(rc->host);
-    conn_sockaddr.sin_port = htons(rc->port_number);
-    if (conn_sockaddr.sin_addr.s_addr == INADDR_NONE) {
+    rc->commands = rtmp_command_table_create();
+    if (rc->commands == NULL) {
         rtmp_client_free(rc);
         return NULL;
     }
-
-    rc->conn_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (rc->conn_sock == -1) {
+    if (rtmp_client_on_command(
+            rc, "_result", rtmp_client_on_result, NULL) != RTMP_SUCCESS ||
+        rtmp_client_on_command(
+            rc, "_error", rtmp_client_on_error, NULL) != RTMP_SUCCESS) {
         rtmp_client_free(rc);
         return NULL;
     }
 
-#ifdef __USE_W32_SOCKETS
-    ret = connect(
-        rc->conn_sock,
-        (PSOCKADDR)&conn_sockaddr, sizeof(conn_sockaddr));
-    if (ret == SOCKET_ERROR) {
+    /* an address literal needs no lookup */
+    rc->addresses = rtmp_resolve_numeric(rc->host, rc->port_number);
+    if (rc->addresses == NULL) {
+        rc->resolver = rtmp_resolver_start(rc->host, rc->port_number);
+        if (rc->resolver == NULL) {
+            rtmp_client_free(rc);
+            return NULL;
+        }
+        return rc;
+    }
+    rc->address = rc->addresses;
+    if (rtmp_client_start_connect(rc) != RTMP_SUCCESS) {
         rtmp_client_free(rc);
         return NULL;
     }
-#else
-    ret = connect(
-        rc->conn_sock, (const struct sockaddr*)&(conn_sockaddr),
-        sizeof(conn_sockaddr));
-    if (ret == -1) {
+
+    return rc;
+}
+
+
+/*
+ * Starts playing stream_name of url in as few round trips as possible.
+ * The connect, createStream and play commands are sent together as soon as
+ * the handshake is done, play on the stream id servers give the first
+ * stream, and sent again should the server give another.  When not 0, the
+ * window acknowledgement size goes ahead of them and the buffer length in
+ * milliseconds ahead of play.  The connect and play results come as events
+ * as usual.
+ */
+rtmp_client_t *rtmp_client_play_url(
+    const char *url, const char *stream_name,
+    unsigned long window_ack_size, unsigned long buffer_length)
+{
+    rtmp_client_t *rc;
+
+    rc = rtmp_client_create(url);
+    if (rc == NULL) {
+        return NULL;
+    }
+    rc->play_stream_name = (char*)rtmp_allocate(
+        RTMP_ALLOCATION_CONNECTION, strlen(stream_name) + 1);
+    if (rc->play_stream_name == NULL) {
         rtmp_client_free(rc);
         return NULL;
     }
-#endif
+    strcpy(rc->play_stream_name, stream_name);
+    rc->window_ack_size = window_ack_size;
+    rc->buffer_length = buffer_length;
+
+    return rc;
+}
+
+
+/*
+ * Moves the connection on: takes the addresses once the lookup is done,
+ * and once a connect completes, either goes on with the handshake or tries
+ * the next address.  Gives up when the timeout passes.
+ */
+static rtmp_result_t rtmp_client_continue_connect(rtmp_client_t *rc)
+{
+    int error;
+#ifdef __MINGW32__
+    int error_size;
+#else
+    socklen_t error_size;
+#endif
+
+    if (rc->connect_state == RTMP_CLIENT_RESOLVING) {
+        if (rtmp_resolver_is_done(rc->resolver)) {
+            rc->addresses = rtmp_resolver_take_addresses(rc->resolver);
+            rtmp_resolver_free(rc->resolver);
+            rc->resolver = NULL;
+            rc->address = rc->addresses;
+            return rtmp_client_start_connect(rc);
+        }
+    } else if (rtmp_socket_is_ready(rc->conn_sock, 1)) {
+        error = 0;
+        error_size = sizeof(error);
+        if (getsockopt(
+                rc->conn_sock, SOL_SOCKET, SO_ERROR,
+                (char*)&error, &error_size) == -1) {
+            error = -1;
+        }
+        if (error == 0) {
+            rtmp_client_on_connected(rc);
+            return RTMP_SUCCESS;
+        }
+        rtmp_client_close_socket(rc);
+        rc->address = rc->address->ai_next;
+        return rtmp_client_start_connect(rc);
+    }
+
+    if (rc->connect_timeout > 0 &&
+        rtmp_get_time() - rc->connect_started >= rc->connect_timeout) {
+        return rtmp_client_fail_connect(rc);
+    }
+    return RTMP_SUCCESS;
+}
+
+
+/* connects to rc->address, or the first of the ones after it that works */
+static rtmp_result_t rtmp_client_start_connect(rtmp_client_t *rc)
+{
+    int ret;
+
+    for (; rc->address; rc->address = rc->address->ai_next) {
+        rc->conn_sock = socket(
+            rc->address->ai_family,
+            rc->address->ai_socktype, rc->address->ai_protocol);
+        if (rc->conn_sock == -1) {
+            continue;
+        }
+        /* set before connecting, the window scale depends on them */
+        if (!rtmp_socket_set_nonblocking(rc->conn_sock) ||
+            rtmp_socket_set_buffer_sizes(
+                rc->conn_sock, &rc->socket_options) != RTMP_SUCCESS) {
+            rtmp_client_close_socket(rc);
+            continue;
+        }
+        ret = connect(
+            rc->conn_sock,
+            rc->address->ai_addr, (int)rc->address->ai_addrlen);
+        if (ret == 0) {
+            rtmp_client_on_connected(rc);
+            return RTMP_SUCCESS;
+        }
+        if (rtmp_socket_is_connecting()) {
+            rc->connect_state = RTMP_CLIENT_CONNECTING;
+            return RTMP_SUCCESS;
+        }
+        rtmp_client_close_socket(rc);
+    }
+    return rtmp_client_fail_connect(rc);
+}
+
+
+static void rtmp_client_on_connected(rtmp_client_t *rc)
+{
+    rc->connect_state = RTMP_CLIENT_CONNECTED;
+    freeaddrinfo(rc->addresses);
+    rc->addresses = NULL;
+    rc->address = NULL;
+    /* the buffer sizes were set before connecting */
+    rtmp_socket_set_options(rc->conn_sock, &rc->socket_options);
+}
+
+
+static void rtmp_client_close_socket(rtmp_client_t *rc)
+{
+    if (rc->conn_sock != -1) {
+        rtmp_socket_close(rc->conn_sock);
+        rc->conn_sock = -1;
+    }
+}
 
-    rc->amf_chunk_size = DEFAULT_AMF_CHUNK_SIZE;
-    rc->received_size = 0;
-    rc->will_send_size = 0;
-    rc->process_message = rtmp_client_handshake_first;
-    rc->message_number = 0.0;
-    rc->events = NULL;
 
-    return rc;
+/*
+ * Registers the handler called when the server invokes command, including
+ * responses such as _result.
+ */
+rtmp_result_t rtmp_client_on_command(
+    rtmp_client_t *rc, const char *command,
+    rtmp_client_command_handler_t handler, void *data)
+{
+    rtmp_command_handler_t command_handler;
+
+    command_handler.client = handler;
+    return rtmp_command_table_register(
+        rc->commands, command, command_handler, data);
+}
+
+
+/*
+ * Registers the handler called for every audio and video message received.
+ * The packet is only valid during the call.  NULL removes the handler.
+ */
+void rtmp_client_on_media(
+    rtmp_client_t *rc, rtmp_client_media_handler_t handler, void *data)
+{
+    rc->media_handler = handler;
+    rc->media_handler_data = data;
+}
+
+
+/*
+ * Registers the handler called for every event as it happens, on the
+ * thread processing the client, instead of queueing it.  NULL goes back
+ * to queueing.
+ */
+void rtmp_client_on_event(
+    rtmp_client_t *rc, rtmp_client_event_handler_t handler, void *data)
+{
+    rc->event_handler = handler;
+    rc->event_handler_data = data;
 }
 
 
 void rtmp_client_free(rtmp_client_t *rc)
 {
-    /* FIXME: clean up some memory */
-    if (rc->conn_sock != -1) {
-#ifdef __USE_W32_SOCKETS
-        closesocket(rc->conn_sock);
-        WSACleanup();
-#else
-        close(rc->conn_sock);
-#endif
+    size_t i;
+
+    /* completing an entry may move another one into its slot */
+    i = 0;
+    while (i < rc->transactions_capacity) {
+        if (rc->transactions[i].id != 0) {
+            rtmp_client_complete_transaction(
+                rc, &rc->transactions[i], RTMP_TRANSACTION_CANCELLED, NULL);
+        } else {
+            ++i;
+        }
+    }
+    rtmp_release(rc->transactions);
+    rtmp_client_close_socket(rc);
+    if (rc->resolver) {
+        rtmp_resolver_free(rc->resolver);
+    }
+    if (rc->addresses) {
+        freeaddrinfo(rc->addresses);
     }
 
     if (rc->url) {
-        free(rc->url);
+        rtmp_release(rc->url);
     }
     if (rc->protocol) {
-        free(rc->protocol);
+        rtmp_release(rc->protocol);
     }
     if (rc->host) {
-        free(rc->host);
+        rtmp_release(rc->host);
     }
     if (rc->path) {
-        free(rc->path);
+        rtmp_release(rc->path);
+    }
+    if (rc->play_stream_name) {
+        rtmp_release(rc->play_stream_name);
     }
+    if (rc->commands) {
+        rtmp_command_table_free(rc->commands);
+    }
+    if (rc->data) {
+        rtmp_packet_free((rtmp_packet_t*)rc->data);
+    }
+    rtmp_release_aligned(rc);
+}
+
+
+/*
+ * The backlog is ignored.  Set before the connection is established, the
+ * buffer sizes also set the window scale it negotiates.
+ */
+rtmp_result_t rtmp_client_set_socket_options(
+    rtmp_client_t *rc, const rtmp_socket_options_t *options)
+{
+    rc->socket_options = *options;
+    if (rc->connect_state != RTMP_CLIENT_CONNECTED) {
+        return RTMP_SUCCESS;
+    }
+    if (rtmp_socket_set_buffer_sizes(rc->conn_sock, options) !=
+        RTMP_SUCCESS) {
+        return RTMP_ERROR_UNKNOWN;
+    }
+    return rtmp_socket_set_options(rc->conn_sock, options);
+}
+
+
+/*
+ * Seconds an invoke waits for its response before its handler is called
+ * with RTMP_TRANSACTION_TIMED_OUT, RTMP_CALL_TIMEOUT by default.  0 waits
+ * for as long as the connection lasts.  Applies to the invokes sent next.
+ */
+void rtmp_client_set_call_timeout(rtmp_client_t *rc, double call_timeout)
+{
+    rc->call_timeout = call_timeout;
+}
+
+
+/*
+ * Seconds from rtmp_client_create to the connection being established,
+ * RTMP_CONNECT_TIMEOUT by default.  0 waits for as long as the system does.
+ */
+void rtmp_client_set_connect_timeout(rtmp_client_t *rc, double connect_timeout)
+{
+    rc->connect_timeout = connect_timeout;
+}
+
+
+void rtmp_client_get_stats(rtmp_client_t *rc, rtmp_stats_t *stats)
+{
+    memcpy(stats, &rc->stats, sizeof(rtmp_stats_t));
 }
 
 
@@ -961,19 +2585,19 @@ static void rtmp_client_parse_url(rtmp_client_t *rc, const char *url)
     char previous_charactor;
     char *host_and_port_number;
 
+    position = 0;
     for (i = 0; url[i]; ++i) {
         if (url[i] == ':') {
             if (i == 0) {
                 return;
 	    }
-            rc->protocol = malloc(i + 1);
+            rc->protocol = rtmp_allocate(RTMP_ALLOCATION_CONNECTION, i + 1);
             if (rc->protocol == NULL) {
                 return;
             }
             strncpy(rc->protocol, url, i);
-#ifdef DEBUG
-            printf("protocol: %s\n", rc->protocol);
-#endif
+            rc->protocol[i] = '\0';
+            RTMP_TRACE_TEXT(RTMP_TRACE_URL_PROTOCOL, 0, rc->protocol);
             position = i;
             break;
         }
@@ -1003,14 +2627,16 @@ static void rtmp_client_parse_url(rtmp_client_t *rc, const char *url)
             if (i == 0) {
                 break;
             }
-            host_and_port_number = malloc(i + 1);
+            host_and_port_number = rtmp_allocate(
+                RTMP_ALLOCATION_CONNECTION, i + 1);
             if (host_and_port_number == NULL) {
                 return;
             }
             strncpy(host_and_port_number, url + position, i);
+            host_and_port_number[i] = '\0';
             rtmp_client_parse_host_and_port_number(
                 rc, host_and_port_number);
-            free(host_and_port_number);
+            rtmp_release(host_and_port_number);
             position += i;
             break;
         }
@@ -1021,34 +2647,59 @@ static void rtmp_client_parse_url(rtmp_client_t *rc, const char *url)
     position++;
 
     length = strlen(url + position);
-    rc->path = malloc(length + 1);
+    rc->path = rtmp_allocate(RTMP_ALLOCATION_CONNECTION, length + 1);
     if (rc->path == NULL) {
         return;
     }
     strncpy(rc->path, url + position, length);
-#ifdef DEBUG
-    printf("path: %s\n", rc->path);
-#endif
+    rc->path[length] = '\0';
+    RTMP_TRACE_TEXT(RTMP_TRACE_URL_PATH, 0, rc->path);
 }
 
 
+/* an IPv6 address is written in brackets, as in [::1]:1935 */
 static void rtmp_client_parse_host_and_port_number(
     rtmp_client_t *rc, const char *host_and_port_number)
 {
     int i;
 
+    if (host_and_port_number[0] == '[') {
+        for (i = 1; host_and_port_number[i]; ++i) {
+            if (host_and_port_number[i] == ']') {
+                break;
+            }
+        }
+        if (host_and_port_number[i] == '\0') {
+            return;
+        }
+        rc->host = rtmp_allocate(RTMP_ALLOCATION_CONNECTION, i);
+        if (rc->host == NULL) {
+            return;
+        }
+        strncpy(rc->host, host_and_port_number + 1, i - 1);
+        rc->host[i - 1] = '\0';
+        rc->port_number = 1935;
+        if (host_and_port_number[i + 1] == ':') {
+            rc->port_number = atoi(host_and_port_number + i + 2);
+        }
+        RTMP_TRACE_TEXT(RTMP_TRACE_URL_HOST, rc->port_number, rc->host);
+        return;
+    }
+
     for (i = 0; host_and_port_number[i]; ++i) {
         if (host_and_port_number[i] == ':') {
-            rc->host = malloc(i + 1);
+            rc->host = rtmp_allocate(RTMP_ALLOCATION_CONNECTION, i + 1);
             if (rc->host == NULL) {
                 return;
             }
             strncpy(rc->host, host_and_port_number, i);
+            rc->host[i] = '\0';
             break;
 	}
     }
     if (rc->host == NULL) {
-        rc->host = malloc(strlen(host_and_port_number) + 1);
+        rc->host = rtmp_allocate(
+            RTMP_ALLOCATION_CONNECTION, strlen(host_and_port_number) + 1);
         if (rc->host == NULL) {
             return;
         }
@@ -1057,69 +2708,111 @@ static void rtmp_client_parse_host_and_port_number(
     } else {
         rc->port_number = atoi(host_and_port_number + i + 1);
     }
-#ifdef DEBUG
-    printf("host: %s\n", rc->host);
-    printf("port_number: %d\n", rc->port_number);
-#endif
+    RTMP_TRACE_TEXT(RTMP_TRACE_URL_HOST, rc->port_number, rc->host);
 }
 
 
-void rtmp_client_process_message(rtmp_client_t *rc)
+/*
+ * Returns RTMP_ERROR_DISCONNECTED once the connection is over, after adding
+ * a NetConnection.Connect.Closed event: with the level status when the
+ * server closed it, error when it failed.  A connection which could not be
+ * established adds NetConnection.Connect.Failed instead.
+ */
+rtmp_result_t rtmp_client_process_message(rtmp_client_t *rc)
 {
-    fd_set fdset;
-    int ret;
     int received_size;
     int sent_size;
-    struct timeval timeout;
+    rtmp_result_t result;
 
-    FD_ZERO(&fdset);
-    FD_SET(rc->conn_sock, &fdset);
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    ret = select(rc->conn_sock + 1, &fdset, NULL, NULL, &timeout);
-    if (ret == 1) {
+    if (rc->disconnected) {
+        return RTMP_ERROR_DISCONNECTED;
+    }
+    if (rc->connect_state != RTMP_CLIENT_CONNECTED) {
+        result = rtmp_client_continue_connect(rc);
+        if (result != RTMP_SUCCESS ||
+            rc->connect_state != RTMP_CLIENT_CONNECTED) {
+            return result;
+        }
+    }
+    if (rc->transactions_num > 0) {
+        rtmp_client_expire_transactions(rc, rtmp_get_time());
+    }
+
+    /* a full buffer would make recv return 0 as at the end of stream */
+    if (!rc->peer_closed && rc->received_size < RTMP_BUFFER_SIZE &&
+        rtmp_socket_is_ready(rc->conn_sock, 0)) {
         received_size = recv(
             rc->conn_sock,
             rc->received_buffer + rc->received_size,
             RTMP_BUFFER_SIZE - rc->received_size, 0);
-        /* FIXME: process finishing when recv returns -1 */
         if (received_size > 0) {
-#ifdef DEBUG
-            printf("received: %d\n", received_size);
-#endif
+            RTMP_TRACE(RTMP_TRACE_RECEIVED, received_size);
             rc->received_size += received_size;
+            rc->stats.bytes_in += received_size;
+            rc->received_time = rtmp_get_time();
+        } else if (received_size == 0) {
+            RTMP_TRACE(RTMP_TRACE_PEER_CLOSED, rc->conn_sock);
+            rc->peer_closed = 1;
+        } else if (!rtmp_socket_should_retry()) {
+            return rtmp_client_disconnect(rc, "error");
         }
     }
 
-    rc->process_message(rc);
+    rtmp_client_process_received(rc);
+    if (rc->failed) {
+        return rtmp_client_disconnect(rc, "error");
+    }
 
     if (rc->will_send_size > 0) {
-        FD_ZERO(&fdset);
-        FD_SET(rc->conn_sock, &fdset);
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 0;
-        ret = select(rc->conn_sock + 1, NULL, &fdset, NULL, &timeout);
-        if (ret == 1) {
+        if (rtmp_socket_is_ready(rc->conn_sock, 1)) {
             sent_size = send(
                 rc->conn_sock,
                 rc->will_send_buffer,
-                rc->will_send_size, 0);
-#ifdef DEBUG
-            if (sent_size > 0) {
-                printf("sent: %d\n", sent_size);
-            }
-#endif
-            if (sent_size != -1) {
-                if (rc->will_send_size - sent_size > 0) {
-                    memmove(
-                        rc->will_send_buffer,
-                        rc->will_send_buffer + sent_size,
-                        rc->will_send_size - sent_size);
+                rc->will_send_size, RTMP_SEND_FLAGS);
+            if (sent_size == -1) {
+                if (!rtmp_socket_should_retry()) {
+                    return rtmp_client_disconnect(rc, "error");
                 }
-                rc->will_send_size -= sent_size;
+                return RTMP_SUCCESS;
+            }
+            RTMP_TRACE(RTMP_TRACE_SENT, sent_size);
+            rc->stats.bytes_out += sent_size;
+            rtmp_send_marks_pop(
+                &rc->send_marks, rc->stats.bytes_out,
+                &rc->stats.send_latency);
+            if (rc->will_send_size - sent_size > 0) {
+                rc->stats.partial_writes++;
+                memmove(
+                    rc->will_send_buffer,
+                    rc->will_send_buffer + sent_size,
+                    rc->will_send_size - sent_size);
             }
+            rc->will_send_size -= sent_size;
         }
     }
+
+    if (rc->peer_closed && rc->will_send_size == 0) {
+        return rtmp_client_disconnect(rc, "status");
+    }
+    return RTMP_SUCCESS;
+}
+
+
+static rtmp_result_t rtmp_client_disconnect(rtmp_client_t *rc, const char *level)
+{
+    RTMP_TRACE(RTMP_TRACE_DISCONNECTED, rc->conn_sock);
+    rc->disconnected = 1;
+    rtmp_client_add_event(rc, "NetConnection.Connect.Closed", level);
+    return RTMP_ERROR_DISCONNECTED;
+}
+
+
+static rtmp_result_t rtmp_client_fail_connect(rtmp_client_t *rc)
+{
+    RTMP_TRACE(RTMP_TRACE_DISCONNECTED, rc->conn_sock);
+    rc->disconnected = 1;
+    rtmp_client_add_event(rc, "NetConnection.Connect.Failed", "error");
+    return RTMP_ERROR_DISCONNECTED;
 }
 
 
@@ -1133,6 +2826,11 @@ static int rtmp_client_set_will_send_buffer(
         rc->will_send_buffer + rc->will_send_size,
         data, size);
     rc->will_send_size += size;
+    if (rc->will_send_size > rc->stats.send_queue_high_water) {
+        rc->stats.send_queue_high_water = rc->will_send_size;
+    }
+    rtmp_send_marks_push(
+        &rc->send_marks, rc->stats.bytes_out + rc->will_send_size);
     return RTMP_SUCCESS;
 }
 
@@ -1162,6 +2860,7 @@ static void rtmp_client_handshake_first(rtmp_client_t *rc)
     unsigned long now;
 #endif
 
+    rc->handshake_started = rtmp_get_time();
     rtmp_client_set_will_send_buffer(rc, magic, 1);
 
 #if defined(__WIN32__) || defined(WIN32)
@@ -1174,181 +2873,600 @@ static void rtmp_client_handshake_first(rtmp_client_t *rc)
     for (i = 8; i < RTMP_HANDSHAKE_SIZE; ++i) {
         rc->handshake[i] = (unsigned char)(rand() % 256);
     }
-    rtmp_client_set_will_send_buffer(
-        rc, rc->handshake, RTMP_HANDSHAKE_SIZE);
-#ifdef DEBUG
-    printf("handshake 1\n");
-#endif
-    rc->process_message = rtmp_client_handshake_second;
+    rtmp_client_set_will_send_buffer(
+        rc, rc->handshake, RTMP_HANDSHAKE_SIZE);
+    RTMP_TRACE(RTMP_TRACE_HANDSHAKE_1, 0);
+    rc->process_message = rtmp_client_handshake_second;
+}
+
+
+static void rtmp_client_handshake_second(rtmp_client_t *rc)
+{
+    unsigned char *server_signature;
+    double handshake_time;
+
+    if (rc->received_size >= (1 + RTMP_HANDSHAKE_SIZE * 2)) {
+        server_signature = rc->received_buffer + 1;
+        rtmp_client_set_will_send_buffer(
+            rc, server_signature, RTMP_HANDSHAKE_SIZE);
+        /* 1 when the response echoes the handshake we sent */
+        RTMP_TRACE(
+            RTMP_TRACE_HANDSHAKE_2,
+            memcmp(
+                rc->handshake,
+                rc->received_buffer + 1 + RTMP_HANDSHAKE_SIZE,
+                RTMP_HANDSHAKE_SIZE) == 0);
+        rtmp_client_delete_received_buffer(
+            rc, 1 + RTMP_HANDSHAKE_SIZE * 2);
+        handshake_time = rtmp_get_time() - rc->handshake_started;
+        rc->stats.handshakes = 1;
+        rc->stats.handshake_time = handshake_time;
+        rc->stats.handshake_time_max = handshake_time;
+        rc->data = rtmp_packet_create();
+        rc->process_message = rtmp_client_get_packet;
+        if (rc->play_stream_name) {
+            rtmp_client_send_pipelined_play(rc);
+        } else {
+            rtmp_client_connect(rc);
+        }
+    }
+}
+
+
+/* the commands rtmp_client_play_url sends in one flight */
+static void rtmp_client_send_pipelined_play(rtmp_client_t *rc)
+{
+    if (rc->window_ack_size > 0) {
+        rtmp_client_send_window_ack_size(rc, rc->window_ack_size);
+    }
+    rtmp_client_connect(rc);
+    rtmp_client_create_stream(rc);
+    rc->stream_id = RTMP_CLIENT_FIRST_STREAM_ID;
+    if (rc->buffer_length > 0) {
+        rtmp_client_send_buffer_length(rc, rc->buffer_length);
+    }
+    rtmp_client_play(rc, rc->play_stream_name);
+}
+
+
+static void rtmp_client_get_packet(rtmp_client_t *rc)
+{
+    rtmp_result_t ret;
+    size_t packet_size;
+    rtmp_packet_t *packet;
+
+    if (rc->received_size == 0) {
+        return;
+    }
+    packet = (rtmp_packet_t*)rc->data;
+    ret = rtmp_packet_analyze_data(
+        packet,
+        rc->received_buffer, rc->received_size,
+        rc->amf_chunk_size,
+        &packet_size);
+    if (ret == RTMP_SUCCESS) {
+        rtmp_client_delete_received_buffer(rc, packet_size);
+        rtmp_stats_count_message(rc->stats.messages_in, packet->data_type);
+        rtmp_client_process_packet(rc, packet);
+        rtmp_histogram_record(
+            &rc->stats.dispatch_latency,
+            rtmp_get_time() - rc->received_time);
+    } else if (ret != RTMP_ERROR_DIVIDED_PACKET ||
+               rc->received_size == RTMP_BUFFER_SIZE) {
+        /*
+         * An incomplete message only waits for the rest, unless it can
+         * not fit in the buffer.  Nothing after a message which can not
+         * be parsed can be, so the connection is closed.
+         */
+        if (ret == RTMP_ERROR_DIVIDED_PACKET) {
+            ret = RTMP_ERROR_BUFFER_OVERFLOW;
+        }
+        rc->stats.parse_errors[ret]++;
+        rc->failed = 1;
+    }
+}
+
+
+/* see rtmp_server_client_process_received */
+static void rtmp_client_process_received(rtmp_client_t *rc)
+{
+    size_t received_size;
+
+    do {
+        received_size = rc->received_size;
+        rc->process_message(rc);
+    } while (rc->received_size > 0 && rc->received_size != received_size);
+}
+
+
+void rtmp_client_process_packet(
+    rtmp_client_t *rc, rtmp_packet_t *packet)
+{
+    rtmp_packet_inner_amf_t *inner_amf;
+    amf_packet_t *amf;
+    const char *code;
+    const char *level;
+    rtmp_command_entry_t *entry;
+    double transaction_id;
+    rtmp_packet_inner_amf_t *arguments;
+
+    switch (packet->data_type) {
+    case RTMP_DATATYPE_CHUNK_SIZE:
+        rc->amf_chunk_size = read_be32int(packet->body_data);
+        break;
+    case RTMP_DATATYPE_BYTES_READ:
+        break;
+    case RTMP_DATATYPE_PING:
+        if (packet->body_data_length >= 6 &&
+            read_be16int(packet->body_data) == RTMP_PING_REQUEST) {
+            rtmp_client_send_ping_response(
+                rc, read_be32int(packet->body_data + 2));
+        }
+        break;
+    case RTMP_DATATYPE_SERVER_BW:
+        break;
+    case RTMP_DATATYPE_CLIENT_BW:
+        break;
+    case RTMP_DATATYPE_AUDIO_DATA:
+    case RTMP_DATATYPE_VIDEO_DATA:
+        if (rc->media_handler) {
+            rc->media_handler(rc, packet, rc->media_handler_data);
+        }
+        break;
+    case RTMP_DATATYPE_NOTIFY:
+        inner_amf = packet->inner_amf_packets;
+        amf = inner_amf->amf;
+        if (amf->datatype != AMF_DATATYPE_STRING) {
+            break;
+        }
+        RTMP_TRACE_TEXT(RTMP_TRACE_NOTIFY_COMMAND, 0, amf->string.value);
+        rtmp_packet_retrieve_status_info(packet, &code, &level);
+        if (code == NULL || level == NULL) {
+            break;
+        }
+        RTMP_TRACE_TEXT(RTMP_TRACE_STATUS_CODE, 0, code);
+        RTMP_TRACE_TEXT(RTMP_TRACE_STATUS_LEVEL, 0, level);
+        rtmp_client_add_event(rc, code, level);
+        break;
+    case RTMP_DATATYPE_SHARED_OBJECT:
+        break;
+    case RTMP_DATATYPE_MESSAGE:
+        if (packet->body_type != RTMP_BODY_TYPE_AMF) {
+            break;
+        }
+        /* AMF3 command, handled as an invoke */
+        /* FALLTHROUGH */
+    case RTMP_DATATYPE_INVOKE:
+        entry = rtmp_command_table_find_invoke(
+            rc->commands, packet, &transaction_id, &arguments);
+        if (entry == NULL) {
+            break;
+        }
+        RTMP_TRACE_TEXT(RTMP_TRACE_INVOKE_COMMAND, 0, entry->name);
+        entry->handler.client(rc, transaction_id, arguments, entry->data);
+        break;
+    default:
+        break;
+    }
+}
+
+
+static void rtmp_client_on_result(
+    rtmp_client_t *rc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, void *data)
+{
+    (void)data;
+
+    rtmp_client_on_response(
+        rc, transaction_id, arguments, RTMP_TRANSACTION_RESULT);
+}
+
+
+static void rtmp_client_on_error(
+    rtmp_client_t *rc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, void *data)
+{
+    (void)data;
+
+    rtmp_client_on_response(
+        rc, transaction_id, arguments, RTMP_TRANSACTION_ERROR);
+}
+
+
+/*
+ * Completes the pending invoke the response is for.  A response nothing
+ * waits for is turned into an event if it carries a status.
+ */
+static void rtmp_client_on_response(
+    rtmp_client_t *rc, double transaction_id,
+    rtmp_packet_inner_amf_t *arguments, rtmp_transaction_status_t status)
+{
+    rtmp_transaction_t *entry;
+    long id;
+    const char *code;
+    const char *level;
+
+    /* a whole number in range, or the peer's id can not be ours */
+    entry = NULL;
+    if (transaction_id >= 1 && transaction_id < (double)LONG_MAX) {
+        id = (long)transaction_id;
+        if (!(transaction_id > (double)id)) {
+            entry = rtmp_client_find_transaction(rc, id);
+        }
+    }
+    if (entry != NULL) {
+        rtmp_client_complete_transaction(rc, entry, status, arguments);
+        return;
+    }
+    rtmp_packet_retrieve_status_info_of_amf(arguments, &code, &level);
+    if (code == NULL || level == NULL) {
+        return;
+    }
+    RTMP_TRACE_TEXT(RTMP_TRACE_STATUS_CODE, 0, code);
+    RTMP_TRACE_TEXT(RTMP_TRACE_STATUS_LEVEL, 0, level);
+    rtmp_client_add_event(rc, code, level);
+}
+
+
+/* the status of the response becomes an event, as it always has */
+static void rtmp_client_on_connect_result(
+    rtmp_client_t *rc, rtmp_transaction_t *transaction, void *data)
+{
+    const char *code;
+    const char *level;
+
+    (void)data;
+
+    if (transaction->status == RTMP_TRANSACTION_TIMED_OUT) {
+        rtmp_client_add_event(rc, "NetConnection.Connect.Failed", "error");
+        return;
+    }
+    if (transaction->arguments == NULL) {
+        return;
+    }
+    rtmp_packet_retrieve_status_info_of_amf(
+        transaction->arguments, &code, &level);
+    if (code == NULL || level == NULL) {
+        return;
+    }
+    RTMP_TRACE_TEXT(RTMP_TRACE_STATUS_CODE, 0, code);
+    RTMP_TRACE_TEXT(RTMP_TRACE_STATUS_LEVEL, 0, level);
+    rtmp_client_add_event(rc, code, level);
+}
+
+
+/*
+ * The number is the stream id.  A play sent ahead on another stream id is
+ * sent again on this one.
+ */
+static void rtmp_client_on_create_stream_result(
+    rtmp_client_t *rc, rtmp_transaction_t *transaction, void *data)
+{
+    long stream_id;
+
+    (void)data;
+
+    if (transaction->status != RTMP_TRANSACTION_RESULT) {
+        if (rc->play_stream_name) {
+            rtmp_release(rc->play_stream_name);
+            rc->play_stream_name = NULL;
+        }
+        return;
+    }
+    stream_id = (long)transaction->number;
+    if (rc->play_stream_name) {
+        if (stream_id != rc->stream_id) {
+            rc->stream_id = stream_id;
+            if (rc->buffer_length > 0) {
+                rtmp_client_send_buffer_length(rc, rc->buffer_length);
+            }
+            rtmp_client_play(rc, rc->play_stream_name);
+        }
+        rtmp_release(rc->play_stream_name);
+        rc->play_stream_name = NULL;
+    }
+    rc->stream_id = stream_id;
+}
+
+
+/*
+ * The slot of transactions holding id, or else the empty slot it goes in.
+ * The table is open addressed, probing from slot id & (capacity - 1), and
+ * at most half full, so that an empty slot ends every probe.  Transaction
+ * ids are handed out in order, so the probes stay short even while some
+ * invokes are never answered.
+ */
+static rtmp_transaction_t *rtmp_transaction_probe(
+    rtmp_transaction_t *transactions, size_t capacity, long id)
+{
+    size_t i;
+
+    i = (size_t)id & (capacity - 1);
+    while (transactions[i].id != 0 && transactions[i].id != id) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &transactions[i];
 }
 
 
-static void rtmp_client_handshake_second(rtmp_client_t *rc)
+/* at most RTMP_CLIENT_CALLS_MAX invokes wait at once, the others fail */
+static rtmp_result_t rtmp_client_add_transaction(
+    rtmp_client_t *rc, long id,
+    rtmp_client_result_handler_t handler, void *data)
 {
-    unsigned char *server_signature;
-    unsigned char *response;
+    rtmp_transaction_t *transactions;
+    rtmp_transaction_t *entry;
+    size_t capacity;
+    size_t i;
 
-    if (rc->received_size >= (1 + RTMP_HANDSHAKE_SIZE * 2)) {
-        server_signature = rc->received_buffer + 1;
-        response = rc->received_buffer + 1 + RTMP_HANDSHAKE_SIZE;
-        rtmp_client_set_will_send_buffer(
-            rc, server_signature, RTMP_HANDSHAKE_SIZE);
-#ifdef DEBUG
-        if (memcmp(rc->handshake, response, RTMP_HANDSHAKE_SIZE) == 0) {
-            printf("handshake response OK!\n");
+    if (rc->transactions_num >= RTMP_CLIENT_CALLS_MAX) {
+        return RTMP_ERROR_LACKED_MEMORY;
+    }
+    if ((rc->transactions_num + 1) * 2 > rc->transactions_capacity) {
+        capacity = rc->transactions_capacity ?
+            rc->transactions_capacity * 2 : 8;
+        transactions = (rtmp_transaction_t*)rtmp_allocate_zeroed(
+            RTMP_ALLOCATION_CONNECTION, capacity, sizeof(rtmp_transaction_t));
+        if (transactions == NULL) {
+            return RTMP_ERROR_MEMORY_ALLOCATION;
+        }
+        for (i = 0; i < rc->transactions_capacity; ++i) {
+            if (rc->transactions[i].id != 0) {
+                *rtmp_transaction_probe(
+                    transactions, capacity, rc->transactions[i].id) =
+                    rc->transactions[i];
+            }
+        }
+        rtmp_release(rc->transactions);
+        rc->transactions = transactions;
+        rc->transactions_capacity = capacity;
+    }
+
+    entry = rtmp_transaction_probe(
+        rc->transactions, rc->transactions_capacity, id);
+    entry->id = id;
+    entry->handler = handler;
+    entry->data = data;
+    entry->deadline = 0;
+    if (rc->call_timeout > 0) {
+        entry->deadline = rtmp_get_time() + rc->call_timeout;
+        if (rc->transactions_deadline <= 0 ||
+            entry->deadline < rc->transactions_deadline) {
+            rc->transactions_deadline = entry->deadline;
         }
-#endif
-        rtmp_client_delete_received_buffer(
-            rc, 1 + RTMP_HANDSHAKE_SIZE * 2);
-#ifdef DEBUG
-        printf("handshake 2\n");
-#endif
-        rc->data = rtmp_packet_create();
-        rc->process_message = rtmp_client_get_packet;
-        rtmp_client_connect(rc);
     }
+    entry->status = RTMP_TRANSACTION_RESULT;
+    entry->arguments = NULL;
+    entry->number = 0;
+    rc->transactions_num++;
+    return RTMP_SUCCESS;
 }
 
 
-static void rtmp_client_get_packet(rtmp_client_t *rc)
+static rtmp_transaction_t *rtmp_client_find_transaction(
+    rtmp_client_t *rc, long id)
 {
-    rtmp_result_t ret;
-    size_t packet_size;
-    rtmp_packet_t *packet;
+    rtmp_transaction_t *entry;
 
-    packet = (rtmp_packet_t*)rc->data;
-    ret = rtmp_packet_analyze_data(
-        packet,
-        rc->received_buffer, rc->received_size,
-        rc->amf_chunk_size,
-        &packet_size);
-    if (ret == RTMP_SUCCESS) {
-        rtmp_client_delete_received_buffer(rc, packet_size);
-        rtmp_client_process_packet(rc, packet);
+    if (rc->transactions_num == 0 || id == 0) {
+        return NULL;
+    }
+    entry = rtmp_transaction_probe(
+        rc->transactions, rc->transactions_capacity, id);
+    if (entry->id != id) {
+        return NULL;
     }
+    return entry;
 }
 
 
-void rtmp_client_process_packet(
-    rtmp_client_t *rc, rtmp_packet_t *packet)
+/*
+ * Empties the slot of entry, moving back the entries after it which
+ * probed past it, so that no probe ends early.  An entry from further on
+ * may take the slot.
+ */
+static void rtmp_client_remove_transaction(
+    rtmp_client_t *rc, rtmp_transaction_t *entry)
 {
-    rtmp_packet_inner_amf_t *inner_amf;
-    amf_packet_t *amf;
-    char *command;
-    char *code;
-    char *level;
-
-    switch (packet->data_type) {
-    case RTMP_DATATYPE_CHUNK_SIZE:
-        rc->amf_chunk_size = read_be32int(packet->body_data);
-        break;
-    case RTMP_DATATYPE_BYTES_READ:
-        break;
-    case RTMP_DATATYPE_PING:
-        break;
-    case RTMP_DATATYPE_SERVER_BW:
-        break;
-    case RTMP_DATATYPE_CLIENT_BW:
-        break;
-    case RTMP_DATATYPE_AUDIO_DATA:
-        break;
-    case RTMP_DATATYPE_VIDEO_DATA:
-        break;
-    case RTMP_DATATYPE_MESSAGE:
-        break;
-    case RTMP_DATATYPE_NOTIFY:
-        inner_amf = packet->inner_amf_packets;
-        amf = inner_amf->amf;
-        if (amf->datatype != AMF_DATATYPE_STRING) {
+    size_t mask;
+    size_t hole;
+    size_t i;
+    size_t home;
+
+    mask = rc->transactions_capacity - 1;
+    hole = (size_t)(entry - rc->transactions);
+    i = hole;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (rc->transactions[i].id == 0) {
             break;
         }
-        command = amf->string.value;
-#ifdef DEBUG
-        printf("command: %s\n", command);
-#endif
-        rtmp_packet_retrieve_status_info(packet, &code, &level);
-        if (code == NULL || level == NULL) {
-            break;
+        /* it may move unless its probe starts between the hole and it */
+        home = (size_t)rc->transactions[i].id & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            rc->transactions[hole] = rc->transactions[i];
+            hole = i;
         }
-#ifdef DEBUG
-        printf("code: %s\n", code);
-        printf("level: %s\n", level);
-#endif
-        rtmp_client_add_event(rc, code, level);
-        break;
-    case RTMP_DATATYPE_SHARED_OBJECT:
-        break;
-    case RTMP_DATATYPE_INVOKE:
-        inner_amf = packet->inner_amf_packets;
-        amf = inner_amf->amf;
-        if (amf->datatype != AMF_DATATYPE_STRING) {
+    }
+    rc->transactions[hole].id = 0;
+    rc->transactions_num--;
+}
+
+
+/*
+ * Frees the slot before calling the handler, which may invoke again and
+ * so move the table.
+ */
+static void rtmp_client_complete_transaction(
+    rtmp_client_t *rc, rtmp_transaction_t *entry,
+    rtmp_transaction_status_t status, rtmp_packet_inner_amf_t *arguments)
+{
+    rtmp_transaction_t transaction;
+    rtmp_packet_inner_amf_t *argument;
+
+    transaction = *entry;
+    rtmp_client_remove_transaction(rc, entry);
+
+    transaction.status = status;
+    transaction.arguments = arguments;
+    for (argument = arguments; argument; argument = argument->next) {
+        if (argument->amf->datatype == AMF_DATATYPE_NUMBER) {
+            transaction.number = argument->amf->number.value;
             break;
         }
-        command = amf->string.value;
-#ifdef DEBUG
-        printf("command: %s\n", command);
-#endif
-        if (strcmp(command, "_result") == 0) {
-            rtmp_packet_retrieve_status_info(packet, &code, &level);
-            if (code == NULL || level == NULL) {
-                break;
-            }
-#ifdef DEBUG
-            printf("code: %s\n", code);
-            printf("level: %s\n", level);
-#endif
-            rtmp_client_add_event(rc, code, level);
+    }
+    transaction.handler(rc, &transaction, transaction.data);
+}
+
+
+/* times out the invokes past their deadline, once the earliest passes */
+static void rtmp_client_expire_transactions(rtmp_client_t *rc, double now)
+{
+    size_t i;
+    double deadline;
+
+    if (rc->transactions_deadline <= 0 || now < rc->transactions_deadline) {
+        return;
+    }
+    /*
+     * Completing an entry may move another one into its slot, which is
+     * looked at again.  A handler which invokes again may grow the table
+     * and move the entries left; the scan goes on from the same slot and
+     * any expired entry it misses keeps the deadline past, for the next
+     * call.
+     */
+    i = 0;
+    while (i < rc->transactions_capacity) {
+        if (rc->transactions[i].id != 0 &&
+            rc->transactions[i].deadline > 0 &&
+            rc->transactions[i].deadline <= now) {
+            rtmp_client_complete_transaction(
+                rc, &rc->transactions[i], RTMP_TRANSACTION_TIMED_OUT, NULL);
+        } else {
+            ++i;
         }
-        break;
-    default:
-        break;
     }
+
+    deadline = 0;
+    for (i = 0; i < rc->transactions_capacity; ++i) {
+        if (rc->transactions[i].id != 0 &&
+            rc->transactions[i].deadline > 0 &&
+            (deadline <= 0 || rc->transactions[i].deadline < deadline)) {
+            deadline = rc->transactions[i].deadline;
+        }
+    }
+    rc->transactions_deadline = deadline;
 }
 
 
+/*
+ * Hands the event to the event handler, or else queues it in the ring.
+ * Nothing is allocated; a full ring drops the event.
+ */
 rtmp_result_t rtmp_client_add_event(
-    rtmp_client_t *rc, char *code, char *level)
+    rtmp_client_t *rc, const char *code, const char *level)
 {
+    rtmp_event_t handler_event;
     rtmp_event_t *event;
-    rtmp_event_t *last_event;
-
-    event = (rtmp_event_t*)malloc(sizeof(rtmp_event_t));
-    event->code = (char*)malloc(strlen(code) + 1);
-    strcpy(event->code, code);
-    event->level = (char*)malloc(strlen(level) + 1);
-    strcpy(event->level, level);
-    event->next = NULL;
-    if (rc->events == NULL) {
-        rc->events = event;
+    unsigned int tail;
+    int i;
+
+    tail = rc->events.tail;
+    if (rc->event_handler) {
+        event = &handler_event;
     } else {
-        last_event = rc->events;
-        while (last_event->next != NULL) {
-            last_event = last_event->next;
+        if (tail - RTMP_LOAD_ACQUIRE(rc->events.head) >=
+            RTMP_EVENT_RING_SIZE) {
+            rc->events.dropped++;
+            return RTMP_ERROR_LACKED_MEMORY;
+        }
+        event = &rc->events.events[tail & (RTMP_EVENT_RING_SIZE - 1)];
+    }
+
+    event->code = rtmp_event_intern(
+        code, event->code_buffer, sizeof(event->code_buffer));
+    event->id = RTMP_EVENT_UNKNOWN;
+    for (i = RTMP_EVENT_UNKNOWN + 1; i < RTMP_EVENT_CODE_NUM; ++i) {
+        if (event->code == amf_intern_strings[rtmp_event_code_interns[i]]) {
+            event->id = (rtmp_event_code_t)i;
+            break;
         }
-        last_event->next = event;
+    }
+    event->level = rtmp_event_intern(
+        level, event->level_buffer, sizeof(event->level_buffer));
+    if (event->level == AMF_INTERNED(STATUS)) {
+        event->level_id = RTMP_EVENT_LEVEL_STATUS;
+    } else if (event->level == AMF_INTERNED(WARNING)) {
+        event->level_id = RTMP_EVENT_LEVEL_WARNING;
+    } else if (event->level == AMF_INTERNED(LEVEL_ERROR)) {
+        event->level_id = RTMP_EVENT_LEVEL_ERROR;
+    } else {
+        event->level_id = RTMP_EVENT_LEVEL_UNKNOWN;
+    }
+
+    if (rc->event_handler) {
+        rc->event_handler(rc, event, rc->event_handler_data);
+    } else {
+        RTMP_STORE_RELEASE(rc->events.tail, tail + 1);
     }
 
     return RTMP_SUCCESS;
 }
 
 
+/* the interned copy of string, or else string cut to fit in buffer */
+static const char *rtmp_event_intern(
+    const char *string, char *buffer, size_t buffer_size)
+{
+    const char *interned;
+    size_t length;
+
+    length = strlen(string);
+    interned = amf_intern_lookup((const unsigned char*)string, length);
+    if (interned != NULL) {
+        return interned;
+    }
+    if (length >= buffer_size) {
+        length = buffer_size - 1;
+    }
+    memcpy(buffer, string, length);
+    buffer[length] = '\0';
+    return buffer;
+}
+
+
+/*
+ * The oldest queued event, or NULL.  Events may be read by another thread
+ * than the one processing the client, as long as only one thread reads.
+ */
 rtmp_event_t *rtmp_client_get_event(rtmp_client_t *rc)
 {
-    return rc->events;
+    unsigned int head;
+
+    head = rc->events.head;
+    if (head == RTMP_LOAD_ACQUIRE(rc->events.tail)) {
+        return NULL;
+    }
+    return &rc->events.events[head & (RTMP_EVENT_RING_SIZE - 1)];
 }
 
 
+/* releases the event returned by rtmp_client_get_event */
 void rtmp_client_delete_event(rtmp_client_t *rc)
 {
-    rtmp_event_t *delete_event;
-    rtmp_event_t *next_event;
+    unsigned int head;
+
+    head = rc->events.head;
+    if (head == RTMP_LOAD_ACQUIRE(rc->events.tail)) {
+        return;
+    }
+    RTMP_STORE_RELEASE(rc->events.head, head + 1);
+}
 
-    delete_event = rc->events;
-    free(delete_event->code);
-    free(delete_event->level);
-    free(delete_event);
 
-    rc->events = next_event;
+unsigned long rtmp_client_get_dropped_events(rtmp_client_t *rc)
+{
+    return rc->events.dropped;
 }
 
 
@@ -1365,17 +3483,51 @@ rtmp_result_t rtmp_client_send_packet(
         1024,
         rc->amf_chunk_size,
         &packet_size);
-    rtmp_client_set_will_send_buffer(
+    if (result != RTMP_SUCCESS) {
+        return result;
+    }
+    result = rtmp_client_set_will_send_buffer(
         rc, fuck, packet_size);
+    if (result != RTMP_SUCCESS) {
+        return result;
+    }
+    rtmp_stats_count_message(rc->stats.messages_out, packet->data_type);
 
     return RTMP_SUCCESS;
 }
 
 
-void rtmp_client_connect(rtmp_client_t *rc)
+/*
+ * Encoding asked for in the connect command, RTMP_OBJECT_ENCODING_AMF3 for
+ * Flex style peers.  Takes effect if called before the handshake finishes.
+ */
+void rtmp_client_set_object_encoding(
+    rtmp_client_t *rc, double object_encoding)
+{
+    rc->object_encoding = object_encoding;
+}
+
+
+/*
+ * Starts an invoke of command in the client's packet, with the next
+ * transaction id, which is returned.  With a handler the invoke waits for
+ * its response, and 0 is returned if it can not.  Before the handshake
+ * there is no packet yet and 0 is returned too.
+ */
+static long rtmp_client_start_invoke(
+    rtmp_client_t *rc, const char *command,
+    rtmp_client_result_handler_t handler, void *data)
 {
     rtmp_packet_t *rtmp_packet;
-    amf_packet_t *amf_object;
+
+    if (rc->data == NULL) {
+        return 0;
+    }
+    if (handler != NULL &&
+        rtmp_client_add_transaction(
+            rc, rc->message_number + 1, handler, data) != RTMP_SUCCESS) {
+        return 0;
+    }
 
     rtmp_packet = (rtmp_packet_t*)rc->data;
     rtmp_packet_cleanup(rtmp_packet);
@@ -1385,11 +3537,83 @@ void rtmp_client_connect(rtmp_client_t *rc)
     rc->message_number++;
     rtmp_packet_add_amf(
         rtmp_packet,
-        amf_packet_create_string("connect"));
+        amf_packet_create_string(command));
     rtmp_packet_add_amf(
         rtmp_packet,
         amf_packet_create_number((double)rc->message_number));
 
+    return rc->message_number;
+}
+
+
+/*
+ * Invokes command with a null command object and the arguments, which the
+ * call takes over.  handler, if not NULL, is called with the response, see
+ * rtmp_transaction_t.  Returns the transaction id, 0 if the invoke could
+ * not be sent, queued or waited for.  Up to RTMP_CLIENT_CALLS_MAX calls
+ * can be waiting at once.
+ */
+long rtmp_client_call(
+    rtmp_client_t *rc, const char *command,
+    amf_packet_t **arguments, size_t arguments_num,
+    rtmp_client_result_handler_t handler, void *data)
+{
+    rtmp_packet_t *rtmp_packet;
+    long transaction_id;
+    size_t i;
+
+    transaction_id = rtmp_client_start_invoke(rc, command, handler, data);
+    if (transaction_id == 0) {
+        for (i = 0; i < arguments_num; ++i) {
+            amf_packet_free(arguments[i]);
+        }
+        return 0;
+    }
+
+    rtmp_packet = (rtmp_packet_t*)rc->data;
+    rtmp_packet_add_amf(rtmp_packet, amf_packet_create_null());
+    for (i = 0; i < arguments_num; ++i) {
+        rtmp_packet_add_amf(rtmp_packet, arguments[i]);
+    }
+
+    return rtmp_client_send_invoke(rc, transaction_id);
+}
+
+
+/*
+ * Sends the invoke rtmp_client_start_invoke started and returns its
+ * transaction id.  An invoke too large to serialize or to queue is not
+ * waited for, and 0 is returned.
+ */
+static long rtmp_client_send_invoke(rtmp_client_t *rc, long transaction_id)
+{
+    rtmp_transaction_t *entry;
+
+    if (rtmp_client_send_packet(rc, (rtmp_packet_t*)rc->data) ==
+        RTMP_SUCCESS) {
+        return transaction_id;
+    }
+    entry = rtmp_client_find_transaction(rc, transaction_id);
+    if (entry != NULL) {
+        rtmp_client_remove_transaction(rc, entry);
+    }
+    return 0;
+}
+
+
+void rtmp_client_connect(rtmp_client_t *rc)
+{
+    rtmp_packet_t *rtmp_packet;
+    amf_packet_t *amf_object;
+    long transaction_id;
+
+    transaction_id = rtmp_client_start_invoke(
+        rc, "connect", rtmp_client_on_connect_result, NULL);
+    if (transaction_id == 0) {
+        return;
+    }
+    rtmp_packet = (rtmp_packet_t*)rc->data;
+
     amf_object = amf_packet_create_object();
     amf_packet_add_property_to_object(
         amf_object, "app", amf_packet_create_string(rc->path));
@@ -1413,34 +3637,50 @@ void rtmp_client_connect(rtmp_client_t *rc)
     amf_packet_add_property_to_object(
         amf_object, "pageUrl", amf_packet_create_undefined());
     amf_packet_add_property_to_object(
-        amf_object, "objectEncoding", amf_packet_create_number(0.0));
+        amf_object, "objectEncoding",
+        amf_packet_create_number(rc->object_encoding));
     rtmp_packet_add_amf(rtmp_packet, amf_object);
 
-    rtmp_client_send_packet(rc, rtmp_packet);
+    rtmp_client_send_invoke(rc, transaction_id);
 }
 
 
-void rtmp_client_create_stream(rtmp_client_t *rc)
+/* echoes the timestamp of a ping request, which keeps the server waiting */
+static void rtmp_client_send_ping_response(rtmp_client_t *rc, int timestamp)
 {
     rtmp_packet_t *rtmp_packet;
 
     rtmp_packet = (rtmp_packet_t*)rc->data;
     rtmp_packet_cleanup(rtmp_packet);
-    rtmp_packet->data_type = RTMP_DATATYPE_INVOKE;
-    rtmp_packet->object_id = 3;
+    rtmp_packet->object_id = 2;
+    rtmp_packet->timer = 0;
+    rtmp_packet->data_type = RTMP_DATATYPE_PING;
+    rtmp_packet->stream_id = 0;
+    rtmp_packet->body_type = RTMP_BODY_TYPE_DATA;
+    rtmp_packet_allocate_body_data(rtmp_packet, 6);
+    write_be16int(rtmp_packet->body_data, RTMP_PING_RESPONSE);
+    write_be32int(rtmp_packet->body_data + 2, timestamp);
 
-    rc->message_number++;
-    rtmp_packet_add_amf(
-        rtmp_packet,
-        amf_packet_create_string("createStream"));
-    rtmp_packet_add_amf(
-        rtmp_packet,
-        amf_packet_create_number((double)rc->message_number));
+    rtmp_client_send_packet(rc, rtmp_packet);
+}
+
+
+void rtmp_client_create_stream(rtmp_client_t *rc)
+{
+    rtmp_packet_t *rtmp_packet;
+    long transaction_id;
+
+    transaction_id = rtmp_client_start_invoke(
+        rc, "createStream", rtmp_client_on_create_stream_result, NULL);
+    if (transaction_id == 0) {
+        return;
+    }
+    rtmp_packet = (rtmp_packet_t*)rc->data;
     rtmp_packet_add_amf(
         rtmp_packet,
         amf_packet_create_null());
 
-    rtmp_client_send_packet(rc, rtmp_packet);
+    rtmp_client_send_invoke(rc, transaction_id);
 }
 
 
@@ -1448,18 +3688,12 @@ void rtmp_client_play(rtmp_client_t *rc, const char *file_name)
 {
     rtmp_packet_t *rtmp_packet;
 
+    /* answered with onStatus on the stream rather than _result */
+    if (rtmp_client_start_invoke(rc, "play", NULL, NULL) == 0) {
+        return;
+    }
     rtmp_packet = (rtmp_packet_t*)rc->data;
-    rtmp_packet_cleanup(rtmp_packet);
-    rtmp_packet->data_type = RTMP_DATATYPE_INVOKE;
-    rtmp_packet->object_id = 3;
-
-    rc->message_number++;
-    rtmp_packet_add_amf(
-        rtmp_packet,
-        amf_packet_create_string("play"));
-    rtmp_packet_add_amf(
-        rtmp_packet,
-        amf_packet_create_number((double)rc->message_number));
+    rtmp_packet->stream_id = rc->stream_id;
     rtmp_packet_add_amf(
         rtmp_packet,
         amf_packet_create_null());
@@ -1470,3 +3704,44 @@ void rtmp_client_play(rtmp_client_t *rc, const char *file_name)
     rtmp_client_send_packet(rc, rtmp_packet);
 }
 
+
+/* RTMP_DATATYPE_SERVER_BW, the bytes the server may send unacknowledged */
+void rtmp_client_send_window_ack_size(
+    rtmp_client_t *rc, unsigned long window_ack_size)
+{
+    rtmp_packet_t *rtmp_packet;
+
+    rtmp_packet = (rtmp_packet_t*)rc->data;
+    rtmp_packet_cleanup(rtmp_packet);
+    rtmp_packet->object_id = 2;
+    rtmp_packet->timer = 0;
+    rtmp_packet->data_type = RTMP_DATATYPE_SERVER_BW;
+    rtmp_packet->stream_id = 0;
+    rtmp_packet->body_type = RTMP_BODY_TYPE_DATA;
+    rtmp_packet_allocate_body_data(rtmp_packet, 4);
+    write_be32int(rtmp_packet->body_data, (int)window_ack_size);
+
+    rtmp_client_send_packet(rc, rtmp_packet);
+}
+
+
+/* milliseconds of the played stream the client buffers */
+void rtmp_client_send_buffer_length(
+    rtmp_client_t *rc, unsigned long buffer_length)
+{
+    rtmp_packet_t *rtmp_packet;
+
+    rtmp_packet = (rtmp_packet_t*)rc->data;
+    rtmp_packet_cleanup(rtmp_packet);
+    rtmp_packet->object_id = 2;
+    rtmp_packet->timer = 0;
+    rtmp_packet->data_type = RTMP_DATATYPE_PING;
+    rtmp_packet->stream_id = 0;
+    rtmp_packet->body_type = RTMP_BODY_TYPE_DATA;
+    rtmp_packet_allocate_body_data(rtmp_packet, 10);
+    write_be16int(rtmp_packet->body_data, RTMP_PING_SET_BUFFER_LENGTH);
+    write_be32int(rtmp_packet->body_data + 2, (int)rc->stream_id);
+    write_be32int(rtmp_packet->body_data + 6, (int)buffer_length);
+
+    rtmp_client_send_packet(rc, rtmp_packet);
+}
@@ -46,14 +46,13 @@
 #ifndef __BEOS__
 #include <arpa/inet.h>
 #endif
-#ifdef linux /* FIXME: what other platforms have this? */
-#include <netinet/tcp.h>
-#endif
 #include <netdb.h>
 #include <sys/socket.h>
 #endif /* WIN32 */
 #endif /* Open Transport */
 
+#include "rtmp_histogram.h"
+#include "rtmp_timer.h"
 
 /* Set up for C function definitions, even when using C++ */
 #ifdef __cplusplus
@@ -64,25 +63,199 @@ extern "C" {
 #define RTMP_BUFFER_SIZE 4096
 
 
+typedef enum rtmp_result rtmp_result_t;
+
+enum rtmp_result
+{
+    RTMP_SUCCESS,
+    RTMP_ERROR_UNKNOWN,
+    RTMP_ERROR_BUFFER_OVERFLOW,
+    RTMP_ERROR_BROKEN_PACKET,
+    RTMP_ERROR_DIVIDED_PACKET,
+    RTMP_ERROR_MEMORY_ALLOCATION,
+    RTMP_ERROR_LACKED_MEMORY,
+    RTMP_ERROR_DISCONNECTED,
+};
+
+
+#define RTMP_CACHE_LINE_SIZE 64
+#ifdef __GNUC__
+#define RTMP_CACHE_LINE_ALIGNED __attribute__((aligned(RTMP_CACHE_LINE_SIZE)))
+#else
+#define RTMP_CACHE_LINE_ALIGNED
+#endif
+
+/* message type ids at or above this are counted under 0 */
+#define RTMP_STATS_DATATYPE_NUM 0x20
+#define RTMP_STATS_RESULT_NUM (RTMP_ERROR_DISCONNECTED + 1)
+
+typedef struct rtmp_stats_t rtmp_stats_t;
+
+/*
+ * Counters of one connection, or of every connection of a server when
+ * aggregated.  Each connection owns its counters and only the thread
+ * running its loop writes them, so they are plain increments; the struct
+ * is cache line aligned so that connections run by different threads
+ * never share a line.
+ */
+struct rtmp_stats_t
+{
+    unsigned long long connections;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long messages_in[RTMP_STATS_DATATYPE_NUM];
+    unsigned long long messages_out[RTMP_STATS_DATATYPE_NUM];
+    /*
+     * results of parsing received data, other than RTMP_SUCCESS and
+     * RTMP_ERROR_DIVIDED_PACKET, or RTMP_ERROR_BUFFER_OVERFLOW for a
+     * message larger than the receive buffer; each closes the connection
+     */
+    unsigned long long parse_errors[RTMP_STATS_RESULT_NUM];
+    unsigned long long partial_writes;
+    size_t send_queue_high_water; /* bytes */
+    /* media messages dropped because the send queue was backed up */
+    unsigned long long video_dropped;
+    unsigned long long audio_dropped;
+    /* connections closed right after accept, see rtmp_admission_t */
+    unsigned long long connections_shed;
+    unsigned long long handshakes; /* completed */
+    double handshake_time; /* seconds, summed over the handshakes */
+    double handshake_time_max;
+    /* from the recv() that completed a message to the end of its handling */
+    rtmp_histogram_t dispatch_latency;
+    /* from queueing data to send to the send() that passed its last byte */
+    rtmp_histogram_t send_latency;
+} RTMP_CACHE_LINE_ALIGNED;
+
+#define RTMP_SEND_MARK_NUM 16
+
+typedef struct rtmp_send_marks_t rtmp_send_marks_t;
+
+/*
+ * Ring of the data queued to send and not sent yet, as the value bytes_out
+ * reaches once it is sent and the time it was queued.  Data queued while
+ * the ring is full goes unmeasured.
+ */
+struct rtmp_send_marks_t
+{
+    unsigned long long ends[RTMP_SEND_MARK_NUM];
+    double times[RTMP_SEND_MARK_NUM];
+    int first;
+    int num;
+};
+
+
+typedef struct rtmp_socket_options_t rtmp_socket_options_t;
+
+/*
+ * TCP settings of a connection.  0 for a size leaves the system default.
+ * not_sent_low_water keeps the kernel from buffering more unsent data than
+ * that, so that the send queue, where frames can still be dropped, holds
+ * the backlog.  Set up with rtmp_socket_options_initialize.
+ */
+struct rtmp_socket_options_t
+{
+    int no_delay; /* TCP_NODELAY, 1 by default */
+    int send_buffer_size; /* SO_SNDBUF */
+    int receive_buffer_size; /* SO_RCVBUF */
+    int not_sent_low_water; /* TCP_NOTSENT_LOWAT, where available */
+    int backlog; /* of the listening socket, SOMAXCONN by default */
+};
+
+extern void rtmp_socket_options_initialize(rtmp_socket_options_t *options);
+
+
+#define RTMP_ACCEPT_BATCH 64
+/* seconds the backlog is left alone when the process is out of descriptors */
+#define RTMP_ACCEPT_PAUSE 0.1
+
+typedef struct rtmp_admission_t rtmp_admission_t;
+
+/*
+ * Limits on the connections a server takes.  A connection over a limit is
+ * closed as soon as it is accepted, before anything is allocated for it.
+ * 0 disables a limit.  The rate is refilled continuously and up to burst
+ * connections, or a second worth of them when burst is 0, are taken at
+ * once.  Set up with rtmp_admission_initialize.
+ */
+struct rtmp_admission_t
+{
+    size_t accept_batch; /* accepted per loop, RTMP_ACCEPT_BATCH by default */
+    size_t max_connections;
+    size_t max_connections_per_address;
+    double max_rate; /* connections per second */
+    double burst;
+};
+
+extern void rtmp_admission_initialize(rtmp_admission_t *admission);
+
+
 typedef struct rtmp_server_client_t rtmp_server_client_t;
+typedef struct rtmp_server_t rtmp_server_t;
+
+struct rtmp_command_table_t;
+struct rtmp_packet_t;
+struct rtmp_packet_inner_amf_t;
 
+/*
+ * The fields used on every loop come first.  The buffers are borrowed from
+ * the body pool while data is in flight and returned once emptied, and the
+ * handshake only lives until the handshake completes, so that an idle
+ * connection costs little more than its counters.
+ */
 struct rtmp_server_client_t
 {
     unsigned int conn_sock;
-    struct sockaddr_in conn_sockaddr;
-    unsigned char received_buffer[RTMP_BUFFER_SIZE];
+    void (*process_message)(rtmp_server_client_t *rsc);
+    unsigned char *received_buffer; /* RTMP_BUFFER_SIZE bytes, or NULL */
     size_t received_size;
-    unsigned char will_send_buffer[RTMP_BUFFER_SIZE];
+    unsigned char *will_send_buffer; /* will_send_capacity bytes, or NULL */
     size_t will_send_size;
+    size_t will_send_capacity;
+    int waiting_keyframe; /* dropping video until the next keyframe */
+    int peer_closed; /* received the end of stream, flushing what is left */
     size_t amf_chunk_size;
     void *data;
-    void (*process_message)(rtmp_server_client_t *rsc);
-    unsigned char handshake[RTMP_HANDSHAKE_SIZE];
+    double received_time;
+    rtmp_server_t *server;
     rtmp_server_client_t *prev;
     rtmp_server_client_t *next;
+    unsigned char *handshake; /* RTMP_HANDSHAKE_SIZE bytes, or NULL */
+    double handshake_started;
+    rtmp_timer_t handshake_timer;
+    rtmp_timer_t idle_timer;
+    rtmp_timer_t ping_timer;
+    int timed_out;
+    /* received data which can not be handled or lost a keyframe, closing */
+    int failed;
+    double object_encoding;
+    struct sockaddr_in conn_sockaddr;
+    rtmp_send_marks_t send_marks;
+    rtmp_stats_t stats;
 };
 
-typedef struct rtmp_server_t rtmp_server_t;
+#define RTMP_CLIENT_POOL_SIZE 64
+
+/*
+ * Bytes.  The send queue of a server client grows up to the maximum, media
+ * is dropped past the high water mark, see rtmp_server_set_backpressure.
+ */
+#define RTMP_SEND_QUEUE_SIZE_MAX (1024 * 1024)
+#define RTMP_SEND_QUEUE_HIGH_WATER (256 * 1024)
+
+/* seconds, see rtmp_server_set_timeouts */
+#define RTMP_HANDSHAKE_TIMEOUT 10.0
+#define RTMP_IDLE_TIMEOUT 60.0
+#define RTMP_PING_INTERVAL 20.0
+
+typedef struct rtmp_address_count_t rtmp_address_count_t;
+
+/* connections from one IPv4 address, an empty slot when count is 0 */
+struct rtmp_address_count_t
+{
+    unsigned long address;
+    size_t count;
+};
 
 struct rtmp_server_t
 {
@@ -90,51 +263,233 @@ struct rtmp_server_t
     struct sockaddr_in conn_sockaddr;
     int stand_by_socket;
     rtmp_server_client_t *client_working;
+    /* freed clients kept for reuse, at most client_pool_max */
     rtmp_server_client_t *client_pool;
+    size_t client_pool_size;
+    size_t client_pool_max;
+    void *poll_fds; /* one entry per socket, reused by each loop */
+    size_t poll_fds_capacity;
+    rtmp_timer_wheel_t timers;
+    double handshake_timeout;
+    double idle_timeout;
+    double ping_interval;
+    size_t send_queue_high_water;
+    int drop_audio;
+    rtmp_socket_options_t socket_options; /* of the clients accepted next */
+    rtmp_admission_t admission;
+    size_t client_working_num;
+    double accept_tokens; /* rate limit bucket, refilled as of accept_time */
+    double accept_time;
+    double accept_resumed; /* the backlog is not polled before */
+    rtmp_address_count_t *address_counts; /* open addressing, or NULL */
+    size_t address_counts_capacity; /* power of 2 */
+    size_t address_counts_num;
+    struct rtmp_command_table_t *commands;
+    rtmp_stats_t closed_stats; /* of the connections already freed */
 };
 
 
 extern rtmp_server_t *rtmp_server_create(unsigned short port_number);
 extern void rtmp_server_process_message(rtmp_server_t *rs);
+extern void rtmp_server_wait_message(rtmp_server_t *rs, double timeout);
 extern void rtmp_server_free(rtmp_server_t *rs);
+extern void rtmp_server_set_client_pool_size(rtmp_server_t *rs, size_t size);
+extern void rtmp_server_set_timeouts(
+    rtmp_server_t *rs,
+    double handshake_timeout, double idle_timeout, double ping_interval);
+extern void rtmp_server_set_backpressure(
+    rtmp_server_t *rs, size_t high_water, int drop_audio);
+extern rtmp_result_t rtmp_server_set_socket_options(
+    rtmp_server_t *rs, const rtmp_socket_options_t *options);
+extern void rtmp_server_set_admission(
+    rtmp_server_t *rs, const rtmp_admission_t *admission);
+extern rtmp_result_t rtmp_server_client_set_socket_options(
+    rtmp_server_client_t *rsc, const rtmp_socket_options_t *options);
+extern void rtmp_server_get_stats(rtmp_server_t *rs, rtmp_stats_t *stats);
+extern void rtmp_server_client_get_stats(
+    rtmp_server_client_t *rsc, rtmp_stats_t *stats);
 
 
 #define DEFAULT_AMF_CHUNK_SIZE 128
 
+#define RTMP_OBJECT_ENCODING_AMF0 0.0
+#define RTMP_OBJECT_ENCODING_AMF3 3.0
 
-typedef enum rtmp_result rtmp_result_t;
 
-enum rtmp_result
+/*
+ * Status codes known to the client, by the name of their interned string
+ * (see amf_intern.h).  Any other code is RTMP_EVENT_UNKNOWN and is told
+ * apart by its text.
+ */
+#define RTMP_EVENT_CODE_LIST \
+    RTMP_EVENT_CODE_ENTRY(CONNECT_SUCCESS) \
+    RTMP_EVENT_CODE_ENTRY(CONNECT_REJECTED) \
+    RTMP_EVENT_CODE_ENTRY(CONNECT_CLOSED) \
+    RTMP_EVENT_CODE_ENTRY(CONNECT_FAILED) \
+    RTMP_EVENT_CODE_ENTRY(CONNECT_INVALID_APP) \
+    RTMP_EVENT_CODE_ENTRY(PLAY_START) \
+    RTMP_EVENT_CODE_ENTRY(PLAY_STOP) \
+    RTMP_EVENT_CODE_ENTRY(PLAY_RESET) \
+    RTMP_EVENT_CODE_ENTRY(PLAY_STREAM_NOT_FOUND) \
+    RTMP_EVENT_CODE_ENTRY(PLAY_FAILED) \
+    RTMP_EVENT_CODE_ENTRY(PLAY_PUBLISH_NOTIFY) \
+    RTMP_EVENT_CODE_ENTRY(PLAY_UNPUBLISH_NOTIFY) \
+    RTMP_EVENT_CODE_ENTRY(PAUSE_NOTIFY) \
+    RTMP_EVENT_CODE_ENTRY(UNPAUSE_NOTIFY) \
+    RTMP_EVENT_CODE_ENTRY(SEEK_NOTIFY) \
+    RTMP_EVENT_CODE_ENTRY(PUBLISH_START) \
+    RTMP_EVENT_CODE_ENTRY(PUBLISH_BAD_NAME)
+
+typedef enum rtmp_event_code rtmp_event_code_t;
+
+enum rtmp_event_code
 {
-    RTMP_SUCCESS,
-    RTMP_ERROR_UNKNOWN,
-    RTMP_ERROR_BUFFER_OVERFLOW,
-    RTMP_ERROR_BROKEN_PACKET,
-    RTMP_ERROR_DIVIDED_PACKET,
-    RTMP_ERROR_MEMORY_ALLOCATION,
-    RTMP_ERROR_LACKED_MEMORY,
-    RTMP_ERROR_DISCONNECTED,
+    RTMP_EVENT_UNKNOWN,
+#define RTMP_EVENT_CODE_ENTRY(id) RTMP_EVENT_##id,
+    RTMP_EVENT_CODE_LIST
+#undef RTMP_EVENT_CODE_ENTRY
+    RTMP_EVENT_CODE_NUM
 };
 
+typedef enum rtmp_event_level rtmp_event_level_t;
+
+enum rtmp_event_level
+{
+    RTMP_EVENT_LEVEL_UNKNOWN,
+    RTMP_EVENT_LEVEL_STATUS,
+    RTMP_EVENT_LEVEL_WARNING,
+    RTMP_EVENT_LEVEL_ERROR,
+};
+
+#define RTMP_EVENT_CODE_SIZE 64 /* longer unknown codes are cut */
+#define RTMP_EVENT_LEVEL_SIZE 16
+#define RTMP_EVENT_RING_SIZE 32 /* must be power of 2 */
 
 typedef struct rtmp_event_t rtmp_event_t;
 
+/*
+ * code and level point to interned strings, or to the buffers of the
+ * event for unknown ones, so an event is never allocated.
+ */
 struct rtmp_event_t
 {
-    char *code;
-    char *level;
-    rtmp_event_t *next;
+    rtmp_event_code_t id;
+    rtmp_event_level_t level_id;
+    const char *code;
+    const char *level;
+    char code_buffer[RTMP_EVENT_CODE_SIZE];
+    char level_buffer[RTMP_EVENT_LEVEL_SIZE];
+};
+
+typedef struct rtmp_event_ring_t rtmp_event_ring_t;
+
+/*
+ * Events waiting for rtmp_client_get_event.  The thread processing the
+ * client only moves tail and the thread reading events only moves head,
+ * so the two may differ without a lock: each publishes its index with a
+ * release store and loads the other's with acquire.  Events arriving
+ * while the ring is full are dropped and counted.
+ */
+struct rtmp_event_ring_t
+{
+    unsigned int head;
+    char head_padding[RTMP_CACHE_LINE_SIZE - sizeof(unsigned int)];
+    unsigned int tail;
+    unsigned long dropped;
+    rtmp_event_t events[RTMP_EVENT_RING_SIZE];
 };
 
 typedef struct rtmp_client_t rtmp_client_t;
 
+typedef enum rtmp_client_connect_state rtmp_client_connect_state_t;
+
+/*
+ * A client looks its host up, then tries the addresses found in turn,
+ * without blocking, until one accepts the connection.  conn_sock is -1
+ * while resolving and changes with each address tried.
+ */
+enum rtmp_client_connect_state
+{
+    RTMP_CLIENT_RESOLVING,
+    RTMP_CLIENT_CONNECTING,
+    RTMP_CLIENT_CONNECTED,
+};
+
+/* seconds, see rtmp_client_set_connect_timeout */
+#define RTMP_CONNECT_TIMEOUT 10.0
+
+/* what servers return to the first createStream of a connection */
+#define RTMP_CLIENT_FIRST_STREAM_ID 1
+
+/* invokes waiting for their response at once, see rtmp_client_call */
+#define RTMP_CLIENT_CALLS_MAX 1024
+
+/* seconds, see rtmp_client_set_call_timeout */
+#define RTMP_CALL_TIMEOUT 30.0
+
+struct rtmp_resolver_t;
+struct addrinfo;
+union amf_packet_t;
+
+typedef enum rtmp_transaction_status rtmp_transaction_status_t;
+
+enum rtmp_transaction_status
+{
+    RTMP_TRANSACTION_RESULT, /* answered with _result */
+    RTMP_TRANSACTION_ERROR, /* answered with _error */
+    RTMP_TRANSACTION_TIMED_OUT,
+    RTMP_TRANSACTION_CANCELLED, /* the client is being freed */
+};
+
+typedef struct rtmp_transaction_t rtmp_transaction_t;
+
+typedef void (*rtmp_client_result_handler_t)(
+    rtmp_client_t *rc, rtmp_transaction_t *transaction, void *data);
+
+/*
+ * An invoke waiting for its response, by transaction id.  Its handler is
+ * called exactly once, when the response comes, the call times out or the
+ * client is freed, after which the entry is gone.  The arguments are the
+ * values following the transaction id in the response, valid during the
+ * call only and only until the handler sends anything, which reuses the
+ * client packet.
+ */
+struct rtmp_transaction_t
+{
+    long id; /* 0 for a free slot */
+    rtmp_client_result_handler_t handler;
+    void *data;
+    double deadline; /* 0 for none */
+    rtmp_transaction_status_t status;
+    struct rtmp_packet_inner_amf_t *arguments; /* NULL unless answered */
+    double number; /* the first number of the arguments, or 0 */
+};
+
+/* audio and video messages, packet is a struct rtmp_packet_t */
+typedef void (*rtmp_client_media_handler_t)(
+    rtmp_client_t *rc, struct rtmp_packet_t *packet, void *data);
+
+/* events, instead of the ring; the event is only valid during the call */
+typedef void (*rtmp_client_event_handler_t)(
+    rtmp_client_t *rc, const rtmp_event_t *event, void *data);
+
 struct rtmp_client_t
 {
     int conn_sock;
+    rtmp_client_connect_state_t connect_state;
+    struct rtmp_resolver_t *resolver; /* while resolving */
+    struct addrinfo *addresses; /* of the host, until connected */
+    struct addrinfo *address; /* being connected to */
+    double connect_started;
+    double connect_timeout;
+    rtmp_socket_options_t socket_options;
     unsigned char received_buffer[RTMP_BUFFER_SIZE];
     size_t received_size;
     unsigned char will_send_buffer[RTMP_BUFFER_SIZE];
     size_t will_send_size;
+    int peer_closed; /* received the end of stream, flushing what is left */
+    int failed; /* received data which can not be handled, closing */
+    int disconnected;
     void (*process_message)(rtmp_client_t *client);
     void *data;
     char *url;
@@ -145,24 +500,93 @@ struct rtmp_client_t
     size_t amf_chunk_size;
     unsigned char handshake[RTMP_HANDSHAKE_SIZE];
     long message_number;
-    rtmp_event_t *events;
+    double object_encoding;
+    long stream_id; /* of the stream played, 0 until known */
+    /* pending invokes, open addressed by id, see rtmp_client_call */
+    rtmp_transaction_t *transactions;
+    size_t transactions_capacity; /* power of 2 */
+    size_t transactions_num;
+    double transactions_deadline; /* the earliest, 0 for none */
+    double call_timeout;
+    /* see rtmp_client_play_url */
+    char *play_stream_name; /* sent before createStream returned, or NULL */
+    unsigned long window_ack_size;
+    unsigned long buffer_length;
+    struct rtmp_command_table_t *commands;
+    rtmp_client_media_handler_t media_handler;
+    void *media_handler_data;
+    rtmp_client_event_handler_t event_handler;
+    void *event_handler_data;
+    rtmp_stats_t stats;
+    double handshake_started;
+    double received_time;
+    rtmp_send_marks_t send_marks;
+    rtmp_event_ring_t events;
 };
 
 
+/*
+ * Invoke handlers.  arguments is the list of decoded values following the
+ * command name and the transaction id; it points into the received packet
+ * and is only valid during the call.
+ */
+typedef void (*rtmp_server_command_handler_t)(
+    rtmp_server_client_t *rsc, double transaction_id,
+    struct rtmp_packet_inner_amf_t *arguments, void *data);
+typedef void (*rtmp_client_command_handler_t)(
+    rtmp_client_t *rc, double transaction_id,
+    struct rtmp_packet_inner_amf_t *arguments, void *data);
+
+extern rtmp_result_t rtmp_server_on_command(
+    rtmp_server_t *rs, const char *command,
+    rtmp_server_command_handler_t handler, void *data);
+extern rtmp_result_t rtmp_client_on_command(
+    rtmp_client_t *rc, const char *command,
+    rtmp_client_command_handler_t handler, void *data);
+extern void rtmp_client_on_media(
+    rtmp_client_t *rc, rtmp_client_media_handler_t handler, void *data);
+extern void rtmp_client_on_event(
+    rtmp_client_t *rc, rtmp_client_event_handler_t handler, void *data);
+
+
 rtmp_client_t *rtmp_client_create(const char *url);
+extern rtmp_client_t *rtmp_client_play_url(
+    const char *url, const char *stream_name,
+    unsigned long window_ack_size, unsigned long buffer_length);
 extern void rtmp_client_free(rtmp_client_t *client);
+extern void rtmp_client_get_stats(rtmp_client_t *client, rtmp_stats_t *stats);
+extern rtmp_result_t rtmp_client_set_socket_options(
+    rtmp_client_t *client, const rtmp_socket_options_t *options);
+extern void rtmp_client_set_connect_timeout(
+    rtmp_client_t *client, double connect_timeout);
+extern void rtmp_client_set_call_timeout(
+    rtmp_client_t *client, double call_timeout);
 
 extern rtmp_event_t *rtmp_client_get_event(rtmp_client_t *client);
 extern void rtmp_client_delete_event(rtmp_client_t *client);
+extern unsigned long rtmp_client_get_dropped_events(rtmp_client_t *client);
 
+extern void rtmp_client_set_object_encoding(
+    rtmp_client_t *client, double object_encoding);
 extern void rtmp_client_connect(
     rtmp_client_t *client
     /* FIXME: take URL */);
 extern void rtmp_client_create_stream(rtmp_client_t *client);
 extern void rtmp_client_play(rtmp_client_t *client, const char *file_name);
+extern long rtmp_client_call(
+    rtmp_client_t *client, const char *command,
+    union amf_packet_t **arguments, size_t arguments_num,
+    rtmp_client_result_handler_t handler, void *data);
+extern void rtmp_client_send_window_ack_size(
+    rtmp_client_t *client, unsigned long window_ack_size);
+extern void rtmp_client_send_buffer_length(
+    rtmp_client_t *client, unsigned long buffer_length);
 extern void rtmp_server_client_send_server_bandwidth(rtmp_server_client_t *rsc);
 extern void rtmp_server_client_send_client_bandwidth(rtmp_server_client_t *rsc);
 extern void rtmp_server_client_send_ping(rtmp_server_client_t *rsc);
+extern void rtmp_server_client_send_ping_request(rtmp_server_client_t *rsc);
+extern rtmp_result_t rtmp_server_client_send_media(
+    rtmp_server_client_t *rsc, struct rtmp_packet_t *packet);
 extern void rtmp_server_client_send_chunk_size(rtmp_server_client_t *rsc);
 extern void rtmp_server_client_send_connect_result(
    rtmp_server_client_t *rsc, double number);
@@ -173,7 +597,7 @@ extern void rtmp_server_client_send_play_result_error(
 extern void rtmp_server_client_send_play_result_success(
     rtmp_server_client_t *rsc, double number);
 
-extern void rtmp_client_process_message(rtmp_client_t *client);
+extern rtmp_result_t rtmp_client_process_message(rtmp_client_t *client);
 
 
 /* Ends C function definitions when using C++ */
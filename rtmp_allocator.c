@@ -0,0 +1,361 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtmp_allocator.h"
+
+
+/*
+ * Each block is preceded by a header holding its size and tag, so that
+ * rtmp_release and the live counters do not need them from the caller.
+ * The header keeps the alignment malloc gives on the usual platforms.
+ */
+#define RTMP_ALLOCATION_HEADER_SIZE 16
+
+typedef struct rtmp_allocation_header_t rtmp_allocation_header_t;
+
+struct rtmp_allocation_header_t
+{
+    size_t size;
+    rtmp_allocation_tag_t tag;
+};
+
+/* fails to compile when the header does not fit */
+typedef char rtmp_allocation_header_check[
+    sizeof(rtmp_allocation_header_t) <= RTMP_ALLOCATION_HEADER_SIZE ? 1 : -1];
+
+#if defined(__GNUC__)
+#define RTMP_ALLOCATOR_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define RTMP_ALLOCATOR_THREAD_LOCAL __declspec(thread)
+#else
+#define RTMP_ALLOCATOR_THREAD_LOCAL
+#endif
+
+typedef struct rtmp_allocator_counters_t rtmp_allocator_counters_t;
+
+/*
+ * The live counters of one thread, updated by it alone.  A block released
+ * by another thread than the one which allocated it leaves the counters
+ * of each off by its size: only their sum over the threads is meaningful.
+ */
+struct rtmp_allocator_counters_t
+{
+    size_t live_bytes[RTMP_ALLOCATION_TAG_NUM];
+    size_t live_blocks[RTMP_ALLOCATION_TAG_NUM];
+    rtmp_allocator_counters_t *next;
+};
+
+
+static void *rtmp_allocator_default_allocate(
+    size_t size, rtmp_allocation_tag_t tag, void *data);
+static void *rtmp_allocator_default_reallocate(
+    void *pointer, size_t size, rtmp_allocation_tag_t tag, void *data);
+static void rtmp_allocator_default_release(
+    void *pointer, rtmp_allocation_tag_t tag, void *data);
+static rtmp_allocator_counters_t *rtmp_allocator_get_counters(void);
+static void rtmp_allocator_count(
+    rtmp_allocation_tag_t tag, size_t size, int blocks);
+
+
+static rtmp_allocator_t rtmp_allocator = {
+    rtmp_allocator_default_allocate,
+    rtmp_allocator_default_reallocate,
+    rtmp_allocator_default_release,
+    NULL
+};
+
+/* allocated on the first count of each thread, never freed */
+static RTMP_ALLOCATOR_THREAD_LOCAL rtmp_allocator_counters_t
+    *rtmp_allocator_counters;
+
+/* the counters of every thread, for the readers to sum */
+static rtmp_allocator_counters_t *rtmp_allocator_all_counters;
+
+/* for the counts of a thread which could not get its own counters */
+static rtmp_allocator_counters_t rtmp_allocator_shared_counters;
+
+static const char *rtmp_allocator_tag_names[] = {
+    "amf", "packet", "packet_body", "connection", "event", "trace"
+};
+
+/* fails to compile when the names and the tags do not match */
+typedef char rtmp_allocator_tag_names_check[
+    sizeof(rtmp_allocator_tag_names) / sizeof(rtmp_allocator_tag_names[0]) ==
+    RTMP_ALLOCATION_TAG_NUM ? 1 : -1];
+
+
+static void *rtmp_allocator_default_allocate(
+    size_t size, rtmp_allocation_tag_t tag, void *data)
+{
+    (void)tag;
+    (void)data;
+    return malloc(size);
+}
+
+
+static void *rtmp_allocator_default_reallocate(
+    void *pointer, size_t size, rtmp_allocation_tag_t tag, void *data)
+{
+    (void)tag;
+    (void)data;
+    return realloc(pointer, size);
+}
+
+
+static void rtmp_allocator_default_release(
+    void *pointer, rtmp_allocation_tag_t tag, void *data)
+{
+    (void)tag;
+    (void)data;
+    free(pointer);
+}
+
+
+/*
+ * The counters are taken from malloc rather than the allocator, which
+ * may not be set yet and whose blocks are counted here.
+ */
+static rtmp_allocator_counters_t *rtmp_allocator_get_counters(void)
+{
+    rtmp_allocator_counters_t *counters;
+
+    if (rtmp_allocator_counters) {
+        return rtmp_allocator_counters;
+    }
+    counters = (rtmp_allocator_counters_t*)calloc(
+        1, sizeof(rtmp_allocator_counters_t));
+    if (counters == NULL) {
+        /* racy, but the thread still counts */
+        return &rtmp_allocator_shared_counters;
+    }
+#ifdef __GNUC__
+    do {
+        counters->next = rtmp_allocator_all_counters;
+    } while (!__sync_bool_compare_and_swap(
+                 &rtmp_allocator_all_counters, counters->next, counters));
+#else
+    counters->next = rtmp_allocator_all_counters;
+    rtmp_allocator_all_counters = counters;
+#endif
+    rtmp_allocator_counters = counters;
+    return counters;
+}
+
+
+static void rtmp_allocator_count(
+    rtmp_allocation_tag_t tag, size_t size, int blocks)
+{
+    rtmp_allocator_counters_t *counters;
+
+    counters = rtmp_allocator_get_counters();
+    if (blocks > 0) {
+        counters->live_bytes[tag] += size;
+        counters->live_blocks[tag]++;
+    } else {
+        counters->live_bytes[tag] -= size;
+        counters->live_blocks[tag]--;
+    }
+}
+
+
+/*
+ * Routes the allocations of the library through allocator, or back to
+ * malloc when it is NULL.  Call it before the library allocates anything:
+ * blocks are always released through the allocator set at the time.
+ */
+void rtmp_set_allocator(const rtmp_allocator_t *allocator)
+{
+    if (allocator == NULL) {
+        rtmp_allocator.allocate = rtmp_allocator_default_allocate;
+        rtmp_allocator.reallocate = rtmp_allocator_default_reallocate;
+        rtmp_allocator.release = rtmp_allocator_default_release;
+        rtmp_allocator.data = NULL;
+    } else {
+        memcpy(&rtmp_allocator, allocator, sizeof(rtmp_allocator_t));
+    }
+}
+
+
+/*
+ * Bytes the library has allocated with tag and not released yet, summed
+ * over the threads.  The threads still running may be counting meanwhile,
+ * so the sum is exact only once they are done.
+ */
+size_t rtmp_allocator_get_live_bytes(rtmp_allocation_tag_t tag)
+{
+    rtmp_allocator_counters_t *counters;
+    size_t bytes;
+
+    if ((unsigned int)tag >= RTMP_ALLOCATION_TAG_NUM) {
+        return 0;
+    }
+    /* unsigned wrapping keeps the sum right across threads */
+    bytes = rtmp_allocator_shared_counters.live_bytes[tag];
+    for (counters = rtmp_allocator_all_counters; counters;
+         counters = counters->next) {
+        bytes += counters->live_bytes[tag];
+    }
+    return bytes;
+}
+
+
+size_t rtmp_allocator_get_live_blocks(rtmp_allocation_tag_t tag)
+{
+    rtmp_allocator_counters_t *counters;
+    size_t blocks;
+
+    if ((unsigned int)tag >= RTMP_ALLOCATION_TAG_NUM) {
+        return 0;
+    }
+    blocks = rtmp_allocator_shared_counters.live_blocks[tag];
+    for (counters = rtmp_allocator_all_counters; counters;
+         counters = counters->next) {
+        blocks += counters->live_blocks[tag];
+    }
+    return blocks;
+}
+
+
+const char *rtmp_allocator_get_tag_name(rtmp_allocation_tag_t tag)
+{
+    if ((unsigned int)tag >= RTMP_ALLOCATION_TAG_NUM) {
+        return "unknown";
+    }
+    return rtmp_allocator_tag_names[tag];
+}
+
+
+void *rtmp_allocate(rtmp_allocation_tag_t tag, size_t size)
+{
+    rtmp_allocation_header_t *header;
+
+    if (size > (size_t)-1 - RTMP_ALLOCATION_HEADER_SIZE) {
+        return NULL;
+    }
+    header = (rtmp_allocation_header_t*)rtmp_allocator.allocate(
+        RTMP_ALLOCATION_HEADER_SIZE + size, tag, rtmp_allocator.data);
+    if (header == NULL) {
+        return NULL;
+    }
+    header->size = size;
+    header->tag = tag;
+    rtmp_allocator_count(tag, size, 1);
+    return (unsigned char*)header + RTMP_ALLOCATION_HEADER_SIZE;
+}
+
+
+void *rtmp_allocate_zeroed(rtmp_allocation_tag_t tag, size_t num, size_t size)
+{
+    void *pointer;
+
+    if (size > 0 && num > (size_t)-1 / size) {
+        return NULL;
+    }
+    pointer = rtmp_allocate(tag, num * size);
+    if (pointer == NULL) {
+        return NULL;
+    }
+    memset(pointer, 0x00, num * size);
+    return pointer;
+}
+
+
+/* like realloc; a block keeps the tag it was allocated with */
+void *rtmp_reallocate(rtmp_allocation_tag_t tag, void *pointer, size_t size)
+{
+    rtmp_allocation_header_t *header;
+    size_t old_size;
+
+    if (pointer == NULL) {
+        return rtmp_allocate(tag, size);
+    }
+    if (size > (size_t)-1 - RTMP_ALLOCATION_HEADER_SIZE) {
+        return NULL;
+    }
+    header = (rtmp_allocation_header_t*)(
+        (unsigned char*)pointer - RTMP_ALLOCATION_HEADER_SIZE);
+    old_size = header->size;
+    tag = header->tag;
+    header = (rtmp_allocation_header_t*)rtmp_allocator.reallocate(
+        header, RTMP_ALLOCATION_HEADER_SIZE + size, tag, rtmp_allocator.data);
+    if (header == NULL) {
+        return NULL;
+    }
+    header->size = size;
+    rtmp_allocator_count(tag, old_size, -1);
+    rtmp_allocator_count(tag, size, 1);
+    return (unsigned char*)header + RTMP_ALLOCATION_HEADER_SIZE;
+}
+
+
+void rtmp_release(void *pointer)
+{
+    rtmp_allocation_header_t *header;
+
+    if (pointer == NULL) {
+        return;
+    }
+    header = (rtmp_allocation_header_t*)(
+        (unsigned char*)pointer - RTMP_ALLOCATION_HEADER_SIZE);
+    rtmp_allocator_count(header->tag, header->size, -1);
+    rtmp_allocator.release(header, header->tag, rtmp_allocator.data);
+}
+
+
+/*
+ * alignment is a power of two.  The block allocated is bigger by
+ * alignment and a pointer, which is kept just before the returned address.
+ */
+void *rtmp_allocate_aligned(
+    rtmp_allocation_tag_t tag, size_t size, size_t alignment)
+{
+    unsigned char *block;
+    unsigned char *aligned;
+
+    if (size > (size_t)-1 - alignment - sizeof(void*)) {
+        return NULL;
+    }
+    block = (unsigned char*)rtmp_allocate(
+        tag, size + alignment + sizeof(void*));
+    if (block == NULL) {
+        return NULL;
+    }
+    aligned = block + sizeof(void*);
+    aligned += (alignment - (size_t)aligned % alignment) % alignment;
+    memcpy(aligned - sizeof(void*), &block, sizeof(void*));
+    return aligned;
+}
+
+
+void rtmp_release_aligned(void *pointer)
+{
+    void *block;
+
+    if (pointer == NULL) {
+        return;
+    }
+    memcpy(&block, (unsigned char*)pointer - sizeof(void*), sizeof(void*));
+    rtmp_release(block);
+}
@@ -0,0 +1,88 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#ifndef _rtmp_allocator_H_
+#define _rtmp_allocator_H_
+
+#include <stddef.h>
+
+
+/* Set up for C function definitions, even when using C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* what a block of library memory is used for */
+typedef enum rtmp_allocation_tag rtmp_allocation_tag_t;
+
+enum rtmp_allocation_tag
+{
+    RTMP_ALLOCATION_AMF, /* decoded and created AMF values */
+    RTMP_ALLOCATION_PACKET, /* rtmp_packet_t and serializing buffers */
+    RTMP_ALLOCATION_PACKET_BODY, /* received and raw message bodies */
+    RTMP_ALLOCATION_CONNECTION, /* servers, clients and what they own */
+    RTMP_ALLOCATION_EVENT, /* queued client events */
+    RTMP_ALLOCATION_TRACE, /* trace rings */
+    RTMP_ALLOCATION_TAG_NUM
+};
+
+typedef struct rtmp_allocator_t rtmp_allocator_t;
+
+/*
+ * Hooks every allocation of the library goes through.  They behave like
+ * malloc, realloc and free; tag is what the block is for and data is the
+ * data member of the allocator.
+ */
+struct rtmp_allocator_t
+{
+    void *(*allocate)(size_t size, rtmp_allocation_tag_t tag, void *data);
+    void *(*reallocate)(
+        void *pointer, size_t size, rtmp_allocation_tag_t tag, void *data);
+    void (*release)(void *pointer, rtmp_allocation_tag_t tag, void *data);
+    void *data;
+};
+
+
+extern void rtmp_set_allocator(const rtmp_allocator_t *allocator);
+extern size_t rtmp_allocator_get_live_bytes(rtmp_allocation_tag_t tag);
+extern size_t rtmp_allocator_get_live_blocks(rtmp_allocation_tag_t tag);
+extern const char *rtmp_allocator_get_tag_name(rtmp_allocation_tag_t tag);
+
+extern void *rtmp_allocate(rtmp_allocation_tag_t tag, size_t size);
+extern void *rtmp_allocate_zeroed(
+    rtmp_allocation_tag_t tag, size_t num, size_t size);
+extern void *rtmp_reallocate(
+    rtmp_allocation_tag_t tag, void *pointer, size_t size);
+extern void rtmp_release(void *pointer);
+extern void *rtmp_allocate_aligned(
+    rtmp_allocation_tag_t tag, size_t size, size_t alignment);
+extern void rtmp_release_aligned(void *pointer);
+
+
+/* Ends C function definitions when using C++ */
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
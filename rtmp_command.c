@@ -0,0 +1,226 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtmp_command.h"
+#include "amf_intern.h"
+#include "rtmp_allocator.h"
+
+
+#define RTMP_COMMAND_TABLE_INITIAL_CAPACITY 16
+
+
+static rtmp_command_entry_t *rtmp_command_table_probe(
+    rtmp_command_entry_t *entries, size_t capacity,
+    const char *name, size_t length, unsigned int hash);
+static rtmp_result_t rtmp_command_table_grow(rtmp_command_table_t *table);
+
+
+rtmp_command_table_t *rtmp_command_table_create(void)
+{
+    rtmp_command_table_t *table;
+
+    table = (rtmp_command_table_t*)rtmp_allocate(
+        RTMP_ALLOCATION_CONNECTION, sizeof(rtmp_command_table_t));
+    if (table == NULL) {
+        return NULL;
+    }
+    table->capacity = RTMP_COMMAND_TABLE_INITIAL_CAPACITY;
+    table->num = 0;
+    table->entries = (rtmp_command_entry_t*)rtmp_allocate_zeroed(
+        RTMP_ALLOCATION_CONNECTION,
+        table->capacity, sizeof(rtmp_command_entry_t));
+    if (table->entries == NULL) {
+        rtmp_release(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+
+void rtmp_command_table_free(rtmp_command_table_t *table)
+{
+    size_t i;
+
+    for (i = 0; i < table->capacity; ++i) {
+        if (table->entries[i].name) {
+            amf_packet_free_string(table->entries[i].name);
+        }
+    }
+    rtmp_release(table->entries);
+    rtmp_release(table);
+}
+
+
+/*
+ * Returns the slot holding name, or the empty slot where it would go.
+ * Command names which are interned hit on the pointer comparison.
+ */
+static rtmp_command_entry_t *rtmp_command_table_probe(
+    rtmp_command_entry_t *entries, size_t capacity,
+    const char *name, size_t length, unsigned int hash)
+{
+    size_t slot;
+    rtmp_command_entry_t *entry;
+
+    slot = hash & (capacity - 1);
+    while (1) {
+        entry = &entries[slot];
+        if (entry->name == NULL || entry->name == name) {
+            return entry;
+        }
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->name, name, length) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & (capacity - 1);
+    }
+}
+
+
+static rtmp_result_t rtmp_command_table_grow(rtmp_command_table_t *table)
+{
+    rtmp_command_entry_t *entries;
+    rtmp_command_entry_t *entry;
+    size_t capacity;
+    size_t i;
+
+    capacity = table->capacity * 2;
+    entries = (rtmp_command_entry_t*)rtmp_allocate_zeroed(
+        RTMP_ALLOCATION_CONNECTION, capacity, sizeof(rtmp_command_entry_t));
+    if (entries == NULL) {
+        return RTMP_ERROR_MEMORY_ALLOCATION;
+    }
+    for (i = 0; i < table->capacity; ++i) {
+        if (table->entries[i].name == NULL) {
+            continue;
+        }
+        entry = rtmp_command_table_probe(
+            entries, capacity,
+            table->entries[i].name, table->entries[i].length,
+            table->entries[i].hash);
+        *entry = table->entries[i];
+    }
+    rtmp_release(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+
+    return RTMP_SUCCESS;
+}
+
+
+/* registering a name again replaces its handler */
+rtmp_result_t rtmp_command_table_register(
+    rtmp_command_table_t *table,
+    const char *name, rtmp_command_handler_t handler, void *data)
+{
+    rtmp_command_entry_t *entry;
+    size_t length;
+    unsigned int hash;
+    char *key;
+    rtmp_result_t result;
+
+    if ((table->num + 1) * 2 > table->capacity) {
+        result = rtmp_command_table_grow(table);
+        if (result != RTMP_SUCCESS) {
+            return result;
+        }
+    }
+
+    length = strlen(name);
+    hash = amf_intern_hash((const unsigned char*)name, length);
+    entry = rtmp_command_table_probe(
+        table->entries, table->capacity, name, length, hash);
+    if (entry->name == NULL) {
+        entry->name = amf_intern_lookup((const unsigned char*)name, length);
+        if (entry->name == NULL) {
+            key = (char*)rtmp_allocate(RTMP_ALLOCATION_CONNECTION, length + 1);
+            if (key == NULL) {
+                return RTMP_ERROR_MEMORY_ALLOCATION;
+            }
+            memmove(key, name, length + 1);
+            entry->name = key;
+        }
+        entry->length = length;
+        entry->hash = hash;
+        table->num++;
+    }
+    entry->handler = handler;
+    entry->data = data;
+
+    return RTMP_SUCCESS;
+}
+
+
+rtmp_command_entry_t *rtmp_command_table_find(
+    rtmp_command_table_t *table, const char *name)
+{
+    rtmp_command_entry_t *entry;
+    size_t length;
+    unsigned int hash;
+
+    /* decoded command names are mostly interned, and not read here */
+    hash = amf_intern_hash_string(name, &length);
+    entry = rtmp_command_table_probe(
+        table->entries, table->capacity, name, length, hash);
+    if (entry->name == NULL) {
+        return NULL;
+    }
+    return entry;
+}
+
+
+/*
+ * Looks up the handler for an invoke packet:
+ * command name(string), transaction id(number), arguments...
+ */
+rtmp_command_entry_t *rtmp_command_table_find_invoke(
+    rtmp_command_table_t *table, rtmp_packet_t *packet,
+    double *transaction_id, rtmp_packet_inner_amf_t **arguments)
+{
+    rtmp_packet_inner_amf_t *inner_amf;
+    rtmp_command_entry_t *entry;
+
+    inner_amf = packet->inner_amf_packets;
+    if (inner_amf == NULL ||
+        inner_amf->amf->datatype != AMF_DATATYPE_STRING) {
+        return NULL;
+    }
+    entry = rtmp_command_table_find(table, inner_amf->amf->string.value);
+    if (entry == NULL || entry->handler.server == NULL) {
+        return NULL;
+    }
+
+    *transaction_id = 0;
+    inner_amf = inner_amf->next;
+    if (inner_amf && inner_amf->amf->datatype == AMF_DATATYPE_NUMBER) {
+        *transaction_id = inner_amf->amf->number.value;
+        inner_amf = inner_amf->next;
+    }
+    *arguments = inner_amf;
+
+    return entry;
+}
@@ -0,0 +1,84 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#ifndef _rtmp_command_H_
+#define _rtmp_command_H_
+
+#include "rtmp.h"
+#include "rtmp_packet.h"
+
+
+/* Set up for C function definitions, even when using C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+typedef union rtmp_command_handler_t rtmp_command_handler_t;
+
+union rtmp_command_handler_t
+{
+    rtmp_server_command_handler_t server;
+    rtmp_client_command_handler_t client;
+};
+
+typedef struct rtmp_command_entry_t rtmp_command_entry_t;
+
+struct rtmp_command_entry_t
+{
+    const char *name; /* interned, or a copy freed with the table */
+    size_t length;
+    unsigned int hash;
+    rtmp_command_handler_t handler;
+    void *data;
+};
+
+typedef struct rtmp_command_table_t rtmp_command_table_t;
+
+struct rtmp_command_table_t
+{
+    rtmp_command_entry_t *entries;
+    size_t capacity; /* power of 2 */
+    size_t num;
+};
+
+
+extern rtmp_command_table_t *rtmp_command_table_create(void);
+extern void rtmp_command_table_free(rtmp_command_table_t *table);
+
+extern rtmp_result_t rtmp_command_table_register(
+    rtmp_command_table_t *table,
+    const char *name, rtmp_command_handler_t handler, void *data);
+extern rtmp_command_entry_t *rtmp_command_table_find(
+    rtmp_command_table_t *table, const char *name);
+extern rtmp_command_entry_t *rtmp_command_table_find_invoke(
+    rtmp_command_table_t *table, rtmp_packet_t *packet,
+    double *transaction_id, rtmp_packet_inner_amf_t **arguments);
+
+
+/* Ends C function definitions when using C++ */
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,138 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#include <stddef.h>
+
+#include "rtmp_histogram.h"
+
+
+static int rtmp_histogram_get_bucket(unsigned long long value);
+static double rtmp_histogram_get_bucket_value(int bucket);
+
+
+/* values below RTMP_HISTOGRAM_SUB_BUCKET_NUM have a bucket each */
+static int rtmp_histogram_get_bucket(unsigned long long value)
+{
+    int magnitude;
+
+    if (value < RTMP_HISTOGRAM_SUB_BUCKET_NUM) {
+        return (int)value;
+    }
+    if (value >> RTMP_HISTOGRAM_MAX_MAGNITUDE) {
+        return RTMP_HISTOGRAM_BUCKET_NUM - 1;
+    }
+#ifdef __GNUC__
+    magnitude = 63 - __builtin_clzll(value);
+#else
+    magnitude = RTMP_HISTOGRAM_SUB_BUCKET_BITS;
+    while (value >> (magnitude + 1)) {
+        magnitude++;
+    }
+#endif
+    return (magnitude - RTMP_HISTOGRAM_SUB_BUCKET_BITS + 1) *
+        RTMP_HISTOGRAM_SUB_BUCKET_NUM +
+        (int)((value >> (magnitude - RTMP_HISTOGRAM_SUB_BUCKET_BITS)) &
+              (RTMP_HISTOGRAM_SUB_BUCKET_NUM - 1));
+}
+
+
+/* middle of the bucket, in seconds */
+static double rtmp_histogram_get_bucket_value(int bucket)
+{
+    int shift;
+    double lowest;
+
+    if (bucket < RTMP_HISTOGRAM_SUB_BUCKET_NUM) {
+        return bucket / 1000000.0;
+    }
+    shift = bucket / RTMP_HISTOGRAM_SUB_BUCKET_NUM - 1;
+    lowest = (double)((RTMP_HISTOGRAM_SUB_BUCKET_NUM +
+                       bucket % RTMP_HISTOGRAM_SUB_BUCKET_NUM) << shift);
+    return (lowest + (1 << shift) / 2.0) / 1000000.0;
+}
+
+
+void rtmp_histogram_record(rtmp_histogram_t *histogram, double seconds)
+{
+    if (seconds < 0) {
+        seconds = 0;
+    }
+    histogram->counts[
+        rtmp_histogram_get_bucket(
+            (unsigned long long)(seconds * 1000000.0))]++;
+    histogram->count++;
+    histogram->sum += seconds;
+    if (seconds > histogram->max) {
+        histogram->max = seconds;
+    }
+}
+
+
+void rtmp_histogram_merge(
+    rtmp_histogram_t *total, const rtmp_histogram_t *histogram)
+{
+    int i;
+
+    for (i = 0; i < RTMP_HISTOGRAM_BUCKET_NUM; ++i) {
+        total->counts[i] += histogram->counts[i];
+    }
+    total->count += histogram->count;
+    total->sum += histogram->sum;
+    if (histogram->max > total->max) {
+        total->max = histogram->max;
+    }
+}
+
+
+/*
+ * Value in seconds below which percentile (0 to 100) of the recorded
+ * values fall, accurate to the bucket width.  0 when nothing is recorded.
+ */
+double rtmp_histogram_get_percentile(
+    const rtmp_histogram_t *histogram, double percentile)
+{
+    unsigned long long rank;
+    unsigned long long seen;
+    double value;
+    int i;
+
+    if (histogram->count == 0) {
+        return 0;
+    }
+    rank = (unsigned long long)(histogram->count * percentile / 100.0);
+    if (rank >= histogram->count) {
+        rank = histogram->count - 1;
+    }
+    seen = 0;
+    for (i = 0; i < RTMP_HISTOGRAM_BUCKET_NUM; ++i) {
+        seen += histogram->counts[i];
+        if (seen > rank) {
+            break;
+        }
+    }
+    value = rtmp_histogram_get_bucket_value(i);
+    /* the last bucket is open ended */
+    if (value > histogram->max) {
+        value = histogram->max;
+    }
+    return value;
+}
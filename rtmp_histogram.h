@@ -0,0 +1,73 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#ifndef _rtmp_histogram_H_
+#define _rtmp_histogram_H_
+
+
+/* Set up for C function definitions, even when using C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * Log bucketed latency histogram in the style of HdrHistogram.  Values are
+ * kept in microseconds; each power of two is split into
+ * RTMP_HISTOGRAM_SUB_BUCKET_NUM linear buckets, so a bucket is at most
+ * 1/8 = 12.5% wide relative to its value.  Values of
+ * 2^RTMP_HISTOGRAM_MAX_MAGNITUDE us (about 134 s) and above go to the last
+ * bucket.  Histograms are merged by adding the counts, so each thread can
+ * record into its own and they can be combined when read.
+ */
+#define RTMP_HISTOGRAM_SUB_BUCKET_BITS 3
+#define RTMP_HISTOGRAM_SUB_BUCKET_NUM (1 << RTMP_HISTOGRAM_SUB_BUCKET_BITS)
+#define RTMP_HISTOGRAM_MAX_MAGNITUDE 27
+#define RTMP_HISTOGRAM_BUCKET_NUM \
+    ((RTMP_HISTOGRAM_MAX_MAGNITUDE - RTMP_HISTOGRAM_SUB_BUCKET_BITS + 1) * \
+     RTMP_HISTOGRAM_SUB_BUCKET_NUM)
+
+typedef struct rtmp_histogram_t rtmp_histogram_t;
+
+struct rtmp_histogram_t
+{
+    unsigned long long counts[RTMP_HISTOGRAM_BUCKET_NUM];
+    unsigned long long count;
+    double sum; /* seconds */
+    double max; /* seconds */
+};
+
+
+extern void rtmp_histogram_record(rtmp_histogram_t *histogram, double seconds);
+extern void rtmp_histogram_merge(
+    rtmp_histogram_t *total, const rtmp_histogram_t *histogram);
+extern double rtmp_histogram_get_percentile(
+    const rtmp_histogram_t *histogram, double percentile);
+
+
+/* Ends C function definitions when using C++ */
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,379 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#if !defined(__WIN32__) && !defined(WIN32)
+#include <sys/mman.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtmp_pool.h"
+#include "rtmp_allocator.h"
+
+
+#if defined(__GNUC__)
+#define RTMP_POOL_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define RTMP_POOL_THREAD_LOCAL __declspec(thread)
+#else
+#define RTMP_POOL_THREAD_LOCAL
+#endif
+
+/* keeps the alignment of the slabs for the bodies */
+#define RTMP_POOL_HEADER_SIZE 16
+#define RTMP_POOL_DIRECT -1 /* class of bodies too large for the pool */
+#define RTMP_POOL_SLAB_SIZE (64 * 1024)
+#define RTMP_POOL_SLAB_BLOCKS_MIN 8
+#define RTMP_POOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define RTMP_POOL_HUGE_CLASS_SIZE_MIN (32 * 1024)
+
+
+typedef struct rtmp_pool_t rtmp_pool_t;
+typedef struct rtmp_pool_block_t rtmp_pool_block_t;
+
+struct rtmp_pool_block_t
+{
+    int size_class;
+    union {
+        rtmp_pool_t *owner; /* while allocated, the pool it goes back to */
+        rtmp_pool_block_t *next; /* while on a free list */
+    } link;
+};
+
+/* fails to compile when the header does not fit */
+typedef char rtmp_pool_block_check[
+    sizeof(rtmp_pool_block_t) <= RTMP_POOL_HEADER_SIZE ? 1 : -1];
+
+typedef struct rtmp_pool_slab_t rtmp_pool_slab_t;
+
+/* at the start of each slab */
+struct rtmp_pool_slab_t
+{
+    rtmp_pool_slab_t *next;
+    size_t size;
+};
+
+typedef char rtmp_pool_slab_check[
+    sizeof(rtmp_pool_slab_t) <= RTMP_POOL_HEADER_SIZE ? 1 : -1];
+
+/* one per thread, kept until the process exits like the slabs */
+struct rtmp_pool_t
+{
+    rtmp_pool_t *next;
+    rtmp_pool_block_t *free_blocks[RTMP_POOL_CLASS_NUM];
+    /* the part of the last slab of each class not carved yet */
+    unsigned char *slab_next[RTMP_POOL_CLASS_NUM];
+    unsigned char *slab_end[RTMP_POOL_CLASS_NUM];
+    /* of any class, released by other threads and pushed atomically */
+    rtmp_pool_block_t *remote_blocks;
+};
+
+
+static int rtmp_pool_get_class(size_t size);
+static size_t rtmp_pool_get_slab_size(int size_class);
+static void *rtmp_pool_map_huge(size_t size);
+static int rtmp_pool_add_slab(rtmp_pool_t *pool, int size_class);
+static rtmp_pool_t *rtmp_pool_get(void);
+static void rtmp_pool_take_remote_blocks(rtmp_pool_t *pool);
+
+
+/*
+ * Tuned for RTMP traffic: control messages, audio frames of a few hundred
+ * bytes, handshakes and connection buffers, video frames of 4 to 64KB and
+ * keyframes.
+ */
+static const size_t rtmp_pool_class_sizes[RTMP_POOL_CLASS_NUM] = {
+    128, 512, 2048, 4096, 8192, 32768, 65536, 262144
+};
+
+static RTMP_POOL_THREAD_LOCAL rtmp_pool_t *rtmp_pool;
+
+/* every slab and pool of every thread, so that they stay reachable */
+static rtmp_pool_slab_t *rtmp_pool_slabs;
+static rtmp_pool_t *rtmp_pool_pools;
+
+static int rtmp_pool_huge_pages;
+
+
+static int rtmp_pool_get_class(size_t size)
+{
+    int size_class;
+
+    for (size_class = 0; size_class < RTMP_POOL_CLASS_NUM; ++size_class) {
+        if (size <= rtmp_pool_class_sizes[size_class]) {
+            return size_class;
+        }
+    }
+    return RTMP_POOL_DIRECT;
+}
+
+
+static size_t rtmp_pool_get_slab_size(int size_class)
+{
+    size_t block_size;
+    size_t slab_size;
+
+    block_size = RTMP_POOL_HEADER_SIZE + rtmp_pool_class_sizes[size_class];
+    slab_size = RTMP_POOL_HEADER_SIZE + block_size * RTMP_POOL_SLAB_BLOCKS_MIN;
+    if (slab_size < RTMP_POOL_SLAB_SIZE) {
+        slab_size = RTMP_POOL_SLAB_SIZE;
+    }
+    if (rtmp_pool_huge_pages &&
+        rtmp_pool_class_sizes[size_class] >= RTMP_POOL_HUGE_CLASS_SIZE_MIN) {
+        slab_size = (slab_size + RTMP_POOL_HUGE_PAGE_SIZE - 1) /
+            RTMP_POOL_HUGE_PAGE_SIZE * RTMP_POOL_HUGE_PAGE_SIZE;
+    }
+    return slab_size;
+}
+
+
+/*
+ * Explicit huge pages when some are reserved, otherwise a huge page
+ * aligned mapping the kernel may back with transparent huge pages.
+ */
+static void *rtmp_pool_map_huge(size_t size)
+{
+#if defined(__WIN32__) || defined(WIN32)
+    (void)size;
+    return NULL;
+#else
+    unsigned char *mapped;
+    size_t head;
+
+#ifdef MAP_HUGETLB
+    mapped = (unsigned char*)mmap(
+        NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mapped != (unsigned char*)MAP_FAILED) {
+        return mapped;
+    }
+#endif
+    mapped = (unsigned char*)mmap(
+        NULL, size + RTMP_POOL_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == (unsigned char*)MAP_FAILED) {
+        return NULL;
+    }
+    head = (RTMP_POOL_HUGE_PAGE_SIZE -
+            (size_t)mapped % RTMP_POOL_HUGE_PAGE_SIZE) %
+        RTMP_POOL_HUGE_PAGE_SIZE;
+    if (head > 0) {
+        munmap(mapped, head);
+    }
+    munmap(mapped + head + size, RTMP_POOL_HUGE_PAGE_SIZE - head);
+    mapped += head;
+#ifdef MADV_HUGEPAGE
+    madvise(mapped, size, MADV_HUGEPAGE);
+#endif
+    return mapped;
+#endif
+}
+
+
+static int rtmp_pool_add_slab(rtmp_pool_t *pool, int size_class)
+{
+    rtmp_pool_slab_t *slab;
+    size_t size;
+
+    size = rtmp_pool_get_slab_size(size_class);
+    slab = NULL;
+    if (size % RTMP_POOL_HUGE_PAGE_SIZE == 0) {
+        slab = (rtmp_pool_slab_t*)rtmp_pool_map_huge(size);
+    }
+    if (slab == NULL) {
+        slab = (rtmp_pool_slab_t*)rtmp_allocate(
+            RTMP_ALLOCATION_PACKET_BODY, size);
+        if (slab == NULL) {
+            return 0;
+        }
+    }
+    slab->size = size;
+#ifdef __GNUC__
+    do {
+        slab->next = rtmp_pool_slabs;
+    } while (!__sync_bool_compare_and_swap(
+                 &rtmp_pool_slabs, slab->next, slab));
+#else
+    slab->next = rtmp_pool_slabs;
+    rtmp_pool_slabs = slab;
+#endif
+
+    pool->slab_next[size_class] = (unsigned char*)slab + RTMP_POOL_HEADER_SIZE;
+    pool->slab_end[size_class] = (unsigned char*)slab + size;
+    return 1;
+}
+
+
+/*
+ * The pool of the calling thread, created on its first allocation.  It
+ * outlives the thread, as blocks of its slabs may still be released to it.
+ */
+static rtmp_pool_t *rtmp_pool_get(void)
+{
+    rtmp_pool_t *pool;
+
+    if (rtmp_pool != NULL) {
+        return rtmp_pool;
+    }
+    pool = (rtmp_pool_t*)rtmp_allocate(
+        RTMP_ALLOCATION_PACKET_BODY, sizeof(rtmp_pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    memset(pool, 0x00, sizeof(rtmp_pool_t));
+#ifdef __GNUC__
+    do {
+        pool->next = rtmp_pool_pools;
+    } while (!__sync_bool_compare_and_swap(
+                 &rtmp_pool_pools, pool->next, pool));
+#else
+    pool->next = rtmp_pool_pools;
+    rtmp_pool_pools = pool;
+#endif
+    rtmp_pool = pool;
+    return pool;
+}
+
+
+/* moves the blocks other threads released onto the free lists */
+static void rtmp_pool_take_remote_blocks(rtmp_pool_t *pool)
+{
+    rtmp_pool_block_t *block;
+    rtmp_pool_block_t *next;
+
+    if (pool->remote_blocks == NULL) {
+        return;
+    }
+#ifdef __GNUC__
+    block = (rtmp_pool_block_t*)__sync_lock_test_and_set(
+        &pool->remote_blocks, NULL);
+#else
+    block = pool->remote_blocks;
+    pool->remote_blocks = NULL;
+#endif
+    while (block) {
+        next = block->link.next;
+        block->link.next = pool->free_blocks[block->size_class];
+        pool->free_blocks[block->size_class] = block;
+        block = next;
+    }
+}
+
+
+void *rtmp_pool_allocate(size_t size)
+{
+    rtmp_pool_t *pool;
+    rtmp_pool_block_t *block;
+    size_t block_size;
+    int size_class;
+
+    size_class = rtmp_pool_get_class(size);
+    if (size_class == RTMP_POOL_DIRECT) {
+        if (size > (size_t)-1 - RTMP_POOL_HEADER_SIZE) {
+            return NULL;
+        }
+        block = (rtmp_pool_block_t*)rtmp_allocate(
+            RTMP_ALLOCATION_PACKET_BODY, RTMP_POOL_HEADER_SIZE + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->size_class = RTMP_POOL_DIRECT;
+        return (unsigned char*)block + RTMP_POOL_HEADER_SIZE;
+    }
+
+    pool = rtmp_pool_get();
+    if (pool == NULL) {
+        return NULL;
+    }
+    if (pool->free_blocks[size_class] == NULL) {
+        rtmp_pool_take_remote_blocks(pool);
+    }
+    block = pool->free_blocks[size_class];
+    if (block) {
+        pool->free_blocks[size_class] = block->link.next;
+        block->link.owner = pool;
+        return (unsigned char*)block + RTMP_POOL_HEADER_SIZE;
+    }
+
+    block_size = RTMP_POOL_HEADER_SIZE + rtmp_pool_class_sizes[size_class];
+    if (pool->slab_next[size_class] == NULL ||
+        (size_t)(pool->slab_end[size_class] - pool->slab_next[size_class]) <
+        block_size) {
+        if (!rtmp_pool_add_slab(pool, size_class)) {
+            return NULL;
+        }
+    }
+    block = (rtmp_pool_block_t*)pool->slab_next[size_class];
+    pool->slab_next[size_class] += block_size;
+    block->size_class = size_class;
+    block->link.owner = pool;
+    return (unsigned char*)block + RTMP_POOL_HEADER_SIZE;
+}
+
+
+void rtmp_pool_release(void *pointer)
+{
+    rtmp_pool_t *pool;
+    rtmp_pool_block_t *block;
+
+    if (pointer == NULL) {
+        return;
+    }
+    block = (rtmp_pool_block_t*)(
+        (unsigned char*)pointer - RTMP_POOL_HEADER_SIZE);
+    if (block->size_class == RTMP_POOL_DIRECT) {
+        rtmp_release(block);
+        return;
+    }
+    pool = block->link.owner;
+    if (pool == rtmp_pool) {
+        block->link.next = pool->free_blocks[block->size_class];
+        pool->free_blocks[block->size_class] = block;
+        return;
+    }
+    /*
+     * Back to the thread which allocated it, so that a thread only
+     * releasing, as one sending what another received, does not keep
+     * blocks the other has to carve again.
+     */
+#ifdef __GNUC__
+    do {
+        block->link.next = pool->remote_blocks;
+    } while (!__sync_bool_compare_and_swap(
+                 &pool->remote_blocks, block->link.next, block));
+#else
+    block->link.next = pool->remote_blocks;
+    pool->remote_blocks = block;
+#endif
+}
+
+
+/*
+ * Backs the slabs of the classes of 32KB and up with huge pages, where the
+ * platform has them.  Those slabs are mapped directly and are not counted
+ * by the allocator.  Only affects slabs added after the call.
+ */
+void rtmp_pool_set_huge_pages(int enabled)
+{
+    rtmp_pool_huge_pages = enabled;
+}
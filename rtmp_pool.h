@@ -0,0 +1,59 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#ifndef _rtmp_pool_H_
+#define _rtmp_pool_H_
+
+#include <stddef.h>
+
+
+/* Set up for C function definitions, even when using C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * Size class pool for message bodies.  Each thread keeps a free list per
+ * class, filled by carving slabs, so that allocating and releasing a body
+ * takes no lock and does not touch the allocator once the pool is warm.
+ * A block may be released by any thread.  Released by another thread, it
+ * goes back to the thread which allocated it, which takes it over once its
+ * own list of the class runs empty.  Slabs and the pools of the threads are
+ * kept until the process exits.  Bodies larger than the largest class go to
+ * the allocator directly.
+ */
+#define RTMP_POOL_CLASS_NUM 8
+
+
+extern void *rtmp_pool_allocate(size_t size);
+extern void rtmp_pool_release(void *pointer);
+extern void rtmp_pool_set_huge_pages(int enabled);
+
+
+/* Ends C function definitions when using C++ */
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
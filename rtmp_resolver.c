@@ -0,0 +1,238 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__WIN32__) || defined(WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <pthread.h>
+#define RTMP_RESOLVER_THREADS
+#endif
+
+#include "rtmp_resolver.h"
+#include "rtmp_allocator.h"
+
+
+/* getaddrinfo runs NSS modules, which want more than a minimal stack */
+#define RTMP_RESOLVER_STACK_SIZE (256 * 1024)
+
+
+/*
+ * Shared by the caller and the lookup thread, whichever lets go of it last
+ * frees it.
+ */
+struct rtmp_resolver_t
+{
+#ifdef RTMP_RESOLVER_THREADS
+    pthread_mutex_t lock;
+#endif
+    int references;
+    int done;
+    struct addrinfo *addresses;
+    char *host;
+    char service[8];
+};
+
+
+static struct addrinfo *rtmp_resolve(
+    const char *host, const char *service, int flags);
+#ifdef RTMP_RESOLVER_THREADS
+static void *rtmp_resolver_main(void *data);
+#endif
+static void rtmp_resolver_release(rtmp_resolver_t *resolver);
+
+
+static struct addrinfo *rtmp_resolve(
+    const char *host, const char *service, int flags)
+{
+    struct addrinfo hints;
+    struct addrinfo *addresses;
+
+    memset(&hints, 0x00, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = flags;
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) {
+        return NULL;
+    }
+    return addresses;
+}
+
+
+/*
+ * The addresses of a host given as an IPv4 or IPv6 literal, or NULL for a
+ * name, which has to be looked up.  Never blocks.
+ */
+struct addrinfo *rtmp_resolve_numeric(const char *host, int port_number)
+{
+    char service[8];
+
+    sprintf(service, "%d", port_number & 0xffff);
+    return rtmp_resolve(host, service, AI_NUMERICHOST | AI_NUMERICSERV);
+}
+
+
+rtmp_resolver_t *rtmp_resolver_start(const char *host, int port_number)
+{
+    rtmp_resolver_t *resolver;
+#ifdef RTMP_RESOLVER_THREADS
+    pthread_attr_t attributes;
+    pthread_t thread;
+    int ret;
+#endif
+
+    resolver = (rtmp_resolver_t*)rtmp_allocate(
+        RTMP_ALLOCATION_CONNECTION, sizeof(rtmp_resolver_t));
+    if (resolver == NULL) {
+        return NULL;
+    }
+    resolver->host = (char*)rtmp_allocate(
+        RTMP_ALLOCATION_CONNECTION, strlen(host) + 1);
+    if (resolver->host == NULL) {
+        rtmp_release(resolver);
+        return NULL;
+    }
+    strcpy(resolver->host, host);
+    sprintf(resolver->service, "%d", port_number & 0xffff);
+    resolver->addresses = NULL;
+    resolver->done = 0;
+
+#ifdef RTMP_RESOLVER_THREADS
+    if (pthread_mutex_init(&resolver->lock, NULL) != 0) {
+        rtmp_release(resolver->host);
+        rtmp_release(resolver);
+        return NULL;
+    }
+    resolver->references = 2;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attributes, RTMP_RESOLVER_STACK_SIZE);
+    ret = pthread_create(&thread, &attributes, rtmp_resolver_main, resolver);
+    pthread_attr_destroy(&attributes);
+    if (ret != 0) {
+        resolver->references = 1;
+        rtmp_resolver_release(resolver);
+        return NULL;
+    }
+#else
+    resolver->references = 1;
+    resolver->addresses = rtmp_resolve(
+        resolver->host, resolver->service, AI_NUMERICSERV);
+    resolver->done = 1;
+#endif
+
+    return resolver;
+}
+
+
+#ifdef RTMP_RESOLVER_THREADS
+static void *rtmp_resolver_main(void *data)
+{
+    rtmp_resolver_t *resolver;
+    struct addrinfo *addresses;
+
+    resolver = (rtmp_resolver_t*)data;
+    addresses = rtmp_resolve(
+        resolver->host, resolver->service, AI_NUMERICSERV);
+    pthread_mutex_lock(&resolver->lock);
+    resolver->addresses = addresses;
+    resolver->done = 1;
+    pthread_mutex_unlock(&resolver->lock);
+    rtmp_resolver_release(resolver);
+    return NULL;
+}
+#endif
+
+
+int rtmp_resolver_is_done(rtmp_resolver_t *resolver)
+{
+    int done;
+
+#ifdef RTMP_RESOLVER_THREADS
+    pthread_mutex_lock(&resolver->lock);
+    done = resolver->done;
+    pthread_mutex_unlock(&resolver->lock);
+#else
+    done = resolver->done;
+#endif
+    return done;
+}
+
+
+/*
+ * Once done, hands the addresses over to the caller, who frees them with
+ * freeaddrinfo.  NULL if the host could not be resolved.
+ */
+struct addrinfo *rtmp_resolver_take_addresses(rtmp_resolver_t *resolver)
+{
+    struct addrinfo *addresses;
+
+#ifdef RTMP_RESOLVER_THREADS
+    pthread_mutex_lock(&resolver->lock);
+#endif
+    addresses = resolver->addresses;
+    resolver->addresses = NULL;
+#ifdef RTMP_RESOLVER_THREADS
+    pthread_mutex_unlock(&resolver->lock);
+#endif
+    return addresses;
+}
+
+
+/* may be called before the lookup is done, which abandons it */
+void rtmp_resolver_free(rtmp_resolver_t *resolver)
+{
+    rtmp_resolver_release(resolver);
+}
+
+
+static void rtmp_resolver_release(rtmp_resolver_t *resolver)
+{
+    int references;
+
+#ifdef RTMP_RESOLVER_THREADS
+    pthread_mutex_lock(&resolver->lock);
+    references = --resolver->references;
+    pthread_mutex_unlock(&resolver->lock);
+#else
+    references = --resolver->references;
+#endif
+    if (references > 0) {
+        return;
+    }
+
+    if (resolver->addresses) {
+        freeaddrinfo(resolver->addresses);
+    }
+#ifdef RTMP_RESOLVER_THREADS
+    pthread_mutex_destroy(&resolver->lock);
+#endif
+    rtmp_release(resolver->host);
+    rtmp_release(resolver);
+}
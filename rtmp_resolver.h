@@ -0,0 +1,61 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#ifndef _rtmp_resolver_H_
+#define _rtmp_resolver_H_
+
+
+/* Set up for C function definitions, even when using C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+struct addrinfo;
+
+typedef struct rtmp_resolver_t rtmp_resolver_t;
+
+/*
+ * Host name lookup running off the caller's thread.  getaddrinfo blocks,
+ * so each lookup runs on a thread of its own, which the caller polls with
+ * rtmp_resolver_is_done.  A lookup the caller gives up on is left to
+ * finish and cleans up after itself.  Where threads are not available the
+ * lookup is done by rtmp_resolver_start.
+ */
+extern rtmp_resolver_t *rtmp_resolver_start(
+    const char *host, int port_number);
+extern int rtmp_resolver_is_done(rtmp_resolver_t *resolver);
+extern struct addrinfo *rtmp_resolver_take_addresses(
+    rtmp_resolver_t *resolver);
+extern void rtmp_resolver_free(rtmp_resolver_t *resolver);
+
+extern struct addrinfo *rtmp_resolve_numeric(
+    const char *host, int port_number);
+
+
+/* Ends C function definitions when using C++ */
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
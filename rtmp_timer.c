@@ -0,0 +1,239 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#include <string.h>
+
+#include "rtmp_timer.h"
+
+
+#define RTMP_TIMER_SLOT_MASK (RTMP_TIMER_SLOT_NUM - 1)
+/* the farthest a timer can be set, in ticks */
+#define RTMP_TIMER_RANGE \
+    (1ULL << (RTMP_TIMER_SLOT_BITS * RTMP_TIMER_LEVEL_NUM))
+
+
+static unsigned long long rtmp_timer_get_tick(double time);
+static void rtmp_timer_insert(rtmp_timer_wheel_t *wheel, rtmp_timer_t *timer);
+static void rtmp_timer_unlink(rtmp_timer_t *timer);
+static int rtmp_timer_cascade(rtmp_timer_wheel_t *wheel, int level);
+
+
+static unsigned long long rtmp_timer_get_tick(double time)
+{
+    if (time <= 0) {
+        return 0;
+    }
+    /*
+     * nudged up, so that the time of a tick, such as rtmp_timer_wheel_next
+     * returns, is not rounded down into the tick before
+     */
+    return (unsigned long long)(time / RTMP_TIMER_TICK + 0.001);
+}
+
+
+/* into the level whose slots are as wide as the time left allows */
+static void rtmp_timer_insert(rtmp_timer_wheel_t *wheel, rtmp_timer_t *timer)
+{
+    unsigned long long expires;
+    unsigned long long left;
+    rtmp_timer_t **slot;
+    int level;
+
+    expires = timer->expires;
+    if (expires < wheel->ticks) {
+        expires = wheel->ticks;
+    }
+    left = expires - wheel->ticks;
+    if (left >= RTMP_TIMER_RANGE) {
+        left = RTMP_TIMER_RANGE - 1;
+        expires = wheel->ticks + left;
+    }
+    level = 0;
+    while (left >= (1ULL << (RTMP_TIMER_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    slot = &wheel->slots[level][
+        (expires >> (RTMP_TIMER_SLOT_BITS * level)) & RTMP_TIMER_SLOT_MASK];
+
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+}
+
+
+static void rtmp_timer_unlink(rtmp_timer_t *timer)
+{
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->slot = NULL;
+}
+
+
+/*
+ * Moves the timers of the slot of level the current tick has reached down
+ * the levels.  Returns the index of that slot: 0 means the level wrapped
+ * and the next one is due as well.
+ */
+static int rtmp_timer_cascade(rtmp_timer_wheel_t *wheel, int level)
+{
+    rtmp_timer_t *timer;
+    rtmp_timer_t *next;
+    int index;
+
+    index = (int)((wheel->ticks >> (RTMP_TIMER_SLOT_BITS * level)) &
+        RTMP_TIMER_SLOT_MASK);
+    timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (timer) {
+        next = timer->next;
+        rtmp_timer_insert(wheel, timer);
+        timer = next;
+    }
+    return index;
+}
+
+
+void rtmp_timer_wheel_initialize(rtmp_timer_wheel_t *wheel, double now)
+{
+    memset(wheel->slots, 0x00, sizeof(wheel->slots));
+    wheel->ticks = rtmp_timer_get_tick(now);
+    wheel->set_num = 0;
+}
+
+
+/*
+ * Fires, in tick order, the timers due at now or before.  Returns how many
+ * fired.
+ */
+size_t rtmp_timer_wheel_run(rtmp_timer_wheel_t *wheel, double now)
+{
+    unsigned long long now_tick;
+    rtmp_timer_t *timer;
+    rtmp_timer_t **slot;
+    size_t fired;
+    int index;
+    int level;
+
+    now_tick = rtmp_timer_get_tick(now);
+    fired = 0;
+    while (wheel->ticks <= now_tick) {
+        if (wheel->set_num == 0) {
+            wheel->ticks = now_tick + 1;
+            return fired;
+        }
+        index = (int)(wheel->ticks & RTMP_TIMER_SLOT_MASK);
+        if (index == 0) {
+            for (level = 1; level < RTMP_TIMER_LEVEL_NUM; ++level) {
+                if (rtmp_timer_cascade(wheel, level) != 0) {
+                    break;
+                }
+            }
+        }
+        slot = &wheel->slots[0][index];
+        wheel->ticks++;
+        /* a callback may set or cancel any timer, this one included */
+        while ((timer = *slot) != NULL) {
+            rtmp_timer_unlink(timer);
+            wheel->set_num--;
+            fired++;
+            timer->callback(timer);
+        }
+    }
+    return fired;
+}
+
+
+/*
+ * The time before which no timer fires, or a negative value when none is
+ * set.  Only the rest of the current turn of the first level is looked
+ * at: past it comes the end of the turn, when the next levels cascade
+ * down, so a caller waiting longer than that gets woken up early.
+ */
+double rtmp_timer_wheel_next(rtmp_timer_wheel_t *wheel)
+{
+    unsigned long long tick;
+
+    if (wheel->set_num == 0) {
+        return -1;
+    }
+    tick = wheel->ticks;
+    if ((tick & RTMP_TIMER_SLOT_MASK) != 0) {
+        while ((tick & RTMP_TIMER_SLOT_MASK) != 0 &&
+               wheel->slots[0][tick & RTMP_TIMER_SLOT_MASK] == NULL) {
+            tick++;
+        }
+    }
+    return tick * RTMP_TIMER_TICK;
+}
+
+
+void rtmp_timer_initialize(
+    rtmp_timer_t *timer, rtmp_timer_callback_t callback, void *data)
+{
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->slot = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+
+/* sets the timer to fire at expires, moving it if it is already set */
+void rtmp_timer_set(
+    rtmp_timer_wheel_t *wheel, rtmp_timer_t *timer, double expires)
+{
+    if (timer->slot) {
+        rtmp_timer_unlink(timer);
+    } else {
+        wheel->set_num++;
+    }
+    timer->expires = rtmp_timer_get_tick(expires);
+    rtmp_timer_insert(wheel, timer);
+}
+
+
+void rtmp_timer_cancel(rtmp_timer_wheel_t *wheel, rtmp_timer_t *timer)
+{
+    if (timer->slot) {
+        rtmp_timer_unlink(timer);
+        wheel->set_num--;
+    }
+}
+
+
+int rtmp_timer_is_set(rtmp_timer_t *timer)
+{
+    return timer->slot != NULL;
+}
@@ -0,0 +1,90 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#ifndef _rtmp_timer_H_
+#define _rtmp_timer_H_
+
+#include <stddef.h>
+
+
+/* Set up for C function definitions, even when using C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * Hierarchical timing wheel.  Times are in seconds on the clock the caller
+ * passes to rtmp_timer_wheel_run, rounded to ticks of RTMP_TIMER_TICK.
+ * Setting, moving and cancelling a timer are constant time; a timer due
+ * further than the first level reaches is moved down a level as its
+ * time approaches.  Timers further than the wheel reaches, about 46 hours,
+ * fire at its end.
+ */
+#define RTMP_TIMER_TICK 0.01
+#define RTMP_TIMER_LEVEL_NUM 4
+#define RTMP_TIMER_SLOT_BITS 6
+#define RTMP_TIMER_SLOT_NUM (1 << RTMP_TIMER_SLOT_BITS)
+
+typedef struct rtmp_timer_t rtmp_timer_t;
+typedef struct rtmp_timer_wheel_t rtmp_timer_wheel_t;
+
+typedef void (*rtmp_timer_callback_t)(rtmp_timer_t *timer);
+
+/* embedded in what it times, the wheel does not allocate */
+struct rtmp_timer_t
+{
+    rtmp_timer_t *prev;
+    rtmp_timer_t *next;
+    rtmp_timer_t **slot; /* NULL while not set */
+    unsigned long long expires; /* tick */
+    rtmp_timer_callback_t callback;
+    void *data;
+};
+
+struct rtmp_timer_wheel_t
+{
+    unsigned long long ticks; /* the next tick to run */
+    size_t set_num;
+    rtmp_timer_t *slots[RTMP_TIMER_LEVEL_NUM][RTMP_TIMER_SLOT_NUM];
+};
+
+
+extern void rtmp_timer_wheel_initialize(rtmp_timer_wheel_t *wheel, double now);
+extern size_t rtmp_timer_wheel_run(rtmp_timer_wheel_t *wheel, double now);
+extern double rtmp_timer_wheel_next(rtmp_timer_wheel_t *wheel);
+
+extern void rtmp_timer_initialize(
+    rtmp_timer_t *timer, rtmp_timer_callback_t callback, void *data);
+extern void rtmp_timer_set(
+    rtmp_timer_wheel_t *wheel, rtmp_timer_t *timer, double expires);
+extern void rtmp_timer_cancel(rtmp_timer_wheel_t *wheel, rtmp_timer_t *timer);
+extern int rtmp_timer_is_set(rtmp_timer_t *timer);
+
+
+/* Ends C function definitions when using C++ */
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
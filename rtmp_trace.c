@@ -0,0 +1,270 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#if defined(__WIN32__) || defined(WIN32)
+#include <windows.h>
+#include <mmsystem.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtmp_trace.h"
+#include "rtmp_allocator.h"
+
+
+#if defined(__GNUC__)
+#define RTMP_TRACE_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define RTMP_TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define RTMP_TRACE_THREAD_LOCAL
+#endif
+
+
+typedef struct rtmp_trace_ring_t rtmp_trace_ring_t;
+
+struct rtmp_trace_ring_t
+{
+    rtmp_trace_record_t records[RTMP_TRACE_RECORD_NUM];
+    size_t first;
+    size_t num;
+    unsigned long dropped; /* overwritten before being drained */
+};
+
+
+static double rtmp_trace_get_time(void);
+
+
+/* allocated on the first record of each thread */
+static RTMP_TRACE_THREAD_LOCAL rtmp_trace_ring_t *rtmp_trace_ring;
+
+static const char *rtmp_trace_point_names[] = {
+    "received",
+    "sent",
+    "disconnected",
+    "peer closed",
+    "timed out",
+    "ping request",
+    "shed",
+    "accept paused",
+    "keyframe dropped",
+    "handshake 1",
+    "handshake 2",
+    "notify command",
+    "invoke command",
+    "status code",
+    "status level",
+    "url protocol",
+    "url host",
+    "url path",
+    "packet start",
+    "packet header_size_magic",
+    "packet object_id",
+    "packet timer",
+    "packet body size",
+    "packet chunk_delimiter_num",
+    "packet data_type",
+    "packet body allocated",
+    "packet end",
+    "packet data",
+    "packet serialize start",
+    "packet serialize data_type",
+    "packet serialize end",
+    "packet serialize AMF start",
+    "packet serialize AMF error",
+    "packet serialize AMF end",
+    "packet serialize data start",
+    "packet serialize data end",
+    "AMF number",
+    "AMF boolean",
+    "AMF string",
+    "AMF object start",
+    "AMF object end",
+    "AMF null",
+    "AMF undefined",
+    "AMF ecma array start",
+    "AMF ecma array end",
+    "AMF property key",
+    "AMF strict array start",
+    "AMF strict array end",
+    "AMF date",
+    "AMF typed object start",
+    "AMF typed object end",
+    "AMF nested too deep",
+    "AMF serialize number",
+    "AMF serialize boolean",
+    "AMF serialize string",
+    "AMF serialize object start",
+    "AMF serialize object end",
+    "AMF serialize undefined",
+    "AMF serialize ecma array start",
+    "AMF serialize ecma array end",
+    "AMF serialize property key",
+    "AMF serialize avmplus",
+    "AMF3 integer",
+    "AMF3 string",
+    "AMF3 reference",
+    "AMF3 array start",
+    "AMF3 array end",
+    "AMF3 dense array start",
+    "AMF3 dense array end",
+    "AMF3 object start",
+    "AMF3 object end",
+    "AMF3 byte array",
+    "AMF3 externalizable object",
+};
+
+/* fails to compile when the names and the points do not match */
+typedef char rtmp_trace_point_names_check[
+    sizeof(rtmp_trace_point_names) / sizeof(rtmp_trace_point_names[0]) ==
+    RTMP_TRACE_POINT_NUM ? 1 : -1];
+
+
+static double rtmp_trace_get_time(void)
+{
+#if defined(__WIN32__) || defined(WIN32)
+    return timeGetTime() / 1000.0;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+#endif
+}
+
+
+void rtmp_trace_record(
+    rtmp_trace_point_t point, double value, const char *text)
+{
+    rtmp_trace_ring_t *ring;
+    rtmp_trace_record_t *record;
+
+    ring = rtmp_trace_ring;
+    if (ring == NULL) {
+        ring = (rtmp_trace_ring_t*)rtmp_allocate(
+            RTMP_ALLOCATION_TRACE, sizeof(rtmp_trace_ring_t));
+        if (ring == NULL) {
+            return;
+        }
+        ring->first = 0;
+        ring->num = 0;
+        ring->dropped = 0;
+        rtmp_trace_ring = ring;
+    }
+
+    if (ring->num == RTMP_TRACE_RECORD_NUM) {
+        ring->first = (ring->first + 1) % RTMP_TRACE_RECORD_NUM;
+        ring->num--;
+        ring->dropped++;
+    }
+    record = &ring->records[(ring->first + ring->num) % RTMP_TRACE_RECORD_NUM];
+    ring->num++;
+
+    record->time = rtmp_trace_get_time();
+    record->value = value;
+    record->point = point;
+    if (text) {
+        strncpy(record->text, text, RTMP_TRACE_TEXT_SIZE - 1);
+        record->text[RTMP_TRACE_TEXT_SIZE - 1] = '\0';
+    } else {
+        record->text[0] = '\0';
+    }
+}
+
+
+/*
+ * Moves up to records_num of the oldest records of the calling thread
+ * into records.  Returns the number moved.
+ */
+size_t rtmp_trace_drain(rtmp_trace_record_t *records, size_t records_num)
+{
+    rtmp_trace_ring_t *ring;
+    size_t i;
+
+    ring = rtmp_trace_ring;
+    if (ring == NULL) {
+        return 0;
+    }
+    for (i = 0; i < records_num && ring->num > 0; ++i) {
+        memcpy(&records[i], &ring->records[ring->first],
+            sizeof(rtmp_trace_record_t));
+        ring->first = (ring->first + 1) % RTMP_TRACE_RECORD_NUM;
+        ring->num--;
+    }
+    return i;
+}
+
+
+/*
+ * Drains the records of the calling thread as text, one line each:
+ *   time point value "text"
+ * Returns the number written.
+ */
+size_t rtmp_trace_dump(FILE *file)
+{
+    rtmp_trace_record_t record;
+    size_t num;
+
+    num = 0;
+    while (rtmp_trace_drain(&record, 1) == 1) {
+        fprintf(file, "%.6f %s %g",
+            record.time,
+            rtmp_trace_get_point_name((rtmp_trace_point_t)record.point),
+            record.value);
+        if (record.text[0] != '\0') {
+            fprintf(file, " \"%s\"", record.text);
+        }
+        fprintf(file, "\n");
+        num++;
+    }
+    return num;
+}
+
+
+/* records of the calling thread overwritten before being drained */
+unsigned long rtmp_trace_get_dropped(void)
+{
+    if (rtmp_trace_ring == NULL) {
+        return 0;
+    }
+    return rtmp_trace_ring->dropped;
+}
+
+
+/* frees the ring of the calling thread, call it before the thread exits */
+void rtmp_trace_release(void)
+{
+    rtmp_release(rtmp_trace_ring);
+    rtmp_trace_ring = NULL;
+}
+
+
+const char *rtmp_trace_get_point_name(rtmp_trace_point_t point)
+{
+    if ((unsigned int)point >= RTMP_TRACE_POINT_NUM) {
+        return "unknown";
+    }
+    return rtmp_trace_point_names[point];
+}
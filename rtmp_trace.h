@@ -0,0 +1,166 @@
+/*
+    librtmp
+    Copyright (C) 2009 ITOYANAGI Kazunori
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    ITOYANAGI Kazunori
+    kazunori@itoyanagi.name
+*/
+
+#ifndef _rtmp_trace_H_
+#define _rtmp_trace_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+
+/* Set up for C function definitions, even when using C++ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ * Static trace points.  Built with RTMP_TRACING defined, each RTMP_TRACE
+ * writes a binary record into a ring of the calling thread, overwriting the
+ * oldest record when the ring is full; the thread reads them back with
+ * rtmp_trace_drain or rtmp_trace_dump.  Built without it, the trace points
+ * compile to nothing and their arguments are not evaluated.
+ */
+
+typedef enum rtmp_trace_point rtmp_trace_point_t;
+
+/* keep in the order of rtmp_trace_point_names in rtmp_trace.c */
+enum rtmp_trace_point
+{
+    RTMP_TRACE_RECEIVED,
+    RTMP_TRACE_SENT,
+    RTMP_TRACE_DISCONNECTED,
+    RTMP_TRACE_PEER_CLOSED,
+    RTMP_TRACE_TIMED_OUT,
+    RTMP_TRACE_PING_REQUEST,
+    RTMP_TRACE_SHED,
+    RTMP_TRACE_ACCEPT_PAUSED,
+    RTMP_TRACE_KEYFRAME_DROPPED,
+    RTMP_TRACE_HANDSHAKE_1,
+    RTMP_TRACE_HANDSHAKE_2,
+    RTMP_TRACE_NOTIFY_COMMAND,
+    RTMP_TRACE_INVOKE_COMMAND,
+    RTMP_TRACE_STATUS_CODE,
+    RTMP_TRACE_STATUS_LEVEL,
+    RTMP_TRACE_URL_PROTOCOL,
+    RTMP_TRACE_URL_HOST,
+    RTMP_TRACE_URL_PATH,
+    RTMP_TRACE_PACKET_START,
+    RTMP_TRACE_PACKET_HEADER_SIZE_MAGIC,
+    RTMP_TRACE_PACKET_OBJECT_ID,
+    RTMP_TRACE_PACKET_TIMER,
+    RTMP_TRACE_PACKET_BODY_SIZE,
+    RTMP_TRACE_PACKET_CHUNK_DELIMITER_NUM,
+    RTMP_TRACE_PACKET_DATA_TYPE,
+    RTMP_TRACE_PACKET_BODY_ALLOCATED,
+    RTMP_TRACE_PACKET_END,
+    RTMP_TRACE_PACKET_DATA,
+    RTMP_TRACE_PACKET_SERIALIZE_START,
+    RTMP_TRACE_PACKET_SERIALIZE_DATA_TYPE,
+    RTMP_TRACE_PACKET_SERIALIZE_END,
+    RTMP_TRACE_PACKET_SERIALIZE_AMF_START,
+    RTMP_TRACE_PACKET_SERIALIZE_AMF_ERROR,
+    RTMP_TRACE_PACKET_SERIALIZE_AMF_END,
+    RTMP_TRACE_PACKET_SERIALIZE_DATA_START,
+    RTMP_TRACE_PACKET_SERIALIZE_DATA_END,
+    RTMP_TRACE_AMF_NUMBER,
+    RTMP_TRACE_AMF_BOOLEAN,
+    RTMP_TRACE_AMF_STRING,
+    RTMP_TRACE_AMF_OBJECT_START,
+    RTMP_TRACE_AMF_OBJECT_END,
+    RTMP_TRACE_AMF_NULL,
+    RTMP_TRACE_AMF_UNDEFINED,
+    RTMP_TRACE_AMF_ECMA_ARRAY_START,
+    RTMP_TRACE_AMF_ECMA_ARRAY_END,
+    RTMP_TRACE_AMF_PROPERTY_KEY,
+    RTMP_TRACE_AMF_STRICT_ARRAY_START,
+    RTMP_TRACE_AMF_STRICT_ARRAY_END,
+    RTMP_TRACE_AMF_DATE,
+    RTMP_TRACE_AMF_TYPED_OBJECT_START,
+    RTMP_TRACE_AMF_TYPED_OBJECT_END,
+    RTMP_TRACE_AMF_TOO_DEEP,
+    RTMP_TRACE_AMF_SERIALIZE_NUMBER,
+    RTMP_TRACE_AMF_SERIALIZE_BOOLEAN,
+    RTMP_TRACE_AMF_SERIALIZE_STRING,
+    RTMP_TRACE_AMF_SERIALIZE_OBJECT_START,
+    RTMP_TRACE_AMF_SERIALIZE_OBJECT_END,
+    RTMP_TRACE_AMF_SERIALIZE_UNDEFINED,
+    RTMP_TRACE_AMF_SERIALIZE_ECMA_ARRAY_START,
+    RTMP_TRACE_AMF_SERIALIZE_ECMA_ARRAY_END,
+    RTMP_TRACE_AMF_SERIALIZE_PROPERTY_KEY,
+    RTMP_TRACE_AMF_SERIALIZE_AVMPLUS,
+    RTMP_TRACE_AMF3_INTEGER,
+    RTMP_TRACE_AMF3_STRING,
+    RTMP_TRACE_AMF3_REFERENCE,
+    RTMP_TRACE_AMF3_ARRAY_START,
+    RTMP_TRACE_AMF3_ARRAY_END,
+    RTMP_TRACE_AMF3_DENSE_ARRAY_START,
+    RTMP_TRACE_AMF3_DENSE_ARRAY_END,
+    RTMP_TRACE_AMF3_OBJECT_START,
+    RTMP_TRACE_AMF3_OBJECT_END,
+    RTMP_TRACE_AMF3_BYTE_ARRAY,
+    RTMP_TRACE_AMF3_EXTERNALIZABLE,
+    RTMP_TRACE_POINT_NUM
+};
+
+#define RTMP_TRACE_TEXT_SIZE 32
+#define RTMP_TRACE_RECORD_NUM 4096 /* per thread */
+
+typedef struct rtmp_trace_record_t rtmp_trace_record_t;
+
+struct rtmp_trace_record_t
+{
+    double time; /* seconds from an arbitrary point */
+    double value;
+    int point; /* rtmp_trace_point_t */
+    char text[RTMP_TRACE_TEXT_SIZE]; /* truncated, always terminated */
+};
+
+
+#ifdef RTMP_TRACING
+#define RTMP_TRACE(point, value) \
+    rtmp_trace_record((point), (double)(value), NULL)
+#define RTMP_TRACE_TEXT(point, value, text) \
+    rtmp_trace_record((point), (double)(value), (text))
+#else
+#define RTMP_TRACE(point, value) ((void)0)
+#define RTMP_TRACE_TEXT(point, value, text) ((void)0)
+#endif
+
+
+extern void rtmp_trace_record(
+    rtmp_trace_point_t point, double value, const char *text);
+extern size_t rtmp_trace_drain(
+    rtmp_trace_record_t *records, size_t records_num);
+extern size_t rtmp_trace_dump(FILE *file);
+extern unsigned long rtmp_trace_get_dropped(void);
+extern void rtmp_trace_release(void);
+extern const char *rtmp_trace_get_point_name(rtmp_trace_point_t point);
+
+
+/* Ends C function definitions when using C++ */
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
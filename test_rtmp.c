@@ -0,0 +1,2215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rtmp.h"
+#include "rtmp_packet.h"
+#include "amf_packet.h"
+#include "amf3_packet.h"
+#include "amf_intern.h"
+#include "rtmp_command.h"
+#include "rtmp_timer.h"
+#include "rtmp_pool.h"
+#include "rtmp_allocator.h"
+
+
+/*
+ * Regression tests, run by "make -f Makefile.gcc check".
+ *
+ * Each case prints one line, "ok name" or "FAIL name: reason", and the
+ * exit status is the number of failed cases.
+ */
+
+#define TEST_CHUNK_SIZE DEFAULT_AMF_CHUNK_SIZE
+#define TEST_MAX_ITERATIONS 1000
+/* enough for the data already sent to be read */
+#define TEST_RUN_ITERATIONS 10
+#define TEST_BUFFER_SIZE (1 + RTMP_HANDSHAKE_SIZE * 2 + RTMP_BUFFER_SIZE)
+#define TEST_AMF_SIZE 256
+/* three chunks of TEST_CHUNK_SIZE */
+#define TEST_PACKET_SIZE 300
+#define TEST_TIMER_NUM 3
+/* seconds a wait is given, shorter than RTMP_ACCEPT_PAUSE */
+#define TEST_WAIT 0.05
+#define TEST_BLOCK_NUM 100
+#define TEST_EVENT_NUM 20000
+/* events sent in one write, more than the ring holds */
+#define TEST_EVENT_BATCH 100
+/* longer than a 16 bit length allows */
+#define TEST_LONG_STRING_SIZE 0x10000
+/* nesting far past AMF_DEPTH_MAX */
+#define TEST_DEEP_NUM 100000
+/* connections, twice the client pool size */
+#define TEST_CLIENT_NUM 4
+/* past half of RTMP_CLIENT_POOL_SIZE, so the address counts grow */
+#define TEST_ADDRESS_NUM 40
+
+
+static int test_failures;
+
+
+static void test_report(const char *name, const char *failure)
+{
+    if (failure == NULL) {
+        printf("ok %s\n", name);
+    } else {
+        printf("FAIL %s: %s\n", name, failure);
+        test_failures++;
+    }
+}
+
+
+/*
+ * Appends a command invoke with transaction id 0 carrying a status with
+ * code to buffer, with a description long enough to take two chunks.
+ */
+static int test_add_status(
+    unsigned char *buffer, size_t buffer_size, size_t *size,
+    const char *command, const char *code)
+{
+    rtmp_packet_t *packet;
+    amf_packet_t *object;
+    char description[TEST_CHUNK_SIZE + 1];
+    size_t packet_size;
+    rtmp_result_t result;
+
+    memset(description, 'x', TEST_CHUNK_SIZE);
+    description[TEST_CHUNK_SIZE] = '\0';
+    packet = rtmp_packet_create();
+    if (packet == NULL) {
+        return 0;
+    }
+    packet->object_id = 5;
+    packet->data_type = RTMP_DATATYPE_INVOKE;
+    packet->stream_id = 1;
+    rtmp_packet_add_amf(packet, amf_packet_create_string(command));
+    rtmp_packet_add_amf(packet, amf_packet_create_number(0.0));
+    rtmp_packet_add_amf(packet, amf_packet_create_null());
+    object = amf_packet_create_object();
+    amf_packet_add_property_to_object(
+        object, "level", amf_packet_create_string("status"));
+    amf_packet_add_property_to_object(
+        object, "code", amf_packet_create_string(code));
+    amf_packet_add_property_to_object(
+        object, "description", amf_packet_create_string(description));
+    rtmp_packet_add_amf(packet, object);
+    result = rtmp_packet_serialize(
+        packet,
+        buffer + *size, buffer_size - *size,
+        TEST_CHUNK_SIZE,
+        &packet_size);
+    rtmp_packet_free(packet);
+    if (result != RTMP_SUCCESS) {
+        return 0;
+    }
+    *size += packet_size;
+    return 1;
+}
+
+
+static int test_add_on_status(
+    unsigned char *buffer, size_t buffer_size, size_t *size, const char *code)
+{
+    return test_add_status(buffer, buffer_size, size, "onStatus", code);
+}
+
+
+/* counts the onStatus codes received, data is an int[2] */
+static void test_on_status(
+    rtmp_client_t *rc, double transaction_id,
+    struct rtmp_packet_inner_amf_t *arguments, void *data)
+{
+    int *counts;
+    const char *code;
+    const char *level;
+
+    (void)rc;
+    (void)transaction_id;
+    counts = (int*)data;
+    rtmp_packet_retrieve_status_info_of_amf(arguments, &code, &level);
+    if (code == NULL) {
+        return;
+    }
+    if (strcmp(code, "NetStream.Play.Start") == 0) {
+        counts[0]++;
+    } else if (strcmp(code, "NetStream.Play.Stop") == 0) {
+        counts[1]++;
+    }
+}
+
+
+/*
+ * A message of three chunks cut anywhere, even just before its last
+ * delimiter or its last byte, is only incomplete.
+ */
+static void test_packet_truncated(void)
+{
+    unsigned char data[TEST_PACKET_SIZE];
+    unsigned char buffer[TEST_BUFFER_SIZE];
+    rtmp_packet_t *packet;
+    size_t size;
+    size_t packet_size;
+    size_t i;
+    rtmp_result_t result;
+    const char *failure;
+
+    for (i = 0; i < sizeof(data); ++i) {
+        data[i] = (unsigned char)i;
+    }
+    packet = rtmp_packet_create();
+    packet->object_id = 6;
+    packet->data_type = RTMP_DATATYPE_AUDIO_DATA;
+    packet->stream_id = 1;
+    packet->body_type = RTMP_BODY_TYPE_DATA;
+    rtmp_packet_allocate_body_data(packet, sizeof(data));
+    memcpy(packet->body_data, data, sizeof(data));
+    result = rtmp_packet_serialize(
+        packet, buffer, sizeof(buffer), TEST_CHUNK_SIZE, &size);
+
+    failure = NULL;
+    if (result != RTMP_SUCCESS || size != 12 + sizeof(data) + 2) {
+        failure = "can not serialize";
+    }
+    for (i = 1; failure == NULL && i < size; ++i) {
+        result = rtmp_packet_analyze_data(
+            packet, buffer, i, TEST_CHUNK_SIZE, &packet_size);
+        if (result != RTMP_ERROR_DIVIDED_PACKET) {
+            failure = "a truncated message was not reported incomplete";
+        }
+    }
+    if (failure == NULL) {
+        result = rtmp_packet_analyze_data(
+            packet, buffer, size, TEST_CHUNK_SIZE, &packet_size);
+        if (result != RTMP_SUCCESS || packet_size != size) {
+            failure = "the whole message was not decoded";
+        } else if (packet->body_data_length != sizeof(data) ||
+                   memcmp(packet->body_data, data, sizeof(data)) != 0) {
+            failure = "decoded a different body";
+        }
+    }
+    rtmp_packet_free(packet);
+    test_report("packet_truncated", failure);
+}
+
+
+/*
+ * Listens on a loopback port of the system's choice, writing the url a
+ * client connects to it with.  Returns the nonblocking socket, or -1.
+ */
+static int test_listen(char *url)
+{
+    struct sockaddr_in address;
+    socklen_t address_size;
+    int listen_sock;
+
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_sock == -1) {
+        return -1;
+    }
+    memset(&address, 0x00, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address_size = sizeof(address);
+    if (bind(listen_sock, (struct sockaddr*)&address, sizeof(address)) ||
+        listen(listen_sock, 1) ||
+        getsockname(listen_sock, (struct sockaddr*)&address, &address_size)) {
+        close(listen_sock);
+        return -1;
+    }
+    fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL) | O_NONBLOCK);
+    sprintf(url, "rtmp://127.0.0.1:%d/live", ntohs(address.sin_port));
+    return listen_sock;
+}
+
+
+/*
+ * Runs rc until listen_sock accepted it and took C0 and C1, so that
+ * closing does not reset.  Returns the nonblocking socket, or -1.
+ */
+static int test_accept(rtmp_client_t *rc, int listen_sock)
+{
+    unsigned char buffer[1 + RTMP_HANDSHAKE_SIZE];
+    int sock;
+    size_t size;
+    ssize_t received_size;
+    int i;
+
+    sock = -1;
+    size = 0;
+    for (i = 0; i < TEST_MAX_ITERATIONS && size < sizeof(buffer); ++i) {
+        rtmp_client_process_message(rc);
+        if (sock == -1) {
+            sock = accept(listen_sock, NULL, NULL);
+            if (sock != -1) {
+                fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+            }
+        } else {
+            received_size = recv(sock, buffer, sizeof(buffer) - size, 0);
+            if (received_size > 0) {
+                size += received_size;
+            }
+        }
+        usleep(1000);
+    }
+    if (size < sizeof(buffer)) {
+        if (sock != -1) {
+            close(sock);
+        }
+        return -1;
+    }
+    return sock;
+}
+
+
+/* S0, S1 and S2, which the client does not check; returns their size */
+static size_t test_add_server_handshake(unsigned char *buffer)
+{
+    memset(buffer, 0x00, 1 + RTMP_HANDSHAKE_SIZE * 2);
+    buffer[0] = 0x03;
+    return 1 + RTMP_HANDSHAKE_SIZE * 2;
+}
+
+
+/*
+ * Runs rc for some iterations, dropping its events and what it sends.
+ * Returns the last result.
+ */
+static rtmp_result_t test_run_client(
+    rtmp_client_t *rc, int sock, int iterations, int *closed)
+{
+    unsigned char buffer[RTMP_BUFFER_SIZE];
+    rtmp_event_t *event;
+    rtmp_result_t result;
+    int i;
+
+    result = RTMP_SUCCESS;
+    for (i = 0; i < iterations; ++i) {
+        result = rtmp_client_process_message(rc);
+        while ((event = rtmp_client_get_event(rc)) != NULL) {
+            if (event->id == RTMP_EVENT_CONNECT_CLOSED && closed != NULL) {
+                (*closed)++;
+            }
+            rtmp_client_delete_event(rc);
+        }
+        if (result == RTMP_ERROR_DISCONNECTED) {
+            break;
+        }
+        /* drain what the client sends, so that closing does not reset */
+        while (recv(sock, buffer, sizeof(buffer), 0) > 0) {
+        }
+    }
+    return result;
+}
+
+
+/*
+ * A peer which sends its last messages together with the end of stream:
+ * the handshake, two onStatus invokes, then the close, all in one write.
+ * Every message has to be dispatched before the connection is reported
+ * closed.
+ */
+static void test_close_after_messages(void)
+{
+    static unsigned char buffer[TEST_BUFFER_SIZE];
+    char url[64];
+    int listen_sock;
+    int sock;
+    size_t size;
+    rtmp_client_t *rc;
+    rtmp_result_t result;
+    int counts[2];
+    int closed;
+    const char *failure;
+
+    listen_sock = test_listen(url);
+    if (listen_sock == -1) {
+        test_report("close_after_messages", "can not listen");
+        return;
+    }
+    rc = rtmp_client_create(url);
+    counts[0] = 0;
+    counts[1] = 0;
+    if (rc == NULL ||
+        rtmp_client_on_command(
+            rc, "onStatus", test_on_status, counts) != RTMP_SUCCESS) {
+        close(listen_sock);
+        test_report("close_after_messages", "can not create the client");
+        return;
+    }
+
+    failure = NULL;
+    sock = test_accept(rc, listen_sock);
+    if (sock == -1) {
+        failure = "no handshake from the client";
+    }
+    if (failure == NULL) {
+        size = test_add_server_handshake(buffer);
+        if (!test_add_on_status(
+                buffer, sizeof(buffer), &size, "NetStream.Play.Start") ||
+            !test_add_on_status(
+                buffer, sizeof(buffer), &size, "NetStream.Play.Stop") ||
+            send(sock, buffer, size, 0) != (ssize_t)size) {
+            failure = "can not send";
+        }
+        shutdown(sock, SHUT_WR);
+        /* let everything arrive before the client reads */
+        usleep(20000);
+    }
+
+    closed = 0;
+    result = RTMP_SUCCESS;
+    if (failure == NULL) {
+        result = test_run_client(rc, sock, TEST_MAX_ITERATIONS, &closed);
+        if (result != RTMP_ERROR_DISCONNECTED || closed != 1) {
+            failure = "the close was not reported";
+        } else if (counts[0] != 1 || counts[1] != 1) {
+            failure = "a message sent before the close was lost";
+        }
+    }
+
+    rtmp_client_free(rc);
+    if (sock != -1) {
+        close(sock);
+    }
+    close(listen_sock);
+    test_report("close_after_messages", failure);
+}
+
+
+/*
+ * A message arriving in two reads, cut inside its second chunk, is
+ * dispatched once complete and never counted as a parse error.
+ */
+static void test_divided_message(void)
+{
+    static unsigned char buffer[TEST_BUFFER_SIZE];
+    char url[64];
+    int listen_sock;
+    int sock;
+    size_t size;
+    size_t handshake_size;
+    size_t first_size;
+    rtmp_client_t *rc;
+    rtmp_stats_t stats;
+    int counts[2];
+    int i;
+    const char *failure;
+
+    listen_sock = test_listen(url);
+    if (listen_sock == -1) {
+        test_report("divided_message", "can not listen");
+        return;
+    }
+    rc = rtmp_client_create(url);
+    counts[0] = 0;
+    counts[1] = 0;
+    if (rc == NULL ||
+        rtmp_client_on_command(
+            rc, "onStatus", test_on_status, counts) != RTMP_SUCCESS) {
+        close(listen_sock);
+        test_report("divided_message", "can not create the client");
+        return;
+    }
+
+    failure = NULL;
+    sock = test_accept(rc, listen_sock);
+    if (sock == -1) {
+        failure = "no handshake from the client";
+    }
+    size = 0;
+    handshake_size = 0;
+    if (failure == NULL) {
+        handshake_size = test_add_server_handshake(buffer);
+        size = handshake_size;
+        if (!test_add_on_status(
+                buffer, sizeof(buffer), &size, "NetStream.Play.Start") ||
+            size <= handshake_size + 12 + TEST_CHUNK_SIZE + 2) {
+            failure = "can not serialize";
+        }
+    }
+    /* up to a few bytes into the second chunk */
+    first_size = handshake_size + 12 + TEST_CHUNK_SIZE + 2;
+    if (failure == NULL) {
+        if (send(sock, buffer, first_size, 0) != (ssize_t)first_size) {
+            failure = "can not send";
+        }
+        usleep(20000);
+    }
+    if (failure == NULL) {
+        test_run_client(rc, sock, TEST_RUN_ITERATIONS, NULL);
+        if (counts[0] != 0) {
+            failure = "an incomplete message was dispatched";
+        } else if (send(sock, buffer + first_size, size - first_size, 0) !=
+                   (ssize_t)(size - first_size)) {
+            failure = "can not send";
+        }
+        usleep(20000);
+    }
+    if (failure == NULL) {
+        test_run_client(rc, sock, TEST_RUN_ITERATIONS, NULL);
+        rtmp_client_get_stats(rc, &stats);
+        if (counts[0] != 1) {
+            failure = "the message was not dispatched";
+        }
+        for (i = 0; failure == NULL && i < RTMP_STATS_RESULT_NUM; ++i) {
+            if (stats.parse_errors[i] > 0) {
+                failure = "counted a parse error";
+            }
+        }
+    }
+
+    rtmp_client_free(rc);
+    if (sock != -1) {
+        close(sock);
+    }
+    close(listen_sock);
+    test_report("divided_message", failure);
+}
+
+
+/* a server on a port of the system's choice, written to *port */
+static rtmp_server_t *test_create_server(int *port)
+{
+    rtmp_server_t *rs;
+    struct sockaddr_in address;
+    socklen_t address_size;
+
+    rs = rtmp_server_create(0);
+    if (rs == NULL) {
+        return NULL;
+    }
+    address_size = sizeof(address);
+    if (getsockname(
+            rs->conn_sock, (struct sockaddr*)&address, &address_size)) {
+        rtmp_server_free(rs);
+        return NULL;
+    }
+    *port = ntohs(address.sin_port);
+    return rs;
+}
+
+
+/*
+ * A nonblocking socket connected to port on the loopback from source, a
+ * loopback address in host byte order, or -1.
+ */
+static int test_server_connect_from(int port, unsigned long source)
+{
+    struct sockaddr_in address;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    memset(&address, 0x00, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(source);
+    if (bind(sock, (struct sockaddr*)&address, sizeof(address))) {
+        close(sock);
+        return -1;
+    }
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (connect(sock, (struct sockaddr*)&address, sizeof(address))) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    return sock;
+}
+
+
+/* the same from INADDR_LOOPBACK */
+static int test_server_connect(int port)
+{
+    return test_server_connect_from(port, INADDR_LOOPBACK);
+}
+
+
+/*
+ * Runs rs for some iterations, dropping what it sends to sock, and counts
+ * the bytes into *received if not NULL.  Returns 1 once the server closed
+ * sock.
+ */
+static int test_run_server(
+    rtmp_server_t *rs, int sock, int iterations, size_t *received)
+{
+    unsigned char buffer[RTMP_BUFFER_SIZE];
+    ssize_t received_size;
+    int i;
+
+    for (i = 0; i < iterations; ++i) {
+        rtmp_server_process_message(rs);
+        while ((received_size = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+            if (received != NULL) {
+                *received += received_size;
+            }
+        }
+        if (received_size == 0) {
+            return 1;
+        }
+        usleep(1000);
+    }
+    return 0;
+}
+
+
+/* completes the handshake of sock with rs, returns 0 if it can not */
+static int test_server_handshake(rtmp_server_t *rs, int sock)
+{
+    unsigned char buffer[1 + RTMP_HANDSHAKE_SIZE];
+    size_t received;
+    int i;
+
+    memset(buffer, 0x00, sizeof(buffer));
+    buffer[0] = 0x03;
+    if (send(sock, buffer, sizeof(buffer), 0) != (ssize_t)sizeof(buffer)) {
+        return 0;
+    }
+    received = 0;
+    for (i = 0; i < TEST_MAX_ITERATIONS &&
+             received < 1 + RTMP_HANDSHAKE_SIZE * 2; ++i) {
+        if (test_run_server(rs, sock, 1, &received)) {
+            return 0;
+        }
+    }
+    if (received < 1 + RTMP_HANDSHAKE_SIZE * 2 ||
+        send(sock, buffer + 1, RTMP_HANDSHAKE_SIZE, 0) !=
+        RTMP_HANDSHAKE_SIZE) {
+        return 0;
+    }
+    return !test_run_server(rs, sock, TEST_RUN_ITERATIONS, NULL);
+}
+
+
+/*
+ * An invoke which can not be decoded closes the connection, rather than
+ * being parsed again on every loop until the idle timeout.
+ */
+static void test_broken_message(void)
+{
+    static const unsigned char message[] = {
+        0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, RTMP_DATATYPE_INVOKE,
+        0x00, 0x00, 0x00, 0x00,
+        0x7F, /* no AMF0 type */
+    };
+    rtmp_server_t *rs;
+    rtmp_stats_t stats;
+    int port;
+    int sock;
+    const char *failure;
+
+    rs = test_create_server(&port);
+    if (rs == NULL) {
+        test_report("broken_message", "can not create the server");
+        return;
+    }
+    failure = NULL;
+    sock = test_server_connect(port);
+    if (sock == -1 || !test_server_handshake(rs, sock)) {
+        failure = "can not connect";
+    } else if (send(sock, message, sizeof(message), 0) !=
+               (ssize_t)sizeof(message)) {
+        failure = "can not send";
+    } else if (!test_run_server(rs, sock, TEST_RUN_ITERATIONS, NULL)) {
+        failure = "the connection was not closed";
+    } else {
+        rtmp_server_get_stats(rs, &stats);
+        if (rs->client_working_num != 0) {
+            failure = "the client was not freed";
+        } else if (stats.parse_errors[RTMP_ERROR_BROKEN_PACKET] != 1) {
+            failure = "the parse error was not counted once";
+        }
+    }
+    if (sock != -1) {
+        close(sock);
+    }
+    rtmp_server_free(rs);
+    test_report("broken_message", failure);
+}
+
+
+
+/*
+ * A keyframe larger than the send queue can hold closes the connection,
+ * rather than leaving the viewer waiting for a keyframe which never fits.
+ */
+static void test_keyframe_too_large(void)
+{
+    rtmp_server_t *rs;
+    rtmp_packet_t *packet;
+    int port;
+    int sock;
+    const char *failure;
+
+    failure = NULL;
+    rs = test_create_server(&port);
+    if (rs == NULL) {
+        test_report("keyframe_too_large", "can not listen");
+        return;
+    }
+    sock = test_server_connect(port);
+    packet = rtmp_packet_create();
+    if (sock == -1 || !test_server_handshake(rs, sock) ||
+        rs->client_working == NULL) {
+        failure = "can not connect";
+    } else if (packet == NULL ||
+               rtmp_packet_allocate_body_data(
+                   packet, RTMP_SEND_QUEUE_SIZE_MAX) != RTMP_SUCCESS) {
+        failure = "can not allocate";
+    } else {
+        packet->object_id = 6;
+        packet->data_type = RTMP_DATATYPE_VIDEO_DATA;
+        packet->stream_id = 1;
+        packet->body_type = RTMP_BODY_TYPE_DATA;
+        memset(packet->body_data, 0x00, packet->body_data_length);
+        packet->body_data[0] = RTMP_VIDEO_FRAME_KEY << 4;
+        if (rtmp_server_client_send_media(rs->client_working, packet) !=
+            RTMP_ERROR_DISCONNECTED) {
+            failure = "queued a keyframe too large";
+        } else if (!test_run_server(rs, sock, TEST_RUN_ITERATIONS, NULL)) {
+            failure = "the connection was not closed";
+        }
+    }
+    if (packet != NULL) {
+        rtmp_packet_free(packet);
+    }
+    if (sock != -1) {
+        close(sock);
+    }
+    rtmp_server_free(rs);
+    test_report("keyframe_too_large", failure);
+}
+
+static double test_get_time(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+
+/*
+ * With no descriptor left for a connection waiting in the backlog, the
+ * server stops polling the listening socket for a while instead of waking
+ * on it over and over, and accepts the connection once it can.
+ */
+static void test_accept_out_of_descriptors(void)
+{
+    rtmp_server_t *rs;
+    struct rlimit limit;
+    struct rlimit lowered;
+    int port;
+    int sock;
+    int next_fd;
+    double started;
+    const char *failure;
+
+    failure = NULL;
+    rs = test_create_server(&port);
+    if (rs == NULL) {
+        test_report("accept_out_of_descriptors", "can not listen");
+        return;
+    }
+    sock = test_server_connect(port);
+    next_fd = dup(0);
+    if (sock == -1 || next_fd == -1 || getrlimit(RLIMIT_NOFILE, &limit)) {
+        failure = "can not connect";
+    } else {
+        close(next_fd);
+        lowered = limit;
+        lowered.rlim_cur = next_fd;
+        if (setrlimit(RLIMIT_NOFILE, &lowered)) {
+            failure = "can not lower the descriptor limit";
+        }
+    }
+    if (failure == NULL) {
+        rtmp_server_wait_message(rs, TEST_WAIT);
+        if (rs->client_working != NULL) {
+            failure = "accepted past the descriptor limit";
+        } else {
+            started = test_get_time();
+            rtmp_server_wait_message(rs, TEST_WAIT);
+            if (test_get_time() - started < TEST_WAIT / 2) {
+                failure = "woke for a backlog it can not accept";
+            }
+        }
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (failure == NULL) {
+        usleep((useconds_t)(RTMP_ACCEPT_PAUSE * 1000000));
+        rtmp_server_wait_message(rs, TEST_WAIT);
+        if (rs->client_working == NULL) {
+            failure = "did not accept once descriptors were freed";
+        }
+    }
+    if (sock != -1) {
+        close(sock);
+    }
+    rtmp_server_free(rs);
+    test_report("accept_out_of_descriptors", failure);
+}
+
+
+/*
+ * Connections idle after their handshake hold no buffer, freed clients
+ * are kept up to the pool size, and shrinking the pool frees the extra
+ * ones, which a new connection does not miss.
+ */
+static void test_client_pool(void)
+{
+    rtmp_server_t *rs;
+    rtmp_server_client_t *rsc;
+    int socks[TEST_CLIENT_NUM];
+    int port;
+    size_t i;
+    int j;
+    const char *failure;
+
+    failure = NULL;
+    rs = test_create_server(&port);
+    if (rs == NULL) {
+        test_report("client_pool", "can not listen");
+        return;
+    }
+    rtmp_server_set_client_pool_size(rs, TEST_CLIENT_NUM / 2);
+    for (i = 0; i < TEST_CLIENT_NUM; ++i) {
+        socks[i] = test_server_connect(port);
+        if (failure == NULL &&
+            (socks[i] == -1 || !test_server_handshake(rs, socks[i]))) {
+            failure = "can not connect";
+        }
+    }
+    for (rsc = rs->client_working; failure == NULL && rsc; rsc = rsc->next) {
+        if (rsc->received_buffer != NULL || rsc->will_send_buffer != NULL ||
+            rsc->handshake != NULL) {
+            failure = "an idle connection holds a buffer";
+        }
+    }
+    if (failure == NULL && rs->client_working_num != TEST_CLIENT_NUM) {
+        failure = "did not accept every connection";
+    }
+
+    for (i = 0; i < TEST_CLIENT_NUM; ++i) {
+        if (socks[i] != -1) {
+            close(socks[i]);
+        }
+    }
+    for (j = 0; j < TEST_MAX_ITERATIONS && rs->client_working; ++j) {
+        rtmp_server_process_message(rs);
+        usleep(1000);
+    }
+    if (failure == NULL &&
+        (rs->client_working != NULL ||
+         rs->client_pool_size != TEST_CLIENT_NUM / 2)) {
+        failure = "did not keep freed clients up to the pool size";
+    }
+    rtmp_server_set_client_pool_size(rs, 1);
+    if (failure == NULL && rs->client_pool_size != 1) {
+        failure = "did not free the clients past a smaller pool size";
+    }
+
+    socks[0] = test_server_connect(port);
+    if (failure == NULL &&
+        (socks[0] == -1 || !test_server_handshake(rs, socks[0]) ||
+         rs->client_working == NULL || rs->client_pool_size != 0)) {
+        failure = "did not take a new connection from the pool";
+    }
+    if (socks[0] != -1) {
+        close(socks[0]);
+    }
+    rtmp_server_free(rs);
+    test_report("client_pool", failure);
+}
+
+/*
+ * Runs rs until it serves working connections and has shed shed of them,
+ * returning 0 if it does not within TEST_MAX_ITERATIONS.
+ */
+static int test_run_admission(
+    rtmp_server_t *rs, size_t working, unsigned long long shed)
+{
+    int i;
+
+    for (i = 0; i < TEST_MAX_ITERATIONS; ++i) {
+        rtmp_server_process_message(rs);
+        if (rs->client_working_num == working &&
+            rs->closed_stats.connections_shed == shed) {
+            return 1;
+        }
+        usleep(1000);
+    }
+    return 0;
+}
+
+
+/*
+ * Connections over each admission limit are shed.  The counts of the
+ * addresses are found again after the table grows and after the entries
+ * around them are deleted, and are gone once their connections close.
+ */
+static void test_admission(void)
+{
+    rtmp_server_t *rs;
+    rtmp_admission_t admission;
+    int socks[TEST_ADDRESS_NUM + 1];
+    int again[TEST_ADDRESS_NUM];
+    int port;
+    int i;
+    const char *failure;
+
+    failure = NULL;
+    for (i = 0; i <= TEST_ADDRESS_NUM; ++i) {
+        socks[i] = -1;
+    }
+    for (i = 0; i < TEST_ADDRESS_NUM; ++i) {
+        again[i] = -1;
+    }
+    rs = test_create_server(&port);
+    if (rs == NULL) {
+        test_report("admission", "can not listen");
+        return;
+    }
+
+    rtmp_admission_initialize(&admission);
+    admission.max_connections = 2;
+    rtmp_server_set_admission(rs, &admission);
+    for (i = 0; i < 3; ++i) {
+        socks[i] = test_server_connect(port);
+    }
+    if (!test_run_admission(rs, 2, 1)) {
+        failure = "did not shed past max_connections";
+    }
+    for (i = 0; i < 3; ++i) {
+        close(socks[i]);
+        socks[i] = -1;
+    }
+    if (failure == NULL &&
+        (!test_run_admission(rs, 0, 1) || rs->address_counts_num != 0)) {
+        failure = "kept the count of a closed address";
+    }
+
+    /* 127.0.0.1 and up, the last connection again from 127.0.0.1 */
+    admission.max_connections = 0;
+    admission.max_connections_per_address = 1;
+    rtmp_server_set_admission(rs, &admission);
+    for (i = 0; failure == NULL && i < TEST_ADDRESS_NUM; ++i) {
+        socks[i] = test_server_connect_from(port, INADDR_LOOPBACK + i);
+        if (socks[i] == -1) {
+            failure = "can not connect from a loopback address";
+        }
+    }
+    if (failure == NULL) {
+        socks[TEST_ADDRESS_NUM] = test_server_connect(port);
+        if (!test_run_admission(rs, TEST_ADDRESS_NUM, 2) ||
+            rs->address_counts_num != TEST_ADDRESS_NUM) {
+            failure = "did not limit the connections of an address";
+        }
+    }
+
+    /* every other address is deleted, then each connects again */
+    if (failure == NULL) {
+        for (i = 0; i < TEST_ADDRESS_NUM; i += 2) {
+            close(socks[i]);
+            socks[i] = -1;
+        }
+        if (!test_run_admission(rs, TEST_ADDRESS_NUM / 2, 2) ||
+            rs->address_counts_num != TEST_ADDRESS_NUM / 2) {
+            failure = "did not delete the count of a closed address";
+        }
+    }
+    if (failure == NULL) {
+        for (i = 0; i < TEST_ADDRESS_NUM; ++i) {
+            again[i] = test_server_connect_from(port, INADDR_LOOPBACK + i);
+        }
+        if (!test_run_admission(
+                rs, TEST_ADDRESS_NUM, 2 + TEST_ADDRESS_NUM / 2) ||
+            rs->address_counts_num != TEST_ADDRESS_NUM) {
+            failure = "lost the count of an address next to a deleted one";
+        }
+    }
+    for (i = 0; i <= TEST_ADDRESS_NUM; ++i) {
+        if (socks[i] != -1) {
+            close(socks[i]);
+        }
+    }
+    for (i = 0; i < TEST_ADDRESS_NUM; ++i) {
+        if (again[i] != -1) {
+            close(again[i]);
+        }
+    }
+    if (failure == NULL &&
+        (!test_run_admission(rs, 0, 2 + TEST_ADDRESS_NUM / 2) ||
+         rs->address_counts_num != 0)) {
+        failure = "kept the count of a closed address";
+    }
+
+    /* a burst of 2 with next to nothing refilled while the test runs */
+    admission.max_connections_per_address = 0;
+    admission.max_rate = 1;
+    admission.burst = 2;
+    rtmp_server_set_admission(rs, &admission);
+    for (i = 0; i < 3; ++i) {
+        socks[i] = test_server_connect(port);
+    }
+    if (failure == NULL &&
+        !test_run_admission(rs, 2, 3 + TEST_ADDRESS_NUM / 2)) {
+        failure = "did not shed past the rate";
+    }
+    for (i = 0; i < 3; ++i) {
+        if (socks[i] != -1) {
+            close(socks[i]);
+        }
+    }
+    rtmp_server_free(rs);
+    test_report("admission", failure);
+}
+
+
+/* appends a _result invoke answering transaction_id with number */
+static int test_add_result(
+    unsigned char *buffer, size_t buffer_size, size_t *size,
+    double transaction_id, double number)
+{
+    rtmp_packet_t *packet;
+    size_t packet_size;
+    rtmp_result_t result;
+
+    packet = rtmp_packet_create();
+    if (packet == NULL) {
+        return 0;
+    }
+    packet->object_id = 3;
+    packet->data_type = RTMP_DATATYPE_INVOKE;
+    rtmp_packet_add_amf(packet, amf_packet_create_string("_result"));
+    rtmp_packet_add_amf(packet, amf_packet_create_number(transaction_id));
+    rtmp_packet_add_amf(packet, amf_packet_create_null());
+    rtmp_packet_add_amf(packet, amf_packet_create_number(number));
+    result = rtmp_packet_serialize(
+        packet,
+        buffer + *size, buffer_size - *size,
+        TEST_CHUNK_SIZE,
+        &packet_size);
+    rtmp_packet_free(packet);
+    if (result != RTMP_SUCCESS) {
+        return 0;
+    }
+    *size += packet_size;
+    return 1;
+}
+
+
+/*
+ * A client connected to listen_sock, past its handshake, which leaves its
+ * connect invoke waiting.  *sock is the server side of the connection.
+ */
+static rtmp_client_t *test_connect(
+    const char *url, int listen_sock, int *sock)
+{
+    unsigned char buffer[1 + RTMP_HANDSHAKE_SIZE * 2];
+    rtmp_client_t *rc;
+    size_t size;
+
+    rc = rtmp_client_create(url);
+    if (rc == NULL) {
+        return NULL;
+    }
+    *sock = test_accept(rc, listen_sock);
+    if (*sock == -1) {
+        rtmp_client_free(rc);
+        return NULL;
+    }
+    size = test_add_server_handshake(buffer);
+    if (send(*sock, buffer, size, 0) != (ssize_t)size) {
+        close(*sock);
+        rtmp_client_free(rc);
+        return NULL;
+    }
+    usleep(20000);
+    test_run_client(rc, *sock, TEST_RUN_ITERATIONS, NULL);
+    return rc;
+}
+
+
+typedef struct test_call_t test_call_t;
+
+/* how the handler of one call was called */
+struct test_call_t
+{
+    int completions;
+    rtmp_transaction_status_t status;
+    double number;
+};
+
+
+static void test_call_completed(
+    rtmp_client_t *rc, rtmp_transaction_t *transaction, void *data)
+{
+    test_call_t *call;
+
+    (void)rc;
+    call = (test_call_t*)data;
+    call->completions++;
+    call->status = transaction->status;
+    call->number = transaction->number;
+}
+
+
+
+/*
+ * Three calls: the response to the second completes it alone, the first
+ * times out and the third is cancelled when the client is freed.
+ */
+static void test_transactions(void)
+{
+    static unsigned char buffer[TEST_BUFFER_SIZE];
+    char url[64];
+    int listen_sock;
+    int sock;
+    size_t size;
+    rtmp_client_t *rc;
+    test_call_t calls[3];
+    long ids[3];
+    int i;
+    const char *failure;
+
+    listen_sock = test_listen(url);
+    if (listen_sock == -1) {
+        test_report("transactions", "can not listen");
+        return;
+    }
+    rc = test_connect(url, listen_sock, &sock);
+    if (rc == NULL) {
+        close(listen_sock);
+        test_report("transactions", "can not connect");
+        return;
+    }
+
+    memset(calls, 0x00, sizeof(calls));
+    failure = NULL;
+    for (i = 0; i < 3; ++i) {
+        rtmp_client_set_call_timeout(rc, i == 0 ? 0.05 : 0);
+        ids[i] = rtmp_client_call(
+            rc, "test", NULL, 0, test_call_completed, &calls[i]);
+        if (ids[i] == 0) {
+            failure = "can not call";
+        }
+    }
+    size = 0;
+    if (failure == NULL &&
+        (!test_add_result(buffer, sizeof(buffer), &size, ids[1], 7.0) ||
+         send(sock, buffer, size, 0) != (ssize_t)size)) {
+        failure = "can not send";
+    }
+    if (failure == NULL) {
+        usleep(20000);
+        test_run_client(rc, sock, TEST_RUN_ITERATIONS, NULL);
+        if (calls[1].completions != 1 ||
+            calls[1].status != RTMP_TRANSACTION_RESULT ||
+            calls[1].number < 7.0 || calls[1].number > 7.0) {
+            failure = "the response did not complete its call";
+        } else if (calls[0].completions != 0 || calls[2].completions != 0) {
+            failure = "the response completed another call";
+        }
+    }
+    if (failure == NULL) {
+        usleep(60000);
+        test_run_client(rc, sock, TEST_RUN_ITERATIONS, NULL);
+        if (calls[0].completions != 1 ||
+            calls[0].status != RTMP_TRANSACTION_TIMED_OUT) {
+            failure = "the call did not time out";
+        } else if (calls[2].completions != 0) {
+            failure = "a call without a deadline timed out";
+        }
+    }
+
+    rtmp_client_free(rc);
+    if (failure == NULL &&
+        (calls[2].completions != 1 ||
+         calls[2].status != RTMP_TRANSACTION_CANCELLED ||
+         calls[0].completions != 1 || calls[1].completions != 1)) {
+        failure = "the call left was not cancelled once";
+    }
+    close(sock);
+    close(listen_sock);
+    test_report("transactions", failure);
+}
+
+
+/*
+ * A call too large to send is not left waiting, and calls never answered
+ * are refused past RTMP_CLIENT_CALLS_MAX until one is.
+ */
+static void test_transaction_limit(void)
+{
+    static unsigned char buffer[TEST_BUFFER_SIZE];
+    static char text[RTMP_BUFFER_SIZE];
+    char url[64];
+    int listen_sock;
+    int sock;
+    size_t size;
+    rtmp_client_t *rc;
+    test_call_t call;
+    amf_packet_t *argument;
+    long id;
+    long first_id;
+    int i;
+    const char *failure;
+
+    listen_sock = test_listen(url);
+    if (listen_sock == -1) {
+        test_report("transaction_limit", "can not listen");
+        return;
+    }
+    rc = test_connect(url, listen_sock, &sock);
+    if (rc == NULL) {
+        close(listen_sock);
+        test_report("transaction_limit", "can not connect");
+        return;
+    }
+    rtmp_client_set_call_timeout(rc, 0);
+    memset(&call, 0x00, sizeof(call));
+
+    /* only the connect invoke is waiting */
+    failure = NULL;
+    memset(text, 'x', sizeof(text) - 1);
+    argument = amf_packet_create_string(text);
+    if (rtmp_client_call(
+            rc, "test", &argument, 1, test_call_completed, &call) != 0) {
+        failure = "a call too large to send was accepted";
+    } else if (rc->transactions_num != 1) {
+        failure = "a call too large to send is waiting";
+    }
+
+    first_id = 0;
+    for (i = 1; failure == NULL && i < RTMP_CLIENT_CALLS_MAX; ++i) {
+        id = rtmp_client_call(rc, "test", NULL, 0, test_call_completed, &call);
+        if (id == 0) {
+            /* the send queue is full, flush it */
+            test_run_client(rc, sock, 1, NULL);
+            id = rtmp_client_call(
+                rc, "test", NULL, 0, test_call_completed, &call);
+        }
+        if (id == 0) {
+            failure = "refused a call under the limit";
+        } else if (first_id == 0) {
+            first_id = id;
+        }
+    }
+    test_run_client(rc, sock, 1, NULL);
+    if (failure == NULL &&
+        rtmp_client_call(
+            rc, "test", NULL, 0, test_call_completed, &call) != 0) {
+        failure = "accepted a call over the limit";
+    }
+    if (failure == NULL &&
+        rc->transactions_capacity > RTMP_CLIENT_CALLS_MAX * 2) {
+        failure = "the table grew past the limit";
+    }
+    size = 0;
+    if (failure == NULL &&
+        (!test_add_result(buffer, sizeof(buffer), &size, first_id, 0.0) ||
+         send(sock, buffer, size, 0) != (ssize_t)size)) {
+        failure = "can not send";
+    }
+    if (failure == NULL) {
+        usleep(20000);
+        test_run_client(rc, sock, TEST_RUN_ITERATIONS, NULL);
+        if (call.completions != 1) {
+            failure = "the response did not complete its call";
+        } else if (rtmp_client_call(
+                       rc, "test", NULL, 0, test_call_completed, &call) == 0) {
+            failure = "refused a call once one was answered";
+        }
+    }
+
+    rtmp_client_free(rc);
+    close(sock);
+    close(listen_sock);
+    test_report("transaction_limit", failure);
+}
+
+
+/*
+ * Encodes amf, checking its size, then decodes and encodes it again, which
+ * has to give the same bytes back.  Frees amf.
+ */
+static const char *test_amf0_round_trip(amf_packet_t *amf)
+{
+    static unsigned char input[TEST_LONG_STRING_SIZE * 2];
+    static unsigned char output[TEST_LONG_STRING_SIZE * 2];
+    amf_packet_t *decoded;
+    size_t size;
+    size_t packet_size;
+    const char *failure;
+
+    failure = NULL;
+    size = amf_packet_serialize(amf, input, sizeof(input));
+    if (size == 0) {
+        failure = "can not encode";
+    } else if (amf_packet_get_size(amf) != size) {
+        failure = "sized differently";
+    }
+    amf_packet_free(amf);
+    if (failure != NULL) {
+        return failure;
+    }
+    decoded = amf_packet_analyze_data(input, size, &packet_size);
+    if (decoded == NULL) {
+        return "can not decode";
+    }
+    if (packet_size != size) {
+        failure = "decoded a wrong length";
+    } else if (amf_packet_serialize(decoded, output, sizeof(output)) != size ||
+               memcmp(input, output, size) != 0) {
+        failure = "encoded differently";
+    }
+    amf_packet_free(decoded);
+    return failure;
+}
+
+
+/* metadata as encoders send it, with every AMF0 type */
+static void test_amf0_types(void)
+{
+    static const double times[] = {0.0, 2.0, 4.0, 6.0};
+    static char long_string[TEST_LONG_STRING_SIZE + 1];
+    amf_packet_t *metadata;
+    amf_packet_t *keyframes;
+    amf_packet_t *mixed;
+    amf_packet_t *typed;
+
+    memset(long_string, 'x', TEST_LONG_STRING_SIZE);
+    metadata = amf_packet_create_ecma_array();
+    amf_packet_add_property_to_object(
+        metadata, "duration", amf_packet_create_number(6.5));
+    amf_packet_add_property_to_object(
+        metadata, "stereo", amf_packet_create_boolean(1));
+    amf_packet_add_property_to_object(
+        metadata, "encoder", amf_packet_create_string("test"));
+    amf_packet_add_property_to_object(
+        metadata, "comment", amf_packet_create_string(long_string));
+    amf_packet_add_property_to_object(
+        metadata, "author", amf_packet_create_null());
+    amf_packet_add_property_to_object(
+        metadata, "title", amf_packet_create_undefined());
+    amf_packet_add_property_to_object(
+        metadata, "creationdate", amf_packet_create_date(1234567890000.0));
+    amf_packet_add_property_to_object(
+        metadata, "xmp", amf_packet_create_xml_document("<x/>"));
+    keyframes = amf_packet_create_object();
+    amf_packet_add_property_to_object(
+        keyframes, "times", amf_packet_create_number_array(times, 4));
+    amf_packet_add_property_to_object(metadata, "keyframes", keyframes);
+    mixed = amf_packet_create_strict_array();
+    amf_packet_add_value_to_strict_array(mixed, amf_packet_create_number(1.0));
+    amf_packet_add_value_to_strict_array(mixed, amf_packet_create_string("a"));
+    amf_packet_add_property_to_object(metadata, "mixed", mixed);
+    typed = amf_packet_create_typed_object("Foo");
+    amf_packet_add_property_to_object(
+        typed, "bar", amf_packet_create_number(1.0));
+    amf_packet_add_property_to_object(metadata, "typed", typed);
+    test_report("amf0_types", test_amf0_round_trip(metadata));
+}
+
+
+/*
+ * Writes count containers of the given kind, one in the other, around a
+ * null, and returns the size written.  An AMF3 nesting starts with the
+ * switch marker.
+ */
+static size_t test_write_nested(
+    unsigned char *data, amf_datatype_t datatype, size_t count)
+{
+    size_t size;
+    size_t i;
+
+    size = 0;
+    if (datatype == AMF_DATATYPE_AVMPLUS_OBJECT) {
+        data[size++] = AMF_DATATYPE_AVMPLUS_OBJECT;
+    }
+    for (i = 0; i < count; ++i) {
+        switch (datatype) {
+        case AMF_DATATYPE_OBJECT:
+            /* {a: ...} */
+            memcpy(data + size, "\x03\x00\x01" "a", 4);
+            size += 4;
+            break;
+        case AMF_DATATYPE_STRICT_ARRAY:
+            /* [...] */
+            memcpy(data + size, "\x0A\x00\x00\x00\x01", 5);
+            size += 5;
+            break;
+        default:
+            /* AMF3 [...], one dense value and no associative ones */
+            memcpy(data + size, "\x09\x03\x01", 3);
+            size += 3;
+            break;
+        }
+    }
+    data[size++] = datatype == AMF_DATATYPE_AVMPLUS_OBJECT ?
+        AMF3_DATATYPE_NULL : AMF_DATATYPE_NULL;
+    if (datatype == AMF_DATATYPE_OBJECT) {
+        for (i = 0; i < count; ++i) {
+            memcpy(data + size, "\x00\x00\x09", 3);
+            size += 3;
+        }
+    }
+    return size;
+}
+
+
+/*
+ * Values nested up to AMF_DEPTH_MAX deep decode, deeper ones are rejected
+ * without recursing, however deep they go.
+ */
+static void test_amf_depth(void)
+{
+    static const amf_datatype_t datatypes[] = {
+        AMF_DATATYPE_OBJECT,
+        AMF_DATATYPE_STRICT_ARRAY,
+        AMF_DATATYPE_AVMPLUS_OBJECT,
+    };
+    static unsigned char data[TEST_DEEP_NUM * 7 + 2];
+    amf_packet_t *amf;
+    size_t size;
+    size_t packet_size;
+    size_t i;
+    const char *failure;
+
+    failure = NULL;
+    for (i = 0; failure == NULL &&
+             i < sizeof(datatypes) / sizeof(datatypes[0]); ++i) {
+        size = test_write_nested(data, datatypes[i], AMF_DEPTH_MAX);
+        amf = amf_packet_analyze_data(data, size, &packet_size);
+        if (amf == NULL || packet_size != size) {
+            failure = "can not decode a value nested as deep as allowed";
+        }
+        if (amf != NULL) {
+            amf_packet_free(amf);
+        }
+        size = test_write_nested(data, datatypes[i], AMF_DEPTH_MAX + 1);
+        amf = amf_packet_analyze_data(data, size, &packet_size);
+        if (failure == NULL && amf != NULL) {
+            failure = "decoded a value nested too deep";
+        }
+        if (amf != NULL) {
+            amf_packet_free(amf);
+        }
+        size = test_write_nested(data, datatypes[i], TEST_DEEP_NUM);
+        amf = amf_packet_analyze_data(data, size, &packet_size);
+        if (failure == NULL && amf != NULL) {
+            failure = "decoded a value nested far too deep";
+        }
+        if (amf != NULL) {
+            amf_packet_free(amf);
+        }
+    }
+    test_report("amf_depth", failure);
+}
+
+
+/* a key longer than its 16 bit length allows is refused, not cut */
+static void test_amf_long_key(void)
+{
+    static char key[TEST_LONG_STRING_SIZE + 1];
+    unsigned char output[TEST_AMF_SIZE];
+    amf_packet_t *object;
+    amf_packet_t *value;
+    const char *failure;
+
+    memset(key, 'k', TEST_LONG_STRING_SIZE);
+    failure = NULL;
+    object = amf_packet_create_object();
+    value = amf_packet_create_null();
+    if (amf_packet_add_property_to_object(object, key, value) ==
+        RTMP_SUCCESS) {
+        failure = "added a property with a long key";
+    } else {
+        amf_packet_free(value);
+    }
+    /* as decoded from AMF3, which allows such keys */
+    if (failure == NULL &&
+        amf_packet_add_property_to_object(
+            object, "k", amf_packet_create_null()) != RTMP_SUCCESS) {
+        failure = "can not add a property";
+    }
+    if (failure == NULL) {
+        amf_packet_free_string(object->object.properties->key);
+        object->object.properties->key = amf_packet_duplicate_string(
+            (const unsigned char*)key, TEST_LONG_STRING_SIZE);
+        if (amf_packet_serialize(object, output, sizeof(output)) != 0) {
+            failure = "serialized a long key";
+        }
+    }
+    amf_packet_free(object);
+    test_report("amf_long_key", failure);
+}
+
+
+/*
+ * Decodes data, an AMF3 value after the AMF0 switch marker, and encodes
+ * it again, which has to give the same bytes back.  Returns the decoded
+ * packet, NULL with *failure set otherwise.
+ */
+static amf_packet_t *test_amf3_round_trip(
+    const unsigned char *data, size_t size, const char **failure)
+{
+    unsigned char input[TEST_AMF_SIZE];
+    unsigned char output[TEST_AMF_SIZE];
+    amf_packet_t *amf;
+    size_t packet_size;
+    size_t serialized_size;
+
+    input[0] = AMF_DATATYPE_AVMPLUS_OBJECT;
+    memcpy(input + 1, data, size);
+    amf = amf_packet_analyze_data(input, 1 + size, &packet_size);
+    if (amf == NULL) {
+        *failure = "can not decode";
+        return NULL;
+    }
+    if (packet_size != 1 + size) {
+        *failure = "decoded a wrong length";
+    } else if (amf_packet_get_size(amf) != 1 + size) {
+        *failure = "sized differently";
+    } else {
+        serialized_size = amf_packet_serialize(amf, output, sizeof(output));
+        if (serialized_size != 1 + size ||
+            memcmp(input, output, serialized_size) != 0) {
+            *failure = "encoded differently";
+        }
+    }
+    if (*failure != NULL) {
+        amf_packet_free(amf);
+        return NULL;
+    }
+    return amf;
+}
+
+
+/* integers take 1 to 4 bytes, out of range numbers become doubles */
+static void test_amf3_u29(void)
+{
+    static const double numbers[] = {
+        0, 0x7F, 0x80, 0x3FFF, 0x4000, 0x1FFFFF, 0x200000,
+        AMF3_INTEGER_MAX, -1, AMF3_INTEGER_MIN,
+        AMF3_INTEGER_MAX + 1.0, AMF3_INTEGER_MIN - 1.0, 0.5,
+    };
+    static const size_t sizes[] = {
+        2, 2, 3, 3, 4, 4, 5, 5, 5, 5, 9, 9, 9,
+    };
+    unsigned char data[TEST_AMF_SIZE];
+    amf3_context_t context;
+    amf_packet_t *amf;
+    amf_packet_t *value;
+    size_t size;
+    size_t i;
+    const char *failure;
+
+    failure = NULL;
+    for (i = 0; failure == NULL && i < sizeof(sizes) / sizeof(sizes[0]);
+         ++i) {
+        amf = amf_packet_create_number(numbers[i]);
+        amf3_context_initialize(&context);
+        size = amf3_packet_serialize(&context, amf, data, sizeof(data));
+        amf3_context_cleanup(&context);
+        amf_packet_free(amf);
+        if (size != sizes[i]) {
+            failure = "encoded with a wrong length";
+            break;
+        }
+        amf = test_amf3_round_trip(data, size, &failure);
+        if (amf == NULL) {
+            break;
+        }
+        value = amf->avmplus.value;
+        if (value->datatype != AMF_DATATYPE_NUMBER ||
+            value->number.value < numbers[i] ||
+            value->number.value > numbers[i]) {
+            failure = "decoded a different number";
+        }
+        amf_packet_free(amf);
+    }
+    test_report("amf3_u29", failure);
+}
+
+
+/*
+ * [{a: "x"}, {a: "x"}, the first object again, "x"], then two objects of
+ * class Foo: the second object refers to the trait, the key and the
+ * string of the first one.
+ */
+static void test_amf3_references(void)
+{
+    static const unsigned char anonymous[] = {
+        0x09, 0x09, 0x01,
+        0x0A, 0x0B, 0x01, 0x03, 'a', 0x06, 0x03, 'x', 0x01,
+        0x0A, 0x01, 0x00, 0x06, 0x02, 0x01,
+        0x0A, 0x02,
+        0x06, 0x02,
+    };
+    static const unsigned char typed[] = {
+        0x09, 0x05, 0x01,
+        0x0A, 0x0B, 0x07, 'F', 'o', 'o', 0x01,
+        0x0A, 0x01, 0x01,
+    };
+    amf_packet_t *amf;
+    amf_packet_t **values;
+    const char *failure;
+
+    failure = NULL;
+    amf = test_amf3_round_trip(anonymous, sizeof(anonymous), &failure);
+    if (amf != NULL) {
+        values = amf->avmplus.value->strict_array.values;
+        if (amf->avmplus.value->strict_array.num != 4 ||
+            values[1]->datatype != AMF_DATATYPE_OBJECT ||
+            values[1]->object.properties == NULL ||
+            strcmp(values[1]->object.properties->key, "a") != 0 ||
+            values[1]->object.properties->value->datatype !=
+            AMF_DATATYPE_STRING ||
+            strcmp(values[1]->object.properties->value->string.value,
+                   "x") != 0 ||
+            values[2]->datatype != AMF_DATATYPE_REFERENCE ||
+            values[2]->reference.value != values[0] ||
+            values[3]->datatype != AMF_DATATYPE_STRING ||
+            strcmp(values[3]->string.value, "x") != 0) {
+            failure = "decoded different values";
+        }
+        amf_packet_free(amf);
+    }
+    if (failure == NULL) {
+        amf = test_amf3_round_trip(typed, sizeof(typed), &failure);
+        if (amf != NULL) {
+            values = amf->avmplus.value->strict_array.values;
+            if (values[1]->datatype != AMF_DATATYPE_TYPED_OBJECT ||
+                strcmp(values[1]->typed_object.class_name, "Foo") != 0) {
+                failure = "decoded a different class";
+            }
+            amf_packet_free(amf);
+        }
+    }
+    test_report("amf3_references", failure);
+}
+
+
+/* [bytes, the same bytes again, no bytes] */
+static void test_amf3_byte_array(void)
+{
+    static const unsigned char data[] = {
+        0x09, 0x07, 0x01,
+        0x0C, 0x07, 0x01, 0x02, 0x03,
+        0x0C, 0x02,
+        0x0C, 0x01,
+    };
+    amf_packet_t *amf;
+    amf_packet_t **values;
+    const char *failure;
+
+    failure = NULL;
+    amf = test_amf3_round_trip(data, sizeof(data), &failure);
+    if (amf != NULL) {
+        values = amf->avmplus.value->strict_array.values;
+        if (values[0]->datatype != AMF_DATATYPE_BYTE_ARRAY ||
+            values[0]->byte_array.length != 3 ||
+            memcmp(values[0]->byte_array.data, data + 5, 3) != 0 ||
+            values[1]->datatype != AMF_DATATYPE_REFERENCE ||
+            values[1]->reference.value != values[0] ||
+            values[2]->datatype != AMF_DATATYPE_BYTE_ARRAY ||
+            values[2]->byte_array.length != 0) {
+            failure = "decoded different bytes";
+        }
+        amf_packet_free(amf);
+    }
+    test_report("amf3_byte_array", failure);
+}
+
+
+/* the body of an externalizable object can not be skipped */
+static void test_amf3_externalizable(void)
+{
+    static unsigned char data[] = {
+        AMF_DATATYPE_AVMPLUS_OBJECT,
+        0x0A, 0x07, 0x07, 'F', 'o', 'o', 0x04, 0x01,
+    };
+    amf_packet_t *amf;
+    size_t packet_size;
+
+    amf = amf_packet_analyze_data(data, sizeof(data), &packet_size);
+    if (amf != NULL) {
+        amf_packet_free(amf);
+        test_report(
+            "amf3_externalizable", "an externalizable object was decoded");
+        return;
+    }
+    test_report("amf3_externalizable", NULL);
+}
+
+
+static double test_timer_now;
+
+
+typedef struct test_timer_t test_timer_t;
+
+struct test_timer_t
+{
+    int fired;
+    double fired_at;
+};
+
+
+/* data is a test_timer_t */
+static void test_timer_fired(rtmp_timer_t *timer)
+{
+    test_timer_t *test_timer;
+
+    test_timer = (test_timer_t*)timer->data;
+    test_timer->fired = 1;
+    test_timer->fired_at = test_timer_now;
+}
+
+
+/*
+ * A loop sleeping until rtmp_timer_wheel_next each time fires every timer
+ * on time, whether it is on the first level or further.
+ */
+static void test_timer_wheel_next(void)
+{
+    static const double delays[TEST_TIMER_NUM] = {0.05, 2.5, 100.0};
+    rtmp_timer_wheel_t wheel;
+    rtmp_timer_t timers[TEST_TIMER_NUM];
+    test_timer_t fired[TEST_TIMER_NUM];
+    double start;
+    double next;
+    size_t i;
+    int wakeups;
+    const char *failure;
+
+    start = 1000.0;
+    test_timer_now = start;
+    rtmp_timer_wheel_initialize(&wheel, start);
+    for (i = 0; i < TEST_TIMER_NUM; ++i) {
+        fired[i].fired = 0;
+        rtmp_timer_initialize(&timers[i], test_timer_fired, &fired[i]);
+        rtmp_timer_set(&wheel, &timers[i], start + delays[i]);
+    }
+
+    failure = NULL;
+    for (wakeups = 0; (next = rtmp_timer_wheel_next(&wheel)) >= 0;
+         ++wakeups) {
+        if (next < test_timer_now) {
+            failure = "the next expiry is in the past";
+            break;
+        }
+        if (wakeups == TEST_MAX_ITERATIONS) {
+            failure = "too many wakeups";
+            break;
+        }
+        test_timer_now = next;
+        rtmp_timer_wheel_run(&wheel, test_timer_now);
+    }
+    for (i = 0; failure == NULL && i < TEST_TIMER_NUM; ++i) {
+        if (!fired[i].fired) {
+            failure = "a timer did not fire";
+        } else if (fired[i].fired_at < start + delays[i] - RTMP_TIMER_TICK) {
+            failure = "a timer fired early";
+        } else if (fired[i].fired_at > start + delays[i] + RTMP_TIMER_TICK) {
+            failure = "a timer fired late";
+        }
+    }
+    test_report("timer_wheel_next", failure);
+}
+
+
+/*
+ * Interned command names, looked up by their precomputed hash, find the
+ * same entries as copies of them, and a string inside an interned one is
+ * looked up as any other.
+ */
+static void test_command_table(void)
+{
+    static const char connect[] = "connect";
+    rtmp_command_table_t *table;
+    rtmp_command_handler_t handler;
+    rtmp_command_entry_t *entry;
+    int data;
+    size_t length;
+    int id;
+    const char *failure;
+
+    failure = NULL;
+    for (id = 0; failure == NULL && id < AMF_INTERN_NUM; ++id) {
+        if (amf_intern_hash_string(amf_intern_strings[id], &length) !=
+            amf_intern_hash(
+                (const unsigned char*)amf_intern_strings[id],
+                strlen(amf_intern_strings[id])) ||
+            length != strlen(amf_intern_strings[id])) {
+            failure = "hashed an interned string differently";
+        }
+    }
+    table = rtmp_command_table_create();
+    if (table == NULL) {
+        test_report("command_table", "can not create");
+        return;
+    }
+    handler.server = NULL;
+    if (failure == NULL &&
+        (rtmp_command_table_register(table, connect, handler, &data) !=
+         RTMP_SUCCESS ||
+         rtmp_command_table_register(table, "Stream", handler, NULL) !=
+         RTMP_SUCCESS)) {
+        failure = "can not register";
+    }
+    if (failure == NULL) {
+        entry = rtmp_command_table_find(table, AMF_INTERNED(CONNECT));
+        if (entry == NULL || entry->data != &data ||
+            rtmp_command_table_find(table, connect) != entry) {
+            failure = "did not find an interned name";
+        } else if (rtmp_command_table_find(table, AMF_INTERNED(PLAY))) {
+            failure = "found a name not registered";
+        } else if (rtmp_command_table_find(
+                       table, AMF_INTERNED(CREATE_STREAM) + 6) == NULL) {
+            failure = "did not find the end of an interned string";
+        }
+    }
+    rtmp_command_table_free(table);
+    test_report("command_table", failure);
+}
+
+/* runs the client given as data until it is disconnected */
+static void *test_process_client(void *data)
+{
+    rtmp_client_t *rc;
+
+    rc = (rtmp_client_t*)data;
+    while (rtmp_client_process_message(rc) != RTMP_ERROR_DISCONNECTED) {
+        usleep(100);
+    }
+    return NULL;
+}
+
+
+/*
+ * One thread processing a client while another reads its events, with
+ * the ring full at times.  The events read come in order and intact, and
+ * none is lost without being counted as dropped.  Run under
+ * ThreadSanitizer to check the ordering of the ring indices.
+ */
+static void test_event_ring_threads(void)
+{
+    static unsigned char buffer[TEST_EVENT_BATCH * TEST_PACKET_SIZE];
+    char url[64];
+    char code[32];
+    int listen_sock;
+    int sock;
+    rtmp_client_t *rc;
+    pthread_t thread;
+    rtmp_event_t *event;
+    size_t size;
+    size_t sent;
+    ssize_t sent_size;
+    int sent_num;
+    int next;
+    int number;
+    unsigned long received;
+    int closed;
+    const char *failure;
+
+    listen_sock = test_listen(url);
+    if (listen_sock == -1) {
+        test_report("event_ring_threads", "can not listen");
+        return;
+    }
+    rc = test_connect(url, listen_sock, &sock);
+    close(listen_sock);
+    if (rc == NULL) {
+        test_report("event_ring_threads", "can not connect");
+        return;
+    }
+    while (rtmp_client_get_event(rc) != NULL) {
+        rtmp_client_delete_event(rc);
+    }
+    if (pthread_create(&thread, NULL, test_process_client, rc)) {
+        close(sock);
+        rtmp_client_free(rc);
+        test_report("event_ring_threads", "can not start a thread");
+        return;
+    }
+
+    /* statuses nothing waits for, sent in batches and read in between */
+    failure = NULL;
+    sent_num = 0;
+    next = 0;
+    received = 0;
+    closed = 0;
+    while (!closed) {
+        if (sent_num < TEST_EVENT_NUM) {
+            size = 0;
+            do {
+                sprintf(code, "test.%d", sent_num);
+                if (!test_add_status(
+                        buffer, sizeof(buffer), &size, "_result", code)) {
+                    break;
+                }
+            } while (++sent_num % TEST_EVENT_BATCH != 0);
+            for (sent = 0; sent < size; ) {
+                sent_size = send(sock, buffer + sent, size - sent, 0);
+                if (sent_size > 0) {
+                    sent += sent_size;
+                } else {
+                    usleep(100);
+                }
+            }
+            if (sent_num % TEST_EVENT_BATCH != 0) {
+                failure = "can not serialize";
+                sent_num = TEST_EVENT_NUM;
+            }
+            if (sent_num == TEST_EVENT_NUM) {
+                shutdown(sock, SHUT_WR);
+            }
+        }
+        while ((event = rtmp_client_get_event(rc)) != NULL) {
+            if (event->id == RTMP_EVENT_CONNECT_CLOSED) {
+                closed = 1;
+            } else if (sscanf(event->code, "test.%d", &number) != 1 ||
+                       number < next ||
+                       event->level_id != RTMP_EVENT_LEVEL_STATUS) {
+                if (failure == NULL) {
+                    failure = "read an event out of order or broken";
+                }
+            } else {
+                next = number + 1;
+                received++;
+            }
+            rtmp_client_delete_event(rc);
+        }
+        usleep(100);
+    }
+    pthread_join(thread, NULL);
+    if (failure == NULL &&
+        received + rtmp_client_get_dropped_events(rc) != TEST_EVENT_NUM) {
+        failure = "lost events without counting them";
+    }
+    close(sock);
+    rtmp_client_free(rc);
+    test_report("event_ring_threads", failure);
+}
+
+
+/* calls to the allocator hooks, by hook and tag */
+static size_t test_allocator_calls[3][RTMP_ALLOCATION_TAG_NUM];
+
+
+static void *test_allocator_allocate(
+    size_t size, rtmp_allocation_tag_t tag, void *data)
+{
+    (void)data;
+    test_allocator_calls[0][tag]++;
+    return malloc(size);
+}
+
+
+static void *test_allocator_reallocate(
+    void *pointer, size_t size, rtmp_allocation_tag_t tag, void *data)
+{
+    (void)data;
+    test_allocator_calls[1][tag]++;
+    return realloc(pointer, size);
+}
+
+
+static void test_allocator_release(
+    void *pointer, rtmp_allocation_tag_t tag, void *data)
+{
+    (void)data;
+    test_allocator_calls[2][tag]++;
+    free(pointer);
+}
+
+
+/* data is a void *, set to a block of TEST_AMF_SIZE event bytes */
+static void *test_allocate_event(void *data)
+{
+    *(void**)data = rtmp_allocate(RTMP_ALLOCATION_EVENT, TEST_AMF_SIZE);
+    return NULL;
+}
+
+
+/*
+ * Every block reaches the hooks with its tag, keeps it when reallocated,
+ * and is counted live under it until released, by any thread.
+ */
+static void test_allocator_tags(void)
+{
+    static const rtmp_allocator_t allocator = {
+        test_allocator_allocate,
+        test_allocator_reallocate,
+        test_allocator_release,
+        NULL
+    };
+    size_t bytes;
+    size_t blocks;
+    size_t amf_blocks;
+    unsigned char *block;
+    void *event;
+    amf_packet_t *amf;
+    pthread_t thread;
+    const char *failure;
+
+    memset(test_allocator_calls, 0x00, sizeof(test_allocator_calls));
+    rtmp_set_allocator(&allocator);
+    failure = NULL;
+
+    bytes = rtmp_allocator_get_live_bytes(RTMP_ALLOCATION_EVENT);
+    blocks = rtmp_allocator_get_live_blocks(RTMP_ALLOCATION_EVENT);
+    block = (unsigned char*)rtmp_allocate(
+        RTMP_ALLOCATION_EVENT, TEST_AMF_SIZE);
+    if (block == NULL ||
+        rtmp_allocator_get_live_bytes(RTMP_ALLOCATION_EVENT) !=
+        bytes + TEST_AMF_SIZE ||
+        rtmp_allocator_get_live_blocks(RTMP_ALLOCATION_EVENT) != blocks + 1 ||
+        test_allocator_calls[0][RTMP_ALLOCATION_EVENT] != 1) {
+        failure = "did not count an allocation";
+    }
+    if (block != NULL) {
+        /* the tag given again is ignored */
+        block = (unsigned char*)rtmp_reallocate(
+            RTMP_ALLOCATION_AMF, block, TEST_PACKET_SIZE);
+    }
+    if (failure == NULL &&
+        (block == NULL ||
+         rtmp_allocator_get_live_bytes(RTMP_ALLOCATION_EVENT) !=
+         bytes + TEST_PACKET_SIZE ||
+         rtmp_allocator_get_live_blocks(RTMP_ALLOCATION_EVENT) !=
+         blocks + 1 ||
+         test_allocator_calls[1][RTMP_ALLOCATION_EVENT] != 1)) {
+        failure = "did not keep the tag of a reallocated block";
+    }
+    rtmp_release(block);
+    if (failure == NULL &&
+        (rtmp_allocator_get_live_bytes(RTMP_ALLOCATION_EVENT) != bytes ||
+         rtmp_allocator_get_live_blocks(RTMP_ALLOCATION_EVENT) != blocks ||
+         test_allocator_calls[2][RTMP_ALLOCATION_EVENT] != 1)) {
+        failure = "did not count a release";
+    }
+
+    bytes = rtmp_allocator_get_live_bytes(RTMP_ALLOCATION_TRACE);
+    block = (unsigned char*)rtmp_allocate_aligned(
+        RTMP_ALLOCATION_TRACE, TEST_AMF_SIZE, RTMP_CACHE_LINE_SIZE);
+    if (failure == NULL &&
+        (block == NULL || (size_t)block % RTMP_CACHE_LINE_SIZE != 0 ||
+         rtmp_allocator_get_live_bytes(RTMP_ALLOCATION_TRACE) <=
+         bytes + TEST_AMF_SIZE)) {
+        failure = "did not align or count an aligned block";
+    }
+    rtmp_release_aligned(block);
+    if (failure == NULL &&
+        rtmp_allocator_get_live_bytes(RTMP_ALLOCATION_TRACE) != bytes) {
+        failure = "did not count the release of an aligned block";
+    }
+
+    amf_blocks = rtmp_allocator_get_live_blocks(RTMP_ALLOCATION_AMF);
+    amf = amf_packet_create_string("not interned");
+    if (failure == NULL &&
+        (amf == NULL ||
+         rtmp_allocator_get_live_blocks(RTMP_ALLOCATION_AMF) !=
+         amf_blocks + 2)) {
+        failure = "did not tag an AMF value and its string";
+    }
+    if (amf != NULL) {
+        amf_packet_free(amf);
+    }
+    if (failure == NULL &&
+        rtmp_allocator_get_live_blocks(RTMP_ALLOCATION_AMF) != amf_blocks) {
+        failure = "did not count the release of an AMF value";
+    }
+
+    /* released by another thread than the one which allocated it */
+    bytes = rtmp_allocator_get_live_bytes(RTMP_ALLOCATION_EVENT);
+    event = NULL;
+    if (pthread_create(&thread, NULL, test_allocate_event, &event) == 0) {
+        pthread_join(thread, NULL);
+    }
+    if (failure == NULL &&
+        (event == NULL ||
+         rtmp_allocator_get_live_bytes(RTMP_ALLOCATION_EVENT) !=
+         bytes + TEST_AMF_SIZE)) {
+        failure = "did not count an allocation of another thread";
+    }
+    rtmp_release(event);
+    if (failure == NULL &&
+        rtmp_allocator_get_live_bytes(RTMP_ALLOCATION_EVENT) != bytes) {
+        failure = "did not count a release from another thread";
+    }
+
+    if (failure == NULL &&
+        strcmp(rtmp_allocator_get_tag_name(RTMP_ALLOCATION_EVENT),
+               "event") != 0) {
+        failure = "named a tag wrong";
+    }
+    rtmp_set_allocator(NULL);
+    test_report("allocator_tags", failure);
+}
+
+/* data is a const char *, set to the string looked up or NULL */
+static void *test_intern_lookup(void *data)
+{
+    *(const char**)data = amf_intern_lookup(
+        (const unsigned char*)"connect", strlen("connect"));
+    return NULL;
+}
+
+
+/*
+ * Run first: threads looking strings up before anything initialized the
+ * intern table build it once between them.
+ */
+static void test_intern_first_use(void)
+{
+    pthread_t threads[2];
+    const char *found[2];
+    size_t i;
+    const char *failure;
+
+    failure = NULL;
+    for (i = 0; i < 2; ++i) {
+        found[i] = NULL;
+        if (pthread_create(
+                &threads[i], NULL, test_intern_lookup, &found[i])) {
+            failure = "can not start a thread";
+            break;
+        }
+    }
+    while (i > 0) {
+        pthread_join(threads[--i], NULL);
+    }
+    if (failure == NULL &&
+        (found[0] != AMF_INTERNED(CONNECT) ||
+         found[1] != AMF_INTERNED(CONNECT))) {
+        failure = "did not find an interned string";
+    }
+    test_report("intern_first_use", failure);
+}
+
+
+/* data is an array of TEST_BLOCK_NUM blocks to release */
+static void *test_release_blocks(void *data)
+{
+    void **blocks;
+    size_t i;
+
+    blocks = (void**)data;
+    for (i = 0; i < TEST_BLOCK_NUM; ++i) {
+        rtmp_pool_release(blocks[i]);
+    }
+    return NULL;
+}
+
+
+/*
+ * Run in a thread of its own, so that its pool starts empty.  data is a
+ * const char *, set to the failure or NULL.
+ */
+static void *test_allocate_blocks_again(void *data)
+{
+    void *blocks[TEST_BLOCK_NUM];
+    void *again[TEST_BLOCK_NUM];
+    void *block;
+    pthread_t thread;
+    size_t i;
+    size_t j;
+    const char *failure;
+
+    for (i = 0; i < TEST_BLOCK_NUM; ++i) {
+        blocks[i] = rtmp_pool_allocate(TEST_AMF_SIZE);
+        if (blocks[i] == NULL) {
+            *(const char**)data = "can not allocate";
+            return NULL;
+        }
+    }
+    if (pthread_create(&thread, NULL, test_release_blocks, blocks)) {
+        *(const char**)data = "can not start a thread";
+        return NULL;
+    }
+    pthread_join(thread, NULL);
+
+    failure = NULL;
+    for (i = 0; i < TEST_BLOCK_NUM; ++i) {
+        block = rtmp_pool_allocate(TEST_AMF_SIZE);
+        for (j = 0; j < TEST_BLOCK_NUM && blocks[j] != block; ++j) {
+        }
+        if (j == TEST_BLOCK_NUM) {
+            failure = "carved a block while released ones were free";
+            rtmp_pool_release(block);
+            break;
+        }
+        /* kept, so that a block given twice is caught */
+        blocks[j] = NULL;
+        again[i] = block;
+    }
+    for (j = 0; j < i; ++j) {
+        rtmp_pool_release(again[j]);
+    }
+    *(const char**)data = failure;
+    return NULL;
+}
+
+
+/*
+ * Blocks released by another thread go back to the thread which allocated
+ * them, which gets them again instead of carving new ones.
+ */
+static void test_pool_remote_release(void)
+{
+    pthread_t thread;
+    const char *failure;
+
+    failure = NULL;
+    if (pthread_create(
+            &thread, NULL, test_allocate_blocks_again, &failure)) {
+        test_report("pool_remote_release", "can not start a thread");
+        return;
+    }
+    pthread_join(thread, NULL);
+    test_report("pool_remote_release", failure);
+}
+
+
+int main(void)
+{
+    test_intern_first_use();
+    test_packet_truncated();
+    test_close_after_messages();
+    test_divided_message();
+    test_broken_message();
+    test_keyframe_too_large();
+    test_accept_out_of_descriptors();
+    test_client_pool();
+    test_admission();
+    test_transactions();
+    test_transaction_limit();
+    test_amf0_types();
+    test_amf_depth();
+    test_amf_long_key();
+    test_amf3_u29();
+    test_amf3_references();
+    test_amf3_byte_array();
+    test_amf3_externalizable();
+    test_timer_wheel_next();
+    test_pool_remote_release();
+    test_command_table();
+    test_event_ring_threads();
+    test_allocator_tags();
+    return test_failures;
+}